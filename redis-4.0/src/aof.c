@@ -39,158 +39,802 @@
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/param.h>
+#include <pthread.h>
 
 void aofUpdateCurrentSize(void);
-void aofClosePipes(void);
 
 /* ----------------------------------------------------------------------------
- * AOF rewrite buffer implementation.
+ * AOF manifest
  *
- * The following code implement a simple buffer used in order to accumulate
- * changes while the background process is rewriting the AOF file.
+ * The AOF is not a single file. A rewrite produces a new base file with the
+ * dataset at the time of the fork, while the writes received from then on
+ * go to a new incremental (incr) file, so the parent never has to buffer
+ * them and pass them to the child. The manifest lists, in loading order,
+ * the files the AOF is made of, one per line:
  *
- * We only need to append, but can't just use realloc with a large block
- * because 'huge' reallocs are not always handled as one could expect
- * (via remapping of pages at OS level) but may involve copying data.
+ *   file "appendonly.aof.3.base.rdb" seq 3 type b
+ *   file "appendonly.aof.5.incr.aof" seq 5 type i
  *
- * For this reason we use a list of blocks, every block is
- * AOF_RW_BUF_BLOCK_SIZE bytes.
+ * The manifest is always replaced atomically (temp file + rename), and is
+ * the only source of truth: once a manifest listing a new base is on disk,
+ * the files it no longer lists are just deleted.
+ *
+ * All the file names are derived from 'appendfilename'. An 'appendfilename'
+ * file without a manifest is a single file AOF written by older versions:
+ * it is loaded as the base, and replaced by the first rewrite.
  * ------------------------------------------------------------------------- */
 
-#define AOF_RW_BUF_BLOCK_SIZE (1024*1024*10)    /* 10 MB per block */
+static aofInfo *aofInfoCreate(void) {
+    return zcalloc(sizeof(aofInfo));
+}
+
+static void aofInfoFree(aofInfo *ai) {
+    sdsfree(ai->file_name);
+    zfree(ai);
+}
+
+static aofInfo *aofInfoDup(aofInfo *orig) {
+    aofInfo *ai = aofInfoCreate();
+
+    ai->file_name = sdsdup(orig->file_name);
+    ai->file_seq = orig->file_seq;
+    ai->file_type = orig->file_type;
+    return ai;
+}
+
+/* Wrappers used as free / dup methods of the incr files list. */
+static void aofInfoFreeVoid(void *ai) {
+    aofInfoFree(ai);
+}
+
+static void *aofInfoDupVoid(void *ai) {
+    return aofInfoDup(ai);
+}
 
-typedef struct aofrwblock {
-    unsigned long used, free;
-    char buf[AOF_RW_BUF_BLOCK_SIZE];
-} aofrwblock;
+static aofManifest *aofManifestCreate(void) {
+    aofManifest *am = zcalloc(sizeof(*am));
 
-/* This function free the old AOF rewrite buffer if needed, and initialize
- * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
- * so can be used for the first initialization as well. */
-void aofRewriteBufferReset(void) {
-    if (server.aof_rewrite_buf_blocks)
-        listRelease(server.aof_rewrite_buf_blocks);
+    am->incr_aof_list = listCreate();
+    listSetFreeMethod(am->incr_aof_list,aofInfoFreeVoid);
+    listSetDupMethod(am->incr_aof_list,aofInfoDupVoid);
+    return am;
+}
+
+void aofManifestFree(aofManifest *am) {
+    if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+    listRelease(am->incr_aof_list);
+    zfree(am);
+}
 
-    server.aof_rewrite_buf_blocks = listCreate();
-    listSetFreeMethod(server.aof_rewrite_buf_blocks,zfree);
+/* Changes are always applied to a copy of the manifest, that replaces the
+ * current one only once it was written on disk. */
+static aofManifest *aofManifestDup(aofManifest *orig) {
+    aofManifest *am = zcalloc(sizeof(*am));
+
+    if (orig->base_aof_info)
+        am->base_aof_info = aofInfoDup(orig->base_aof_info);
+    am->incr_aof_list = listDup(orig->incr_aof_list);
+    am->curr_base_file_seq = orig->curr_base_file_seq;
+    am->curr_incr_file_seq = orig->curr_incr_file_seq;
+    return am;
 }
 
-/* Return the current size of the AOF rewrite buffer. */
-unsigned long aofRewriteBufferSize(void) {
+/* Return the content of the manifest file describing 'am'. */
+static sds aofManifestToString(aofManifest *am) {
+    sds buf = sdsempty();
     listNode *ln;
     listIter li;
-    unsigned long size = 0;
+    aofInfo *ai = am->base_aof_info;
 
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        size += block->used;
+    listRewind(am->incr_aof_list,&li);
+    if (ai == NULL) {
+        ln = listNext(&li);
+        ai = ln ? ln->value : NULL;
+    }
+    while (ai) {
+        buf = sdscat(buf,"file ");
+        buf = sdscatrepr(buf,ai->file_name,sdslen(ai->file_name));
+        buf = sdscatprintf(buf," seq %lld type %c\n",
+            ai->file_seq,ai->file_type);
+        ln = listNext(&li);
+        ai = ln ? ln->value : NULL;
     }
-    return size;
+    return buf;
 }
 
-/* Event handler used to send data to the child process doing the AOF
- * rewrite. We send pieces of our AOF differences buffer so that the final
- * write when the child finishes the rewrite will be small. */
-void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask) {
-    listNode *ln;
-    aofrwblock *block;
-    ssize_t nwritten;
-    UNUSED(el);
-    UNUSED(fd);
-    UNUSED(privdata);
-    UNUSED(mask);
+/* Names of the AOF files, derived from 'appendfilename'. */
+static sds getAofManifestFileName(void) {
+    return sdscatprintf(sdsempty(),"%s.manifest",server.aof_filename);
+}
 
-    while(1) {
-        ln = listFirst(server.aof_rewrite_buf_blocks);
-        block = ln ? ln->value : NULL;
-        if (server.aof_stop_sending_diff || !block) {
-            aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,
-                              AE_WRITABLE);
-            return;
+static sds getTempAofManifestFileName(void) {
+    return sdscatprintf(sdsempty(),"temp-%s.manifest",server.aof_filename);
+}
+
+static sds getNewBaseFileName(long long seq) {
+    return sdscatprintf(sdsempty(),"%s.%lld.base.%s",server.aof_filename,
+        seq,server.aof_use_rdb_preamble ? "rdb" : "aof");
+}
+
+static sds getNewIncrFileName(long long seq) {
+    return sdscatprintf(sdsempty(),"%s.%lld.incr.aof",server.aof_filename,
+        seq);
+}
+
+/* While waiting for the first rewrite after the AOF is turned on, the writes
+ * go to this file, that is not listed by the manifest yet. */
+static sds getTempIncrFileName(void) {
+    return sdscatprintf(sdsempty(),"temp-%s.incr",server.aof_filename);
+}
+
+/* Load the manifest 'filename'. NULL is returned if the file does not exist.
+ * Any other error is fatal, since we can't tell what the AOF is made of. */
+static aofManifest *aofLoadManifestFromFile(char *filename) {
+    FILE *fp = fopen(filename,"r");
+    aofManifest *am;
+    char buf[1024];
+    const char *err = NULL;
+    int linenum = 0;
+
+    if (fp == NULL) {
+        if (errno == ENOENT) return NULL;
+        serverLog(LL_WARNING,"Fatal error: can't open the AOF manifest %s "
+                             "for reading: %s",filename,strerror(errno));
+        exit(1);
+    }
+
+    am = aofManifestCreate();
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        sds line = sdstrim(sdsnew(buf)," \t\r\n");
+        sds *argv;
+        aofInfo *ai;
+        int argc, j;
+
+        linenum++;
+        if (line[0] == '#' || line[0] == '\0') {
+            sdsfree(line);
+            continue;
         }
-        if (block->used > 0) {
-            nwritten = write(server.aof_pipe_write_data_to_child,
-                             block->buf,block->used);
-            if (nwritten <= 0) return;
-            memmove(block->buf,block->buf+nwritten,block->used-nwritten);
-            block->used -= nwritten;
-            block->free += nwritten;
+        argv = sdssplitargs(line,&argc);
+        sdsfree(line);
+        if (argv == NULL || argc % 2) {
+            err = "Unbalanced quotes or missing value";
+            goto loaderr;
         }
-        if (block->used == 0) listDelNode(server.aof_rewrite_buf_blocks,ln);
-    }
-}
-
-/* Append data to the AOF rewrite buffer, allocating new blocks if needed. */
-void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
-    listNode *ln = listLast(server.aof_rewrite_buf_blocks);
-    aofrwblock *block = ln ? ln->value : NULL;
-
-    while(len) {
-        /* If we already got at least an allocated block, try appending
-         * at least some piece into it. */
-        if (block) {
-            unsigned long thislen = (block->free < len) ? block->free : len;
-            if (thislen) {  /* The current block is not already full. */
-                memcpy(block->buf+block->used, s, thislen);
-                block->used += thislen;
-                block->free -= thislen;
-                s += thislen;
-                len -= thislen;
+
+        /* Unknown keys are skipped, so that newer versions can add fields. */
+        ai = aofInfoCreate();
+        for (j = 0; j < argc; j += 2) {
+            if (!strcasecmp(argv[j],"file")) {
+                sdsfree(ai->file_name);
+                ai->file_name = sdsdup(argv[j+1]);
+            } else if (!strcasecmp(argv[j],"seq")) {
+                ai->file_seq = strtoll(argv[j+1],NULL,10);
+            } else if (!strcasecmp(argv[j],"type")) {
+                ai->file_type = argv[j+1][0];
             }
         }
+        sdsfreesplitres(argv,argc);
 
-        if (len) { /* First block to allocate, or need another block. */
-            int numblocks;
-
-            block = zmalloc(sizeof(*block));
-            block->free = AOF_RW_BUF_BLOCK_SIZE;
-            block->used = 0;
-            listAddNodeTail(server.aof_rewrite_buf_blocks,block);
-
-            /* Log every time we cross more 10 or 100 blocks, respectively
-             * as a notice or warning. */
-            numblocks = listLength(server.aof_rewrite_buf_blocks);
-            if (((numblocks+1) % 10) == 0) {
-                int level = ((numblocks+1) % 100) == 0 ? LL_WARNING :
-                                                         LL_NOTICE;
-                serverLog(level,"Background AOF buffer size: %lu MB",
-                    aofRewriteBufferSize()/(1024*1024));
+        if (ai->file_name == NULL || !pathIsBaseName(ai->file_name)) {
+            err = "Missing or invalid file name";
+            goto loaderr;
+        }
+        if (ai->file_type == AOF_FILE_TYPE_BASE) {
+            if (am->base_aof_info) {
+                err = "More than one base file";
+                goto loaderr;
             }
+            am->base_aof_info = ai;
+            am->curr_base_file_seq = ai->file_seq;
+        } else if (ai->file_type == AOF_FILE_TYPE_INCR) {
+            if (ai->file_seq <= am->curr_incr_file_seq) {
+                err = "Incr files out of order";
+                goto loaderr;
+            }
+            listAddNodeTail(am->incr_aof_list,ai);
+            am->curr_incr_file_seq = ai->file_seq;
+        } else {
+            err = "Unknown file type";
+            goto loaderr;
+        }
+    }
+    if (ferror(fp)) {
+        serverLog(LL_WARNING,"Fatal error: can't read the AOF manifest %s: %s",
+            filename,strerror(errno));
+        exit(1);
+    }
+    fclose(fp);
+    return am;
+
+loaderr:
+    serverLog(LL_WARNING,"Fatal error: bad AOF manifest %s at line %d: %s",
+        filename,linenum,err);
+    exit(1);
+}
+
+/* Load the manifest at startup, or create an empty one. See the top comment
+ * for AOF files written by older versions. */
+void aofLoadManifestFromDisk(void) {
+    sds filename = getAofManifestFileName();
+    aofManifest *am = aofLoadManifestFromFile(filename);
+    struct redis_stat sb;
+
+    if (am == NULL) {
+        am = aofManifestCreate();
+        if (redis_stat(server.aof_filename,&sb) == 0) {
+            aofInfo *ai = aofInfoCreate();
+
+            ai->file_name = sdsnew(server.aof_filename);
+            ai->file_seq = 0;
+            ai->file_type = AOF_FILE_TYPE_BASE;
+            am->base_aof_info = ai;
+            serverLog(LL_NOTICE,"No AOF manifest found: using %s as the "
+                                "AOF base file",server.aof_filename);
         }
     }
+    if (server.aof_manifest) aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
+    sdsfree(filename);
+}
+
+/* Write the manifest 'am' on disk, atomically replacing the current one.
+ * Returns C_OK or C_ERR. */
+static int aofPersistManifest(aofManifest *am) {
+    sds content = aofManifestToString(am);
+    sds tmpname = getTempAofManifestFileName();
+    sds filename = getAofManifestFileName();
+    int fd, retval = C_ERR;
+
+    fd = open(tmpname,O_WRONLY|O_TRUNC|O_CREAT,0644);
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Can't open the AOF manifest temp file %s: %s",
+            tmpname,strerror(errno));
+        goto cleanup;
+    }
+    if (write(fd,content,sdslen(content)) != (ssize_t)sdslen(content) ||
+        aof_fsync(fd) == -1)
+    {
+        serverLog(LL_WARNING,"Error writing the AOF manifest temp file %s: %s",
+            tmpname,strerror(errno));
+        close(fd);
+        unlink(tmpname);
+        goto cleanup;
+    }
+    close(fd);
+    if (rename(tmpname,filename) == -1) {
+        serverLog(LL_WARNING,"Error renaming the AOF manifest %s into %s: %s",
+            tmpname,filename,strerror(errno));
+        unlink(tmpname);
+        goto cleanup;
+    }
+    retval = C_OK;
+
+cleanup:
+    sdsfree(content);
+    sdsfree(tmpname);
+    sdsfree(filename);
+    return retval;
+}
+
+/* Delete 'filename' without blocking: the file is unlinked while still open,
+ * so that its blocks are released by the close(2) performed by a bio thread,
+ * that is the last reference to it. */
+static void aofDelFileInBackground(char *filename) {
+    int fd = open(filename,O_RDONLY|O_NONBLOCK);
+
+    if (unlink(filename) == -1 && errno != ENOENT) {
+        serverLog(LL_WARNING,"Can't delete the old AOF file %s: %s",
+            filename,strerror(errno));
+    }
+    if (fd != -1) bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)fd,NULL,NULL);
+}
 
-    /* Install a file event to send data to the rewrite child if there is
-     * not one already. */
-    if (aeGetFileEvents(server.el,server.aof_pipe_write_data_to_child) == 0) {
-        aeCreateFileEvent(server.el, server.aof_pipe_write_data_to_child,
-            AE_WRITABLE, aofChildWriteDiffData, NULL);
+/* Return true if 'am' lists a file named 'filename'. */
+static int aofManifestHasFile(aofManifest *am, sds filename) {
+    listNode *ln;
+    listIter li;
+
+    if (am->base_aof_info &&
+        !strcmp(am->base_aof_info->file_name,filename)) return 1;
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = ln->value;
+        if (!strcmp(ai->file_name,filename)) return 1;
     }
+    return 0;
 }
 
-/* Write the buffer (possibly composed of multiple blocks) into the specified
- * fd. If a short write or any other error happens -1 is returned,
- * otherwise the number of bytes written is returned. */
-ssize_t aofRewriteBufferWrite(int fd) {
+/* Delete the files listed by 'old' that the new manifest 'am' dropped. */
+static void aofDelDroppedFiles(aofManifest *old, aofManifest *am) {
     listNode *ln;
     listIter li;
-    ssize_t count = 0;
-
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        ssize_t nwritten;
-
-        if (block->used) {
-            nwritten = write(fd,block->buf,block->used);
-            if (nwritten != (ssize_t)block->used) {
-                if (nwritten == 0) errno = EIO;
-                return -1;
+
+    if (old->base_aof_info &&
+        !aofManifestHasFile(am,old->base_aof_info->file_name))
+    {
+        aofDelFileInBackground(old->base_aof_info->file_name);
+    }
+    listRewind(old->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = ln->value;
+        if (!aofManifestHasFile(am,ai->file_name))
+            aofDelFileInBackground(ai->file_name);
+    }
+}
+
+/* Start the new incr file 'fd' with the magic of the binary format if
+ * "aof-format" is "binary". Returns the bytes written, or -1 on error. */
+static ssize_t aofWriteFileHeader(int fd) {
+    if (server.aof_format != AOF_FORMAT_BINARY) return 0;
+    if (write(fd,AOF_BIN_MAGIC,AOF_BIN_MAGIC_LEN) != AOF_BIN_MAGIC_LEN)
+        return -1;
+    return AOF_BIN_MAGIC_LEN;
+}
+
+/* Switch the AOF writes to a new incr file. Called before forking the
+ * rewrite child: the writes it would miss are all in this file, that
+ * together with the new base is all that is left of the AOF once the
+ * rewrite is done. With the AOF ON the file is listed by the manifest right
+ * away. While waiting for the first rewrite (AOF_WAIT_REWRITE) the manifest
+ * still describes the dataset of when the AOF was turned off, so a temp file
+ * is used, listed only along with the new base. Returns C_OK or C_ERR. */
+static int aofOpenNewIncrFile(void) {
+    aofManifest *am = NULL;
+    sds filename;
+    ssize_t hdrlen = 0;
+    int fd;
+
+    if (server.aof_state == AOF_OFF) return C_OK;
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        filename = getTempIncrFileName();
+        fd = open(filename,O_WRONLY|O_TRUNC|O_CREAT|O_APPEND,0644);
+        if (fd != -1 && (hdrlen = aofWriteFileHeader(fd)) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        am = aofManifestDup(server.aof_manifest);
+        filename = getNewIncrFileName(++am->curr_incr_file_seq);
+        fd = open(filename,O_WRONLY|O_TRUNC|O_CREAT|O_APPEND,0644);
+        if (fd != -1 && (hdrlen = aofWriteFileHeader(fd)) == -1) {
+            close(fd);
+            unlink(filename);
+            fd = -1;
+        }
+        if (fd != -1) {
+            aofInfo *ai = aofInfoCreate();
+
+            ai->file_name = sdsdup(filename);
+            ai->file_seq = am->curr_incr_file_seq;
+            ai->file_type = AOF_FILE_TYPE_INCR;
+            listAddNodeTail(am->incr_aof_list,ai);
+            if (aofPersistManifest(am) == C_ERR) {
+                close(fd);
+                unlink(filename);
+                fd = -1;
             }
-            count += nwritten;
         }
     }
-    return count;
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Can't switch the AOF writes to the new file "
+                             "%s: %s",filename,strerror(errno));
+        if (am) aofManifestFree(am);
+        sdsfree(filename);
+        return C_ERR;
+    }
+    if (am) {
+        aofManifestFree(server.aof_manifest);
+        server.aof_manifest = am;
+    }
+
+    /* Asynchronously close the previous file, like after a rewrite. */
+    if (server.aof_fd != -1)
+        bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)server.aof_fd,NULL,NULL);
+    server.aof_fd = fd;
+    server.aof_fd_binary = server.aof_format == AOF_FORMAT_BINARY;
+    server.aof_current_size += hdrlen;
+    server.aof_last_incr_size = hdrlen;
+    server.aof_selected_db = -1; /* Every incr file starts with a SELECT. */
+    sdsfree(filename);
+    return C_OK;
+}
+
+/* Called at startup, after loading the AOF, to open the file receiving the
+ * writes: the last incr file, or a new one if there is none. The writes
+ * keep the format of the file, unless it is empty. */
+void aofOpenIfNeededOnServerStart(void) {
+    listNode *ln = listLast(server.aof_manifest->incr_aof_list);
+    struct redis_stat sb;
+    char sig[AOF_BIN_MAGIC_LEN];
+
+    if (server.aof_state != AOF_ON) return;
+    if (ln == NULL) {
+        if (aofOpenNewIncrFile() == C_ERR) exit(1);
+        return;
+    }
+
+    aofInfo *ai = ln->value;
+    server.aof_fd = open(ai->file_name,O_RDWR|O_APPEND|O_CREAT,0644);
+    if (server.aof_fd == -1 || redis_fstat(server.aof_fd,&sb) == -1) {
+        serverLog(LL_WARNING,"Can't open the append-only file %s: %s",
+            ai->file_name,strerror(errno));
+        exit(1);
+    }
+    if (sb.st_size == 0) {
+        ssize_t hdrlen = aofWriteFileHeader(server.aof_fd);
+
+        if (hdrlen == -1) {
+            serverLog(LL_WARNING,"Can't write the append-only file %s: %s",
+                ai->file_name,strerror(errno));
+            exit(1);
+        }
+        server.aof_fd_binary = server.aof_format == AOF_FORMAT_BINARY;
+        server.aof_current_size += hdrlen;
+        sb.st_size = hdrlen;
+    } else {
+        server.aof_fd_binary =
+            pread(server.aof_fd,sig,sizeof(sig),0) == sizeof(sig) &&
+            memcmp(sig,AOF_BIN_MAGIC,sizeof(sig)) == 0;
+    }
+    server.aof_last_incr_size = sb.st_size;
+}
+
+/* With a binary incr file aof_buf is filled with records, framed in a block
+ * only when written, so that every write(2) is a whole block. After a
+ * failed write the remaining blocks are kept, and the newer records are
+ * framed in a block of their own. */
+static void aofFrameBuffer(void) {
+    size_t framed = server.aof_buf_framed, len = sdslen(server.aof_buf);
+    sds buf;
+
+    if (!server.aof_fd_binary || framed == len) return;
+    buf = sdsnewlen(server.aof_buf,framed);
+    buf = aofBinCatBlock(buf,server.aof_buf+framed,len-framed,
+                         server.aof_binary_compression);
+    sdsfree(server.aof_buf);
+    server.aof_buf = buf;
+    server.aof_buf_framed = sdslen(buf);
+}
+
+/* ----------------------------------------------------------------------------
+ * AOF writer thread
+ *
+ * With 'aof-writer-thread yes' the write(2) and fsync(2) of the AOF buffer
+ * are performed by a dedicated thread, so that a slow disk never blocks the
+ * event loop. While a batch is written, server.aof_buf keeps accumulating
+ * the writes of the next one: when the disk is slow the batches just get
+ * larger, and the cost of each fsync is shared by more writes (group
+ * commit).
+ *
+ * With 'appendfsync always' nothing that depends on a write leaves the
+ * server before the write is fsynced, like with the write + fsync performed
+ * by beforeSleep() without the thread:
+ *
+ * - The reply of every command is held (CLIENT_AOF_WAIT) until the AOF is
+ *   fsynced up to where it was when the command ran, since also a read may
+ *   see the writes of the other clients. The same for the clients served
+ *   by a push to the list they were blocked on.
+ * - The replication stream is sent to the slaves only up to the offset it
+ *   had when the last fsynced batch was handed over to the thread, see
+ *   aofReplSafeOffset().
+ *
+ * The thread only performs the system calls: the outcome is handled by the
+ * main thread, woken up by a pipe, exactly like a synchronous write.
+ * ------------------------------------------------------------------------- */
+
+#define AOF_WRITER_IDLE 0   /* No batch. */
+#define AOF_WRITER_BUSY 1   /* The thread is writing the batch. */
+#define AOF_WRITER_DONE 2   /* The main thread must handle the outcome. */
+
+#define AOF_WRITER_STACK_SIZE (1024*1024*4)
+
+static struct aofWriter {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;    /* Signaled when a batch is handed over. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is written. */
+    int started;
+    int notify_pipe[2];         /* Wakes up the main thread. */
+    int state;                  /* AOF_WRITER_* */
+    /* The batch, set by the main thread. */
+    sds buf;
+    int fd;
+    int fsync;                  /* fsync(2) after writing the batch? */
+    long long end_offset;       /* aof_fed_offset at the end of the batch. */
+    long long end_repl_offset;  /* master_repl_offset at the same time. */
+    /* The outcome, set by the thread. */
+    ssize_t nwritten;
+    int write_errno;
+    mstime_t write_latency;
+    mstime_t fsync_latency;
+    sds spare;                  /* Written batch, reused as aof_buf. */
+} aof_writer;
+
+static int aofHandleWriteResult(sds buf, ssize_t nwritten, int write_errno);
+
+static void *aofWriterMain(void *arg) {
+    sigset_t sigset;
+    mstime_t latency;
+    UNUSED(arg);
+
+    /* Like the bio threads, leave the watchdog signal to the main thread. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in AOF writer thread: %s",
+            strerror(errno));
+
+    pthread_mutex_lock(&aof_writer.lock);
+    while(1) {
+        if (aof_writer.state != AOF_WRITER_BUSY) {
+            pthread_cond_wait(&aof_writer.job_cond,&aof_writer.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&aof_writer.lock);
+
+        latencyStartMonitor(latency);
+        aof_writer.nwritten = write(aof_writer.fd,aof_writer.buf,
+                                    sdslen(aof_writer.buf));
+        aof_writer.write_errno = errno;
+        latencyEndMonitor(latency);
+        aof_writer.write_latency = latency;
+        aof_writer.fsync_latency = 0;
+        if (aof_writer.fsync &&
+            aof_writer.nwritten == (ssize_t)sdslen(aof_writer.buf))
+        {
+            latencyStartMonitor(latency);
+            aof_fsync(aof_writer.fd);
+            latencyEndMonitor(latency);
+            aof_writer.fsync_latency = latency;
+        }
+
+        pthread_mutex_lock(&aof_writer.lock);
+        aof_writer.state = AOF_WRITER_DONE;
+        pthread_cond_signal(&aof_writer.done_cond);
+        if (write(aof_writer.notify_pipe[1],"!",1) != 1) {
+            /* Ignore the error: the pipe is full, so the main thread is
+             * going to be woken up anyway. */
+        }
+    }
+    return NULL;
+}
+
+/* Return true if the reply of the client can't be sent yet: with
+ * 'appendfsync always' a write is acknowledged, or seen, only once it is
+ * fsynced. Slaves are held by aofReplSafeOffset() instead. */
+int aofClientMustWait(client *c) {
+    return server.aof_fsync == AOF_FSYNC_ALWAYS &&
+           !(c->flags & CLIENT_SLAVE) &&
+           c->aof_woff > server.aof_flushed_offset;
+}
+
+/* Return the offset of the last byte of the replication stream that can be
+ * sent to the slaves: with the thread and 'appendfsync always' the part of
+ * the stream whose writes are not fsynced yet is held. */
+long long aofReplSafeOffset(void) {
+    if (!server.aof_writer_thread || server.aof_fsync != AOF_FSYNC_ALWAYS ||
+        server.aof_flushed_offset == server.aof_fed_offset)
+        return server.master_repl_offset;
+    return server.aof_flushed_repl_offset;
+}
+
+/* Hold the reply of the client until aofReleaseWaitingClients(). */
+void aofHoldClient(client *c) {
+    if (c->flags & CLIENT_AOF_WAIT) return;
+    c->flags |= CLIENT_AOF_WAIT;
+    listAddNodeTail(server.clients_waiting_aof,c);
+}
+
+/* Called before writing the replies to the clients: put aside the ones
+ * whose writes are still being written by the AOF writer thread. */
+void aofHoldReplies(void) {
+    listIter li;
+    listNode *ln;
+
+    if (server.aof_flushed_offset == server.aof_fed_offset) return;
+    listRewind(server.clients_pending_write,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = ln->value;
+
+        if (!aofClientMustWait(c)) continue;
+        c->flags &= ~CLIENT_PENDING_WRITE;
+        listDelNode(server.clients_pending_write,ln);
+        aofHoldClient(c);
+    }
+}
+
+/* Send again the replies of the clients whose writes are now on disk, and
+ * the replication stream held for the slaves. */
+static void aofReleaseWaitingClients(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_waiting_aof,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = ln->value;
+
+        if (aofClientMustWait(c)) continue;
+        c->flags &= ~CLIENT_AOF_WAIT;
+        listDelNode(server.clients_waiting_aof,ln);
+        clientInstallWriteHandler(c);
+    }
+
+    listRewind(server.slaves,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *slave = ln->value;
+
+        if (replicaHasSendableStream(slave)) clientInstallWriteHandler(slave);
+    }
+}
+
+/* Handle the outcome of the batch written by the thread, if any. */
+static void aofWriterHandleDone(void) {
+    sds buf;
+
+    pthread_mutex_lock(&aof_writer.lock);
+    if (aof_writer.state != AOF_WRITER_DONE) {
+        pthread_mutex_unlock(&aof_writer.lock);
+        return;
+    }
+    aof_writer.state = AOF_WRITER_IDLE;
+    pthread_mutex_unlock(&aof_writer.lock);
+
+    buf = aof_writer.buf;
+    aof_writer.buf = NULL;
+    latencyAddSampleIfNeeded("aof-write",aof_writer.write_latency);
+    latencyAddSampleIfNeeded("aof-fsync-writer",aof_writer.fsync_latency);
+    if (aofHandleWriteResult(buf,aof_writer.nwritten,
+                             aof_writer.write_errno) == C_ERR)
+    {
+        /* What is left must be written before the newer writes. */
+        if (server.aof_fd_binary) server.aof_buf_framed = sdslen(buf);
+        buf = sdscatsds(buf,server.aof_buf);
+        sdsfree(server.aof_buf);
+        server.aof_buf = buf;
+        return;
+    }
+    server.aof_flushed_offset = aof_writer.end_offset;
+    server.aof_flushed_repl_offset = aof_writer.end_repl_offset;
+    if (aof_writer.spare == NULL && sdsalloc(buf) < 4000) {
+        sdsclear(buf);
+        aof_writer.spare = buf;
+    } else {
+        sdsfree(buf);
+    }
+    aofReleaseWaitingClients();
+}
+
+static void aofWriterPipeReadable(aeEventLoop *el, int fd, void *privdata,
+                                  int mask)
+{
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    aofWriterHandleDone();
+}
+
+/* Start the thread the first time it is needed. On error the thread is
+ * disabled, and C_ERR is returned. */
+static int aofWriterStart(void) {
+    pthread_attr_t attr;
+    size_t stacksize;
+
+    if (aof_writer.started) return C_OK;
+    if (pipe(aof_writer.notify_pipe) == -1) {
+        serverLog(LL_WARNING,"Can't create the AOF writer thread pipe: %s",
+            strerror(errno));
+        goto err;
+    }
+    anetNonBlock(NULL,aof_writer.notify_pipe[0]);
+    anetNonBlock(NULL,aof_writer.notify_pipe[1]);
+    if (aeCreateFileEvent(server.el,aof_writer.notify_pipe[0],AE_READABLE,
+                          aofWriterPipeReadable,NULL) == AE_ERR)
+    {
+        serverLog(LL_WARNING,"Can't register the AOF writer thread pipe");
+        goto errpipe;
+    }
+
+    pthread_mutex_init(&aof_writer.lock,NULL);
+    pthread_cond_init(&aof_writer.job_cond,NULL);
+    pthread_cond_init(&aof_writer.done_cond,NULL);
+    aof_writer.state = AOF_WRITER_IDLE;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1;
+    while (stacksize < AOF_WRITER_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+    if (pthread_create(&aof_writer.thread,&attr,aofWriterMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Can't create the AOF writer thread: %s",
+            strerror(errno));
+        pthread_attr_destroy(&attr);
+        pthread_mutex_destroy(&aof_writer.lock);
+        pthread_cond_destroy(&aof_writer.job_cond);
+        pthread_cond_destroy(&aof_writer.done_cond);
+        aeDeleteFileEvent(server.el,aof_writer.notify_pipe[0],AE_READABLE);
+        goto errpipe;
+    }
+    pthread_attr_destroy(&attr);
+    aof_writer.started = 1;
+    return C_OK;
+
+errpipe:
+    close(aof_writer.notify_pipe[0]);
+    close(aof_writer.notify_pipe[1]);
+err:
+    serverLog(LL_WARNING,"Disabling aof-writer-thread.");
+    server.aof_writer_thread = 0;
+    return C_ERR;
+}
+
+/* Wait for the batch being written, if any, and handle its outcome. */
+static void aofWriterWait(void) {
+    if (!aof_writer.started) return;
+    pthread_mutex_lock(&aof_writer.lock);
+    while (aof_writer.state == AOF_WRITER_BUSY)
+        pthread_cond_wait(&aof_writer.done_cond,&aof_writer.lock);
+    pthread_mutex_unlock(&aof_writer.lock);
+    aofWriterHandleDone();
+}
+
+/* The flushAppendOnlyFile() implementation using the AOF writer thread:
+ * aof_buf is handed over to the thread, unless it is still busy with the
+ * previous batch. With 'force' it returns once everything was written.
+ * C_ERR is returned if the caller should write aof_buf by itself. */
+static int aofWriterFlush(int force) {
+    int busy;
+
+    if (!server.aof_writer_thread) {
+        /* The thread may have been disabled with a batch in flight, that
+         * must reach the file before the newer writes. */
+        aofWriterWait();
+        return C_ERR;
+    }
+    if (aofWriterStart() == C_ERR) return C_ERR;
+
+    if (force) aofWriterWait();
+    else aofWriterHandleDone(); /* The pipe may not be processed yet. */
+    pthread_mutex_lock(&aof_writer.lock);
+    busy = aof_writer.state != AOF_WRITER_IDLE;
+    pthread_mutex_unlock(&aof_writer.lock);
+    if (busy || sdslen(server.aof_buf) == 0) return C_OK;
+
+    aofFrameBuffer();
+    aof_writer.buf = server.aof_buf;
+    aof_writer.fd = server.aof_fd;
+    aof_writer.end_offset = server.aof_fed_offset;
+    aof_writer.end_repl_offset = server.master_repl_offset;
+    aof_writer.fsync = server.aof_fsync == AOF_FSYNC_ALWAYS ||
+                       (server.aof_fsync == AOF_FSYNC_EVERYSEC &&
+                        server.unixtime > server.aof_last_fsync);
+    if (server.aof_no_fsync_on_rewrite &&
+        (server.aof_child_pid != -1 || server.rdb_child_pid != -1))
+        aof_writer.fsync = 0;
+    if (aof_writer.fsync) server.aof_last_fsync = server.unixtime;
+    server.aof_buf = aof_writer.spare ? aof_writer.spare : sdsempty();
+    server.aof_buf_framed = 0;
+    aof_writer.spare = NULL;
+
+    pthread_mutex_lock(&aof_writer.lock);
+    aof_writer.state = AOF_WRITER_BUSY;
+    pthread_cond_signal(&aof_writer.job_cond);
+    pthread_mutex_unlock(&aof_writer.lock);
+
+    if (force) aofWriterWait();
+    return C_OK;
+}
+
+/* Drop the writes not yet in the AOF, when they are no longer needed. */
+static void aofDiscardBuffer(void) {
+    aofWriterWait();
+    sdsclear(server.aof_buf);
+    server.aof_buf_framed = 0;
+    server.aof_flushed_offset = server.aof_fed_offset;
+    aofReleaseWaitingClients();
 }
 
 /* ----------------------------------------------------------------------------
@@ -207,9 +851,21 @@ void aof_background_fsync(int fd) {
  * at runtime using the CONFIG command. */
 void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
-    flushAppendOnlyFile(1);
-    aof_fsync(server.aof_fd);
-    close(server.aof_fd);
+    if (server.aof_fd != -1) {
+        flushAppendOnlyFile(1);
+        aof_fsync(server.aof_fd);
+        close(server.aof_fd);
+    }
+    /* Writes that could not reach the file are lost, like the ones for
+     * the temp incr file. */
+    aofDiscardBuffer();
+    /* The writes received while waiting for the first rewrite are useless
+     * without the base the rewrite was going to produce. */
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        sds tmpincr = getTempIncrFileName();
+        unlink(tmpincr);
+        sdsfree(tmpincr);
+    }
 
     server.aof_fd = -1;
     server.aof_selected_db = -1;
@@ -223,119 +879,42 @@ void stopAppendOnly(void) {
         if (kill(server.aof_child_pid,SIGUSR1) != -1) {
             while(wait3(&statloc,0,NULL) != server.aof_child_pid);
         }
-        /* reset the buffer accumulating changes while the child saves */
-        aofRewriteBufferReset();
         aofRemoveTempFile(server.aof_child_pid);
         server.aof_child_pid = -1;
         server.aof_rewrite_time_start = -1;
-        /* close pipes used for IPC between the two processes. */
-        aofClosePipes();
     }
 }
 
 /* Called when the user switches from "appendonly no" to "appendonly yes"
  * at runtime using the CONFIG command. */
 int startAppendOnly(void) {
-    char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-
-    server.aof_last_fsync = server.unixtime;
-    server.aof_fd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
-    if (server.aof_fd == -1) {
-        char *cwdp = getcwd(cwd,MAXPATHLEN);
-
-        serverLog(LL_WARNING,
-            "Redis needs to enable the AOF but can't open the "
-            "append only file %s (in server root dir %s): %s",
-            server.aof_filename,
-            cwdp ? cwdp : "unknown",
-            strerror(errno));
-        return C_ERR;
-    }
+    server.aof_last_fsync = server.unixtime;
+    /* Set the state first: the rewrite opens the temp incr file receiving
+     * the writes until it is done, see aofOpenNewIncrFile(). */
+    server.aof_state = AOF_WAIT_REWRITE;
     if (server.rdb_child_pid != -1) {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already a child process saving an RDB file on disk. An AOF background was scheduled to start when possible.");
     } else if (rewriteAppendOnlyFileBackground() == C_ERR) {
-        close(server.aof_fd);
+        server.aof_state = AOF_OFF;
         serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
         return C_ERR;
     }
     /* We correctly switched on AOF, now wait for the rewrite to be complete
      * in order to append data on disk. */
-    server.aof_state = AOF_WAIT_REWRITE;
     return C_OK;
 }
 
-/*
- * 把aof缓冲区写入硬盘
- *
- * 因为要做到在响应客户端之前就写AOF缓冲区到硬盘，而且客户端socket只能在事件循环中执行写动作
- * 因此再次进入事件循环之前，使用此函数计算所有在内存缓冲的aof指令并且写到硬盘
- *
- * force参数说明 :
- *
- * 当同步策略设为每秒的时候，如果同步正在后台进行，程序需要延迟输出缓冲，因为Linux的write操作会被后台的同步阻塞。
- * 当上面的情况发生时，程序需要记住这里有一些aof缓冲需要及时被输出，会在serverCron函数里体现。
- *
- * 但是，如果force=1，就会忽略后台的同步，强制地输出缓冲。 */
 #define AOF_WRITE_LOG_ERROR_RATE 30 /* Seconds between errors logging. */
-void flushAppendOnlyFile(int force) {
-    ssize_t nwritten;
-    int sync_in_progress = 0;
-    mstime_t latency;
-
-    if (sdslen(server.aof_buf) == 0) return;
-
-    if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
-        sync_in_progress = bioPendingJobsOfType(BIO_AOF_FSYNC) != 0;
-
-    if (server.aof_fsync == AOF_FSYNC_EVERYSEC && !force) {
-        /* 同步策略是每秒，而且没有强制要求，在后台执行同步操作
-         * 如果同步仍在执行，就会尝试延迟写
-         */
-        if (sync_in_progress) {
-            // 如果同步正在执行
-            if (server.aof_flush_postponed_start == 0) {
-
-                /* 之前的写操作没有被延迟，记录延迟缓冲输出时间然后返回 */
-                server.aof_flush_postponed_start = server.unixtime;
-                return;
-            } else if (server.unixtime - server.aof_flush_postponed_start < 2) {
-                /* 当前以及在等待同步的完成，如果2秒之后还没完成，再次延迟。 */
-                return;
-            }
-            /* 否则，就执行写操作，延迟1秒 */
-            server.aof_delayed_fsync++;
-            serverLog(LL_NOTICE,"Asynchronous AOF fsync is taking too long (disk is busy?). Writing the AOF buffer without waiting for fsync to complete, this may slow down Redis.");
-        }
-    }
-    /* 希望程序执行一个单一的写操作。如果写的是真正的物理硬盘，这个操作需要保证原子性
-     *
-     * While this will save us against the server being killed I don't think
-     * there is much to do about the whole server stopping for power problems
-     * or alike */
-
-    latencyStartMonitor(latency);
-    nwritten = write(server.aof_fd,server.aof_buf,sdslen(server.aof_buf));
-    latencyEndMonitor(latency);
-    /* We want to capture different events for delayed writes:
-     * when the delay happens with a pending fsync, or with a saving child
-     * active, and when the above two conditions are missing.
-     * We also use an additional event name to save all samples which is
-     * useful for graphing / monitoring purposes. */
-    if (sync_in_progress) {
-        latencyAddSampleIfNeeded("aof-write-pending-fsync",latency);
-    } else if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) {
-        latencyAddSampleIfNeeded("aof-write-active-child",latency);
-    } else {
-        latencyAddSampleIfNeeded("aof-write-alone",latency);
-    }
-    latencyAddSampleIfNeeded("aof-write",latency);
 
-    /* 以下执行写操作，把推迟输出缓冲标志设为0 */
-    server.aof_flush_postponed_start = 0;
-
-    if (nwritten != (signed)sdslen(server.aof_buf)) {
+/* Handle the outcome of writing 'buf' to the AOF, where 'nwritten' and
+ * 'write_errno' are the return value of write(2) and its errno. On success
+ * the AOF size is updated and C_OK is returned. On error the problem is
+ * logged and C_ERR is returned: 'buf' is left with the part that did not
+ * reach the file, for the caller to try again later. */
+static int aofHandleWriteResult(sds buf, ssize_t nwritten, int write_errno) {
+    if (nwritten != (signed)sdslen(buf)) {
         // 出错的处理
         static time_t last_write_error_log = 0;
         int can_log = 0;
@@ -350,8 +929,8 @@ void flushAppendOnlyFile(int force) {
         if (nwritten == -1) {
             if (can_log) {
                 serverLog(LL_WARNING,"Error writing to the AOF file: %s",
-                    strerror(errno));
-                server.aof_last_write_errno = errno;
+                    strerror(write_errno));
+                server.aof_last_write_errno = write_errno;
             }
         } else {
             // 记录日志
@@ -360,10 +939,10 @@ void flushAppendOnlyFile(int force) {
                                        "the AOF file: (nwritten=%lld, "
                                        "expected=%lld)",
                                        (long long)nwritten,
-                                       (long long)sdslen(server.aof_buf));
+                                       (long long)sdslen(buf));
             }
 
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            if (ftruncate(server.aof_fd, server.aof_last_incr_size) == -1) {
                 if (can_log) {
                     serverLog(LL_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -396,9 +975,10 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
-                sdsrange(server.aof_buf,nwritten,-1);
+                server.aof_last_incr_size += nwritten;
+                sdsrange(buf,nwritten,-1);
             }
-            return; /* We'll try again on the next call... */
+            return C_ERR;
         }
     } else {
         /* 写成功了，如果AOF在错误的阶段，重新记录OK状态和事件 */
@@ -409,6 +989,88 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_last_incr_size += nwritten;
+    return C_OK;
+}
+
+/*
+ * 把aof缓冲区写入硬盘
+ *
+ * 因为要做到在响应客户端之前就写AOF缓冲区到硬盘，而且客户端socket只能在事件循环中执行写动作
+ * 因此再次进入事件循环之前，使用此函数计算所有在内存缓冲的aof指令并且写到硬盘
+ *
+ * force参数说明 :
+ *
+ * 当同步策略设为每秒的时候，如果同步正在后台进行，程序需要延迟输出缓冲，因为Linux的write操作会被后台的同步阻塞。
+ * 当上面的情况发生时，程序需要记住这里有一些aof缓冲需要及时被输出，会在serverCron函数里体现。
+ *
+ * 但是，如果force=1，就会忽略后台的同步，强制地输出缓冲。 */
+void flushAppendOnlyFile(int force) {
+    ssize_t nwritten;
+    int sync_in_progress = 0, write_errno;
+    mstime_t latency;
+
+    if (aofWriterFlush(force) == C_OK) return;
+    if (sdslen(server.aof_buf) == 0) return;
+
+    if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
+        sync_in_progress = bioPendingJobsOfType(BIO_AOF_FSYNC) != 0;
+
+    if (server.aof_fsync == AOF_FSYNC_EVERYSEC && !force) {
+        /* 同步策略是每秒，而且没有强制要求，在后台执行同步操作
+         * 如果同步仍在执行，就会尝试延迟写
+         */
+        if (sync_in_progress) {
+            // 如果同步正在执行
+            if (server.aof_flush_postponed_start == 0) {
+
+                /* 之前的写操作没有被延迟，记录延迟缓冲输出时间然后返回 */
+                server.aof_flush_postponed_start = server.unixtime;
+                return;
+            } else if (server.unixtime - server.aof_flush_postponed_start < 2) {
+                /* 当前以及在等待同步的完成，如果2秒之后还没完成，再次延迟。 */
+                return;
+            }
+            /* 否则，就执行写操作，延迟1秒 */
+            server.aof_delayed_fsync++;
+            serverLog(LL_NOTICE,"Asynchronous AOF fsync is taking too long (disk is busy?). Writing the AOF buffer without waiting for fsync to complete, this may slow down Redis.");
+        }
+    }
+    /* 希望程序执行一个单一的写操作。如果写的是真正的物理硬盘，这个操作需要保证原子性
+     *
+     * While this will save us against the server being killed I don't think
+     * there is much to do about the whole server stopping for power problems
+     * or alike */
+
+    aofFrameBuffer();
+    latencyStartMonitor(latency);
+    nwritten = write(server.aof_fd,server.aof_buf,sdslen(server.aof_buf));
+    write_errno = errno;
+    latencyEndMonitor(latency);
+    /* We want to capture different events for delayed writes:
+     * when the delay happens with a pending fsync, or with a saving child
+     * active, and when the above two conditions are missing.
+     * We also use an additional event name to save all samples which is
+     * useful for graphing / monitoring purposes. */
+    if (sync_in_progress) {
+        latencyAddSampleIfNeeded("aof-write-pending-fsync",latency);
+    } else if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) {
+        latencyAddSampleIfNeeded("aof-write-active-child",latency);
+    } else {
+        latencyAddSampleIfNeeded("aof-write-alone",latency);
+    }
+    latencyAddSampleIfNeeded("aof-write",latency);
+
+    /* 以下执行写操作，把推迟输出缓冲标志设为0 */
+    server.aof_flush_postponed_start = 0;
+
+    if (aofHandleWriteResult(server.aof_buf,nwritten,write_errno) == C_ERR) {
+        if (server.aof_fd_binary) server.aof_buf_framed = sdslen(server.aof_buf);
+        return; /* We'll try again on the next call... */
+    }
+    server.aof_buf_framed = 0;
+    server.aof_flushed_offset = server.aof_fed_offset;
+    if (listLength(server.clients_waiting_aof)) aofReleaseWaitingClients();
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -466,6 +1128,13 @@ sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
     return dst;
 }
 
+/* Append a command to 'dst' in the format of the open incr file. */
+static sds catAppendOnlyCommand(sds dst, int argc, robj **argv) {
+    if (server.aof_fd_binary)
+        return catAppendOnlyBinaryCommand(dst,argc,argv);
+    return catAppendOnlyGenericCommand(dst,argc,argv);
+}
+
 /* Create the sds representation of an PEXPIREAT command, using
  * 'seconds' as time to live and 'cmd' to understand what command
  * we are translating into a PEXPIREAT.
@@ -497,7 +1166,7 @@ sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, r
     argv[0] = createStringObject("PEXPIREAT",9);
     argv[1] = key;
     argv[2] = createStringObjectFromLongLong(when);
-    buf = catAppendOnlyGenericCommand(buf, 3, argv);
+    buf = catAppendOnlyCommand(buf, 3, argv);
     decrRefCount(argv[0]);
     decrRefCount(argv[2]);
     return buf;
@@ -512,9 +1181,13 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
     if (dictid != server.aof_selected_db) {
         char seldb[64];
 
-        snprintf(seldb,sizeof(seldb),"%d",dictid);
-        buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
-            (unsigned long)strlen(seldb),seldb);
+        if (server.aof_fd_binary) {
+            buf = catAppendOnlyBinarySelect(buf,dictid);
+        } else {
+            snprintf(seldb,sizeof(seldb),"%d",dictid);
+            buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
+                (unsigned long)strlen(seldb),seldb);
+        }
         server.aof_selected_db = dictid;
     }
 
@@ -527,14 +1200,14 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
         tmpargv[0] = createStringObject("SET",3);
         tmpargv[1] = argv[1];
         tmpargv[2] = argv[3];
-        buf = catAppendOnlyGenericCommand(buf,3,tmpargv);
+        buf = catAppendOnlyCommand(buf,3,tmpargv);
         decrRefCount(tmpargv[0]);
         buf = catAppendOnlyExpireAtCommand(buf,cmd,argv[1],argv[2]);
     } else if (cmd->proc == setCommand && argc > 3) {
         int i;
         robj *exarg = NULL, *pxarg = NULL;
         /* Translate SET [EX seconds][PX milliseconds] to SET and PEXPIREAT */
-        buf = catAppendOnlyGenericCommand(buf,3,argv);
+        buf = catAppendOnlyCommand(buf,3,argv);
         for (i = 3; i < argc; i ++) {
             if (!strcasecmp(argv[i]->ptr, "ex")) exarg = argv[i+1];
             if (!strcasecmp(argv[i]->ptr, "px")) pxarg = argv[i+1];
@@ -550,21 +1223,22 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
         /* All the other commands don't need translation or need the
          * same translation already operated in the command vector
          * for the replication itself. */
-        buf = catAppendOnlyGenericCommand(buf,argc,argv);
+        buf = catAppendOnlyCommand(buf,argc,argv);
     }
 
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+     * positive reply about the operation performed.
+     *
+     * While waiting for the first rewrite the writes go to the temp incr
+     * file, but only once the rewrite child was forked: what happened before
+     * is already in the dataset it saves. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_state == AOF_WAIT_REWRITE && server.aof_child_pid != -1))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
-
-    /* If a background append only file rewriting is in progress we want to
-     * accumulate the differences between the child DB and the current one
-     * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+        server.aof_fed_offset += sdslen(buf);
+    }
 
     sdsfree(buf);
 }
@@ -618,19 +1292,21 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
-/* Replay the append log file. On success C_OK is returned. On non fatal
- * error (the append only file is zero-length) C_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyFile(char *filename) {
+/* Replay one of the files the AOF is made of. 'last' is true for the last
+ * file of the manifest, the only one that may be truncated by a crash, and
+ * 'offset' is the total size of the files loaded before it, used to report
+ * the loading progress. On success C_OK is returned. On non fatal error (the
+ * file is zero-length) C_ERR is returned. On fatal error an error message is
+ * logged and the program exists. */
+static int loadSingleAppendOnlyFile(char *filename, int last, off_t offset) {
     struct client *fakeClient;
     FILE *fp = fopen(filename,"r");
     struct redis_stat sb;
-    int old_aof_state = server.aof_state;
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of latest well-formed command loaded. */
 
     if (fp == NULL) {
-        serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
+        serverLog(LL_WARNING,"Fatal error: can't open the append log file %s for reading: %s",filename,strerror(errno));
         exit(1);
     }
 
@@ -639,22 +1315,27 @@ int loadAppendOnlyFile(char *filename) {
      * a zero length file at startup, that will remain like that if no write
      * operation is received. */
     if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
-        server.aof_current_size = 0;
         fclose(fp);
         return C_ERR;
     }
 
-    /* Temporarily disable AOF, to prevent EXEC from feeding a MULTI
-     * to the same file we're about to read. */
-    server.aof_state = AOF_OFF;
-
     fakeClient = createFakeClient();
-    startLoading(fp);
 
     /* Check if this AOF file has an RDB preamble. In that case we need to
      * load the RDB file and later continue loading the AOF tail. */
     char sig[5]; /* "REDIS" */
-    if (fread(sig,1,5,fp) != 5 || memcmp(sig,"REDIS",5) != 0) {
+    size_t siglen = fread(sig,1,5,fp);
+    if (siglen == 5 && memcmp(sig,AOF_BIN_MAGIC,5) == 0) {
+        /* Binary incr file, see aofbin.c. */
+        switch(aofBinLoad(fp,fakeClient,offset,&valid_up_to)) {
+        case AOF_BIN_OK: break;
+        case AOF_BIN_TRUNCATED: goto uxeof;
+        case AOF_BIN_READERR: goto readerr;
+        default: goto fmterr;
+        }
+        if (fakeClient->flags & CLIENT_MULTI) goto uxeof;
+        goto loaded_ok;
+    } else if (siglen != 5 || memcmp(sig,"REDIS",5) != 0) {
         /* No RDB preamble, seek back at 0 offset. */
         if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
     } else {
@@ -683,7 +1364,7 @@ int loadAppendOnlyFile(char *filename) {
 
         /* Serve the clients from time to time */
         if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
+            loadingProgress(offset+ftello(fp));
             processEventsWhileBlocked();
         }
 
@@ -752,13 +1433,9 @@ int loadAppendOnlyFile(char *filename) {
      * If the client is in the middle of a MULTI/EXEC, log error and quit. */
     if (fakeClient->flags & CLIENT_MULTI) goto uxeof;
 
-loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
+loaded_ok: /* File loaded, cleanup and return C_OK to the caller. */
     fclose(fp);
     freeFakeClient(fakeClient);
-    server.aof_state = old_aof_state;
-    stopLoading();
-    aofUpdateCurrentSize();
-    server.aof_rewrite_base_size = server.aof_current_size;
     return C_OK;
 
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
@@ -769,7 +1446,7 @@ readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     }
 
 uxeof: /* Unexpected AOF end of file. */
-    if (server.aof_load_truncated) {
+    if (server.aof_load_truncated && last) {
         serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
         serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
             (unsigned long long) valid_up_to);
@@ -803,6 +1480,59 @@ fmterr: /* Format error. */
     exit(1);
 }
 
+/* Replay the AOF described by the manifest 'am': the base file, then the
+ * incr files in order. On success C_OK is returned. On non fatal error
+ * (there is nothing to load, or all the files are zero-length) C_ERR is
+ * returned. On fatal error an error message is logged and the program
+ * exists. */
+int loadAppendOnlyFiles(aofManifest *am) {
+    int old_aof_state = server.aof_state;
+    int loaded = 0, total_num, num = 0;
+    off_t total_size = 0, offset = 0;
+    struct redis_stat sb;
+    listNode *ln;
+    listIter li;
+    aofInfo *ai;
+
+    total_num = listLength(am->incr_aof_list) + (am->base_aof_info != NULL);
+    if (total_num == 0) return C_ERR;
+
+    /* The progress is reported against the size of all the files. */
+    if (am->base_aof_info && redis_stat(am->base_aof_info->file_name,&sb) == 0)
+        total_size += sb.st_size;
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        ai = ln->value;
+        if (redis_stat(ai->file_name,&sb) == 0) total_size += sb.st_size;
+    }
+
+    /* Temporarily disable AOF, to prevent EXEC from feeding a MULTI
+     * to the same file we're about to read. */
+    server.aof_state = AOF_OFF;
+    startLoadingStream(total_size,0);
+
+    ai = am->base_aof_info;
+    listRewind(am->incr_aof_list,&li);
+    if (ai == NULL) {
+        ln = listNext(&li);
+        ai = ln ? ln->value : NULL;
+    }
+    while (ai) {
+        num++;
+        if (loadSingleAppendOnlyFile(ai->file_name,num == total_num,
+                                     offset) == C_OK) loaded++;
+        if (redis_stat(ai->file_name,&sb) == 0) offset += sb.st_size;
+        ln = listNext(&li);
+        ai = ln ? ln->value : NULL;
+    }
+
+    server.aof_state = old_aof_state;
+    stopLoading();
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    return loaded ? C_OK : C_ERR;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -907,7 +1637,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -915,13 +1645,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpFirst(zl);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -978,12 +1708,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1041,28 +1771,13 @@ int rewriteModuleObject(rio *r, robj *key, robj *o) {
     return io.error ? 0 : 1;
 }
 
-/* This function is called by the child rewriting the AOF file to read
- * the difference accumulated from the parent into a buffer, that is
- * concatenated at the end of the rewrite. */
-ssize_t aofReadDiffFromParent(void) {
-    char buf[65536]; /* Default pipe buffer size on most Linux systems. */
-    ssize_t nread, total = 0;
-
-    while ((nread =
-            read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
-        server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
-        total += nread;
-    }
-    return total;
-}
-
 /*
  * 重写实现
  */
 int rewriteAppendOnlyFileRio(rio *aof) {
     dictIterator *di = NULL;
     dictEntry *de;
-    size_t processed = 0;
+    robj *decoded = NULL;
     long long now = mstime();
     int j;
 
@@ -1091,11 +1806,15 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             initStaticStringObject(key,keystr); // 为key创建字符串对象
 
             // 过期时间
-            expiretime = getExpire(db,&key);
+            expiretime = getEntryExpire(de);
 
             /* 忽略超过过期时间的key */
             if (expiretime != -1 && expiretime < now) continue;
 
+            /* 值还在映射的RDB文件中，临时解码，见rdbmap.c */
+            if (o->encoding == OBJ_ENCODING_MAPPED)
+                o = decoded = rdbMappedDecode(o);
+
             /* 保存key和对应的值 */
             if (o->type == OBJ_STRING) {
                 /* 处理set命令 */
@@ -1124,10 +1843,9 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rioWriteBulkObject(aof,&key) == 0) goto werr;
                 if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
             }
-            /* 从父进程读取更新的值 */
-            if (aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES) {
-                processed = aof->processed_bytes;
-                aofReadDiffFromParent();
+            if (decoded) {
+                decrRefCount(decoded);
+                decoded = NULL;
             }
         }
         dictReleaseIterator(di);
@@ -1137,6 +1855,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
 
 werr:
     if (di) dictReleaseIterator(di);
+    if (decoded) decrRefCount(decoded);
     return C_ERR;
 }
 
@@ -1148,7 +1867,6 @@ int rewriteAppendOnlyFile(char *filename) {
     rio aof;
     FILE *fp;
     char tmpfile[256];
-    char byte;
 
     /* 注意，另一个重写函数rewriteAppendOnlyFileBackground也会产生临时文件，为了区分，这里需要使用不同的临时文件名称 */
     snprintf(tmpfile,256,"temp-rewriteaof-%d.aof", (int) getpid());
@@ -1158,7 +1876,6 @@ int rewriteAppendOnlyFile(char *filename) {
         return C_ERR;
     }
 
-    server.aof_child_diff = sdsempty();
     rioInitWithFile(&aof,fp);
 
     // 如果需要马上同步，设置标记
@@ -1177,50 +1894,6 @@ int rewriteAppendOnlyFile(char *filename) {
         if (rewriteAppendOnlyFileRio(&aof) == C_ERR) goto werr;
     }
 
-    /* 为了下一次同步更快一点，父进程还在发送数据时，先执行一次文件同步 */
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
-
-    /* Read again a few times to get more data from the parent.
-     * We can't read forever (the server may receive data from clients
-     * faster than it is able to send data to the child), so we try to read
-     * some more data in a loop as soon as there is a good chance more data
-     * will come. If it looks like we are wasting time, we abort (this
-     * happens after 20 ms without new data). */
-    int nodata = 0;
-    mstime_t start = mstime();
-    while(mstime()-start < 1000 && nodata < 20) {
-        if (aeWait(server.aof_pipe_read_data_from_parent, AE_READABLE, 1) <= 0)
-        {
-            nodata++;
-            continue;
-        }
-        nodata = 0; /* Start counting from zero, we stop on N *contiguous*
-                       timeouts. */
-        aofReadDiffFromParent();
-    }
-
-    /* 通知主库停止发送更多命令 */
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
-    if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
-    /* We read the ACK from the server using a 10 seconds timeout. Normally
-     * it should reply ASAP, but just in case we lose its reply, we are sure
-     * the child will eventually get terminated. */
-    if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
-    serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
-
-    /* Read the final diff if any. */
-    aofReadDiffFromParent();
-
-    /* Write the received diff to the file. */
-    serverLog(LL_NOTICE,
-        "Concatenating %.2f MB of AOF diff received from parent.",
-        (double) sdslen(server.aof_child_diff) / (1024*1024));
-    if (rioWrite(&aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
-        goto werr;
-
     /* 把缓冲都输出，确保当前计算机不会保存之前的缓冲 */
     if (fflush(fp) == EOF) goto werr;
     if (fsync(fileno(fp)) == -1) goto werr;
@@ -1244,80 +1917,6 @@ werr:
     return C_ERR;
 }
 
-/* ----------------------------------------------------------------------------
- * AOF rewrite pipes for IPC
- * -------------------------------------------------------------------------- */
-
-/* This event handler is called when the AOF rewriting child sends us a
- * single '!' char to signal we should stop sending buffer diffs. The
- * parent sends a '!' as well to acknowledge. */
-void aofChildPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
-    char byte;
-    UNUSED(el);
-    UNUSED(privdata);
-    UNUSED(mask);
-
-    if (read(fd,&byte,1) == 1 && byte == '!') {
-        serverLog(LL_NOTICE,"AOF rewrite child asks to stop sending diffs.");
-        server.aof_stop_sending_diff = 1;
-        if (write(server.aof_pipe_write_ack_to_child,"!",1) != 1) {
-            /* If we can't send the ack, inform the user, but don't try again
-             * since in the other side the children will use a timeout if the
-             * kernel can't buffer our write, or, the children was
-             * terminated. */
-            serverLog(LL_WARNING,"Can't send ACK to AOF child: %s",
-                strerror(errno));
-        }
-    }
-    /* Remove the handler since this can be called only one time during a
-     * rewrite. */
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-}
-
-/* Create the pipes used for parent - child process IPC during rewrite.
- * We have a data pipe used to send AOF incremental diffs to the child,
- * and two other pipes used by the children to signal it finished with
- * the rewrite so no more data should be written, and another for the
- * parent to acknowledge it understood this new condition. */
-int aofCreatePipes(void) {
-    int fds[6] = {-1, -1, -1, -1, -1, -1};
-    int j;
-
-    if (pipe(fds) == -1) goto error; /* parent -> children data. */
-    if (pipe(fds+2) == -1) goto error; /* children -> parent ack. */
-    if (pipe(fds+4) == -1) goto error; /* children -> parent ack. */
-    /* Parent -> children data is non blocking. */
-    if (anetNonBlock(NULL,fds[0]) != ANET_OK) goto error;
-    if (anetNonBlock(NULL,fds[1]) != ANET_OK) goto error;
-    if (aeCreateFileEvent(server.el, fds[2], AE_READABLE, aofChildPipeReadable, NULL) == AE_ERR) goto error;
-
-    server.aof_pipe_write_data_to_child = fds[1];
-    server.aof_pipe_read_data_from_parent = fds[0];
-    server.aof_pipe_write_ack_to_parent = fds[3];
-    server.aof_pipe_read_ack_from_child = fds[2];
-    server.aof_pipe_write_ack_to_child = fds[5];
-    server.aof_pipe_read_ack_from_parent = fds[4];
-    server.aof_stop_sending_diff = 0;
-    return C_OK;
-
-error:
-    serverLog(LL_WARNING,"Error opening /setting AOF rewrite IPC pipes: %s",
-        strerror(errno));
-    for (j = 0; j < 6; j++) if(fds[j] != -1) close(fds[j]);
-    return C_ERR;
-}
-
-void aofClosePipes(void) {
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-    aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,AE_WRITABLE);
-    close(server.aof_pipe_write_data_to_child);
-    close(server.aof_pipe_read_data_from_parent);
-    close(server.aof_pipe_write_ack_to_parent);
-    close(server.aof_pipe_read_ack_from_child);
-    close(server.aof_pipe_write_ack_to_child);
-    close(server.aof_pipe_read_ack_from_parent);
-}
-
 /* ----------------------------------------------------------------------------
  * AOF background rewrite
  * ------------------------------------------------------------------------- */
@@ -1325,21 +1924,36 @@ void aofClosePipes(void) {
 /* This is how rewriting of the append only file in background works:
  *
  * 1) The user calls BGREWRITEAOF
- * 2) Redis calls this function, that forks():
+ * 2) Redis calls this function, that switches the AOF writes to a new incr
+ *    file and forks():
  *    2a) the child rewrite the append only file in a temp file.
- *    2b) the parent accumulates differences in server.aof_rewrite_buf.
+ *    2b) the parent appends the new writes to the new incr file.
  * 3) When the child finished '2a' exists.
- * 4) The parent will trap the exit code, if it's OK, will append the
- *    data accumulated into server.aof_rewrite_buf into the temp file, and
- *    finally will rename(2) the temp file in the actual file name.
- *    The the new file is reopened as the new append only file. Profit!
+ * 4) The parent will trap the exit code, if it's OK, will rename(2) the
+ *    temp file as the new base, and write a manifest listing it followed
+ *    by the new incr file. The files it no longer lists are deleted.
  */
 int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
     long long start;
 
     if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+
+    /* Everything written before the fork must be in the old incr file, or
+     * it would be replayed twice: once from the new base, and once from the
+     * new incr file. While waiting for the first rewrite it is just dropped,
+     * the rewrite saves it anyway. */
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        aofDiscardBuffer();
+    } else if (server.aof_state == AOF_ON) {
+        flushAppendOnlyFile(1);
+        if (sdslen(server.aof_buf)) {
+            serverLog(LL_WARNING,"Can't rewrite the AOF while its buffer "
+                                 "can't be written to disk.");
+            return C_ERR;
+        }
+    }
+    if (aofOpenNewIncrFile() == C_ERR) return C_ERR;
     openChildInfoPipe();
     start = ustime();
     if ((childpid = fork()) == 0) {
@@ -1374,7 +1988,6 @@ int rewriteAppendOnlyFileBackground(void) {
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
             return C_ERR;
         }
         serverLog(LL_NOTICE,
@@ -1383,11 +1996,6 @@ int rewriteAppendOnlyFileBackground(void) {
         server.aof_rewrite_time_start = time(NULL);
         server.aof_child_pid = childpid;
         updateDictResizePolicy();
-        /* We set appendseldb to -1 in order to force the next call to the
-         * feedAppendOnlyFile() to issue a SELECT command, so the differences
-         * accumulated by the parent into server.aof_rewrite_buf will start
-         * with a SELECT statement and it will be safe to merge. */
-        server.aof_selected_db = -1;
         replicationScriptCacheFlush();
         return C_OK;
     }
@@ -1415,20 +2023,37 @@ void aofRemoveTempFile(pid_t childpid) {
 }
 
 /* Update the server.aof_current_size field explicitly using stat(2)
- * to check the size of the file. This is useful after a rewrite or after
- * a restart, normally the size is updated just adding the write length
- * to the current length, that is much faster. */
+ * to check the size of the files listed by the manifest. This is useful
+ * after a rewrite or after a restart, normally the size is updated just
+ * adding the write length to the current length, that is much faster. */
 void aofUpdateCurrentSize(void) {
     struct redis_stat sb;
     mstime_t latency;
+    off_t size = 0;
+    listNode *ln;
+    listIter li;
+    aofInfo *ai;
 
     latencyStartMonitor(latency);
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
-        serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
-            strerror(errno));
-    } else {
-        server.aof_current_size = sb.st_size;
+    ai = server.aof_manifest->base_aof_info;
+    listRewind(server.aof_manifest->incr_aof_list,&li);
+    if (ai == NULL) {
+        ln = listNext(&li);
+        ai = ln ? ln->value : NULL;
+    }
+    while (ai) {
+        if (redis_stat(ai->file_name,&sb) == -1) {
+            serverLog(LL_WARNING,"Unable to obtain the AOF file %s length. "
+                                 "stat: %s",ai->file_name,strerror(errno));
+        } else {
+            size += sb.st_size;
+        }
+        ln = listNext(&li);
+        ai = ln ? ln->value : NULL;
     }
+    server.aof_current_size = size;
+    if (server.aof_fd != -1 && redis_fstat(server.aof_fd,&sb) != -1)
+        server.aof_last_incr_size = sb.st_size;
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("aof-fstat",latency);
 }
@@ -1436,115 +2061,91 @@ void aofUpdateCurrentSize(void) {
 /* A background append only file rewriting (BGREWRITEAOF) terminated its work.
  * Handle this. */
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
+    aofManifest *am = NULL;
+    sds basename = NULL, tmpincr = NULL, incrname = NULL;
+
     if (!bysignal && exitcode == 0) {
-        int newfd, oldfd;
         char tmpfile[256];
         long long now = ustime();
         mstime_t latency;
+        aofManifest *old = server.aof_manifest;
+        aofInfo *base;
 
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
-
-        /* Flush the differences accumulated by the parent to the
-         * rewritten AOF. */
-        latencyStartMonitor(latency);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
             (int)server.aof_child_pid);
-        newfd = open(tmpfile,O_WRONLY|O_APPEND);
-        if (newfd == -1) {
-            serverLog(LL_WARNING,
-                "Unable to open the temporary AOF produced by the child: %s", strerror(errno));
-            goto cleanup;
-        }
 
-        if (aofRewriteBufferWrite(newfd) == -1) {
-            serverLog(LL_WARNING,
-                "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
-            close(newfd);
-            goto cleanup;
+        /* The new manifest lists the new base, followed by the incr file
+         * opened when the rewrite started. With the AOF ON it is the last
+         * one of the current manifest, all the previous ones are now in the
+         * base. With the AOF OFF there is none. While waiting for the first
+         * rewrite it is the temp incr file, renamed as a regular one. */
+        am = aofManifestDup(old);
+        basename = getNewBaseFileName(++am->curr_base_file_seq);
+        base = aofInfoCreate();
+        base->file_name = sdsdup(basename);
+        base->file_seq = am->curr_base_file_seq;
+        base->file_type = AOF_FILE_TYPE_BASE;
+        if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+        am->base_aof_info = base;
+        while (listLength(am->incr_aof_list) >
+               (unsigned long)(server.aof_state == AOF_ON))
+        {
+            listDelNode(am->incr_aof_list,listFirst(am->incr_aof_list));
         }
-        latencyEndMonitor(latency);
-        latencyAddSampleIfNeeded("aof-rewrite-diff-write",latency);
-
-        serverLog(LL_NOTICE,
-            "Residual parent diff successfully flushed to the rewritten AOF (%.2f MB)", (double) aofRewriteBufferSize() / (1024*1024));
-
-        /* The only remaining thing to do is to rename the temporary file to
-         * the configured file and switch the file descriptor used to do AOF
-         * writes. We don't want close(2) or rename(2) calls to block the
-         * server on old file deletion.
-         *
-         * There are two possible scenarios:
-         *
-         * 1) AOF is DISABLED and this was a one time rewrite. The temporary
-         * file will be renamed to the configured file. When this file already
-         * exists, it will be unlinked, which may block the server.
-         *
-         * 2) AOF is ENABLED and the rewritten AOF will immediately start
-         * receiving writes. After the temporary file is renamed to the
-         * configured file, the original AOF file descriptor will be closed.
-         * Since this will be the last reference to that file, closing it
-         * causes the underlying file to be unlinked, which may block the
-         * server.
-         *
-         * To mitigate the blocking effect of the unlink operation (either
-         * caused by rename(2) in scenario 1, or by close(2) in scenario 2), we
-         * use a background thread to take care of this. First, we
-         * make scenario 1 identical to scenario 2 by opening the target file
-         * when it exists. The unlink operation after the rename(2) will then
-         * be executed upon calling close(2) for its descriptor. Everything to
-         * guarantee atomicity for this switch has already happened by then, so
-         * we don't care what the outcome or duration of that close operation
-         * is, as long as the file descriptor is released again. */
-        if (server.aof_fd == -1) {
-            /* AOF disabled */
-
-             /* Don't care if this fails: oldfd will be -1 and we handle that.
-              * One notable case of -1 return is if the old file does
-              * not exist. */
-             oldfd = open(server.aof_filename,O_RDONLY|O_NONBLOCK);
-        } else {
-            /* AOF enabled */
-            oldfd = -1; /* We'll set this to the current AOF filedes later. */
+        if (server.aof_state == AOF_WAIT_REWRITE) {
+            aofInfo *ai = aofInfoCreate();
+
+            tmpincr = getTempIncrFileName();
+            incrname = getNewIncrFileName(++am->curr_incr_file_seq);
+            ai->file_name = sdsdup(incrname);
+            ai->file_seq = am->curr_incr_file_seq;
+            ai->file_type = AOF_FILE_TYPE_INCR;
+            listAddNodeTail(am->incr_aof_list,ai);
         }
 
-        /* Rename the temporary file. This will not unlink the target file if
-         * it exists, because we reference it with "oldfd". */
+        /* Rename the files first, then switch to the new manifest, that
+         * is the point where the rewrite is committed. */
         latencyStartMonitor(latency);
-        if (rename(tmpfile,server.aof_filename) == -1) {
+        if (rename(tmpfile,basename) == -1) {
             serverLog(LL_WARNING,
                 "Error trying to rename the temporary AOF file %s into %s: %s",
-                tmpfile,
-                server.aof_filename,
-                strerror(errno));
-            close(newfd);
-            if (oldfd != -1) close(oldfd);
-            goto cleanup;
+                tmpfile,basename,strerror(errno));
+            goto manifesterr;
+        }
+        if (tmpincr && rename(tmpincr,incrname) == -1) {
+            serverLog(LL_WARNING,
+                "Error trying to rename the temporary AOF file %s into %s: %s",
+                tmpincr,incrname,strerror(errno));
+            unlink(basename);
+            goto manifesterr;
+        }
+        if (aofPersistManifest(am) == C_ERR) {
+            unlink(basename);
+            if (tmpincr) rename(incrname,tmpincr);
+            goto manifesterr;
         }
         latencyEndMonitor(latency);
         latencyAddSampleIfNeeded("aof-rename",latency);
 
-        if (server.aof_fd == -1) {
-            /* AOF disabled, we don't need to set the AOF file descriptor
-             * to this new file, so we can close it. */
-            close(newfd);
-        } else {
-            /* AOF enabled, replace the old fd with the new one. */
-            oldfd = server.aof_fd;
-            server.aof_fd = newfd;
+        /* Delete the files the new manifest dropped. This would block the
+         * server on large files, so it is done in a background thread. */
+        aofDelDroppedFiles(old,am);
+        aofManifestFree(old);
+        server.aof_manifest = am;
+        sdsfree(basename);
+        sdsfree(tmpincr);
+        sdsfree(incrname);
+
+        if (server.aof_fd != -1) {
             if (server.aof_fsync == AOF_FSYNC_ALWAYS)
-                aof_fsync(newfd);
+                aof_fsync(server.aof_fd);
             else if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
-                aof_background_fsync(newfd);
-            server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
-            aofUpdateCurrentSize();
-            server.aof_rewrite_base_size = server.aof_current_size;
-
-            /* Clear regular AOF buffer since its contents was just written to
-             * the new AOF from the background rewrite buffer. */
-            sdsfree(server.aof_buf);
-            server.aof_buf = sdsempty();
+                aof_background_fsync(server.aof_fd);
         }
+        aofUpdateCurrentSize();
+        server.aof_rewrite_base_size = server.aof_current_size;
 
         server.aof_lastbgrewrite_status = C_OK;
 
@@ -1553,9 +2154,6 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         if (server.aof_state == AOF_WAIT_REWRITE)
             server.aof_state = AOF_ON;
 
-        /* Asynchronously close the overwritten AOF. */
-        if (oldfd != -1) bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,NULL,NULL);
-
         serverLog(LL_VERBOSE,
             "Background AOF rewrite signal handler took %lldus", ustime()-now);
     } else if (!bysignal && exitcode != 0) {
@@ -1573,8 +2171,6 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     }
 
 cleanup:
-    aofClosePipes();
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.aof_child_pid);
     server.aof_child_pid = -1;
     server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
@@ -1582,4 +2178,12 @@ cleanup:
     /* Schedule a new rewrite if we are waiting for it to switch the AOF ON. */
     if (server.aof_state == AOF_WAIT_REWRITE)
         server.aof_rewrite_scheduled = 1;
+    return;
+
+manifesterr:
+    aofManifestFree(am);
+    sdsfree(basename);
+    sdsfree(tmpincr);
+    sdsfree(incrname);
+    goto cleanup;
 }
@@ -0,0 +1,408 @@
+/* Binary encoding of the AOF incr files.
+ *
+ * The RESP protocol written by catAppendOnlyGenericCommand() spends bytes on
+ * decimal lengths and CRLF separators, and loading it means parsing every
+ * line with fgets() and looking up every command by name. When "aof-format"
+ * is "binary" the incr files use instead this layout:
+ *
+ *   <AOF_BIN_MAGIC> <block> <block> ...
+ *
+ * Every flush of the AOF buffer writes one block:
+ *
+ *   <flags> <varint len> [<varint raw len>] <payload> <crc64>
+ *
+ * The flags byte has AOF_BIN_LZ4 set if the payload is compressed, in that
+ * case the length of the uncompressed payload follows. The CRC64 of the
+ * payload as stored is 8 bytes, little endian. The uncompressed payload is
+ * a sequence of records, one per command:
+ *
+ *   <varint argc> <varint id> [<varint len> <name>] (<varint len> <arg>)*
+ *
+ * 'id' indexes aofBinCommands[]: 0 means that the command name follows as
+ * a normal argument. Ids are stored in the files, so the table can only be
+ * extended. A varint is an unsigned LEB128 number: 7 bits per byte, least
+ * significant group first, the high bit set in all the bytes but the last.
+ *
+ * Blocks are written with a single write(2), so a crash can only leave a
+ * partial block at the end of the file: the loader truncates the file at
+ * the last complete block like it does with a partial RESP command. Base
+ * files are still produced by the rewrite as RDB or RESP, and the format of
+ * every file is told by its first bytes, so changing "aof-format" takes
+ * effect with the next incr file. */
+
+#include "server.h"
+#include "crc64.h"
+#include "endianconv.h"
+#include "lz4.h"
+
+#define AOF_BIN_LZ4 (1<<0)
+#define AOF_BIN_FLAGS_MASK AOF_BIN_LZ4
+#define AOF_BIN_MIN_COMPRESS 256        /* Smaller payloads are stored raw. */
+#define AOF_BIN_MAX_BLOCK (1ULL<<36)    /* Sanity check reading blocks. */
+#define AOF_BIN_SELECT 1                /* Id of SELECT. */
+
+static const char *aofBinCommands[] = {
+    NULL, /* The name follows. */
+    "select", "set", "pexpireat", "del", "unlink", "incr", "incrby", "decr",
+    "decrby", "append", "setrange", "setbit", "setnx", "getset", "mset",
+    "msetnx", "rpush", "lpush", "rpushx", "lpushx", "rpop", "lpop",
+    "linsert", "lset", "ltrim", "lrem", "rpoplpush", "sadd", "srem", "smove",
+    "sinterstore", "sunionstore", "sdiffstore", "zadd", "zincrby", "zrem",
+    "zremrangebyscore", "zremrangebyrank", "zremrangebylex", "zunionstore",
+    "zinterstore", "hset", "hmset", "hsetnx", "hdel", "hincrby", "persist",
+    "rename", "renamenx", "move", "swapdb", "flushdb", "flushall", "multi",
+    "exec", "restore", "pfadd", "pfmerge", "bitop", "geoadd", "eval",
+    "evalsha", "script"
+};
+
+#define AOF_BIN_NUMCOMMANDS \
+    (sizeof(aofBinCommands)/sizeof(aofBinCommands[0]))
+
+static struct redisCommand *aofBinCommandTable[AOF_BIN_NUMCOMMANDS];
+static robj *aofBinCommandNames[AOF_BIN_NUMCOMMANDS];
+
+/* Assign the ids to the commands. Called after populateCommandTable(), so
+ * the original names are used even if the commands get renamed. */
+void aofBinInitCommands(void) {
+    unsigned int j;
+
+    for (j = 1; j < AOF_BIN_NUMCOMMANDS; j++) {
+        sds name = sdsnew(aofBinCommands[j]);
+        struct redisCommand *cmd = dictFetchValue(server.orig_commands,name);
+
+        serverAssert(cmd != NULL);
+        cmd->aof_id = j;
+        aofBinCommandTable[j] = cmd;
+        aofBinCommandNames[j] = createObject(OBJ_STRING,name);
+    }
+}
+
+/* ------------------------------- Encoding --------------------------------- */
+
+static sds aofBinCatVarint(sds s, uint64_t v) {
+    unsigned char buf[10];
+    int len = 0;
+
+    do {
+        buf[len] = v & 0x7f;
+        v >>= 7;
+        if (v) buf[len] |= 0x80;
+        len++;
+    } while(v);
+    return sdscatlen(s,buf,len);
+}
+
+static sds aofBinCatString(sds s, const char *p, size_t len) {
+    s = aofBinCatVarint(s,len);
+    return sdscatlen(s,p,len);
+}
+
+/* The binary counterpart of catAppendOnlyGenericCommand(). */
+sds catAppendOnlyBinaryCommand(sds dst, int argc, robj **argv) {
+    struct redisCommand *cmd = NULL;
+    int j;
+
+    if (sdsEncodedObject(argv[0])) cmd = lookupCommand(argv[0]->ptr);
+    dst = aofBinCatVarint(dst,argc);
+    dst = aofBinCatVarint(dst,cmd ? cmd->aof_id : 0);
+    for (j = (cmd && cmd->aof_id) ? 1 : 0; j < argc; j++) {
+        robj *o = argv[j];
+
+        if (sdsEncodedObject(o)) {
+            dst = aofBinCatString(dst,o->ptr,sdslen(o->ptr));
+        } else {
+            char buf[LONG_STR_SIZE];
+            int len = ll2string(buf,sizeof(buf),(long)o->ptr);
+            dst = aofBinCatString(dst,buf,len);
+        }
+    }
+    return dst;
+}
+
+sds catAppendOnlyBinarySelect(sds dst, int dictid) {
+    char buf[LONG_STR_SIZE];
+    int len = ll2string(buf,sizeof(buf),dictid);
+
+    dst = aofBinCatVarint(dst,2);
+    dst = aofBinCatVarint(dst,AOF_BIN_SELECT);
+    return aofBinCatString(dst,buf,len);
+}
+
+/* Append to 'dst' a block with the 'len' bytes of records at 'p'. */
+sds aofBinCatBlock(sds dst, const char *p, size_t len, int compress) {
+    unsigned char flags = 0;
+    char *out = NULL;
+    size_t outlen = 0;
+    uint64_t crc;
+
+    if (compress && len >= AOF_BIN_MIN_COMPRESS) {
+        out = zmalloc(len);
+        outlen = lz4_compress(p,len,out,len-1,LZ4_LEVEL_FAST);
+        if (outlen) flags |= AOF_BIN_LZ4;
+    }
+    dst = sdscatlen(dst,&flags,1);
+    if (flags & AOF_BIN_LZ4) {
+        dst = aofBinCatVarint(dst,outlen);
+        dst = aofBinCatVarint(dst,len);
+        p = out;
+        len = outlen;
+    } else {
+        dst = aofBinCatVarint(dst,len);
+    }
+    dst = sdscatlen(dst,p,len);
+    crc = crc64(0,(unsigned char*)p,len);
+    memrev64ifbe(&crc);
+    dst = sdscatlen(dst,&crc,8);
+    zfree(out);
+    return dst;
+}
+
+/* ------------------------------- Decoding --------------------------------- */
+
+/* Read a varint from the file. Returns 0 on success, -1 on EOF or error. */
+static int aofBinReadFileVarint(FILE *fp, uint64_t *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = getc(fp)) == EOF || shift > 63) return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+    return 0;
+}
+
+/* Read the next block of 'fp' into '*raw', uncompressed. '*stored' is
+ * used as buffer for compressed payloads. Returns AOF_BIN_OK, AOF_BIN_EOF
+ * if the file ends before the block, AOF_BIN_TRUNCATED if it ends in the
+ * middle of it, AOF_BIN_READERR on I/O errors, or AOF_BIN_FMTERR if the
+ * block is corrupted, described by '*err'. */
+static int aofBinReadBlock(FILE *fp, sds *stored, sds *raw, char **err) {
+    uint64_t len, rawlen = 0, crc;
+    sds payload;
+    int flags;
+
+    if ((flags = getc(fp)) == EOF)
+        return ferror(fp) ? AOF_BIN_READERR : AOF_BIN_EOF;
+    if (flags & ~AOF_BIN_FLAGS_MASK) {
+        *err = "invalid block flags";
+        return AOF_BIN_FMTERR;
+    }
+    if (aofBinReadFileVarint(fp,&len) == -1 ||
+        ((flags & AOF_BIN_LZ4) && aofBinReadFileVarint(fp,&rawlen) == -1))
+        goto readerr;
+    if (len > AOF_BIN_MAX_BLOCK || rawlen > AOF_BIN_MAX_BLOCK) {
+        *err = "invalid block length";
+        return AOF_BIN_FMTERR;
+    }
+
+    payload = (flags & AOF_BIN_LZ4) ? *stored : *raw;
+    sdsclear(payload);
+    payload = sdsMakeRoomFor(payload,len);
+    if (flags & AOF_BIN_LZ4) *stored = payload; else *raw = payload;
+    if ((len && fread(payload,len,1,fp) != 1) || fread(&crc,8,1,fp) != 1)
+        goto readerr;
+    sdsIncrLen(payload,len);
+    memrev64ifbe(&crc);
+    if (crc64(0,(unsigned char*)payload,len) != crc) {
+        *err = "block checksum mismatch";
+        return AOF_BIN_FMTERR;
+    }
+
+    if (flags & AOF_BIN_LZ4) {
+        sdsclear(*raw);
+        *raw = sdsMakeRoomFor(*raw,rawlen);
+        if (lz4_decompress(payload,len,*raw,rawlen) != rawlen) {
+            *err = "invalid compressed block";
+            return AOF_BIN_FMTERR;
+        }
+        sdsIncrLen(*raw,rawlen);
+    }
+    return AOF_BIN_OK;
+
+readerr:
+    return ferror(fp) ? AOF_BIN_READERR : AOF_BIN_TRUNCATED;
+}
+
+static int aofBinDecodeVarint(unsigned char **pp, unsigned char *end,
+                              uint64_t *v)
+{
+    unsigned char *p = *pp;
+    int shift = 0;
+
+    *v = 0;
+    do {
+        if (p == end || shift > 63) return -1;
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while(*p++ & 0x80);
+    *pp = p;
+    return 0;
+}
+
+static int aofBinDecodeString(unsigned char **pp, unsigned char *end,
+                              char **s, size_t *len)
+{
+    uint64_t l;
+
+    if (aofBinDecodeVarint(pp,end,&l) == -1 || l > (uint64_t)(end-*pp))
+        return -1;
+    *s = (char*)*pp;
+    *len = l;
+    *pp += l;
+    return 0;
+}
+
+/* Decode the header of the next record of a payload: the number of
+ * arguments and the command, NULL if its name follows as the first
+ * argument. Returns 0 on success, -1 if the record is invalid. */
+static int aofBinDecodeRecord(unsigned char **pp, unsigned char *end,
+                              int *argc, struct redisCommand **cmd)
+{
+    uint64_t n, id;
+
+    if (aofBinDecodeVarint(pp,end,&n) == -1 ||
+        aofBinDecodeVarint(pp,end,&id) == -1) return -1;
+    if (n < 1 || n > INT_MAX || n > (uint64_t)(end-*pp)+1 ||
+        id >= AOF_BIN_NUMCOMMANDS) return -1;
+    *argc = n;
+    *cmd = aofBinCommandTable[id];
+    return 0;
+}
+
+/* Replay the blocks of the binary AOF 'fp', positioned after the magic,
+ * in the context of 'fakeClient'. '*valid_up_to' is set to the end of the
+ * last block loaded. Returns AOF_BIN_OK when the end of the file is
+ * reached, or the error, see aofBinReadBlock(). Unknown commands are
+ * fatal errors like in the RESP loader. */
+int aofBinLoad(FILE *fp, client *fakeClient, off_t offset, off_t *valid_up_to) {
+    sds stored = sdsempty(), raw = sdsempty();
+    long loops = 0;
+    char *err = NULL;
+    int ret;
+
+    *valid_up_to = ftello(fp);
+    while((ret = aofBinReadBlock(fp,&stored,&raw,&err)) == AOF_BIN_OK) {
+        unsigned char *p = (unsigned char*)raw, *end = p+sdslen(raw);
+
+        while(p < end) {
+            struct redisCommand *cmd;
+            int argc, j;
+            char *s;
+            size_t len;
+
+            if (!(loops++ % 1000)) {
+                loadingProgress(offset+ftello(fp));
+                processEventsWhileBlocked();
+            }
+
+            if (aofBinDecodeRecord(&p,end,&argc,&cmd) == -1) goto fmterr;
+            fakeClient->argv = zmalloc(sizeof(robj*)*argc);
+            fakeClient->argc = 0;
+            if (cmd) {
+                fakeClient->argv[fakeClient->argc++] =
+                    aofBinCommandNames[cmd->aof_id];
+                incrRefCount(fakeClient->argv[0]);
+            }
+            for (j = fakeClient->argc; j < argc; j++) {
+                if (aofBinDecodeString(&p,end,&s,&len) == -1) {
+                    freeFakeClientArgv(fakeClient);
+                    goto fmterr;
+                }
+                fakeClient->argv[fakeClient->argc++] =
+                    createStringObject(s,len);
+            }
+            if (cmd == NULL) {
+                cmd = lookupCommand(fakeClient->argv[0]->ptr);
+                if (!cmd) {
+                    serverLog(LL_WARNING,"Unknown command '%s' reading the append only file", (char*)fakeClient->argv[0]->ptr);
+                    exit(1);
+                }
+            }
+            if ((cmd->arity > 0 && cmd->arity != argc) || argc < -cmd->arity) {
+                freeFakeClientArgv(fakeClient);
+                goto fmterr;
+            }
+
+            /* Run the command in the context of a fake client */
+            fakeClient->cmd = cmd;
+            cmd->proc(fakeClient);
+
+            /* The fake client should not have a reply */
+            serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
+            /* The fake client should never get blocked */
+            serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+
+            freeFakeClientArgv(fakeClient);
+            fakeClient->cmd = NULL;
+        }
+        *valid_up_to = ftello(fp);
+    }
+    if (ret == AOF_BIN_EOF) ret = AOF_BIN_OK;
+    if (ret == AOF_BIN_FMTERR)
+        serverLog(LL_WARNING,"Binary AOF: %s at offset %lld",err,
+            (long long)*valid_up_to);
+    sdsfree(stored);
+    sdsfree(raw);
+    return ret;
+
+fmterr:
+    serverLog(LL_WARNING,"Binary AOF: invalid record in the block at offset "
+                         "%lld",(long long)*valid_up_to);
+    sdsfree(stored);
+    sdsfree(raw);
+    return AOF_BIN_FMTERR;
+}
+
+/* redis-check-aof support: check the blocks and the records of the binary
+ * AOF 'fp', positioned after the magic. Returns the offset of the end of
+ * the last valid block not inside a MULTI/EXEC. On errors '*err' is set to
+ * a description of the problem, otherwise to NULL. */
+off_t aofBinCheck(FILE *fp, char **err) {
+    sds stored = sdsempty(), raw = sdsempty();
+    off_t valid_up_to = ftello(fp);
+    int ret, multi = 0;
+
+    *err = NULL;
+    while((ret = aofBinReadBlock(fp,&stored,&raw,err)) == AOF_BIN_OK) {
+        unsigned char *p = (unsigned char*)raw, *end = p+sdslen(raw);
+
+        while(p < end) {
+            struct redisCommand *cmd;
+            int argc, j;
+            char *s, *name = NULL;
+            size_t len;
+
+            if (aofBinDecodeRecord(&p,end,&argc,&cmd) == -1) {
+                *err = "invalid record";
+                goto done;
+            }
+            for (j = cmd ? 1 : 0; j < argc; j++) {
+                if (aofBinDecodeString(&p,end,&s,&len) == -1) {
+                    *err = "invalid argument";
+                    goto done;
+                }
+                if (j == 0) name = sdsnewlen(s,len);
+            }
+            if (cmd) name = sdsnew(cmd->name);
+            if (!strcasecmp(name,"multi")) {
+                if (multi) *err = "unexpected MULTI";
+                multi = 1;
+            } else if (!strcasecmp(name,"exec")) {
+                if (!multi) *err = "unexpected EXEC";
+                multi = 0;
+            }
+            sdsfree(name);
+            if (*err) goto done;
+        }
+        if (!multi) valid_up_to = ftello(fp);
+    }
+    if (ret == AOF_BIN_TRUNCATED) *err = "truncated block";
+    else if (ret == AOF_BIN_READERR) *err = strerror(errno);
+    else if (ret == AOF_BIN_EOF && multi) *err = "reached EOF before reading EXEC for MULTI";
+
+done:
+    sdsfree(stored);
+    sdsfree(raw);
+    return valid_up_to;
+}
@@ -85,8 +85,9 @@ struct bio_job {
 
 void *bioProcessBackgroundJobs(void *arg);
 void lazyfreeFreeObjectFromBioThread(robj *o);
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
+void lazyfreeFreeDatabaseFromBioThread(dict *ht, expireIndex *index);
 void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+void rdbSnapshotWriteFromBioThread(int fd, sds buf, int last);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -191,14 +192,19 @@ void *bioProcessBackgroundJobs(void *arg) {
         } else if (type == BIO_LAZY_FREE) {
             /* What we free changes depending on what arguments are set:
              * arg1 -> free the object at pointer.
-             * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the skiplist. */
+             * arg2 & arg3 -> free a Redis DB (keys dict and expiry index).
+             * only arg3 -> free the radix tree (slots map). */
             if (job->arg1)
                 lazyfreeFreeObjectFromBioThread(job->arg1);
             else if (job->arg2 && job->arg3)
                 lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
             else if (job->arg3)
                 lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+        } else if (type == BIO_RDB_WRITE) {
+            /* arg1 -> file descriptor, arg2 -> buffer to write (or NULL),
+             * arg3 -> non zero if the file must be synced and closed. */
+            rdbSnapshotWriteFromBioThread((long)job->arg1,job->arg2,
+                                          job->arg3 != NULL);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -30,14 +30,26 @@
 
 #include "server.h"
 
+/* The SIMD kernels below are compiled with per function target attributes,
+ * so the rest of the server keeps the baseline instruction set, and are
+ * selected at startup according to what cpuid reports. */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(USE_ALIGNED_ACCESS) && \
+    (defined(__clang__) || __GNUC__ >= 7)
+#define HAVE_BITOPS_SIMD 1
+#include <immintrin.h>
+#endif
+
 /* -----------------------------------------------------------------------------
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
 /* Count number of bits set in the binary array pointed by 's' and long
  * 'count' bytes. The implementation of this function is required to
- * work with a input string length up to 512 MB. */
-size_t redisPopcount(void *s, long count) {
+ * work with a input string length up to 512 MB.
+ *
+ * This is the portable kernel: redisPopcount() calls the fastest one the
+ * CPU supports. */
+static size_t popcountScalar(void *s, long count) {
     size_t bits = 0;
     unsigned char *p = s;
     uint32_t *p4;
@@ -91,6 +103,132 @@ size_t redisPopcount(void *s, long count) {
     return bits;
 }
 
+#ifdef HAVE_BITOPS_SIMD
+/* POPCNT on 64 bit words, with four independent accumulators to hide the
+ * instruction latency. */
+__attribute__((target("popcnt")))
+static size_t popcountPOPCNT(void *s, long count) {
+    unsigned char *p = s;
+    uint64_t a = 0, b = 0, c = 0, d = 0, w[4];
+
+    while (count >= 32) {
+        memcpy(w,p,sizeof(w));
+        a += __builtin_popcountll(w[0]);
+        b += __builtin_popcountll(w[1]);
+        c += __builtin_popcountll(w[2]);
+        d += __builtin_popcountll(w[3]);
+        p += 32;
+        count -= 32;
+    }
+    return a+b+c+d+popcountScalar(p,count);
+}
+
+/* AVX2 has no vector popcount: look up the count of every nibble with a
+ * byte shuffle, accumulate the bytes for up to 31 rounds (31*8 < 256) and
+ * then sum them into 64 bit lanes with SAD. */
+__attribute__((target("avx2")))
+static size_t popcountAVX2(void *s, long count) {
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    unsigned char *p = s;
+    uint64_t lanes[4];
+
+    while (count >= 32) {
+        __m256i local = zero;
+        long rounds = count/32 > 31 ? 31 : count/32;
+
+        count -= rounds*32;
+        while (rounds--) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            __m256i lo = _mm256_and_si256(v,low);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4),low);
+            local = _mm256_add_epi8(local,_mm256_shuffle_epi8(lut,lo));
+            local = _mm256_add_epi8(local,_mm256_shuffle_epi8(lut,hi));
+            p += 32;
+        }
+        acc = _mm256_add_epi64(acc,_mm256_sad_epu8(local,zero));
+    }
+    _mm256_storeu_si256((__m256i*)lanes,acc);
+    return lanes[0]+lanes[1]+lanes[2]+lanes[3]+popcountScalar(p,count);
+}
+
+/* AVX-512 VPOPCNTDQ counts eight 64 bit words per instruction. */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t popcountAVX512(void *s, long count) {
+    __m512i acc = _mm512_setzero_si512();
+    unsigned char *p = s;
+
+    while (count >= 64) {
+        acc = _mm512_add_epi64(acc,_mm512_popcnt_epi64(_mm512_loadu_si512(p)));
+        p += 64;
+        count -= 64;
+    }
+    return _mm512_reduce_add_epi64(acc)+popcountScalar(p,count);
+}
+
+/* Return how many leading bytes of 's', in steps of 64, are all zero (if
+ * 'bit' is 1) or all ones (if 'bit' is 0), so that redisBitpos() can skip
+ * them. */
+__attribute__((target("avx2")))
+static unsigned long bitposSkipAVX2(unsigned char *s, unsigned long count, int bit) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    unsigned long skipped = 0;
+
+    while (count-skipped >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s+skipped));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s+skipped+32));
+        if (bit) {
+            __m256i x = _mm256_or_si256(a,b);
+            if (!_mm256_testz_si256(x,x)) break;
+        } else {
+            if (!_mm256_testc_si256(_mm256_and_si256(a,b),ones)) break;
+        }
+        skipped += 64;
+    }
+    return skipped;
+}
+
+__attribute__((target("avx512f")))
+static unsigned long bitposSkipAVX512(unsigned char *s, unsigned long count, int bit) {
+    const __m512i skipval = _mm512_set1_epi8(bit ? 0 : -1);
+    unsigned long skipped = 0;
+
+    while (count-skipped >= 128) {
+        __m512i a = _mm512_loadu_si512(s+skipped);
+        __m512i b = _mm512_loadu_si512(s+skipped+64);
+        __m512i x = _mm512_or_si512(_mm512_xor_si512(a,skipval),
+                                    _mm512_xor_si512(b,skipval));
+        if (_mm512_test_epi64_mask(x,x)) break;
+        skipped += 128;
+    }
+    return skipped;
+}
+#endif
+
+/* The portable code scans word by word already. */
+static unsigned long bitposSkipScalar(unsigned char *s, unsigned long count, int bit) {
+    UNUSED(s);
+    UNUSED(count);
+    UNUSED(bit);
+    return 0;
+}
+
+/* Kernels in use, set by bitopsSelectKernels(). */
+static size_t (*popcountKernel)(void *s, long count) = NULL;
+static unsigned long (*bitposSkipKernel)(unsigned char *s, unsigned long count, int bit) = NULL;
+static unsigned long (*bitopKernel)(int op, unsigned char *dst, unsigned char **src, unsigned long numkeys, unsigned long len) = NULL;
+static int bitopsKernelLevel = BITOPS_KERNEL_SCALAR;
+
+/* Count number of bits set in the binary array pointed by 's' and long
+ * 'count' bytes, using the fastest kernel available. */
+size_t redisPopcount(void *s, long count) {
+    if (popcountKernel == NULL) bitopsSelectKernels(BITOPS_KERNEL_BEST);
+    return popcountKernel(s,count);
+}
+
 /* Return the position of the first bit set to one (if 'bit' is 1) or
  * zero (if 'bit' is 0) in the bitmap starting at 's' and long 'count' bytes.
  *
@@ -129,7 +267,17 @@ long redisBitpos(void *s, unsigned long count, int bit) {
         pos += 8;
     }
 
-    /* Skip bits with full word step. */
+    /* Skip large runs of bits with the vector kernel first, then the rest
+     * with full word step. */
+    if (!found) {
+        unsigned long skipped;
+
+        if (bitposSkipKernel == NULL) bitopsSelectKernels(BITOPS_KERNEL_BEST);
+        skipped = bitposSkipKernel(c,count,bit);
+        c += skipped;
+        count -= skipped;
+        pos += skipped*8;
+    }
     l = (unsigned long*) c;
     if (!found) {
         skipval = bit ? 0 : ULONG_MAX;
@@ -587,6 +735,193 @@ void getbitCommand(client *c) {
     addReply(c, bitval ? shared.cone : shared.czero);
 }
 
+/* BITOP kernels compute 'op' over the first 'len' bytes of the 'numkeys'
+ * sources into 'dst', where every source has at least 'len' bytes. They
+ * return how many bytes were processed, the caller completes the rest. */
+static unsigned long bitopScalar(int op, unsigned char *dst, unsigned char **src, unsigned long numkeys, unsigned long len) {
+#ifndef USE_ALIGNED_ACCESS
+    /* On ARM this path is skipped since it will result in GCC compiling the
+     * code using multiple-words load/store operations that are not
+     * supported even in ARM >= v6. */
+    unsigned long j = 0, i;
+    unsigned long *ldst = (unsigned long*) dst;
+    const unsigned long step = sizeof(unsigned long)*4;
+
+    memcpy(dst,src[0],len - len % step);
+    /* Different branches per different operations for speed (sorry). */
+    if (op == BITOP_AND) {
+        for (; j+step <= len; j += step, ldst += 4) {
+            for (i = 1; i < numkeys; i++) {
+                unsigned long *l = (unsigned long*)(src[i]+j);
+                ldst[0] &= l[0]; ldst[1] &= l[1];
+                ldst[2] &= l[2]; ldst[3] &= l[3];
+            }
+        }
+    } else if (op == BITOP_OR) {
+        for (; j+step <= len; j += step, ldst += 4) {
+            for (i = 1; i < numkeys; i++) {
+                unsigned long *l = (unsigned long*)(src[i]+j);
+                ldst[0] |= l[0]; ldst[1] |= l[1];
+                ldst[2] |= l[2]; ldst[3] |= l[3];
+            }
+        }
+    } else if (op == BITOP_XOR) {
+        for (; j+step <= len; j += step, ldst += 4) {
+            for (i = 1; i < numkeys; i++) {
+                unsigned long *l = (unsigned long*)(src[i]+j);
+                ldst[0] ^= l[0]; ldst[1] ^= l[1];
+                ldst[2] ^= l[2]; ldst[3] ^= l[3];
+            }
+        }
+    } else if (op == BITOP_NOT) {
+        for (; j+step <= len; j += step, ldst += 4) {
+            ldst[0] = ~ldst[0]; ldst[1] = ~ldst[1];
+            ldst[2] = ~ldst[2]; ldst[3] = ~ldst[3];
+        }
+    }
+    return j;
+#else
+    UNUSED(op);
+    UNUSED(dst);
+    UNUSED(src);
+    UNUSED(numkeys);
+    UNUSED(len);
+    return 0;
+#endif
+}
+
+#ifdef HAVE_BITOPS_SIMD
+/* Fold all the sources into four registers (128 bytes) at a time, so every
+ * destination byte is written once whatever the number of keys. */
+#define BITOP_AVX2_LOOP(vop) do { \
+    for (; j+128 <= len; j += 128) { \
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(src[0]+j)); \
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(src[0]+j+32)); \
+        __m256i a2 = _mm256_loadu_si256((const __m256i*)(src[0]+j+64)); \
+        __m256i a3 = _mm256_loadu_si256((const __m256i*)(src[0]+j+96)); \
+        for (i = 1; i < numkeys; i++) { \
+            a0 = vop(a0,_mm256_loadu_si256((const __m256i*)(src[i]+j))); \
+            a1 = vop(a1,_mm256_loadu_si256((const __m256i*)(src[i]+j+32))); \
+            a2 = vop(a2,_mm256_loadu_si256((const __m256i*)(src[i]+j+64))); \
+            a3 = vop(a3,_mm256_loadu_si256((const __m256i*)(src[i]+j+96))); \
+        } \
+        _mm256_storeu_si256((__m256i*)(dst+j),a0); \
+        _mm256_storeu_si256((__m256i*)(dst+j+32),a1); \
+        _mm256_storeu_si256((__m256i*)(dst+j+64),a2); \
+        _mm256_storeu_si256((__m256i*)(dst+j+96),a3); \
+    } \
+} while(0)
+
+#define BITOP_AVX512_LOOP(vop) do { \
+    for (; j+256 <= len; j += 256) { \
+        __m512i a0 = _mm512_loadu_si512(src[0]+j); \
+        __m512i a1 = _mm512_loadu_si512(src[0]+j+64); \
+        __m512i a2 = _mm512_loadu_si512(src[0]+j+128); \
+        __m512i a3 = _mm512_loadu_si512(src[0]+j+192); \
+        for (i = 1; i < numkeys; i++) { \
+            a0 = vop(a0,_mm512_loadu_si512(src[i]+j)); \
+            a1 = vop(a1,_mm512_loadu_si512(src[i]+j+64)); \
+            a2 = vop(a2,_mm512_loadu_si512(src[i]+j+128)); \
+            a3 = vop(a3,_mm512_loadu_si512(src[i]+j+192)); \
+        } \
+        _mm512_storeu_si512(dst+j,a0); \
+        _mm512_storeu_si512(dst+j+64,a1); \
+        _mm512_storeu_si512(dst+j+128,a2); \
+        _mm512_storeu_si512(dst+j+192,a3); \
+    } \
+} while(0)
+
+__attribute__((target("avx2")))
+static unsigned long bitopAVX2(int op, unsigned char *dst, unsigned char **src, unsigned long numkeys, unsigned long len) {
+    unsigned long j = 0, i;
+
+    if (op == BITOP_AND) {
+        BITOP_AVX2_LOOP(_mm256_and_si256);
+    } else if (op == BITOP_OR) {
+        BITOP_AVX2_LOOP(_mm256_or_si256);
+    } else if (op == BITOP_XOR) {
+        BITOP_AVX2_LOOP(_mm256_xor_si256);
+    } else if (op == BITOP_NOT) {
+        /* NOT has a single source: x ^ all-ones. */
+        const __m256i ones = _mm256_set1_epi8(-1);
+        for (; j+32 <= len; j += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(src[0]+j));
+            _mm256_storeu_si256((__m256i*)(dst+j),_mm256_xor_si256(a,ones));
+        }
+    }
+    return j;
+}
+
+__attribute__((target("avx512f")))
+static unsigned long bitopAVX512(int op, unsigned char *dst, unsigned char **src, unsigned long numkeys, unsigned long len) {
+    unsigned long j = 0, i;
+
+    if (op == BITOP_AND) {
+        BITOP_AVX512_LOOP(_mm512_and_si512);
+    } else if (op == BITOP_OR) {
+        BITOP_AVX512_LOOP(_mm512_or_si512);
+    } else if (op == BITOP_XOR) {
+        BITOP_AVX512_LOOP(_mm512_xor_si512);
+    } else if (op == BITOP_NOT) {
+        const __m512i ones = _mm512_set1_epi8(-1);
+        for (; j+64 <= len; j += 64) {
+            __m512i a = _mm512_loadu_si512(src[0]+j);
+            _mm512_storeu_si512(dst+j,_mm512_xor_si512(a,ones));
+        }
+    }
+    return j;
+}
+#endif
+
+/* Select the BITCOUNT, BITPOS and BITOP kernels: the best ones the CPU
+ * supports, but not above 'maxlevel' (BITOPS_KERNEL_BEST for no limit).
+ * Called at startup, and by the tests to compare the kernels. Returns the
+ * level actually selected. */
+int bitopsSelectKernels(int maxlevel) {
+    int level = BITOPS_KERNEL_SCALAR;
+
+#ifdef HAVE_BITOPS_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) level = BITOPS_KERNEL_POPCNT;
+    if (level == BITOPS_KERNEL_POPCNT && __builtin_cpu_supports("avx2"))
+        level = BITOPS_KERNEL_AVX2;
+    if (level == BITOPS_KERNEL_AVX2 && __builtin_cpu_supports("avx512f"))
+        level = BITOPS_KERNEL_AVX512;
+#endif
+    if (level > maxlevel) level = maxlevel;
+
+    popcountKernel = popcountScalar;
+    bitposSkipKernel = bitposSkipScalar;
+    bitopKernel = bitopScalar;
+#ifdef HAVE_BITOPS_SIMD
+    if (level >= BITOPS_KERNEL_POPCNT) popcountKernel = popcountPOPCNT;
+    if (level >= BITOPS_KERNEL_AVX2) {
+        popcountKernel = popcountAVX2;
+        bitposSkipKernel = bitposSkipAVX2;
+        bitopKernel = bitopAVX2;
+    }
+    if (level >= BITOPS_KERNEL_AVX512) {
+        /* VPOPCNTDQ came after AVX-512F (Ice Lake), check it separately. */
+        if (__builtin_cpu_supports("avx512vpopcntdq"))
+            popcountKernel = popcountAVX512;
+        bitposSkipKernel = bitposSkipAVX512;
+        bitopKernel = bitopAVX512;
+    }
+#endif
+    bitopsKernelLevel = level;
+    return level;
+}
+
+/* Name of the selected kernel level, for INFO. */
+const char *bitopsKernelName(void) {
+    switch(bitopsKernelLevel) {
+    case BITOPS_KERNEL_POPCNT: return "popcnt";
+    case BITOPS_KERNEL_AVX2: return "avx2";
+    case BITOPS_KERNEL_AVX512: return "avx512";
+    default: return "scalar";
+    }
+}
+
 /* BITOP op_name target_key src_key1 src_key2 src_key3 ... src_keyN */
 void bitopCommand(client *c) {
     char *opname = c->argv[1]->ptr;
@@ -660,73 +995,10 @@ void bitopCommand(client *c) {
         unsigned long i;
 
         /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
-        j = 0;
-        #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
-        }
-        #endif
+         * can process them with the vectorized (or word at a time) kernel,
+         * that performs much better than the vanilla algorithm. */
+        if (bitopKernel == NULL) bitopsSelectKernels(BITOPS_KERNEL_BEST);
+        j = minlen ? bitopKernel(op,res,src,numkeys,minlen) : 0;
 
         /* j is set to the next byte to process by the previous loop. */
         for (; j < maxlen; j++) {
@@ -1123,3 +1395,126 @@ void bitfieldCommand(client *c) {
     }
     zfree(ops);
 }
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+
+#define ok() printf("OK\n")
+
+/* Byte at a time reference for the BITOP kernels. */
+static void bitopReference(int op, unsigned char *dst, unsigned char **src, unsigned long numkeys, unsigned long len) {
+    unsigned long i, j;
+
+    for (j = 0; j < len; j++) {
+        unsigned char output = src[0][j];
+        if (op == BITOP_NOT) output = ~output;
+        for (i = 1; i < numkeys; i++) {
+            if (op == BITOP_AND) output &= src[i][j];
+            else if (op == BITOP_OR) output |= src[i][j];
+            else if (op == BITOP_XOR) output ^= src[i][j];
+        }
+        dst[j] = output;
+    }
+}
+
+int bitopsTest(int argc, char *argv[]) {
+    const char *names[] = {"scalar","popcnt","avx2","avx512"};
+    const unsigned long size = 16*1024*1024;
+    unsigned char *buf = zmalloc(size+64), *keys[4], *dst, *ref;
+    int best, level, j;
+    unsigned long k;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    best = bitopsSelectKernels(BITOPS_KERNEL_BEST);
+    printf("Best kernel level: %s\n", bitopsKernelName());
+    for (k = 0; k < size+64; k++) buf[k] = rand();
+    for (j = 0; j < 4; j++) {
+        keys[j] = zmalloc(size);
+        for (k = 0; k < size; k++) keys[j][k] = rand();
+    }
+    dst = zmalloc(size);
+    ref = zmalloc(size);
+
+    printf("Kernels agree with the scalar code: "); {
+        for (level = BITOPS_KERNEL_POPCNT; level <= best; level++) {
+            int len, off, op, bit;
+
+            for (len = 0; len < 1200; len += 7) {
+                for (off = 0; off < 8; off++) {
+                    size_t expected;
+
+                    bitopsSelectKernels(BITOPS_KERNEL_SCALAR);
+                    expected = redisPopcount(buf+off,len);
+                    bitopsSelectKernels(level);
+                    serverAssert(redisPopcount(buf+off,len) == expected);
+                }
+            }
+            for (bit = 0; bit <= 1; bit++) {
+                for (len = 1; len < 1200; len += 13) {
+                    long expected;
+
+                    memset(dst,bit ? 0 : 0xff,len);
+                    dst[rand() % len] ^= 1 << (rand() % 8);
+                    for (off = 0; off < 3; off++) {
+                        bitopsSelectKernels(BITOPS_KERNEL_SCALAR);
+                        expected = redisBitpos(dst+off,len-off,bit);
+                        bitopsSelectKernels(level);
+                        serverAssert(redisBitpos(dst+off,len-off,bit) == expected);
+                    }
+                }
+            }
+            for (op = BITOP_AND; op <= BITOP_NOT; op++) {
+                unsigned long numkeys = op == BITOP_NOT ? 1 : 4, done;
+
+                for (len = 0; len < 3000; len += 61) {
+                    bitopReference(op,ref,keys,numkeys,len);
+                    memset(dst,0,len);
+                    done = bitopKernel(op,dst,keys,numkeys,len);
+                    serverAssert(done <= (unsigned long)len);
+                    serverAssert(memcmp(dst,ref,done) == 0);
+                }
+            }
+        }
+        bitopsSelectKernels(BITOPS_KERNEL_BEST);
+        ok();
+    }
+
+    printf("Benchmark kernels on %lu MB:\n", size/(1024*1024)); {
+        for (level = BITOPS_KERNEL_SCALAR; level <= best; level++) {
+            long long start, popcount_us, bitpos_us, bitop_us;
+            int iter;
+
+            bitopsSelectKernels(level);
+            start = ustime();
+            for (iter = 0; iter < 10; iter++) redisPopcount(buf,size);
+            popcount_us = ustime()-start;
+
+            memset(dst,0,size);
+            dst[size-1] = 1;
+            start = ustime();
+            for (iter = 0; iter < 10; iter++)
+                serverAssert(redisBitpos(dst,size,1) == (long)size*8-1);
+            bitpos_us = ustime()-start;
+
+            start = ustime();
+            for (iter = 0; iter < 10; iter++)
+                bitopKernel(BITOP_AND,dst,keys,4,size);
+            bitop_us = ustime()-start;
+
+            printf("  %-6s: BITCOUNT %.2f GB/s, BITPOS %.2f GB/s, "
+                   "BITOP AND (4 keys) %.2f GB/s\n", names[level],
+                (double)size*10/popcount_us/1000,
+                (double)size*10/bitpos_us/1000,
+                (double)size*4*10/bitop_us/1000);
+        }
+        bitopsSelectKernels(BITOPS_KERNEL_BEST);
+    }
+
+    for (j = 0; j < 4; j++) zfree(keys[j]);
+    zfree(buf);
+    zfree(dst);
+    zfree(ref);
+    return 0;
+}
+#endif
@@ -120,10 +120,14 @@ void processUnblockedClients(void) {
         /* Process remaining data in the input buffer, unless the client
          * is blocked again. Actually processInputBuffer() checks that the
          * client is not blocked before to proceed, but things may change and
-         * the code is conceptually more correct this way. */
+         * the code is conceptually more correct this way. The master
+         * client may also have commands already parsed by the replication
+         * parsing thread, see replparse.c. */
         if (!(c->flags & CLIENT_BLOCKED)) {
-            if (c->querybuf && sdslen(c->querybuf) > 0) {
-                processInputBuffer(c);
+            if ((c->querybuf && sdslen(c->querybuf) > 0) ||
+                replParsePendingBytes(c) > 0)
+            {
+                processInputBufferAndReplicate(c);
             }
         }
     }
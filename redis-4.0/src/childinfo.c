@@ -78,6 +78,12 @@ void receiveChildInfo(void) {
     {
         if (server.child_info_data.process_type == CHILD_INFO_TYPE_RDB) {
             server.stat_rdb_cow_bytes = server.child_info_data.cow_size;
+            server.stat_repl_compress_raw +=
+                server.child_info_data.repl_compress_raw;
+            server.stat_repl_compress_wire +=
+                server.child_info_data.repl_compress_wire;
+            server.stat_repl_compress_usec +=
+                server.child_info_data.repl_compress_usec;
         } else if (server.child_info_data.process_type == CHILD_INFO_TYPE_AOF) {
             server.stat_aof_cow_bytes = server.child_info_data.cow_size;
         }
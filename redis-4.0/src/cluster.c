@@ -39,6 +39,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <stddef.h>
 #include <math.h>
 
 /* A global reference to myself is handy to make code more clear.
@@ -427,6 +428,10 @@ void clusterInit(void) {
         server.cluster->stats_bus_messages_received[i] = 0;
     }
     server.cluster->stats_pfail_nodes = 0;
+    server.cluster->stats_bus_compact_sent = 0;
+    server.cluster->stats_bus_compact_received = 0;
+    server.cluster->stats_bus_bytes_sent = 0;
+    server.cluster->stats_bus_bytes_received = 0;
     memset(server.cluster->slots,0, sizeof(server.cluster->slots));
     clusterCloseAllSlots();
 
@@ -570,6 +575,11 @@ clusterLink *createClusterLink(clusterNode *node) {
     link->rcvbuf = sdsempty();
     link->node = node;
     link->fd = -1;
+    link->peer_compact = 0;
+    link->snd_slots_valid = 0;
+    link->snd_slots_hash = 0;
+    link->rcv_slots_valid = 0;
+    link->rcv_slots_hash = 0;
     return link;
 }
 
@@ -1595,6 +1605,54 @@ void clusterUpdateSlotsConfigWith(clusterNode *sender, uint64_t senderConfigEpoc
     }
 }
 
+/* Remember the slots bitmap received in a full PING, PONG or MEET on 'link',
+ * used to expand the compact messages that may follow on the same link. */
+void clusterCacheLinkSlots(clusterLink *link, unsigned char *slots) {
+    if (link->rcv_slots_valid &&
+        memcmp(link->rcv_slots,slots,sizeof(link->rcv_slots)) == 0) return;
+    memcpy(link->rcv_slots,slots,sizeof(link->rcv_slots));
+    link->rcv_slots_hash = crc64(0,slots,sizeof(link->rcv_slots));
+    link->rcv_slots_valid = 1;
+}
+
+/* Replace the compact PING or PONG in link->rcvbuf with the plain message,
+ * taking the slots bitmap from the last full message received on the link.
+ * Returns C_ERR if the message is invalid or the bitmap is not the one the
+ * sender hashed, that should never happen since the sender only uses the
+ * compact format after a full message with the same slots. */
+int clusterExpandCompactMsg(clusterLink *link) {
+    clusterMsgCompact *c = (clusterMsgCompact*) link->rcvbuf;
+    uint32_t totlen = ntohl(c->totlen);
+    uint16_t type = ntohs(c->type);
+    uint16_t count = ntohs(c->count);
+    size_t gossiplen = sizeof(clusterMsgDataGossip)*count;
+    clusterMsg *hdr;
+    sds msg;
+
+    if (type != CLUSTERMSG_TYPE_PING && type != CLUSTERMSG_TYPE_PONG)
+        return C_ERR;
+    if (totlen != CLUSTERMSG_COMPACT_MIN_LEN+gossiplen) return C_ERR;
+    if (!link->rcv_slots_valid ||
+        ntohu64(c->slots_hash) != link->rcv_slots_hash) return C_ERR;
+
+    msg = sdsnewlen(NULL,CLUSTERMSG_MIN_LEN+gossiplen);
+    hdr = (clusterMsg*) msg;
+    memcpy(hdr,c,offsetof(clusterMsg,myslots));
+    hdr->totlen = htonl(CLUSTERMSG_MIN_LEN+gossiplen);
+    hdr->ver = htons(CLUSTER_PROTO_VER);
+    memcpy(hdr->myslots,link->rcv_slots,sizeof(hdr->myslots));
+    memcpy(hdr->slaveof,c->slaveof,sizeof(hdr->slaveof));
+    memcpy(hdr->myip,c->myip,sizeof(hdr->myip));
+    hdr->cport = c->cport;
+    hdr->flags = c->flags;
+    hdr->state = c->state;
+    memcpy(hdr->mflags,c->mflags,sizeof(hdr->mflags));
+    memcpy(hdr->data.ping.gossip,c->data.ping.gossip,gossiplen);
+    sdsfree(link->rcvbuf);
+    link->rcvbuf = msg;
+    return C_OK;
+}
+
 /* When this function is called, there is a packet to process starting
  * at node->rcvbuf. Releasing the buffer is up to the caller, so this
  * function should just handle the higher level stuff of processing the
@@ -1617,16 +1675,34 @@ int clusterProcessPacket(clusterLink *link) {
     /* Perform sanity checks */
     if (totlen < 16) return 1; /* At least signature, version, totlen, count. */
     if (totlen > sdslen(link->rcvbuf)) return 1;
+    server.cluster->stats_bus_bytes_received += totlen;
+
+    /* A compact PING or PONG is turned into the plain one first. */
+    if (ntohs(hdr->ver) == CLUSTER_PROTO_VER_COMPACT) {
+        if (clusterExpandCompactMsg(link) == C_ERR) {
+            serverLog(LL_VERBOSE,
+                "Can't expand a compact message from the Cluster bus, "
+                "reconnecting the link.");
+            freeClusterLink(link);
+            return 0;
+        }
+        server.cluster->stats_bus_compact_received++;
+        hdr = (clusterMsg*) link->rcvbuf;
+        totlen = ntohl(hdr->totlen);
+    }
 
     if (ntohs(hdr->ver) != CLUSTER_PROTO_VER) {
         /* Can't handle messages of different versions. */
         return 1;
     }
+    if (totlen < CLUSTERMSG_MIN_LEN) return 1;
 
     uint16_t flags = ntohs(hdr->flags);
     uint64_t senderCurrentEpoch = 0, senderConfigEpoch = 0;
     clusterNode *sender;
 
+    if (hdr->mflags[1] & CLUSTERMSG_FLAG1_COMPACT) link->peer_compact = 1;
+
     if (type == CLUSTERMSG_TYPE_PING || type == CLUSTERMSG_TYPE_PONG ||
         type == CLUSTERMSG_TYPE_MEET)
     {
@@ -1636,6 +1712,11 @@ int clusterProcessPacket(clusterLink *link) {
         explen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
         explen += (sizeof(clusterMsgDataGossip)*count);
         if (totlen != explen) return 1;
+
+        /* Remember the slots of a sender that may send compact messages
+         * later on this link. */
+        if (hdr->mflags[1] & CLUSTERMSG_FLAG1_COMPACT)
+            clusterCacheLinkSlots(link,hdr->myslots);
     } else if (type == CLUSTERMSG_TYPE_FAIL) {
         uint32_t explen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
 
@@ -2105,7 +2186,7 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                 /* Perform some sanity check on the message signature
                  * and length. */
                 if (memcmp(hdr->sig,"RCmb",4) != 0 ||
-                    ntohl(hdr->totlen) < CLUSTERMSG_MIN_LEN)
+                    ntohl(hdr->totlen) < CLUSTERMSG_COMPACT_MIN_LEN)
                 {
                     serverLog(LL_WARNING,
                         "Bad message length or signature received "
@@ -2163,6 +2244,9 @@ void clusterSendMessage(clusterLink *link, unsigned char *msg, size_t msglen) {
     uint16_t type = ntohs(hdr->type);
     if (type < CLUSTERMSG_TYPE_COUNT)
         server.cluster->stats_bus_messages_sent[type]++;
+    if (ntohs(hdr->ver) == CLUSTER_PROTO_VER_COMPACT)
+        server.cluster->stats_bus_compact_sent++;
+    server.cluster->stats_bus_bytes_sent += msglen;
 }
 
 /* Send a message to all the nodes that are part of the cluster having
@@ -2249,6 +2333,7 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* Set the message flags. */
     if (nodeIsMaster(myself) && server.cluster->mf_end)
         hdr->mflags[0] |= CLUSTERMSG_FLAG0_PAUSED;
+    hdr->mflags[1] |= CLUSTERMSG_FLAG1_COMPACT;
 
     /* Compute the message length for certain messages. For other messages
      * this is up to the caller. */
@@ -2290,6 +2375,45 @@ void clusterSetGossipEntry(clusterMsg *hdr, int i, clusterNode *n) {
     gossip->notused1 = 0;
 }
 
+/* Send the PING or PONG 'hdr', having 'count' gossip sections, as a compact
+ * message if the receiver accepts it and already got our slots bitmap in a
+ * full message on this link. Returns 1 if the message was sent, otherwise
+ * 0 is returned and the caller should send the full message. */
+int clusterSendCompactPing(clusterLink *link, clusterMsg *hdr, int count) {
+    size_t gossiplen = sizeof(clusterMsgDataGossip)*count;
+    size_t totlen = CLUSTERMSG_COMPACT_MIN_LEN+gossiplen;
+    clusterMsgCompact *c;
+    uint64_t hash;
+
+    if (!server.cluster_compact_bus || !link->peer_compact) return 0;
+    if (ntohs(hdr->type) == CLUSTERMSG_TYPE_MEET) return 0;
+
+    hash = crc64(0,hdr->myslots,sizeof(hdr->myslots));
+    if (!link->snd_slots_valid || link->snd_slots_hash != hash) {
+        /* The slots changed: the full message the caller is going to send
+         * lets the receiver know the new bitmap. */
+        link->snd_slots_hash = hash;
+        link->snd_slots_valid = 1;
+        return 0;
+    }
+
+    c = zcalloc(totlen);
+    memcpy(c,hdr,offsetof(clusterMsgCompact,slots_hash));
+    c->totlen = htonl(totlen);
+    c->ver = htons(CLUSTER_PROTO_VER_COMPACT);
+    c->slots_hash = htonu64(hash);
+    memcpy(c->slaveof,hdr->slaveof,sizeof(c->slaveof));
+    memcpy(c->myip,hdr->myip,sizeof(c->myip));
+    c->cport = hdr->cport;
+    c->flags = hdr->flags;
+    c->state = hdr->state;
+    memcpy(c->mflags,hdr->mflags,sizeof(c->mflags));
+    memcpy(c->data.ping.gossip,hdr->data.ping.gossip,gossiplen);
+    clusterSendMessage(link,(unsigned char*)c,totlen);
+    zfree(c);
+    return 1;
+}
+
 /* Send a PING or PONG packet to the specified node, making sure to add enough
  * gossip informations. */
 void clusterSendPing(clusterLink *link, int type) {
@@ -2329,8 +2453,20 @@ void clusterSendPing(clusterLink *link, int type) {
      *
      * Since we have non-voting slaves that lower the probability of an entry
      * to feature our node, we set the number of entires per packet as
-     * 10% of the total nodes we have. */
+     * 10% of the total nodes we have.
+     *
+     * However the nodes in PFAIL state are always added below, so when we
+     * see none of them, the random entries are only needed to spread the
+     * pong times and the addresses of the nodes. With cluster-compact-bus
+     * enabled we just add the square root of the number of nodes in this
+     * case: every node is still featured many times in node_timeout, but
+     * the size of the message, that is sent to every node, no longer grows
+     * linearly with the cluster. */
     wanted = floor(dictSize(server.cluster->nodes)/10);
+    if (server.cluster_compact_bus && server.cluster->stats_pfail_nodes == 0) {
+        int stable_wanted = ceil(sqrt(dictSize(server.cluster->nodes)));
+        if (wanted > stable_wanted) wanted = stable_wanted;
+    }
     if (wanted < 3) wanted = 3;
     if (wanted > freshnodes) wanted = freshnodes;
 
@@ -2416,7 +2552,8 @@ void clusterSendPing(clusterLink *link, int type) {
     totlen += (sizeof(clusterMsgDataGossip)*gossipcount);
     hdr->count = htons(gossipcount);
     hdr->totlen = htonl(totlen);
-    clusterSendMessage(link,buf,totlen);
+    if (!clusterSendCompactPing(link,hdr,gossipcount))
+        clusterSendMessage(link,buf,totlen);
     zfree(buf);
 }
 
@@ -4337,6 +4474,15 @@ void clusterCommand(client *c) {
         }
         info = sdscatprintf(info,
             "cluster_stats_messages_received:%lld\r\n", tot_msg_received);
+        info = sdscatprintf(info,
+            "cluster_stats_messages_compact_sent:%lld\r\n"
+            "cluster_stats_messages_compact_received:%lld\r\n"
+            "cluster_stats_bytes_sent:%lld\r\n"
+            "cluster_stats_bytes_received:%lld\r\n",
+            server.cluster->stats_bus_compact_sent,
+            server.cluster->stats_bus_compact_received,
+            server.cluster->stats_bus_bytes_sent,
+            server.cluster->stats_bus_bytes_received);
 
         /* Produce the reply protocol. */
         addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n",
@@ -4633,8 +4779,8 @@ void createDumpPayload(rio *payload, robj *o) {
      */
 
     /* RDB version */
-    buf[0] = RDB_VERSION & 0xff;
-    buf[1] = (RDB_VERSION >> 8) & 0xff;
+    buf[0] = rdbSaveVersion(payload) & 0xff;
+    buf[1] = (rdbSaveVersion(payload) >> 8) & 0xff;
     payload->io.buffer.ptr = sdscatlen(payload->io.buffer.ptr,buf,2);
 
     /* CRC64 */
@@ -4659,7 +4805,7 @@ int verifyDumpPayload(unsigned char *p, size_t len) {
 
     /* Verify RDB version */
     rdbver = (footer[1] << 8) | footer[0];
-    if (rdbver > RDB_VERSION) return C_ERR;
+    if (!rdbIsVersionSupported(rdbver)) return C_ERR;
 
     /* Verify CRC64 */
     crc = crc64(0,p,len-8);
@@ -16,6 +16,7 @@
 #define CLUSTER_DEFAULT_NODE_TIMEOUT 15000
 #define CLUSTER_DEFAULT_SLAVE_VALIDITY 10 /* Slave max data age factor. */
 #define CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE 1
+#define CLUSTER_DEFAULT_COMPACT_BUS 1
 #define CLUSTER_FAIL_REPORT_VALIDITY_MULT 2 /* Fail report validity. */
 #define CLUSTER_FAIL_UNDO_TIME_MULT 2 /* Undo fail if master is back. */
 #define CLUSTER_FAIL_UNDO_TIME_ADD 10 /* Some additional time. */
@@ -43,6 +44,13 @@ typedef struct clusterLink {
     sds sndbuf;                 /* Packet send buffer */
     sds rcvbuf;                 /* Packet reception buffer */
     struct clusterNode *node;   /* Node related to this link if any, or NULL */
+    int peer_compact;           /* The peer accepts compact PING/PONG. */
+    int snd_slots_valid;        /* snd_slots_hash is set. */
+    uint64_t snd_slots_hash;    /* Slots sent in the last full PING/PONG. */
+    int rcv_slots_valid;        /* rcv_slots is set. */
+    uint64_t rcv_slots_hash;    /* Hash of rcv_slots. */
+    unsigned char rcv_slots[CLUSTER_SLOTS/8]; /* Slots received in the last
+                                                 full PING/PONG. */
 } clusterLink;
 
 /* Cluster node flags and macros. */
@@ -167,6 +175,10 @@ typedef struct clusterState {
     long long stats_bus_messages_received[CLUSTERMSG_TYPE_COUNT];
     long long stats_pfail_nodes;    /* Number of nodes in PFAIL status,
                                        excluding nodes without address. */
+    long long stats_bus_compact_sent;     /* Compact PING/PONG sent. */
+    long long stats_bus_compact_received; /* Compact PING/PONG received. */
+    long long stats_bus_bytes_sent;       /* Bytes sent on the bus. */
+    long long stats_bus_bytes_received;   /* Bytes received on the bus. */
 } clusterState;
 
 /* Redis cluster messages header */
@@ -256,11 +268,42 @@ typedef struct {
 
 #define CLUSTERMSG_MIN_LEN (sizeof(clusterMsg)-sizeof(union clusterMsgData))
 
+/* Compact PING and PONG, sent instead of the above to the nodes flagging
+ * their messages with CLUSTERMSG_FLAG1_COMPACT, when the receiver already
+ * got the sender slots in a full PING or PONG on the same link: only the
+ * hash of the bitmap is sent. The fields up to 'sender' are the same of
+ * clusterMsg. */
+#define CLUSTER_PROTO_VER_COMPACT 2
+
+typedef struct {
+    char sig[4];        /* Siganture "RCmb" (Redis Cluster message bus). */
+    uint32_t totlen;    /* Total length of this message */
+    uint16_t ver;       /* Protocol version, set to CLUSTER_PROTO_VER_COMPACT. */
+    uint16_t port;      /* TCP base port number. */
+    uint16_t type;      /* CLUSTERMSG_TYPE_PING or CLUSTERMSG_TYPE_PONG. */
+    uint16_t count;     /* Number of gossip sections. */
+    uint64_t currentEpoch;
+    uint64_t configEpoch;
+    uint64_t offset;
+    char sender[CLUSTER_NAMELEN];
+    uint64_t slots_hash; /* CRC64 of the myslots bitmap not sent. */
+    char slaveof[CLUSTER_NAMELEN];
+    char myip[NET_IP_STR_LEN];
+    uint16_t cport;
+    uint16_t flags;
+    unsigned char state;
+    unsigned char mflags[3];
+    union clusterMsgData data;
+} clusterMsgCompact;
+
+#define CLUSTERMSG_COMPACT_MIN_LEN (sizeof(clusterMsgCompact)-sizeof(union clusterMsgData))
+
 /* Message flags better specify the packet content or are used to
  * provide some information about the node state. */
 #define CLUSTERMSG_FLAG0_PAUSED (1<<0) /* Master paused for manual failover. */
 #define CLUSTERMSG_FLAG0_FORCEACK (1<<1) /* Give ACK to AUTH_REQUEST even if
                                             master is up. */
+#define CLUSTERMSG_FLAG1_COMPACT (1<<0) /* Sender accepts compact PING/PONG. */
 
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
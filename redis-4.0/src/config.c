@@ -84,6 +84,20 @@ configEnum supervised_mode_enum[] = {
     {NULL, 0}
 };
 
+configEnum rdb_compression_codec_enum[] = {
+    {"lzf", RDB_COMPRESSION_LZF},
+    {"lz4", RDB_COMPRESSION_LZ4},
+    {"lz4hc", RDB_COMPRESSION_LZ4HC},
+    {NULL, 0}
+};
+
+configEnum repl_diskless_load_enum[] = {
+    {"disabled", REPL_DISKLESS_LOAD_DISABLED},
+    {"on-empty-db", REPL_DISKLESS_LOAD_WHEN_DB_EMPTY},
+    {"swapdb", REPL_DISKLESS_LOAD_SWAPDB},
+    {NULL, 0}
+};
+
 configEnum aof_fsync_enum[] = {
     {"everysec", AOF_FSYNC_EVERYSEC},
     {"always", AOF_FSYNC_ALWAYS},
@@ -91,6 +105,12 @@ configEnum aof_fsync_enum[] = {
     {NULL, 0}
 };
 
+configEnum aof_format_enum[] = {
+    {"resp", AOF_FORMAT_RESP},
+    {"binary", AOF_FORMAT_BINARY},
+    {NULL, 0}
+};
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -374,6 +394,21 @@ void loadServerConfigFromString(char *config) {
                 err = "repl-diskless-sync-delay can't be negative";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"repl-snapshot-reuse-window") &&
+                   argc==2)
+        {
+            server.repl_snapshot_reuse_window = atoi(argv[1]);
+            if (server.repl_snapshot_reuse_window < 0) {
+                err = "repl-snapshot-reuse-window can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-diskless-load") && argc==2) {
+            server.repl_diskless_load =
+                configEnumGetValue(repl_diskless_load_enum,argv[1]);
+            if (server.repl_diskless_load == INT_MIN) {
+                err = "argument must be 'disabled', 'on-empty-db' or 'swapdb'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-backlog-size") && argc == 2) {
             long long size = memtoll(argv[1],NULL);
             if (size <= 0) {
@@ -381,6 +416,14 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
             resizeReplicationBacklog(size);
+        } else if (!strcasecmp(argv[0],"repl-backlog-disk-size") &&
+                   argc == 2)
+        {
+            server.repl_backlog_disk_size = memtoll(argv[1],NULL);
+            if (server.repl_backlog_disk_size < 0) {
+                err = "repl-backlog-disk-size can't be negative";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-backlog-ttl") && argc == 2) {
             server.repl_backlog_time_limit = atoi(argv[1]);
             if (server.repl_backlog_time_limit < 0) {
@@ -406,10 +449,43 @@ void loadServerConfigFromString(char *config) {
             if ((server.rdb_checksum = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-compression-codec") && argc == 2) {
+            server.rdb_compression_codec =
+                configEnumGetValue(rdb_compression_codec_enum,argv[1]);
+            if (server.rdb_compression_codec == INT_MIN) {
+                err = "Invalid RDB compression codec";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-forkless") && argc == 2) {
+            if ((server.rdb_save_forkless = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-index") && argc == 2) {
+            if ((server.rdb_save_index = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-lazy-load") && argc == 2) {
+            if ((server.rdb_lazy_load = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"activerehashing") && argc == 2) {
             if ((server.activerehashing = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"active-rehashing-budget-us") &&
+                   argc == 2)
+        {
+            server.active_rehashing_budget_us = strtoll(argv[1],NULL,10);
+            if (server.active_rehashing_budget_us <= 0) {
+                err = "active-rehashing-budget-us must be 1 or greater";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-expire-cycle-max") && argc == 2) {
+            server.active_expire_cycle_max = atoi(argv[1]);
+            if (server.active_expire_cycle_max < 1 || server.active_expire_cycle_max > 100) {
+                err = "active-expire-cycle-max must be between 1 and 100";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lazyfree-lazy-eviction") && argc == 2) {
             if ((server.lazyfree_lazy_eviction = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -422,10 +498,29 @@ void loadServerConfigFromString(char *config) {
             if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"slave-threaded-parse") && argc == 2) {
+            if ((server.slave_threaded_parse = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-compression") && argc == 2) {
+            if ((server.repl_compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"slave-lazy-flush") && argc == 2) {
             if ((server.repl_slave_lazy_flush = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 ||
+                server.io_threads_num > IO_THREADS_MAX_NUM)
+            {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"io-threads-do-reads") && argc == 2) {
+            if ((server.io_threads_do_reads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"activedefrag") && argc == 2) {
             if ((server.active_defrag_enabled = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -490,6 +585,20 @@ void loadServerConfigFromString(char *config) {
             if ((server.aof_use_rdb_preamble = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"aof-writer-thread") && argc == 2) {
+            if ((server.aof_writer_thread = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-format") && argc == 2) {
+            server.aof_format = configEnumGetValue(aof_format_enum,argv[1]);
+            if (server.aof_format == INT_MIN) {
+                err = "Invalid AOF format";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"aof-binary-compression") && argc == 2) {
+            if ((server.aof_binary_compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"requirepass") && argc == 2) {
             if (strlen(argv[1]) > CONFIG_AUTHPASS_MAX_LEN) {
                 err = "Password is longer than CONFIG_AUTHPASS_MAX_LEN";
@@ -613,6 +722,10 @@ void loadServerConfigFromString(char *config) {
             {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-compact-bus") && argc == 2) {
+            if ((server.cluster_compact_bus = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"cluster-node-timeout") && argc == 2) {
             server.cluster_node_timeout = strtoll(argv[1],NULL,10);
             if (server.cluster_node_timeout <= 0) {
@@ -634,6 +747,22 @@ void loadServerConfigFromString(char *config) {
                 err = "cluster slave validity factor must be zero or positive";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-load-threads") && argc == 2) {
+            server.rdb_load_threads = atoi(argv[1]);
+            if (server.rdb_load_threads < 0 ||
+                server.rdb_load_threads > CONFIG_MAX_RDB_LOAD_THREADS)
+            {
+                err = "rdb-load-threads must be between 0 and 64";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-threads") && argc == 2) {
+            server.rdb_save_threads = atoi(argv[1]);
+            if (server.rdb_save_threads < 0 ||
+                server.rdb_save_threads > CONFIG_MAX_RDB_SAVE_THREADS)
+            {
+                err = "rdb-save-threads must be between 0 and 64";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lua-time-limit") && argc == 2) {
             server.lua_time_limit = strtoll(argv[1],NULL,10);
         } else if (!strcasecmp(argv[0],"slowlog-log-slower-than") &&
@@ -990,18 +1119,30 @@ void configSetCommand(client *c) {
      * config_set_bool_field(name,var). */
     } config_set_bool_field(
       "rdbcompression", server.rdb_compression) {
+    } config_set_bool_field(
+      "rdb-save-forkless", server.rdb_save_forkless) {
+    } config_set_bool_field(
+      "rdb-save-index", server.rdb_save_index) {
+    } config_set_bool_field(
+      "rdb-lazy-load", server.rdb_lazy_load) {
     } config_set_bool_field(
       "repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay) {
     } config_set_bool_field(
       "repl-diskless-sync",server.repl_diskless_sync) {
     } config_set_bool_field(
       "cluster-require-full-coverage",server.cluster_require_full_coverage) {
+    } config_set_bool_field(
+      "cluster-compact-bus",server.cluster_compact_bus) {
     } config_set_bool_field(
       "aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync) {
     } config_set_bool_field(
       "aof-load-truncated",server.aof_load_truncated) {
     } config_set_bool_field(
       "aof-use-rdb-preamble",server.aof_use_rdb_preamble) {
+    } config_set_bool_field(
+      "aof-writer-thread",server.aof_writer_thread) {
+    } config_set_bool_field(
+      "aof-binary-compression",server.aof_binary_compression) {
     } config_set_bool_field(
       "slave-serve-stale-data",server.repl_serve_stale_data) {
     } config_set_bool_field(
@@ -1032,6 +1173,10 @@ void configSetCommand(client *c) {
       "lazyfree-lazy-server-del",server.lazyfree_lazy_server_del) {
     } config_set_bool_field(
       "slave-lazy-flush",server.repl_slave_lazy_flush) {
+    } config_set_bool_field(
+      "slave-threaded-parse",server.slave_threaded_parse) {
+    } config_set_bool_field(
+      "repl-compression",server.repl_compression) {
     } config_set_bool_field(
       "no-appendfsync-on-rewrite",server.aof_no_fsync_on_rewrite) {
 
@@ -1075,6 +1220,10 @@ void configSetCommand(client *c) {
       "zset-max-ziplist-value",server.zset_max_ziplist_value,0,LLONG_MAX) {
     } config_set_numerical_field(
       "hll-sparse-max-bytes",server.hll_sparse_max_bytes,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "rdb-load-threads",server.rdb_load_threads,0,CONFIG_MAX_RDB_LOAD_THREADS) {
+    } config_set_numerical_field(
+      "rdb-save-threads",server.rdb_save_threads,0,CONFIG_MAX_RDB_SAVE_THREADS) {
     } config_set_numerical_field(
       "lua-time-limit",server.lua_time_limit,0,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1093,6 +1242,8 @@ void configSetCommand(client *c) {
       "repl-backlog-ttl",server.repl_backlog_time_limit,0,LLONG_MAX) {
     } config_set_numerical_field(
       "repl-diskless-sync-delay",server.repl_diskless_sync_delay,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "repl-snapshot-reuse-window",server.repl_snapshot_reuse_window,0,LLONG_MAX) {
     } config_set_numerical_field(
       "slave-priority",server.slave_priority,0,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1113,6 +1264,10 @@ void configSetCommand(client *c) {
       "cluster-migration-barrier",server.cluster_migration_barrier,0,LLONG_MAX){
     } config_set_numerical_field(
       "cluster-slave-validity-factor",server.cluster_slave_validity_factor,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "active-rehashing-budget-us",server.active_rehashing_budget_us,1,LLONG_MAX) {
+    } config_set_numerical_field(
+      "active-expire-cycle-max",server.active_expire_cycle_max,1,100) {
     } config_set_numerical_field(
       "hz",server.hz,0,LLONG_MAX) {
         /* Hz is more an hint from the user, so we accept values out of range
@@ -1137,6 +1292,9 @@ void configSetCommand(client *c) {
         }
     } config_set_memory_field("repl-backlog-size",ll) {
         resizeReplicationBacklog(ll);
+    } config_set_memory_field("repl-backlog-disk-size",ll) {
+        server.repl_backlog_disk_size = ll;
+        replDiskTrim();
     } config_set_memory_field("auto-aof-rewrite-min-size",ll) {
         server.aof_rewrite_min_size = ll;
 
@@ -1148,6 +1306,14 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "rdb-compression-codec",server.rdb_compression_codec,
+      rdb_compression_codec_enum) {
+    } config_set_enum_field(
+      "repl-diskless-load",server.repl_diskless_load,
+      repl_diskless_load_enum) {
+    } config_set_enum_field(
+      "aof-format",server.aof_format,aof_format_enum) {
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1251,6 +1417,8 @@ void configGetCommand(client *c) {
     config_get_numerical_field("hll-sparse-max-bytes",
             server.hll_sparse_max_bytes);
     config_get_numerical_field("lua-time-limit",server.lua_time_limit);
+    config_get_numerical_field("rdb-load-threads",server.rdb_load_threads);
+    config_get_numerical_field("rdb-save-threads",server.rdb_save_threads);
     config_get_numerical_field("slowlog-log-slower-than",
             server.slowlog_log_slower_than);
     config_get_numerical_field("latency-monitor-threshold",
@@ -1266,6 +1434,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("repl-timeout",server.repl_timeout);
     config_get_numerical_field("repl-backlog-size",server.repl_backlog_size);
     config_get_numerical_field("repl-backlog-ttl",server.repl_backlog_time_limit);
+    config_get_numerical_field("repl-backlog-disk-size",server.repl_backlog_disk_size);
     config_get_numerical_field("maxclients",server.maxclients);
     config_get_numerical_field("watchdog-period",server.watchdog_period);
     config_get_numerical_field("slave-priority",server.slave_priority);
@@ -1273,15 +1442,21 @@ void configGetCommand(client *c) {
     config_get_numerical_field("min-slaves-to-write",server.repl_min_slaves_to_write);
     config_get_numerical_field("min-slaves-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.hz);
+    config_get_numerical_field("active-rehashing-budget-us",server.active_rehashing_budget_us);
+    config_get_numerical_field("active-expire-cycle-max",server.active_expire_cycle_max);
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
     config_get_numerical_field("repl-diskless-sync-delay",server.repl_diskless_sync_delay);
+    config_get_numerical_field("repl-snapshot-reuse-window",server.repl_snapshot_reuse_window);
     config_get_numerical_field("tcp-keepalive",server.tcpkeepalive);
+    config_get_numerical_field("io-threads",server.io_threads_num);
 
     /* Bool (yes/no) values */
     config_get_bool_field("cluster-require-full-coverage",
             server.cluster_require_full_coverage);
+    config_get_bool_field("cluster-compact-bus",
+            server.cluster_compact_bus);
     config_get_bool_field("no-appendfsync-on-rewrite",
             server.aof_no_fsync_on_rewrite);
     config_get_bool_field("slave-serve-stale-data",
@@ -1293,8 +1468,12 @@ void configGetCommand(client *c) {
     config_get_bool_field("daemonize", server.daemonize);
     config_get_bool_field("rdbcompression", server.rdb_compression);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
+    config_get_bool_field("rdb-save-forkless", server.rdb_save_forkless);
+    config_get_bool_field("rdb-save-index", server.rdb_save_index);
+    config_get_bool_field("rdb-lazy-load", server.rdb_lazy_load);
     config_get_bool_field("activerehashing", server.activerehashing);
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
+    config_get_bool_field("io-threads-do-reads", server.io_threads_do_reads);
     config_get_bool_field("protected-mode", server.protected_mode);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
@@ -1306,6 +1485,10 @@ void configGetCommand(client *c) {
             server.aof_load_truncated);
     config_get_bool_field("aof-use-rdb-preamble",
             server.aof_use_rdb_preamble);
+    config_get_bool_field("aof-writer-thread",
+            server.aof_writer_thread);
+    config_get_bool_field("aof-binary-compression",
+            server.aof_binary_compression);
     config_get_bool_field("lazyfree-lazy-eviction",
             server.lazyfree_lazy_eviction);
     config_get_bool_field("lazyfree-lazy-expire",
@@ -1314,6 +1497,10 @@ void configGetCommand(client *c) {
             server.lazyfree_lazy_server_del);
     config_get_bool_field("slave-lazy-flush",
             server.repl_slave_lazy_flush);
+    config_get_bool_field("slave-threaded-parse",
+            server.slave_threaded_parse);
+    config_get_bool_field("repl-compression",
+            server.repl_compression);
 
     /* Enum values */
     config_get_enum_field("maxmemory-policy",
@@ -1324,6 +1511,12 @@ void configGetCommand(client *c) {
             server.supervised_mode,supervised_mode_enum);
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
+    config_get_enum_field("aof-format",
+            server.aof_format,aof_format_enum);
+    config_get_enum_field("rdb-compression-codec",
+            server.rdb_compression_codec,rdb_compression_codec_enum);
+    config_get_enum_field("repl-diskless-load",
+            server.repl_diskless_load,repl_diskless_load_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
 
@@ -1972,6 +2165,9 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,CONFIG_DEFAULT_RDB_COMPRESSION);
     rewriteConfigYesNoOption(state,"rdbchecksum",server.rdb_checksum,CONFIG_DEFAULT_RDB_CHECKSUM);
+    rewriteConfigYesNoOption(state,"rdb-save-forkless",server.rdb_save_forkless,CONFIG_DEFAULT_RDB_SAVE_FORKLESS);
+    rewriteConfigYesNoOption(state,"rdb-save-index",server.rdb_save_index,CONFIG_DEFAULT_RDB_SAVE_INDEX);
+    rewriteConfigYesNoOption(state,"rdb-lazy-load",server.rdb_lazy_load,CONFIG_DEFAULT_RDB_LAZY_LOAD);
     rewriteConfigStringOption(state,"dbfilename",server.rdb_filename,CONFIG_DEFAULT_RDB_FILENAME);
     rewriteConfigDirOption(state);
     rewriteConfigSlaveofOption(state);
@@ -1984,9 +2180,12 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"repl-timeout",server.repl_timeout,CONFIG_DEFAULT_REPL_TIMEOUT);
     rewriteConfigBytesOption(state,"repl-backlog-size",server.repl_backlog_size,CONFIG_DEFAULT_REPL_BACKLOG_SIZE);
     rewriteConfigBytesOption(state,"repl-backlog-ttl",server.repl_backlog_time_limit,CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT);
+    rewriteConfigBytesOption(state,"repl-backlog-disk-size",server.repl_backlog_disk_size,CONFIG_DEFAULT_REPL_BACKLOG_DISK_SIZE);
     rewriteConfigYesNoOption(state,"repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay,CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY);
     rewriteConfigYesNoOption(state,"repl-diskless-sync",server.repl_diskless_sync,CONFIG_DEFAULT_REPL_DISKLESS_SYNC);
     rewriteConfigNumericalOption(state,"repl-diskless-sync-delay",server.repl_diskless_sync_delay,CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY);
+    rewriteConfigNumericalOption(state,"repl-snapshot-reuse-window",server.repl_snapshot_reuse_window,CONFIG_DEFAULT_REPL_SNAPSHOT_REUSE_WINDOW);
+    rewriteConfigEnumOption(state,"repl-diskless-load",server.repl_diskless_load,repl_diskless_load_enum,CONFIG_DEFAULT_REPL_DISKLESS_LOAD);
     rewriteConfigNumericalOption(state,"slave-priority",server.slave_priority,CONFIG_DEFAULT_SLAVE_PRIORITY);
     rewriteConfigNumericalOption(state,"min-slaves-to-write",server.repl_min_slaves_to_write,CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE);
     rewriteConfigNumericalOption(state,"min-slaves-max-lag",server.repl_min_slaves_max_lag,CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG);
@@ -2003,13 +2202,17 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"appendonly",server.aof_state != AOF_OFF,0);
     rewriteConfigStringOption(state,"appendfilename",server.aof_filename,CONFIG_DEFAULT_AOF_FILENAME);
     rewriteConfigEnumOption(state,"appendfsync",server.aof_fsync,aof_fsync_enum,CONFIG_DEFAULT_AOF_FSYNC);
+    rewriteConfigEnumOption(state,"rdb-compression-codec",server.rdb_compression_codec,rdb_compression_codec_enum,CONFIG_DEFAULT_RDB_COMPRESSION_CODEC);
     rewriteConfigYesNoOption(state,"no-appendfsync-on-rewrite",server.aof_no_fsync_on_rewrite,CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE);
     rewriteConfigNumericalOption(state,"auto-aof-rewrite-percentage",server.aof_rewrite_perc,AOF_REWRITE_PERC);
     rewriteConfigBytesOption(state,"auto-aof-rewrite-min-size",server.aof_rewrite_min_size,AOF_REWRITE_MIN_SIZE);
     rewriteConfigNumericalOption(state,"lua-time-limit",server.lua_time_limit,LUA_SCRIPT_TIME_LIMIT);
+    rewriteConfigNumericalOption(state,"rdb-load-threads",server.rdb_load_threads,CONFIG_DEFAULT_RDB_LOAD_THREADS);
+    rewriteConfigNumericalOption(state,"rdb-save-threads",server.rdb_save_threads,CONFIG_DEFAULT_RDB_SAVE_THREADS);
     rewriteConfigYesNoOption(state,"cluster-enabled",server.cluster_enabled,0);
     rewriteConfigStringOption(state,"cluster-config-file",server.cluster_configfile,CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     rewriteConfigYesNoOption(state,"cluster-require-full-coverage",server.cluster_require_full_coverage,CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE);
+    rewriteConfigYesNoOption(state,"cluster-compact-bus",server.cluster_compact_bus,CLUSTER_DEFAULT_COMPACT_BUS);
     rewriteConfigNumericalOption(state,"cluster-node-timeout",server.cluster_node_timeout,CLUSTER_DEFAULT_NODE_TIMEOUT);
     rewriteConfigNumericalOption(state,"cluster-migration-barrier",server.cluster_migration_barrier,CLUSTER_DEFAULT_MIGRATION_BARRIER);
     rewriteConfigNumericalOption(state,"cluster-slave-validity-factor",server.cluster_slave_validity_factor,CLUSTER_DEFAULT_SLAVE_VALIDITY);
@@ -2026,6 +2229,10 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
+    rewriteConfigNumericalOption(state,"active-rehashing-budget-us",server.active_rehashing_budget_us,CONFIG_DEFAULT_ACTIVE_REHASHING_BUDGET_US);
+    rewriteConfigNumericalOption(state,"active-expire-cycle-max",server.active_expire_cycle_max,CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MAX);
+    rewriteConfigNumericalOption(state,"io-threads",server.io_threads_num,CONFIG_DEFAULT_IO_THREADS_NUM);
+    rewriteConfigYesNoOption(state,"io-threads-do-reads",server.io_threads_do_reads,CONFIG_DEFAULT_IO_THREADS_DO_READS);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
     rewriteConfigYesNoOption(state,"protected-mode",server.protected_mode,CONFIG_DEFAULT_PROTECTED_MODE);
     rewriteConfigClientoutputbufferlimitOption(state);
@@ -2033,11 +2240,16 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"aof-load-truncated",server.aof_load_truncated,CONFIG_DEFAULT_AOF_LOAD_TRUNCATED);
     rewriteConfigYesNoOption(state,"aof-use-rdb-preamble",server.aof_use_rdb_preamble,CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE);
+    rewriteConfigYesNoOption(state,"aof-writer-thread",server.aof_writer_thread,CONFIG_DEFAULT_AOF_WRITER_THREAD);
+    rewriteConfigEnumOption(state,"aof-format",server.aof_format,aof_format_enum,CONFIG_DEFAULT_AOF_FORMAT);
+    rewriteConfigYesNoOption(state,"aof-binary-compression",server.aof_binary_compression,CONFIG_DEFAULT_AOF_BINARY_COMPRESSION);
     rewriteConfigEnumOption(state,"supervised",server.supervised_mode,supervised_mode_enum,SUPERVISED_NONE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-eviction",server.lazyfree_lazy_eviction,CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
     rewriteConfigYesNoOption(state,"slave-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
+    rewriteConfigYesNoOption(state,"slave-threaded-parse",server.slave_threaded_parse,CONFIG_DEFAULT_SLAVE_THREADED_PARSE);
+    rewriteConfigYesNoOption(state,"repl-compression",server.repl_compression,CONFIG_DEFAULT_REPL_COMPRESSION);
 
     /* Rewrite Sentinel config if in Sentinel mode. */
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
@@ -79,10 +79,81 @@ static const uint16_t crc16tab[256]= {
     0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
 };
 
+/* Slicing-by-8 tables: crc16_slice[k][n] is the CRC of the byte 'n' followed
+ * by 'k' zero bytes, so that 8 bytes are processed with 8 independent
+ * lookups instead of a chain of 8 dependent ones. Keys are hashed by
+ * keyHashSlot() on every command in cluster mode. */
+static uint16_t crc16_slice[8][256];
+static int crc16_initialized = 0;
+
+/* Build the slicing tables. Called at startup: crc16() calls it if needed,
+ * but that is not thread safe. */
+void crc16Init(void) {
+    int j, k;
+
+    for (j = 0; j < 256; j++) {
+        crc16_slice[0][j] = crc16tab[j];
+        for (k = 1; k < 8; k++) {
+            uint16_t c = crc16_slice[k-1][j];
+            crc16_slice[k][j] = (uint16_t)(c << 8) ^ crc16tab[c >> 8];
+        }
+    }
+    crc16_initialized = 1;
+}
+
+/* The original byte at a time implementation. */
+static uint16_t crc16Bytewise(uint16_t crc, const unsigned char *p, int len) {
+    while (len--) crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *p++)&0x00FF];
+    return crc;
+}
+
 uint16_t crc16(const char *buf, int len) {
-    int counter;
+    const unsigned char *p = (const unsigned char*)buf;
     uint16_t crc = 0;
-    for (counter = 0; counter < len; counter++)
-            crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *buf++)&0x00FF];
-    return crc;
+
+    if (!crc16_initialized) crc16Init();
+    while (len >= 8) {
+        crc = crc16_slice[7][p[0] ^ (crc >> 8)] ^
+              crc16_slice[6][p[1] ^ (crc & 0xff)] ^
+              crc16_slice[5][p[2]] ^ crc16_slice[4][p[3]] ^
+              crc16_slice[3][p[4]] ^ crc16_slice[2][p[5]] ^
+              crc16_slice[1][p[6]] ^ crc16_slice[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    return crc16Bytewise(crc,p,len);
+}
+
+#ifdef REDIS_TEST
+int crc16Test(int argc, char *argv[]) {
+    unsigned char buf[256];
+    int j, len, errors = 0;
+    long long start, elapsed;
+    unsigned int acc = 0;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    printf("31c3 == %04x\n", crc16("123456789",9));
+    for (j = 0; j < (int)sizeof(buf); j++) buf[j] = rand();
+    for (len = 0; len <= (int)sizeof(buf); len++) {
+        if (crc16((char*)buf,len) != crc16Bytewise(0,buf,len)) {
+            printf("crc16: mismatch with len %d\n", len);
+            errors++;
+        }
+    }
+
+    /* Throughput with key sized inputs. */
+    for (len = 8; len <= 64; len *= 2) {
+        start = ustime();
+        for (j = 0; j < 10000000; j++) acc += crc16Bytewise(0,buf+(j&63),len);
+        elapsed = ustime()-start;
+        printf("len %2d bytewise: %.1f ns/key, ", len, elapsed*1000.0/j);
+        start = ustime();
+        for (j = 0; j < 10000000; j++) acc += crc16((char*)buf+(j&63),len);
+        elapsed = ustime()-start;
+        printf("slice8: %.1f ns/key\n", elapsed*1000.0/j);
+    }
+    printf("(%u)\n", acc & 1);
+    return errors ? 1 : 0;
 }
+#endif
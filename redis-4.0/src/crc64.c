@@ -38,6 +38,13 @@
  * POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdint.h>
+#include <string.h>
+#include "crc64.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC64_CLMUL 1
+#include <immintrin.h>
+#endif
 
 static const uint64_t crc64_tab[256] = {
     UINT64_C(0x0000000000000000), UINT64_C(0x7ad870c830358979),
@@ -170,7 +177,63 @@ static const uint64_t crc64_tab[256] = {
     UINT64_C(0x536fa08fdfd90e51), UINT64_C(0x29b7d047efec8728),
 };
 
-uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+/* ---------------------------------------------------------------------------
+ * Fast implementations.
+ *
+ * The byte at a time loop above processes one byte per table lookup, with
+ * every step depending on the previous one. Two faster kernels are used
+ * when available:
+ *
+ * 1) Slicing-by-8: eight tables, where crc64_slice[k][n] is the CRC of the
+ *    byte 'n' followed by 'k' zero bytes, let us process 8 bytes with 8
+ *    independent lookups.
+ *
+ * 2) Folding with carry-less multiplication (PCLMULQDQ), see "Fast CRC
+ *    Computation for Generic Polynomials Using PCLMULQDQ Instruction",
+ *    Intel, 2009. Four 128 bit accumulators are folded over 64 bytes per
+ *    iteration, then folded into a single one, that is finally reduced
+ *    computing its CRC with slicing-by-8.
+ *
+ * Since the CRC is reflected, a 64 bit word loaded in little endian order
+ * has the bit 'i' representing x^(63-i). The carry-less product of two such
+ * words has the bit 'k' representing x^(126-k), that is, it is already
+ * multiplied by x if we read it as a 128 bit block. So to fold a block
+ * over a distance of 'd' bits the low qword (the higher degree terms) is
+ * multiplied by x^(d+63) mod P, and the high qword by x^(d-1) mod P.
+ * -------------------------------------------------------------------------- */
+
+#define CRC64_POLY UINT64_C(0xad93d23594c935a9)
+
+static uint64_t crc64_slice[8][256];
+static int crc64_kernel = -1;
+
+/* Folding constants, reflected, for distances of 512 and 128 bits. */
+static uint64_t crc64_k512[2], crc64_k128[2];
+
+/* Return x^n mod P in reflected form. */
+static uint64_t crc64XpowMod(int n) {
+    uint64_t r = 1, rev = 0;
+    int j;
+
+    while (n--) r = (r & (UINT64_C(1)<<63)) ? (r << 1) ^ CRC64_POLY : r << 1;
+    for (j = 0; j < 64; j++) rev |= ((r >> j) & 1) << (63-j);
+    return rev;
+}
+
+static inline uint64_t crc64LoadLE(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/* The original byte at a time implementation, used for the tails and as
+ * reference in tests. */
+static uint64_t crc64Bytewise(uint64_t crc, const unsigned char *s,
+                              uint64_t l)
+{
     uint64_t j;
 
     for (j = 0; j < l; j++) {
@@ -180,16 +243,191 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
     return crc;
 }
 
+static uint64_t crc64Slice8(uint64_t crc, const unsigned char *s,
+                            uint64_t l)
+{
+    while (l >= 8) {
+        crc ^= crc64LoadLE(s);
+        crc = crc64_slice[7][crc & 0xff] ^
+              crc64_slice[6][(crc >> 8) & 0xff] ^
+              crc64_slice[5][(crc >> 16) & 0xff] ^
+              crc64_slice[4][(crc >> 24) & 0xff] ^
+              crc64_slice[3][(crc >> 32) & 0xff] ^
+              crc64_slice[2][(crc >> 40) & 0xff] ^
+              crc64_slice[1][(crc >> 48) & 0xff] ^
+              crc64_slice[0][crc >> 56];
+        s += 8;
+        l -= 8;
+    }
+    return crc64Bytewise(crc,s,l);
+}
+
+#ifdef HAVE_CRC64_CLMUL
+/* Fold the accumulator 'acc' over 'data' using the constants 'k'. */
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc64Fold(__m128i acc, __m128i data, __m128i k) {
+    return _mm_xor_si128(data,
+           _mm_xor_si128(_mm_clmulepi64_si128(acc,k,0x00),
+                         _mm_clmulepi64_si128(acc,k,0x11)));
+}
+
+/* Only called with at least 64 bytes. */
+__attribute__((target("pclmul,sse2")))
+static uint64_t crc64Clmul(uint64_t crc, const unsigned char *s,
+                           uint64_t l)
+{
+    __m128i k512 = _mm_set_epi64x(crc64_k512[1],crc64_k512[0]);
+    __m128i k128 = _mm_set_epi64x(crc64_k128[1],crc64_k128[0]);
+    __m128i a0, a1, a2, a3;
+    unsigned char buf[16];
+
+    a0 = _mm_xor_si128(_mm_loadu_si128((__m128i*)s),
+                       _mm_cvtsi64_si128((long long)crc));
+    a1 = _mm_loadu_si128((__m128i*)(s+16));
+    a2 = _mm_loadu_si128((__m128i*)(s+32));
+    a3 = _mm_loadu_si128((__m128i*)(s+48));
+    s += 64;
+    l -= 64;
+
+    while (l >= 64) {
+        a0 = crc64Fold(a0,_mm_loadu_si128((__m128i*)s),k512);
+        a1 = crc64Fold(a1,_mm_loadu_si128((__m128i*)(s+16)),k512);
+        a2 = crc64Fold(a2,_mm_loadu_si128((__m128i*)(s+32)),k512);
+        a3 = crc64Fold(a3,_mm_loadu_si128((__m128i*)(s+48)),k512);
+        s += 64;
+        l -= 64;
+    }
+
+    a0 = crc64Fold(a0,a1,k128);
+    a0 = crc64Fold(a0,a2,k128);
+    a0 = crc64Fold(a0,a3,k128);
+    while (l >= 16) {
+        a0 = crc64Fold(a0,_mm_loadu_si128((__m128i*)s),k128);
+        s += 16;
+        l -= 16;
+    }
+
+    /* The accumulator is now congruent to all the data seen so far: its
+     * CRC, starting from zero, is the CRC of the data. */
+    _mm_storeu_si128((__m128i*)buf,a0);
+    crc = crc64Slice8(0,buf,16);
+    return crc64Slice8(crc,s,l);
+}
+#endif
+
+/* Build the slicing tables and the folding constants, and select the
+ * fastest kernel available. Called at startup: crc64() calls it if needed,
+ * but that is not thread safe. */
+void crc64Init(void) {
+    int j, k;
+
+    if (crc64_kernel != -1) return;
+    for (j = 0; j < 256; j++) {
+        crc64_slice[0][j] = crc64_tab[j];
+        for (k = 1; k < 8; k++) {
+            uint64_t c = crc64_slice[k-1][j];
+            crc64_slice[k][j] = crc64_tab[c & 0xff] ^ (c >> 8);
+        }
+    }
+    crc64_k512[0] = crc64XpowMod(512+63);
+    crc64_k512[1] = crc64XpowMod(512-1);
+    crc64_k128[0] = crc64XpowMod(128+63);
+    crc64_k128[1] = crc64XpowMod(128-1);
+
+    crc64_kernel = CRC64_KERNEL_SLICE8;
+#ifdef HAVE_CRC64_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul")) crc64_kernel = CRC64_KERNEL_CLMUL;
+#endif
+}
+
+/* Use the kernel 'kernel' if available, or the best available one with
+ * CRC64_KERNEL_BEST. Returns the kernel selected. Only used by tests. */
+int crc64SelectKernel(int kernel) {
+    int best;
+
+    crc64_kernel = -1;
+    crc64Init();
+    best = crc64_kernel;
+    if (kernel < best) crc64_kernel = kernel;
+    return crc64_kernel;
+}
+
+const char *crc64KernelName(void) {
+    switch(crc64_kernel) {
+    case CRC64_KERNEL_BYTE: return "bytewise";
+    case CRC64_KERNEL_SLICE8: return "slice8";
+    case CRC64_KERNEL_CLMUL: return "pclmul";
+    default: return "none";
+    }
+}
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+    if (crc64_kernel == -1) crc64Init();
+#ifdef HAVE_CRC64_CLMUL
+    if (crc64_kernel == CRC64_KERNEL_CLMUL && l >= 64)
+        return crc64Clmul(crc,s,l);
+#endif
+    if (crc64_kernel == CRC64_KERNEL_BYTE) return crc64Bytewise(crc,s,l);
+    return crc64Slice8(crc,s,l);
+}
+
 /* Test main */
 #ifdef REDIS_TEST
 #include <stdio.h>
 
+#include <stdlib.h>
+#include <sys/time.h>
+
+static long long crc64TestUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
 #define UNUSED(x) (void)(x)
 int crc64Test(int argc, char *argv[]) {
+    static const char *names[] = {"bytewise","slice8","pclmul"};
+    size_t buflen = 1024*1024*16, j;
+    unsigned char *buf = malloc(buflen);
+    int k, i, errors = 0;
+
     UNUSED(argc);
     UNUSED(argv);
     printf("e9c6d914c4b8d9ca == %016llx\n",
         (unsigned long long) crc64(0,(unsigned char*)"123456789",9));
-    return 0;
+    for (j = 0; j < buflen; j++) buf[j] = rand();
+
+    for (k = CRC64_KERNEL_BYTE; k <= CRC64_KERNEL_CLMUL; k++) {
+        if (crc64SelectKernel(k) != k) continue;
+
+        /* Random offsets, lengths and initial values, compared with the
+         * byte at a time implementation. */
+        for (i = 0; i < 20000; i++) {
+            size_t off = rand() % 64, len = rand() % 2048;
+            uint64_t init = ((uint64_t)rand() << 32) ^ rand();
+
+            if (i % 100 == 0) len = rand() % (1024*64);
+            if (crc64(init,buf+off,len) != crc64Bytewise(init,buf+off,len)) {
+                printf("%s: mismatch at offset %zu len %zu\n",
+                    names[k], off, len);
+                errors++;
+                break;
+            }
+        }
+
+        /* Throughput. */
+        long long start = crc64TestUstime();
+        uint64_t crc = 0;
+        for (i = 0; i < 8; i++) crc = crc64(crc,buf,buflen);
+        long long elapsed = crc64TestUstime()-start;
+        printf("%-8s %016llx %.2f GB/s\n", names[k],
+            (unsigned long long) crc,
+            (double)buflen*8/(elapsed ? elapsed : 1)/1000);
+    }
+    crc64SelectKernel(CRC64_KERNEL_BEST);
+    free(buf);
+    if (errors) printf("crc64 kernels: %d errors\n", errors);
+    return errors ? 1 : 0;
 }
 #endif
@@ -3,7 +3,16 @@
 
 #include <stdint.h>
 
+/* CRC64 implementations, in order of speed. */
+#define CRC64_KERNEL_BYTE 0     /* One table lookup per byte. */
+#define CRC64_KERNEL_SLICE8 1   /* Slicing-by-8. */
+#define CRC64_KERNEL_CLMUL 2    /* Folding with PCLMULQDQ. */
+#define CRC64_KERNEL_BEST 3     /* Best available. */
+
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+void crc64Init(void);
+int crc64SelectKernel(int kernel);
+const char *crc64KernelName(void);
 
 #ifdef REDIS_TEST
 int crc64Test(int argc, char *argv[]);
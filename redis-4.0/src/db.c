@@ -44,11 +44,20 @@
  */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
     // 在字典中根据key查找字典对象
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    return lookupKeyFromEntry(dictFind(db->dict,key->ptr),flags);
+}
+
+/* Like lookupKey() but for callers that already located the key entry,
+ * so that the expire check and the value access share a single lookup. */
+robj *lookupKeyFromEntry(dictEntry *de, int flags) {
     if (de) {
         // 获取字典对象的值
         robj *val = dictGetVal(de);
 
+        /* 值还在映射的RDB文件中，第一次访问时解码，见rdbmap.c */
+        if (val->encoding == OBJ_ENCODING_MAPPED)
+            val = rdbMappedMaterialize(de);
+
         /* 更新key的最新访问时间
          * Don't do it if we have a saving child, as this will trigger
          * a copy on write madness. */
@@ -98,9 +107,10 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * 尽管key的过期操作是在主库上执行，但也可以准确地拿到key的过期状态
  */
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
     robj *val;
 
-    if (expireIfNeeded(db,key) == 1) {
+    if (de && expireEntryIfNeeded(db,key,de) == 1) {
         /* 
          * key已经过期了，如果我们在主库的环境下，expireIfNeeded函数只会在key不存在的情况下返回0
          * 因此，如果key已经过期，尽快地返回NULL
@@ -128,7 +138,7 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
         }
     }
     // 调用底层函数查找key
-    val = lookupKey(db,key,flags);
+    val = lookupKeyFromEntry(de,flags);
     // 更新命中/不命中次数
     if (val == NULL)
         server.stat_keyspace_misses++;
@@ -151,8 +161,13 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * 如果key存在数据库中，返回保存对应key的对象，否则返回NULL
  */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-    expireIfNeeded(db,key);
-    return lookupKey(db,key,LOOKUP_NONE);
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
+    rdbSnapshotTouchKey(db,key->ptr);
+    /* On masters an expired key is deleted, on slaves it stays around. */
+    if (de && expireEntryIfNeeded(db,key,de) && server.masterhost == NULL)
+        return NULL;
+    return lookupKeyFromEntry(de,LOOKUP_NONE);
 }
 
 /*
@@ -179,8 +194,11 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  * 如果key已经存在，则函数终止
  */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr); //  复制一份字符串
-    int retval = dictAdd(db->dict, copy, val); // 添加到dict
+    int retval;
+
+    rdbSnapshotTouchKey(db,key->ptr);
+    /* The key is copied inside the dictEntry by the dict itself. */
+    retval = dictAdd(db->dict, key->ptr, val); // 添加到dict
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
@@ -200,6 +218,8 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     dictEntry *de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL); // 找不到key，函数终止
+    rdbSnapshotTouchKey(db,key->ptr);
+    hllUnionCacheForget(dictGetVal(de));
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         robj *old = dictGetVal(de);
         int saved_lru = old->lru;
@@ -260,7 +280,7 @@ robj *dbRandomKey(redisDb *db) {
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (getEntryExpire(de) != -1) {
             if (expireIfNeeded(db,keyobj)) {
                 decrRefCount(keyobj);
                 continue; /* search for another key. This expired. */
@@ -272,10 +292,13 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
+    rdbSnapshotTouchKey(db,key->ptr);
+    /* The expire lives in the entry: only the index element must go. */
+    if (dbExpiresCount(db) > 0) dbDeleteExpire(db,key);
+    dictEntry *de = dictUnlink(db->dict,key->ptr);
+    if (de) {
+        hllUnionCacheForget(dictGetVal(de));
+        dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key);
         return 1;
     } else {
@@ -351,6 +374,10 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         return -1;
     }
 
+    /* Keys not yet saved by a forkless snapshot are about to go away. */
+    rdbSnapshotFinishSerialization();
+    hllUnionCacheFlush();
+
     for (j = 0; j < server.dbnum; j++) {
         if (dbnum != -1 && dbnum != j) continue;
         removed += dictSize(server.db[j].dict);
@@ -358,7 +385,8 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
             emptyDbAsync(&server.db[j]);
         } else {
             dictEmpty(server.db[j].dict,callback);
-            dictEmpty(server.db[j].expires,callback);
+            expireIndexRelease(server.db[j].expires_index);
+            server.db[j].expires_index = expireIndexCreate();
         }
     }
     if (server.cluster_enabled) {
@@ -372,6 +400,69 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
     return removed;
 }
 
+/* Create a set of empty DBs, not visible to clients, where a slave can load
+ * the RDB payload of its master while still serving the old dataset.
+ * The blocking/ready/watched keys dicts are created empty just so that
+ * dbAdd() works on these DBs: no client can block on a temp DB. */
+redisDb *initTempDb(void) {
+    redisDb *tempDb = zcalloc(sizeof(redisDb)*server.dbnum);
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        tempDb[j].dict = dictCreate(&dbDictType,NULL);
+        tempDb[j].expires_index = expireIndexCreate();
+        tempDb[j].blocking_keys = dictCreate(&keylistDictType,NULL);
+        tempDb[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
+        tempDb[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        tempDb[j].id = j;
+        tempDb[j].avg_ttl = 0;
+    }
+    return tempDb;
+}
+
+/* Release the DBs created with initTempDb() and the data they hold. With
+ * 'async' the keys are freed by the lazyfree thread. */
+void discardTempDb(redisDb *tempDb, int async) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        /* 交给lazyfree线程后，这里只剩下新建的空表 */
+        if (async) emptyDbAsync(&tempDb[j]);
+        dictRelease(tempDb[j].dict);
+        expireIndexRelease(tempDb[j].expires_index);
+        dictRelease(tempDb[j].blocking_keys);
+        dictRelease(tempDb[j].ready_keys);
+        dictRelease(tempDb[j].watched_keys);
+    }
+    zfree(tempDb);
+}
+
+/* Make the data of 'tempDb' the dataset served to clients, leaving the old
+ * data in 'tempDb', to be released with discardTempDb(). Like SWAPDB the
+ * blocking, ready and watched keys stay with the main DBs. */
+void swapMainDbWithTempDb(redisDb *tempDb) {
+    int j;
+
+    rdbSnapshotFinishSerialization();
+    hllUnionCacheFlush();
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb aux = server.db[j];
+        redisDb *activedb = &server.db[j], *newdb = &tempDb[j];
+
+        activedb->dict = newdb->dict;
+        activedb->expires_index = newdb->expires_index;
+        activedb->avg_ttl = newdb->avg_ttl;
+
+        newdb->dict = aux.dict;
+        newdb->expires_index = aux.expires_index;
+        newdb->avg_ttl = aux.avg_ttl;
+
+        /* Clients blocked on lists that exist in the new dataset can be
+         * served now. */
+        scanDatabaseForReadyLists(activedb);
+    }
+}
+
 int selectDb(client *c, int id) {
     if (id < 0 || id >= server.dbnum)
         return C_ERR;
@@ -442,6 +533,7 @@ void flushallCommand(client *c) {
 
     if (getFlushCommandFlags(c,&flags) == C_ERR) return;
     signalFlushedDb(-1);
+    rdbSnapshotAbort();
     server.dirty += emptyDb(-1,flags,NULL);
     addReply(c,shared.ok);
     if (server.rdb_child_pid != -1) {
@@ -722,17 +814,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpFirst(o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -1002,6 +1094,8 @@ int dbSwapDatabases(int id1, int id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    rdbSnapshotFinishSerialization();
+    hllUnionCacheFlush();
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -1009,11 +1103,11 @@ int dbSwapDatabases(int id1, int id2) {
      * ready_keys and watched_keys, since we want clients to
      * remain in the same DB they were. */
     db1->dict = db2->dict;
-    db1->expires = db2->expires;
+    db1->expires_index = db2->expires_index;
     db1->avg_ttl = db2->avg_ttl;
 
     db2->dict = aux.dict;
-    db2->expires = aux.expires;
+    db2->expires_index = aux.expires_index;
     db2->avg_ttl = aux.avg_ttl;
 
     /* Now we need to handle clients blocked on lists: as an effect
@@ -1064,11 +1158,228 @@ void swapdbCommand(client *c) {
  * 过期时间相关API
  *----------------------------------------------------------------------------*/
 
+/* The expire of a key lives in the keyspace itself, next to the key. The
+ * first time a key gets an expire its dictEntry, that already embeds the
+ * key (see dbDictType), is grown by a slot placed right after the key null
+ * term, and SDS_EMBED_FLAG is set in the key header. The slot holds the
+ * expire as a long long, followed by the position of the entry in the
+ * expiry index (see below) as an uint32_t. Once allocated the slot is kept,
+ * and the expire is set to -1 when it is removed.
+ *
+ * This way reading the TTL of a key found in the main dict costs no further
+ * lookup, and there is no expires dict: the only other reference to a
+ * volatile key is the pointer to its entry in db->expires_index.
+ * 过期时间保存在主字典entry中key的后面，另外只有索引中指向entry的指针 */
+#define keyHasExpireSlot(k) (((unsigned char*)(k))[-1] & SDS_EMBED_FLAG)
+#define keyExpireSlot(k) ((k)+sdslen(k)+1)
+#define keyExpireIndexPos(k) (keyExpireSlot(k)+sizeof(long long))
+#define EXPIRE_SLOT_SIZE (sizeof(long long)+sizeof(uint32_t))
+
+/* Return the expire of the key stored in the main dict entry 'de', or -1
+ * if the key is not volatile. */
+long long getEntryExpire(dictEntry *de) {
+    sds key = dictGetKey(de);
+    long long when;
+
+    if (!keyHasExpireSlot(key)) return -1;
+    memcpy(&when,keyExpireSlot(key),sizeof(when));
+    return when;
+}
+
+/* Reallocate the main dict entry 'de' so that it has room for the expire
+ * slot, returning the new entry. The key is not volatile yet, so only the
+ * bucket of the main dict points to the entry. */
+static dictEntry *dbEntryAddExpireSlot(redisDb *db, dictEntry *de) {
+    sds key = dictGetKey(de);
+    size_t keyoff = (char*)key - (char*)de;
+    size_t size = keyoff+sdslen(key)+1;
+    dictEntry **deref, *newde;
+    long long none = -1;
+
+    deref = dictFindEntryRefByPtrAndHash(db->dict,key,dictGetHash(db->dict,key));
+    serverAssert(deref != NULL && *deref == de);
+    newde = zrealloc(de,size+EXPIRE_SLOT_SIZE);
+    *deref = newde;
+    newde->key = (char*)newde+keyoff;
+    ((unsigned char*)newde->key)[-1] |= SDS_EMBED_FLAG;
+    memcpy(keyExpireSlot((sds)newde->key),&none,sizeof(none));
+    return newde;
+}
+
+/* The expiry index of a DB references the main dict entries of the
+ * volatile keys in two arrays:
+ *
+ * - 'heap' is a binary min-heap of the keys not yet due, ordered by expire
+ *   time: the key expiring first is always at heap[0].
+ * - 'due' holds, in no particular order, the keys whose expire is older
+ *   than 'due_time', the last time expireIndexAdvance() was called. They
+ *   are already expired, and wait for the active expire cycle (or on
+ *   slaves for the master DEL).
+ *
+ * Every entry knows its own position (stored in the expire slot, with
+ * EXPIRE_INDEX_DUE set if it is in 'due'), so a key is removed or
+ * rescheduled in O(log N), and the cost of a volatile key is one pointer
+ * instead of a copy of its name. Since the index points to the entries it
+ * can't hold stale elements: a key has an element exactly as long as its
+ * entry has an expire. Being arrays they can also be sampled uniformly.
+ * 最小堆保存还未过期的key，due数组保存已经过期的key */
+#define EXPIRE_INDEX_MIN_SIZE 16
+#define EXPIRE_INDEX_DUE (1U<<31)
+
+expireIndex *expireIndexCreate(void) {
+    return zcalloc(sizeof(expireIndex));
+}
+
+/* Free the index, not the entries it points to. */
+void expireIndexRelease(expireIndex *ei) {
+    zfree(ei->heap);
+    zfree(ei->due);
+    zfree(ei);
+}
+
+static long long expireIndexTime(expireIndex *ei, unsigned long pos) {
+    return getEntryExpire(ei->heap[pos]);
+}
+
+static void expireIndexSetPos(dictEntry *de, uint32_t p) {
+    memcpy(keyExpireIndexPos((sds)dictGetKey(de)),&p,sizeof(p));
+}
+
+static uint32_t expireIndexGetPos(dictEntry *de) {
+    uint32_t p;
+
+    memcpy(&p,keyExpireIndexPos((sds)dictGetKey(de)),sizeof(p));
+    return p;
+}
+
+static void expireIndexSet(expireIndex *ei, unsigned long pos, dictEntry *de) {
+    ei->heap[pos] = de;
+    expireIndexSetPos(de,pos);
+}
+
+/* Grow or shrink the array '*a' of '*size' slots holding 'len' elements. */
+static void expireIndexResize(dictEntry ***a, unsigned long *size,
+                              unsigned long len)
+{
+    if (len == *size) {
+        *size = *size ? *size+*size/2 : EXPIRE_INDEX_MIN_SIZE;
+        *a = zrealloc(*a,sizeof(dictEntry*)*(*size));
+    } else if (*size > EXPIRE_INDEX_MIN_SIZE && len < *size/4) {
+        *size /= 2;
+        *a = zrealloc(*a,sizeof(dictEntry*)*(*size));
+    }
+}
+
+/* Move the element at 'pos' up or down to its place in the heap. */
+static void expireIndexFix(expireIndex *ei, unsigned long pos) {
+    dictEntry *de = ei->heap[pos];
+    long long when = getEntryExpire(de);
+
+    while (pos > 0 && expireIndexTime(ei,(pos-1)/2) > when) {
+        expireIndexSet(ei,pos,ei->heap[(pos-1)/2]);
+        pos = (pos-1)/2;
+    }
+    while (1) {
+        unsigned long child = pos*2+1;
+
+        if (child >= ei->len) break;
+        if (child+1 < ei->len &&
+            expireIndexTime(ei,child+1) < expireIndexTime(ei,child)) child++;
+        if (expireIndexTime(ei,child) >= when) break;
+        expireIndexSet(ei,pos,ei->heap[child]);
+        pos = child;
+    }
+    expireIndexSet(ei,pos,de);
+}
+
+static void expireIndexAddDue(expireIndex *ei, dictEntry *de) {
+    serverAssert(ei->due_len < EXPIRE_INDEX_DUE);
+    expireIndexResize(&ei->due,&ei->due_size,ei->due_len);
+    ei->due[ei->due_len] = de;
+    expireIndexSetPos(de,ei->due_len|EXPIRE_INDEX_DUE);
+    ei->due_len++;
+}
+
+static void expireIndexInsert(expireIndex *ei, dictEntry *de) {
+    if (getEntryExpire(de) < ei->due_time) {
+        expireIndexAddDue(ei,de);
+        return;
+    }
+    serverAssert(ei->len < EXPIRE_INDEX_DUE);
+    expireIndexResize(&ei->heap,&ei->size,ei->len);
+    ei->heap[ei->len++] = de;
+    expireIndexFix(ei,ei->len-1);
+}
+
+static void expireIndexDelete(expireIndex *ei, dictEntry *de) {
+    uint32_t pos = expireIndexGetPos(de);
+
+    if (pos & EXPIRE_INDEX_DUE) {
+        pos &= ~EXPIRE_INDEX_DUE;
+        serverAssert(pos < ei->due_len && ei->due[pos] == de);
+        ei->due_len--;
+        if (pos != ei->due_len) {
+            ei->due[pos] = ei->due[ei->due_len];
+            expireIndexSetPos(ei->due[pos],pos|EXPIRE_INDEX_DUE);
+        }
+        expireIndexResize(&ei->due,&ei->due_size,ei->due_len);
+        return;
+    }
+    serverAssert(pos < ei->len && ei->heap[pos] == de);
+    ei->len--;
+    if (pos != ei->len) {
+        expireIndexSet(ei,pos,ei->heap[ei->len]);
+        expireIndexFix(ei,pos);
+    }
+    expireIndexResize(&ei->heap,&ei->size,ei->len);
+}
+
+/* Move from the heap to the due array the keys that expire before 'now'.
+ * Every key is moved once, so the cost is amortized on the keys expired. */
+void expireIndexAdvance(expireIndex *ei, long long now) {
+    if (now <= ei->due_time) return;
+    ei->due_time = now;
+    while (ei->len && expireIndexTime(ei,0) < now) {
+        dictEntry *de = ei->heap[0];
+
+        expireIndexDelete(ei,de);
+        expireIndexAddDue(ei,de);
+    }
+}
+
+/* Called when the entry 'de' of the main dict of 'db' was moved to a new
+ * allocation (active defrag): fix the pointer in the index. */
+void dbEntryMoved(redisDb *db, dictEntry *de) {
+    expireIndex *ei = db->expires_index;
+    uint32_t pos;
+
+    if (getEntryExpire(de) == -1) return;
+    pos = expireIndexGetPos(de);
+    if (pos & EXPIRE_INDEX_DUE)
+        ei->due[pos & ~EXPIRE_INDEX_DUE] = de;
+    else
+        ei->heap[pos] = de;
+}
+
+/* Remove the expire of 'key', if any, from its keyspace entry and from the
+ * expiry index. Unlike removeExpire() the key is not required to exist.
+ * Returns 1 if the key had an expire, otherwise 0. */
+int dbDeleteExpire(redisDb *db, robj *key) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    long long none = -1;
+
+    if (de == NULL || getEntryExpire(de) == -1) return 0;
+    expireIndexDelete(db->expires_index,de);
+    memcpy(keyExpireSlot((sds)dictGetKey(de)),&none,sizeof(none));
+    return 1;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    rdbSnapshotTouchKey(db,key->ptr);
+    return dbDeleteExpire(db,key);
 }
 
 /* 
@@ -1077,15 +1388,19 @@ int removeExpire(redisDb *db, robj *key) {
  * 参数when是unix时间戳，设置后，在when时间后key就被视为无效了
  */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *kde;
 
-    /* Reuse the sds from the main dict in the expire dict */
+    rdbSnapshotTouchKey(db,key->ptr);
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    // 添加key到数据库的expires数组
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
-    // 上面代码把过期key添加到数据库的expires字典数组了，这里设置key的过期时间，即过期对象的value
-    dictSetSignedIntegerVal(de,when);
+    // 在主字典的entry中保存过期时间
+    if (!keyHasExpireSlot(dictGetKey(kde)))
+        kde = dbEntryAddExpireSlot(db,kde);
+    else if (getEntryExpire(kde) != -1)
+        expireIndexDelete(db->expires_index,kde);
+    memcpy(keyExpireSlot((sds)dictGetKey(kde)),&when,sizeof(when));
+    // 添加key到过期索引
+    expireIndexInsert(db->expires_index,kde);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1102,14 +1417,9 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* 如果key没有设置过期时间，马上返回 */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
-
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    /* 安全校验步骤，上面只在过期的字典中找指定的key，但是也要检查key在数据库的主字典中也应该存在 */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    if (dbExpiresCount(db) == 0 ||
+       (de = dictFind(db->dict,key->ptr)) == NULL) return -1;
+    return getEntryExpire(de);
 }
 
 /* 
@@ -1137,7 +1447,18 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
 }
 
 int expireIfNeeded(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);// 获取key的过期时间
+    dictEntry *de;
+
+    if (dbExpiresCount(db) == 0 ||
+       (de = dictFind(db->dict,key->ptr)) == NULL) return 0;
+    return expireEntryIfNeeded(db,key,de);
+}
+
+/* Like expireIfNeeded() but for callers that already looked up the main
+ * dict entry 'de' of 'key'. On masters 'de' is no longer valid if 1 is
+ * returned, since the key was deleted. */
+int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry *de) {
+    mstime_t when = getEntryExpire(de);// 获取key的过期时间
     mstime_t now;
 
     if (when < 0) return 0; /* 负数代表key没有过期时间 */
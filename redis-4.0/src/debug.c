@@ -136,7 +136,7 @@ void computeDatasetDigest(unsigned char *final) {
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
             sds key;
-            robj *keyobj, *o;
+            robj *keyobj, *o, *decoded = NULL;
             long long expiretime;
 
             memset(digest,0,20); /* This key-val digest */
@@ -146,10 +146,13 @@ void computeDatasetDigest(unsigned char *final) {
             mixDigest(digest,key,sdslen(key));
 
             o = dictGetVal(de);
+            /* Not yet loaded from the mapped RDB file: digest a copy. */
+            if (o->encoding == OBJ_ENCODING_MAPPED)
+                o = decoded = rdbMappedDecode(o);
 
             aux = htonl(o->type);
             mixDigest(digest,&aux,sizeof(aux));
-            expiretime = getExpire(db,keyobj);
+            expiretime = getEntryExpire(de);
 
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
@@ -174,7 +177,7 @@ void computeDatasetDigest(unsigned char *final) {
             } else if (o->type == OBJ_ZSET) {
                 unsigned char eledigest[20];
 
-                if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+                if (o->encoding == OBJ_ENCODING_LISTPACK) {
                     unsigned char *zl = o->ptr;
                     unsigned char *eptr, *sptr;
                     unsigned char *vstr;
@@ -182,13 +185,13 @@ void computeDatasetDigest(unsigned char *final) {
                     long long vll;
                     double score;
 
-                    eptr = ziplistIndex(zl,0);
+                    eptr = lpFirst(zl);
                     serverAssert(eptr != NULL);
-                    sptr = ziplistNext(zl,eptr);
+                    sptr = lpNext(zl,eptr);
                     serverAssert(sptr != NULL);
 
                     while (eptr != NULL) {
-                        serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                        vstr = lpGetValue(eptr,&vlen,&vll);
                         score = zzlGetScore(sptr);
 
                         memset(eledigest,0,20);
@@ -256,6 +259,7 @@ void computeDatasetDigest(unsigned char *final) {
             /* We can finally xor the key-val digest to the final digest */
             xorDigest(final,digest,20);
             decrRefCount(keyobj);
+            if (decoded) decrRefCount(decoded);
         }
         dictReleaseIterator(di);
     }
@@ -293,6 +297,8 @@ void debugCommand(client *c) {
         blen++; addReplyStatus(c,
         "ziplist <key> -- Show low level info about the ziplist encoding.");
         blen++; addReplyStatus(c,
+        "listpack <key> -- Show low level info about the listpack encoding.");
+        blen++; addReplyStatus(c,
         "populate <count> [prefix] [size] -- Create <count> string keys named key:<num>. If a prefix is specified is used instead of the 'key' prefix.");
         blen++; addReplyStatus(c,
         "digest   -- Outputs an hex signature representing the current DB content.");
@@ -351,7 +357,7 @@ void debugCommand(client *c) {
     } else if (!strcasecmp(c->argv[1]->ptr,"loadaof")) {
         if (server.aof_state == AOF_ON) flushAppendOnlyFile(1);
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
-        if (loadAppendOnlyFile(server.aof_filename) != C_OK) {
+        if (loadAppendOnlyFiles(server.aof_manifest) != C_OK) {
             addReply(c,shared.err);
             return;
         }
@@ -414,6 +420,7 @@ void debugCommand(client *c) {
         dictEntry *de;
         robj *val;
         sds key;
+        size_t key_zmalloc;
 
         if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
             addReply(c,shared.nokeyerr);
@@ -421,6 +428,10 @@ void debugCommand(client *c) {
         }
         val = dictGetVal(de);
         key = dictGetKey(de);
+        /* An embedded key is not an allocation by itself: report the size
+         * of the entry holding it. */
+        key_zmalloc = dictHasEmbeddedKeys(c->db->dict) ?
+                      zmalloc_size(de) : sdsZmallocSize(key);
 
         if (val->type != OBJ_STRING || !sdsEncodedObject(val)) {
             addReplyError(c,"Not an sds encoded string.");
@@ -430,7 +441,7 @@ void debugCommand(client *c) {
                 "val_sds_len:%lld, val_sds_avail:%lld, val_zmalloc: %lld",
                 (long long) sdslen(key),
                 (long long) sdsavail(key),
-                (long long) sdsZmallocSize(key),
+                (long long) key_zmalloc,
                 (long long) sdslen(val->ptr),
                 (long long) sdsavail(val->ptr),
                 (long long) getStringObjectSdsUsedMemory(val));
@@ -447,6 +458,18 @@ void debugCommand(client *c) {
             ziplistRepr(o->ptr);
             addReplyStatus(c,"Ziplist structure printed on stdout");
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"listpack") && c->argc == 3) {
+        robj *o;
+
+        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nokeyerr))
+                == NULL) return;
+
+        if (o->encoding != OBJ_ENCODING_LISTPACK) {
+            addReplyError(c,"Not a listpack encoded object.");
+        } else {
+            lpRepr(o->ptr);
+            addReplyStatus(c,"Listpack structure printed on stdout");
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"populate") &&
                c->argc >= 3 && c->argc <= 5) {
         long keys, j;
@@ -544,9 +567,13 @@ void debugCommand(client *c) {
         dictGetStats(buf,sizeof(buf),server.db[dbid].dict);
         stats = sdscat(stats,buf);
 
-        stats = sdscatprintf(stats,"[Expires HT]\n");
-        dictGetStats(buf,sizeof(buf),server.db[dbid].expires);
-        stats = sdscat(stats,buf);
+        stats = sdscatprintf(stats,"[Expires index]\n"
+            " number of elements: %llu\n"
+            " heap size: %llu\n"
+            " due elements: %llu\n",
+            (unsigned long long)server.db[dbid].expires_index->len,
+            (unsigned long long)server.db[dbid].expires_index->size,
+            (unsigned long long)server.db[dbid].expires_index->due_len);
 
         addReplyBulkSds(c,stats);
     } else {
@@ -598,7 +625,9 @@ void serverLogObjectDebugInfo(const robj *o) {
     serverLog(LL_WARNING,"Object type: %d", o->type);
     serverLog(LL_WARNING,"Object encoding: %d", o->encoding);
     serverLog(LL_WARNING,"Object refcount: %d", o->refcount);
-    if (o->type == OBJ_STRING && sdsEncodedObject(o)) {
+    if (o->encoding == OBJ_ENCODING_MAPPED) {
+        serverLog(LL_WARNING,"Object not yet loaded from the mapped RDB");
+    } else if (o->type == OBJ_STRING && sdsEncodedObject(o)) {
         serverLog(LL_WARNING,"Object raw string len: %zu", sdslen(o->ptr));
         if (sdslen(o->ptr) < 4096) {
             sds repr = sdscatrepr(sdsempty(),o->ptr,sdslen(o->ptr));
@@ -246,29 +246,6 @@ double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
     return NULL;
 }
 
-/* Utility function that replaces an old key pointer in the dictionary with a
- * new pointer. Additionally, we try to defrag the dictEntry in that dict.
- * Oldkey mey be a dead pointer and should not be accessed (we get a
- * pre-calculated hash value). Newkey may be null if the key pointer wasn't
- * moved. Return value is the the dictEntry if found, or NULL if not found.
- * NOTE: this is very ugly code, but it let's us avoid the complication of
- * doing a scan on another dict. */
-dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, unsigned int hash, int *defragged) {
-    dictEntry **deref = dictFindEntryRefByPtrAndHash(d, oldkey, hash);
-    if (deref) {
-        dictEntry *de = *deref;
-        dictEntry *newde = activeDefragAlloc(de);
-        if (newde) {
-            de = *deref = newde;
-            (*defragged)++;
-        }
-        if (newkey)
-            de->key = newkey;
-        return de;
-    }
-    return NULL;
-}
-
 /* for each key we scan in the main dict, this function will attempt to defrag
  * all the various pointers it has. Returns a stat of how many pointers were
  * moved. */
@@ -281,17 +258,11 @@ int defragKey(redisDb *db, dictEntry *de) {
     int defragged = 0;
     sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
+    /* Try to defrag the key name. Keys embedded in the dictEntry are moved
+     * together with the entry by defragDictBucketCallback(). */
+    newsds = dictHasEmbeddedKeys(db->dict) ? NULL : activeDefragSds(keysds);
     if (newsds)
         defragged++, de->key = newsds;
-    if (dictSize(db->expires)) {
-         /* Dirty code:
-          * I can't search in db->expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        unsigned int hash = dictGetHash(db->dict, de->key);
-        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
-    }
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
@@ -300,7 +271,9 @@ int defragKey(redisDb *db, dictEntry *de) {
         ob = newob;
     }
 
-    if (ob->type == OBJ_STRING) {
+    if (ob->encoding == OBJ_ENCODING_MAPPED) {
+        /* Not yet loaded from the mapped RDB file, see rdbmap.c. */
+    } else if (ob->type == OBJ_STRING) {
         /* Already handled in activeDefragStringOb. */
     } else if (ob->type == OBJ_LIST) {
         if (ob->encoding == OBJ_ENCODING_QUICKLIST) {
@@ -352,7 +325,7 @@ int defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -386,7 +359,7 @@ int defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -428,11 +401,19 @@ void defragScanCallback(void *privdata, const dictEntry *de) {
 /* Defrag scan callback for for each hash table bicket,
  * used in order to defrag the dictEntry allocations. */
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
-    UNUSED(privdata);
+    redisDb *db = privdata;
+    int embedded = dictHasEmbeddedKeys(db->dict);
     while(*bucketref) {
         dictEntry *de = *bucketref, *newde;
+        sds oldkey = dictGetKey(de);
         if ((newde = activeDefragAlloc(de))) {
             *bucketref = newde;
+            /* The key moved with the entry: fix the pointer stored in the
+             * entry itself, and the one in the expiry index. */
+            if (embedded) {
+                newde->key = (char*)newde + ((char*)oldkey - (char*)de);
+                dbEntryMoved(db,newde);
+            }
         }
         bucketref = &(*bucketref)->next;
     }
@@ -257,11 +257,22 @@ long long timeInMilliseconds(void) {
     return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
 }
 
-/* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds */
+/* 返回当前时间，单位：微秒 */
+long long timeInMicroseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds.
+ * Like _dictRehashStep() nothing is done while iterators are bound to the
+ * table, since moving entries would make them miss or duplicate elements. */
 int dictRehashMilliseconds(dict *d, int ms) {
     long long start = timeInMilliseconds();
     int rehashes = 0;
 
+    if (d->iterators > 0) return 0;
     while(dictRehash(d,100)) {
         rehashes += 100;
         if (timeInMilliseconds()-start > ms) break;
@@ -269,6 +280,23 @@ int dictRehashMilliseconds(dict *d, int ms) {
     return rehashes;
 }
 
+/* Like dictRehashMilliseconds() but with a microseconds budget, so that the
+ * caller can bound the time a single rehashing call may block the server.
+ * The elapsed time is checked every DICT_REHASH_BATCH buckets, that is a
+ * small amount of work, so the budget is not exceeded by much.
+ * 在us微秒的时间预算内进行rehash，返回rehash的bucket数量 */
+int dictRehashMicroseconds(dict *d, unsigned long long us) {
+    long long start = timeInMicroseconds();
+    int rehashes = 0;
+
+    if (d->iterators > 0) return 0;
+    while(dictRehash(d,DICT_REHASH_BATCH)) {
+        rehashes += DICT_REHASH_BATCH;
+        if ((unsigned long long)(timeInMicroseconds()-start) >= us) break;
+    }
+    return rehashes;
+}
+
 /* This function performs just a step of rehashing, and only if there are
  * no safe iterators bound to our hash table. When we have iterators in the
  * middle of a rehashing we can't mess with the two hash tables otherwise
@@ -339,13 +367,17 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0]; // 如果正在进行rehash操作，返回ht[1],否则返回ht[0]
-    entry = zmalloc(sizeof(*entry));
+    if (dictHasEmbeddedKeys(d)) {
+        /* The key lives right after the entry, in the same allocation. */
+        entry = zmalloc(sizeof(*entry)+d->type->keyEmbedLen(key));
+        entry->key = d->type->keyEmbed(entry+1,key);
+    } else {
+        entry = zmalloc(sizeof(*entry));
+        dictSetKey(d, entry, key);
+    }
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
-
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
     return entry;
 }
 
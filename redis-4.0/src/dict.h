@@ -64,6 +64,14 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2); /* 比较键函数 */
     void (*keyDestructor)(void *privdata, void *key); /* 销毁键函数 */
     void (*valDestructor)(void *privdata, void *obj); /* 销毁值函数 */
+    /* Optional: when set the key is copied at the tail of the dictEntry
+     * allocation instead of being referenced, saving one allocation and one
+     * pointer dereference per lookup. keyEmbedLen() returns the bytes needed
+     * for 'key', keyEmbed() writes it into 'buf' returning the stored key.
+     * Embedded keys are freed together with the entry, so keyDup and
+     * keyDestructor should be NULL. */
+    size_t (*keyEmbedLen)(const void *key); /* 嵌入键所需字节数 */
+    void *(*keyEmbed)(void *buf, const void *key); /* 把键写入entry尾部 */
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
@@ -106,6 +114,9 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Buckets moved between two clock checks in dictRehashMicroseconds() */
+#define DICT_REHASH_BATCH        100
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -138,6 +149,8 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
         (entry)->key = (_key_); \
 } while(0)
 
+#define dictHasEmbeddedKeys(d) ((d)->type->keyEmbedLen != NULL)
+
 #define dictCompareKeys(d, key1, key2) \
     (((d)->type->keyCompare) ? \
         (d)->type->keyCompare((d)->privdata, key1, key2) : \
@@ -181,6 +194,7 @@ void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
+int dictRehashMicroseconds(dict *d, unsigned long long us);
 void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
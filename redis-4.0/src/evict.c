@@ -161,11 +161,18 @@ void evictionPoolAlloc(void) {
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, redisDb *db, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    /* The volatile keys are sampled from the expiry index, that for
+     * volatile-ttl directly gives the ones expiring first. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+        count = dictGetSomeKeys(db->dict,samples,server.maxmemory_samples);
+    } else {
+        count = expireIndexGetSomeKeys(db,samples,server.maxmemory_samples,
+                    server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL);
+    }
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
@@ -174,14 +181,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
 
         de = samples[j];
         key = dictGetKey(de);
-
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
-        }
+        o = dictGetVal(de);
 
         /* Calculate the idle time according to the policy. This is called
          * idle just because the code initially handled LRU, but is in fact
@@ -199,7 +199,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
             idle = 255-LFUDecrAndReturn(o);
         } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
             /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
+            idle = ULLONG_MAX - getEntryExpire(de);
         } else {
             serverPanic("Unknown eviction policy in evictionPoolPopulate()");
         }
@@ -353,7 +353,9 @@ unsigned long LFUDecrAndReturn(robj *o) {
 
 /* We don't want to count AOF buffers and slaves output buffers as
  * used memory: the eviction should use mostly data size. This function
- * returns the sum of AOF and slaves buffer. */
+ * returns the sum of AOF and slaves buffer. The replication buffer is
+ * shared by the slaves and the backlog, that is counted as used memory:
+ * only the part exceeding the backlog size is the slaves overhead. */
 size_t freeMemoryGetNotCountedMemory(void) {
     size_t overhead = 0;
     int slaves = listLength(server.slaves);
@@ -365,11 +367,14 @@ size_t freeMemoryGetNotCountedMemory(void) {
         listRewind(server.slaves,&li);
         while((ln = listNext(&li))) {
             client *slave = listNodeValue(ln);
-            overhead += getClientOutputBufferMemoryUsage(slave);
+            overhead += getClientOutputBufferMemoryUsage(slave) -
+                        replicaPendingStreamBytes(slave);
         }
+        if ((long long)server.repl_buffer_mem > server.repl_backlog_size)
+            overhead += server.repl_buffer_mem - server.repl_backlog_size;
     }
     if (server.aof_state != AOF_OFF) {
-        overhead += sdslen(server.aof_buf)+aofRewriteBufferSize();
+        overhead += sdslen(server.aof_buf);
     }
     return overhead;
 }
@@ -413,7 +418,6 @@ int freeMemoryIfNeeded(void) {
         sds bestkey = NULL;
         int bestdbid;
         redisDb *db;
-        dict *dict;
         dictEntry *de;
 
         if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
@@ -429,10 +433,10 @@ int freeMemoryIfNeeded(void) {
                  * every DB. */
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
+                    keys = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                            dictSize(db->dict) : dbExpiresCount(db);
+                    if (keys != 0) {
+                        evictionPoolPopulate(i, db, pool);
                         total_keys += keys;
                     }
                 }
@@ -443,13 +447,12 @@ int freeMemoryIfNeeded(void) {
                     if (pool[k].key == NULL) continue;
                     bestdbid = pool[k].dbid;
 
-                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
-                            pool[k].key);
-                    } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
-                            pool[k].key);
-                    }
+                    de = dictFind(server.db[pool[k].dbid].dict,
+                        pool[k].key);
+                    /* A volatile key may have been persisted meanwhile. */
+                    if (de && getEntryExpire(de) == -1 &&
+                        !(server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS))
+                        de = NULL;
 
                     /* Remove the entry from the pool. */
                     if (pool[k].key != pool[k].cached)
@@ -479,10 +482,12 @@ int freeMemoryIfNeeded(void) {
             for (i = 0; i < server.dbnum; i++) {
                 j = (++next_db) % server.dbnum;
                 db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
+                if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
+                    de = dictSize(db->dict) ? dictGetRandomKey(db->dict) : NULL;
+                } else if (expireIndexGetSomeKeys(db,&de,1,0) == 0) {
+                    de = NULL;
+                }
+                if (de) {
                     bestkey = dictGetKey(de);
                     bestdbid = j;
                     break;
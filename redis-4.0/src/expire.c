@@ -40,9 +40,9 @@
  * if no access is performed on them.
  *----------------------------------------------------------------------------*/
 
-/* Helper function for the activeExpireCycle() function.
- * This function will try to expire the key that is stored in the hash table
- * entry 'de' of the 'expires' hash table of a Redis database.
+/* Helper function for the expireSlaveKeys() function.
+ * This function will try to expire the volatile key that is stored in the
+ * main dict entry 'de' of a Redis database.
  *
  * If the key is found to be expired, it is removed from the database and
  * 1 is returned. Otherwise no operation is performed and 0 is returned.
@@ -52,30 +52,91 @@
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
 int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
+    long long t = getEntryExpire(de);
     if (now > t) {
         sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
 
-        propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
-        if (server.lazyfree_lazy_expire)
-            dbAsyncDelete(db,keyobj);
-        else
-            dbSyncDelete(db,keyobj);
-        notifyKeyspaceEvent(NOTIFY_EXPIRED,
-            "expired",keyobj,db->id);
+        activeExpireKey(db,keyobj);
         decrRefCount(keyobj);
-        server.stat_expiredkeys++;
         return 1;
     } else {
         return 0;
     }
 }
 
-/* Try to expire a few timed out keys. The algorithm used is adaptive and
- * will use few CPU cycles if there are few expiring keys, otherwise
- * it will get more aggressive to avoid that too much memory is used by
- * keys that can be removed from the keyspace.
+/* Delete the expired key 'keyobj', propagating the DEL and firing the
+ * keyspace event. */
+void activeExpireKey(redisDb *db, robj *keyobj) {
+    propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
+    if (server.lazyfree_lazy_expire)
+        dbAsyncDelete(db,keyobj);
+    else
+        dbSyncDelete(db,keyobj);
+    notifyKeyspaceEvent(NOTIFY_EXPIRED,
+        "expired",keyobj,db->id);
+    server.stat_expiredkeys++;
+}
+
+/* Fill 'des' with the main dict entries of up to 'count' volatile keys of
+ * 'db', picked uniformly at random among the elements of the expiry index,
+ * so duplicates are possible. With 'soonest' the keys already due are
+ * returned first, then the first elements of the heap: they are not
+ * exactly the keys that expire first, but every one of them expires before
+ * all the keys below it in the heap. Returns the number of entries stored
+ * in 'des'. */
+unsigned int expireIndexGetSomeKeys(redisDb *db, dictEntry **des,
+                                    unsigned int count, int soonest)
+{
+    expireIndex *ei = db->expires_index;
+    unsigned long total = dbExpiresCount(db);
+    unsigned int j;
+
+    if (count > total) count = total;
+    for (j = 0; j < count; j++) {
+        unsigned long pos = j;
+
+        if (!soonest)
+            pos = (((unsigned long)random() << 31) ^ random()) % total;
+        des[j] = pos < ei->due_len ? ei->due[pos] : ei->heap[pos-ei->due_len];
+    }
+    return count;
+}
+
+/* Update the average TTL stats of 'db' sampling a few random volatile keys:
+ * we just use the current estimate with a weight of 2% and the previous
+ * estimate with a weight of 98%. */
+void activeExpireUpdateAvgTTL(redisDb *db, long long now) {
+    dictEntry *samples[ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP];
+    unsigned int j, num;
+    long long ttl_sum = 0;
+    int ttl_samples = 0;
+
+    num = expireIndexGetSomeKeys(db,samples,
+                                 ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP,0);
+    for (j = 0; j < num; j++) {
+        long long ttl = getEntryExpire(samples[j])-now;
+
+        if (ttl > 0) {
+            /* We want the average TTL of keys yet not expired. */
+            ttl_sum += ttl;
+            ttl_samples++;
+        }
+    }
+
+    if (ttl_samples) {
+        long long avg_ttl = ttl_sum/ttl_samples;
+
+        if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
+        db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
+    }
+}
+
+/* Delete the keys that are due, walking the expiry index of each DB
+ * (db->expires_index) that keeps the volatile keys ordered by expire time.
+ * Instead of sampling random keys, only the keys that actually expired are
+ * visited, so long TTL keys cost nothing and short TTL keys are reclaimed
+ * as soon as the cycle runs.
  *
  * No more than CRON_DBS_PER_CALL databases are tested at every
  * iteration.
@@ -92,7 +153,7 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
  *
  * If type is ACTIVE_EXPIRE_CYCLE_SLOW, that normal expire cycle is
  * executed, where the time limit is a percentage of the REDIS_HZ period
- * as specified by the ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC define. */
+ * as specified by the active-expire-cycle-max configuration. */
 
 void activeExpireCycle(int type) {
     /* This function has some global state in order to continue the work
@@ -103,7 +164,7 @@ void activeExpireCycle(int type) {
 
     int j, iteration = 0;
     int dbs_per_call = CRON_DBS_PER_CALL;
-    long long start = ustime(), timelimit;
+    long long start = ustime(), timelimit, elapsed;
 
     /* When clients are paused the dataset should be static not just from the
      * POV of clients not being able to write, but also from the POV of
@@ -129,96 +190,82 @@ void activeExpireCycle(int type) {
     if (dbs_per_call > server.dbnum || timelimit_exit)
         dbs_per_call = server.dbnum;
 
-    /* We can use at max ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC percentage of CPU time
+    /* We can use at max active-expire-cycle-max percentage of CPU time
      * per iteration. Since this function gets called with a frequency of
      * server.hz times per second, the following is the max amount of
      * microseconds we can spend in this function. */
-    timelimit = 1000000*ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC/server.hz/100;
+    timelimit = 1000000*server.active_expire_cycle_max/server.hz/100;
     timelimit_exit = 0;
     if (timelimit <= 0) timelimit = 1;
 
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
         timelimit = ACTIVE_EXPIRE_CYCLE_FAST_DURATION; /* in microseconds. */
 
-    for (j = 0; j < dbs_per_call; j++) {
-        int expired;
+    for (j = 0; j < dbs_per_call && !timelimit_exit; j++) {
         redisDb *db = server.db+(current_db % server.dbnum);
+        long long now = mstime();
 
         /* Increment the DB now so we are sure if we run out of time
          * in the current DB we'll restart from the next. This allows to
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle more than 25%
-         * of the keys were expired. */
-        do {
-            unsigned long num, slots;
-            long long now, ttl_sum;
-            int ttl_samples;
-
-            /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
-                db->avg_ttl = 0;
-                break;
-            }
-            slots = dictSlots(db->expires);
-            now = mstime();
-
-            /* When there are less than 1% filled slots getting random
-             * keys is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
-            /* The main collection cycle. Sample random keys among keys
-             * with an expire set, checking for expired ones. */
-            expired = 0;
-            ttl_sum = 0;
-            ttl_samples = 0;
-
-            if (num > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP)
-                num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
-
-            while (num--) {
-                dictEntry *de;
-                long long ttl;
-
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
-                ttl = dictGetSignedIntegerVal(de)-now;
-                if (activeExpireCycleTryExpire(db,de,now)) expired++;
-                if (ttl > 0) {
-                    /* We want the average TTL of keys yet not expired. */
-                    ttl_sum += ttl;
-                    ttl_samples++;
-                }
-            }
+        /* If there is nothing to expire try next DB ASAP. */
+        if (dbExpiresCount(db) == 0) {
+            db->avg_ttl = 0;
+            continue;
+        }
 
-            /* Update the average TTL stats for this database. */
-            if (ttl_samples) {
-                long long avg_ttl = ttl_sum/ttl_samples;
-
-                /* Do a simple running average with a few samples.
-                 * We just use the current estimate with a weight of 2%
-                 * and the previous estimate with a weight of 98%. */
-                if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
-                db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
-            }
+        /* The main collection cycle: move the keys that expired since the
+         * last call out of the heap, then delete the due keys. */
+        expireIndexAdvance(db->expires_index,now);
+        while (db->expires_index->due_len > 0) {
+            expireIndex *ei = db->expires_index;
+            unsigned long due = ei->due_len;
+            dictEntry *de = ei->due[due-1];
+            robj *keyobj;
+
+            keyobj = createStringObject(dictGetKey(de),
+                                        sdslen(dictGetKey(de)));
+            activeExpireKey(db,keyobj);
+            decrRefCount(keyobj);
+            /* Deleting the key must remove its element: the index only
+             * references entries of the main dict. */
+            serverAssert(db->expires_index->due_len < due);
 
             /* We can't block forever here even if there are many keys to
-             * expire. So after a given amount of milliseconds return to the
+             * expire. So after a given amount of microseconds return to the
              * caller waiting for the other active expire cycle. */
             iteration++;
             if ((iteration & 0xf) == 0) { /* check once every 16 iterations. */
-                long long elapsed = ustime()-start;
-
-                latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
-                if (elapsed > timelimit) timelimit_exit = 1;
+                if (ustime()-start > timelimit) {
+                    timelimit_exit = 1;
+                    break;
+                }
             }
-            if (timelimit_exit) return;
-            /* We don't repeat the cycle if there are less than 25% of keys
-             * found expired in the current DB. */
-        } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4);
+        }
+        activeExpireUpdateAvgTTL(db,now);
+    }
+
+    elapsed = ustime()-start;
+    latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
+    server.stat_expire_cycle_time_used += elapsed;
+    if (timelimit_exit) server.stat_expired_time_cap_reached_count++;
+}
+
+/* Return the number of keys that are already expired but still present
+ * (on slaves, or when the active cycle can't keep up). The expired keys
+ * are moved to the due array of the index, so this is just its length. */
+unsigned long long countPendingExpires(void) {
+    unsigned long long pending = 0;
+    long long now = mstime();
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        expireIndexAdvance(server.db[j].expires_index,now);
+        pending += server.db[j].expires_index->due_len;
     }
+    return pending;
 }
 
 /*-----------------------------------------------------------------------------
@@ -278,9 +325,12 @@ void expireSlaveKeys(void) {
         while(dbids && dbid < server.dbnum) {
             if ((dbids & 1) != 0) {
                 redisDb *db = server.db+dbid;
-                dictEntry *expire = dictFind(db->expires,keyname);
+                dictEntry *expire = dictFind(db->dict,keyname);
                 int expired = 0;
 
+                /* Only the keys that are still volatile count. */
+                if (expire && getEntryExpire(expire) == -1) expire = NULL;
+
                 if (expire &&
                     activeExpireCycleTryExpire(server.db+dbid,expire,start))
                 {
@@ -35,6 +35,14 @@
 #include "zmalloc.h"
 #include "endianconv.h"
 
+/* The vectorized search kernels are only built on x86-64, which is little
+ * endian, so the contents array can be loaded as is without memrev. */
+#if defined(__x86_64__) && defined(__GNUC__) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_INTSET_SIMD 1
+#include <immintrin.h>
+#endif
+
 /* Note that these encodings are ordered, so:
  * INTSET_ENC_INT16 < INTSET_ENC_INT32 < INTSET_ENC_INT64. */
 #define INTSET_ENC_INT16 (sizeof(int16_t))
@@ -112,6 +120,124 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* Once binary search narrowed the range to at most this many bytes of
+ * contents, the position is found with a branch-free scan of the window. */
+#define INTSET_SEARCH_WINDOW 128
+
+/* A rank kernel returns the number of elements in [lo,hi) smaller than
+ * "value" plus lo, that is the lower bound of "value" in that range. Since
+ * the contents are sorted, counting with vector compares needs no branch
+ * per element. */
+typedef uint32_t intsetRankProc(intset *is, uint32_t lo, uint32_t hi, int64_t value);
+
+static uint32_t intsetRankScalar(intset *is, uint32_t lo, uint32_t hi, int64_t value) {
+    while (lo < hi && _intsetGet(is,lo) < value) lo++;
+    return lo;
+}
+
+#ifdef HAVE_INTSET_SIMD
+/* _mm_cmpgt_epi64 needs SSE4.2, 16 and 32 bit compares are plain SSE2. */
+__attribute__((target("sse4.2,popcnt")))
+static uint32_t intsetRankSSE42(intset *is, uint32_t lo, uint32_t hi, int64_t value) {
+    uint32_t enc = intrev32ifbe(is->encoding), i = lo, count = 0;
+
+    if (enc == INTSET_ENC_INT16) {
+        const int16_t *a = (const int16_t*)is->contents;
+        __m128i v = _mm_set1_epi16((int16_t)value);
+        for (; i+8 <= hi; i += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi16(v,x)))>>1;
+        }
+        for (; i < hi; i++) count += a[i] < value;
+    } else if (enc == INTSET_ENC_INT32) {
+        const int32_t *a = (const int32_t*)is->contents;
+        __m128i v = _mm_set1_epi32((int32_t)value);
+        for (; i+4 <= hi; i += 4) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi32(v,x)))>>2;
+        }
+        for (; i < hi; i++) count += a[i] < value;
+    } else {
+        const int64_t *a = (const int64_t*)is->contents;
+        __m128i v = _mm_set1_epi64x(value);
+        for (; i+2 <= hi; i += 2) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi64(v,x)))>>3;
+        }
+        for (; i < hi; i++) count += a[i] < value;
+    }
+    return lo+count;
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint32_t intsetRankAVX2(intset *is, uint32_t lo, uint32_t hi, int64_t value) {
+    uint32_t enc = intrev32ifbe(is->encoding), i = lo, count = 0;
+
+    if (enc == INTSET_ENC_INT16) {
+        const int16_t *a = (const int16_t*)is->contents;
+        __m256i v = _mm256_set1_epi16((int16_t)value);
+        for (; i+16 <= hi; i += 16) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(a+i));
+            count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi16(v,x)))>>1;
+        }
+        for (; i < hi; i++) count += a[i] < value;
+    } else if (enc == INTSET_ENC_INT32) {
+        const int32_t *a = (const int32_t*)is->contents;
+        __m256i v = _mm256_set1_epi32((int32_t)value);
+        for (; i+8 <= hi; i += 8) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(a+i));
+            count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi32(v,x)))>>2;
+        }
+        for (; i < hi; i++) count += a[i] < value;
+    } else {
+        const int64_t *a = (const int64_t*)is->contents;
+        __m256i v = _mm256_set1_epi64x(value);
+        for (; i+4 <= hi; i += 4) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(a+i));
+            count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi64(v,x)))>>3;
+        }
+        for (; i < hi; i++) count += a[i] < value;
+    }
+    return lo+count;
+}
+#endif
+
+/* Kernel selected at first use according to the running CPU. With the
+ * scalar kernel the window is zero, so the search is a plain binary search. */
+static intsetRankProc *intsetRank = NULL;
+static uint32_t intsetSearchWindow = 0;
+
+#define INTSET_KERNEL_SCALAR 0
+#define INTSET_KERNEL_SSE42 1
+#define INTSET_KERNEL_AVX2 2
+
+/* Select the given kernel, or the best one the CPU supports when -1 is
+ * passed. Returns the kernel actually selected. */
+static int intsetSelectRankKernel(int kernel) {
+#ifdef HAVE_INTSET_SIMD
+    __builtin_cpu_init();
+    if (kernel == -1) {
+        if (__builtin_cpu_supports("avx2")) kernel = INTSET_KERNEL_AVX2;
+        else if (__builtin_cpu_supports("sse4.2")) kernel = INTSET_KERNEL_SSE42;
+        else kernel = INTSET_KERNEL_SCALAR;
+    }
+    if (kernel == INTSET_KERNEL_AVX2 && __builtin_cpu_supports("avx2")) {
+        intsetRank = intsetRankAVX2;
+        intsetSearchWindow = INTSET_SEARCH_WINDOW;
+        return kernel;
+    } else if (kernel == INTSET_KERNEL_SSE42 && __builtin_cpu_supports("sse4.2")) {
+        intsetRank = intsetRankSSE42;
+        intsetSearchWindow = INTSET_SEARCH_WINDOW;
+        return kernel;
+    }
+#else
+    ((void) kernel);
+#endif
+    intsetRank = intsetRankScalar;
+    intsetSearchWindow = 0;
+    return INTSET_KERNEL_SCALAR;
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
@@ -123,6 +249,9 @@ static intset *intsetResize(intset *is, uint32_t len) {
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
     int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
     int64_t cur = -1;
+    uint32_t window;
+
+    if (intsetRank == NULL) intsetSelectRankKernel(-1);
 
     /* The value can never be found when the set is empty */
     /* 如果集合为空，返回0 */
@@ -144,8 +273,9 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
-    /* 有序集合，使用二分查找 */
-    while(max >= min) {
+    /* 有序集合，使用二分查找，范围缩小到窗口大小后交给向量化的 rank 函数 */
+    window = intsetSearchWindow/intrev32ifbe(is->encoding);
+    while(max >= min && (uint32_t)(max-min+1) > window) {
         mid = ((unsigned int)min + (unsigned int)max) >> 1;
         cur = _intsetGet(is,mid);
         if (value > cur) {
@@ -157,14 +287,23 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
+    /* 二分查找未找到 */
+    if (max < min) {
+        if (pos) *pos = min;
+        return 0;
+    }
+
     /* 找到后，返回1，并设置pos（如果pos不为NULL） */
-    if (value == cur) {
+    if ((uint32_t)(max-min+1) > window) {
         if (pos) *pos = mid;
         return 1;
-    } else {
-        if (pos) *pos = min;
-        return 0;
     }
+
+    /* The value lies within the [min,max] window: its lower bound there is
+     * either its own position or the position where it can be inserted. */
+    mid = intsetRank(is,min,max+1,value);
+    if (pos) *pos = mid;
+    return mid <= max && _intsetGet(is,mid) == value;
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -365,6 +504,23 @@ static intset *createSet(int bits, int size) {
     return is;
 }
 
+/* Random value that needs up to 'bits' bits plus the sign. */
+static int64_t randomSigned(int bits) {
+    uint64_t v = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ rand();
+    v &= ((uint64_t)1 << bits)-1;
+    return (rand() & 1) ? -(int64_t)v : (int64_t)v;
+}
+
+static intset *createSignedSet(int bits, int size) {
+    intset *is = intsetNew();
+
+    /* Force the encoding with the largest value of the given width. */
+    is = intsetAdd(is,(int64_t)(((uint64_t)1 << bits)-1),NULL);
+    while ((int)intrev32ifbe(is->length) < size)
+        is = intsetAdd(is,randomSigned(bits),NULL);
+    return is;
+}
+
 static void checkConsistency(intset *is) {
     for (uint32_t i = 0; i < (intrev32ifbe(is->length)-1); i++) {
         uint32_t encoding = intrev32ifbe(is->encoding);
@@ -505,6 +661,63 @@ int intsetTest(int argc, char **argv) {
                num,size,usec()-start);
     }
 
+    printf("Search kernels agree with binary search: "); {
+        int sizes[] = {1,7,63,64,65,200,512,4000};
+        int bits[] = {15,31,63};
+        int kernel, b, z, j;
+
+        for (kernel = INTSET_KERNEL_SSE42; kernel <= INTSET_KERNEL_AVX2; kernel++) {
+            if (intsetSelectRankKernel(kernel) != kernel) continue;
+            for (b = 0; b < 3; b++) {
+                for (z = 0; z < 8; z++) {
+                    is = createSignedSet(bits[b],sizes[z]);
+                    for (j = 0; j < 2000; j++) {
+                        int64_t v = (j & 1) ? randomSigned(bits[b]) :
+                            _intsetGet(is,rand() % intrev32ifbe(is->length));
+                        uint32_t p1, p2;
+                        uint8_t f1, f2;
+
+                        intsetSelectRankKernel(kernel);
+                        f1 = intsetSearch(is,v,&p1);
+                        intsetSelectRankKernel(INTSET_KERNEL_SCALAR);
+                        f2 = intsetSearch(is,v,&p2);
+                        assert(f1 == f2 && p1 == p2);
+                    }
+                    zfree(is);
+                }
+            }
+        }
+        intsetSelectRankKernel(-1);
+        ok();
+    }
+
+    printf("Benchmark search kernels (512 elements, 1000000 lookups):\n"); {
+        char *names[] = {"scalar","sse4.2","avx2"};
+        int bits[] = {15,31,63};
+        int kernel, b, j;
+        long long start;
+
+        for (b = 0; b < 3; b++) {
+            int64_t probes[1024];
+
+            is = createSignedSet(bits[b],512);
+            for (j = 0; j < 1024; j++)
+                probes[j] = (j & 1) ? randomSigned(bits[b]) :
+                    _intsetGet(is,rand() % intrev32ifbe(is->length));
+            for (kernel = INTSET_KERNEL_SCALAR; kernel <= INTSET_KERNEL_AVX2; kernel++) {
+                if (intsetSelectRankKernel(kernel) != kernel) continue;
+                start = usec();
+                for (j = 0; j < 1000000; j++)
+                    intsetSearch(is,probes[j & 1023],NULL);
+                printf("  int%d %-6s: %lldusec\n",
+                    (int)intrev32ifbe(is->encoding)*8,names[kernel],
+                    usec()-start);
+            }
+            zfree(is);
+        }
+        intsetSelectRankKernel(-1);
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
@@ -29,7 +29,9 @@ size_t lazyfreeGetPendingObjectsCount(void) {
  * For lists the funciton returns the number of elements in the quicklist
  * representing the list. */
 size_t lazyfreeGetFreeEffort(robj *obj) {
-    if (obj->type == OBJ_LIST) {
+    if (obj->encoding == OBJ_ENCODING_MAPPED) {
+        return 1; /* Not yet loaded from the mapped RDB file. */
+    } else if (obj->type == OBJ_LIST) {
         quicklist *ql = obj->ptr;
         return ql->len;
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
@@ -52,9 +54,9 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    rdbSnapshotTouchKey(db,key->ptr);
+    /* The expire lives in the entry: only the index element must go. */
+    if (dbExpiresCount(db) > 0) dbDeleteExpire(db,key);
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
@@ -64,6 +66,8 @@ int dbAsyncDelete(redisDb *db, robj *key) {
         robj *val = dictGetVal(de);
         size_t free_effort = lazyfreeGetFreeEffort(val);
 
+        hllUnionCacheForget(val);
+
         /* If releasing the object is too much work, let's put it into the
          * lazy free list. */
         if (free_effort > LAZYFREE_THRESHOLD) {
@@ -88,11 +92,12 @@ int dbAsyncDelete(redisDb *db, robj *key) {
  * create a new empty set of hash tables and scheduling the old ones for
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
-    dict *oldht1 = db->dict, *oldht2 = db->expires;
+    dict *oldht = db->dict;
+    expireIndex *oldindex = db->expires_index;
     db->dict = dictCreate(&dbDictType,NULL);
-    db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+    db->expires_index = expireIndexCreate();
+    atomicIncr(lazyfree_objects,dictSize(oldht));
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht,oldindex);
 }
 
 /* Empty the slots-keys map of Redis CLuster by creating a new empty one
@@ -119,10 +124,10 @@ void lazyfreeFreeObjectFromBioThread(robj *o) {
  * when the database was logically deleted. 'sl' is a skiplist used by
  * Redis Cluster in order to take the hash slots -> keys mapping. This
  * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
-    dictRelease(ht2);
+void lazyfreeFreeDatabaseFromBioThread(dict *ht, expireIndex *index) {
+    size_t numkeys = dictSize(ht);
+    dictRelease(ht);
+    expireIndexRelease(index);
     atomicDecr(lazyfree_objects,numkeys);
 }
 
@@ -0,0 +1,1154 @@
+/* Listpack -- A lists of strings serialization format
+ *
+ * Copyright (c) 2017, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A listpack is a compact serialization of a list of strings and integers,
+ * designed as a replacement of the ziplist. The layout is:
+ *
+ * <total-bytes> <num-elements> <element-1> ... <element-N> <end-byte>
+ *
+ * <total-bytes> is a 32 bit unsigned integer and <num-elements> a 16 bit
+ * unsigned integer, both little endian. When the number of elements does
+ * not fit 16 bits it is set to 65535 and lpLength() counts the elements
+ * by scanning the listpack. <end-byte> is always 0xFF.
+ *
+ * Every element is stored as:
+ *
+ * <encoding-type><element-data><element-tot-len>
+ *
+ * The difference with the ziplist is that the length field is stored at
+ * the *end* of the element and only refers to the element itself, instead
+ * of being the length of the previous entry stored at the start of the
+ * next one. Inserting or deleting an entry never changes the encoding of
+ * its neighbours, so there is nothing like the ziplist cascading update:
+ * every write is a single memmove().
+ *
+ * <element-tot-len> is the size of <encoding-type> + <element-data>,
+ * stored as a variable length number of 1 to 5 bytes, read right to left:
+ * every byte carries 7 bits and the most significant bit is set when more
+ * bytes follow (to the left). This allows to jump to the previous element
+ * starting from the first byte of the current one.
+ *
+ * Encodings:
+ *
+ * 0xxxxxxx                              7 bit unsigned integer.
+ * 10xxxxxx                              string of up to 63 bytes.
+ * 110xxxxx yyyyyyyy                     13 bit signed integer.
+ * 1110xxxx yyyyyyyy                     string of up to 4095 bytes.
+ * 11110001 <2 bytes>                    16 bit signed integer.
+ * 11110010 <3 bytes>                    24 bit signed integer.
+ * 11110011 <4 bytes>                    32 bit signed integer.
+ * 11110100 <8 bytes>                    64 bit signed integer.
+ * 11110000 <4 bytes len>                string of up to 2^32-1 bytes.
+ * 11111111                              end of listpack.
+ *
+ * Multi byte integers and lengths are little endian, negative integers are
+ * stored in two's complement on the number of bits of the encoding.
+ *
+ * 紧凑列表：每个元素尾部保存自身长度，插入/删除不会引起连锁更新 */
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "listpack.h"
+#include "listpack_malloc.h"
+#include "util.h"
+
+/* SSE2 is part of the x86-64 baseline, so it needs no runtime dispatch. */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_LP_SSE2 1
+#endif
+
+#define LP_HDR_SIZE 6       /* 32 bit total len + 16 bit number of elements. */
+#define LP_HDR_NUMELE_UNKNOWN UINT16_MAX
+#define LP_MAX_INT_ENCODING_LEN 9
+#define LP_MAX_BACKLEN_SIZE 5
+#define LP_MAX_ENTRY_BACKLEN 34359738367ULL
+#define LP_ENCODING_INT 0
+#define LP_ENCODING_STRING 1
+
+#define LP_ENCODING_7BIT_UINT 0
+#define LP_ENCODING_7BIT_UINT_MASK 0x80
+#define LP_ENCODING_IS_7BIT_UINT(byte) (((byte)&LP_ENCODING_7BIT_UINT_MASK)==LP_ENCODING_7BIT_UINT)
+
+#define LP_ENCODING_6BIT_STR 0x80
+#define LP_ENCODING_6BIT_STR_MASK 0xC0
+#define LP_ENCODING_IS_6BIT_STR(byte) (((byte)&LP_ENCODING_6BIT_STR_MASK)==LP_ENCODING_6BIT_STR)
+
+#define LP_ENCODING_13BIT_INT 0xC0
+#define LP_ENCODING_13BIT_INT_MASK 0xE0
+#define LP_ENCODING_IS_13BIT_INT(byte) (((byte)&LP_ENCODING_13BIT_INT_MASK)==LP_ENCODING_13BIT_INT)
+
+#define LP_ENCODING_12BIT_STR 0xE0
+#define LP_ENCODING_12BIT_STR_MASK 0xF0
+#define LP_ENCODING_IS_12BIT_STR(byte) (((byte)&LP_ENCODING_12BIT_STR_MASK)==LP_ENCODING_12BIT_STR)
+
+#define LP_ENCODING_16BIT_INT 0xF1
+#define LP_ENCODING_24BIT_INT 0xF2
+#define LP_ENCODING_32BIT_INT 0xF3
+#define LP_ENCODING_64BIT_INT 0xF4
+#define LP_ENCODING_32BIT_STR 0xF0
+#define LP_EOF 0xFF
+
+#define LP_ENCODING_6BIT_STR_LEN(p) ((p)[0] & 0x3F)
+#define LP_ENCODING_12BIT_STR_LEN(p) ((((p)[0] & 0xF) << 8) | (p)[1])
+#define LP_ENCODING_32BIT_STR_LEN(p) (((uint32_t)(p)[1]<<0) | \
+                                      ((uint32_t)(p)[2]<<8) | \
+                                      ((uint32_t)(p)[3]<<16) | \
+                                      ((uint32_t)(p)[4]<<24))
+
+#define lpGetTotalBytes(p)           (((uint32_t)(p)[0]<<0) | \
+                                      ((uint32_t)(p)[1]<<8) | \
+                                      ((uint32_t)(p)[2]<<16) | \
+                                      ((uint32_t)(p)[3]<<24))
+
+#define lpGetNumElements(p)          (((uint32_t)(p)[4]<<0) | \
+                                      ((uint32_t)(p)[5]<<8))
+#define lpSetTotalBytes(p,v) do { \
+    (p)[0] = (v)&0xff; \
+    (p)[1] = ((v)>>8)&0xff; \
+    (p)[2] = ((v)>>16)&0xff; \
+    (p)[3] = ((v)>>24)&0xff; \
+} while(0)
+
+#define lpSetNumElements(p,v) do { \
+    (p)[4] = (v)&0xff; \
+    (p)[5] = ((v)>>8)&0xff; \
+} while(0)
+
+/* Create a new, empty listpack.
+ * On success the new listpack is returned, otherwise NULL. */
+unsigned char *lpNew(void) {
+    unsigned char *lp = lp_malloc(LP_HDR_SIZE+1);
+    if (lp == NULL) return NULL;
+    lpSetTotalBytes(lp,LP_HDR_SIZE+1);
+    lpSetNumElements(lp,0);
+    lp[LP_HDR_SIZE] = LP_EOF;
+    return lp;
+}
+
+/* Free the specified listpack. */
+void lpFree(unsigned char *lp) {
+    lp_free(lp);
+}
+
+/* Given an element 'ele' of size 'size', determine if the element can be
+ * represented inside the listpack encoded as integer, and returns
+ * LP_ENCODING_INT if so. Otherwise returns LP_ENCODING_STRING if no integer
+ * encoding is possible.
+ *
+ * If the LP_ENCODING_INT is returned, the function stores the integer
+ * encoded representation of the element in the 'intenc' buffer.
+ *
+ * Regardless of the returned encoding, 'enclen' is populated by reference
+ * to the number of bytes that the string or integer encoded element will
+ * require in order to be represented. */
+static int lpEncodeGetType(unsigned char *ele, uint32_t size, unsigned char *intenc, uint64_t *enclen) {
+    long long v;
+    if (size <= 20 && string2ll((char*)ele,size,&v)) {
+        if (v >= 0 && v <= 127) {
+            /* Single byte 0-127 integer. */
+            intenc[0] = v;
+            *enclen = 1;
+        } else if (v >= -4096 && v <= 4095) {
+            /* 13 bit integer. */
+            if (v < 0) v = ((int64_t)1<<13)+v;
+            intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
+            intenc[1] = v&0xff;
+            *enclen = 2;
+        } else if (v >= -32768 && v <= 32767) {
+            /* 16 bit integer. */
+            if (v < 0) v = ((int64_t)1<<16)+v;
+            intenc[0] = LP_ENCODING_16BIT_INT;
+            intenc[1] = v&0xff;
+            intenc[2] = v>>8;
+            *enclen = 3;
+        } else if (v >= -8388608 && v <= 8388607) {
+            /* 24 bit integer. */
+            if (v < 0) v = ((int64_t)1<<24)+v;
+            intenc[0] = LP_ENCODING_24BIT_INT;
+            intenc[1] = v&0xff;
+            intenc[2] = (v>>8)&0xff;
+            intenc[3] = v>>16;
+            *enclen = 4;
+        } else if (v >= -2147483648LL && v <= 2147483647LL) {
+            /* 32 bit integer. */
+            if (v < 0) v = ((int64_t)1<<32)+v;
+            intenc[0] = LP_ENCODING_32BIT_INT;
+            intenc[1] = v&0xff;
+            intenc[2] = (v>>8)&0xff;
+            intenc[3] = (v>>16)&0xff;
+            intenc[4] = v>>24;
+            *enclen = 5;
+        } else {
+            /* 64 bit integer. */
+            uint64_t uv = v;
+            intenc[0] = LP_ENCODING_64BIT_INT;
+            intenc[1] = uv&0xff;
+            intenc[2] = (uv>>8)&0xff;
+            intenc[3] = (uv>>16)&0xff;
+            intenc[4] = (uv>>24)&0xff;
+            intenc[5] = (uv>>32)&0xff;
+            intenc[6] = (uv>>40)&0xff;
+            intenc[7] = (uv>>48)&0xff;
+            intenc[8] = uv>>56;
+            *enclen = 9;
+        }
+        return LP_ENCODING_INT;
+    } else {
+        if (size < 64) *enclen = 1+size;
+        else if (size < 4096) *enclen = 2+size;
+        else *enclen = 5+(uint64_t)size;
+        return LP_ENCODING_STRING;
+    }
+}
+
+/* Store a reverse-encoded variable length field, representing the length
+ * of the previous element of size 'l', in the target buffer 'buf'.
+ * The function returns the number of bytes used to encode it, from
+ * 1 to 5. If 'buf' is NULL the function just returns the number of bytes
+ * needed in order to encode the backlen. */
+static unsigned long lpEncodeBacklen(unsigned char *buf, uint64_t l) {
+    if (l <= 127) {
+        if (buf) buf[0] = l;
+        return 1;
+    } else if (l < 16383) {
+        if (buf) {
+            buf[0] = l>>7;
+            buf[1] = (l&127)|128;
+        }
+        return 2;
+    } else if (l < 2097151) {
+        if (buf) {
+            buf[0] = l>>14;
+            buf[1] = ((l>>7)&127)|128;
+            buf[2] = (l&127)|128;
+        }
+        return 3;
+    } else if (l < 268435455) {
+        if (buf) {
+            buf[0] = l>>21;
+            buf[1] = ((l>>14)&127)|128;
+            buf[2] = ((l>>7)&127)|128;
+            buf[3] = (l&127)|128;
+        }
+        return 4;
+    } else {
+        if (buf) {
+            buf[0] = l>>28;
+            buf[1] = ((l>>21)&127)|128;
+            buf[2] = ((l>>14)&127)|128;
+            buf[3] = ((l>>7)&127)|128;
+            buf[4] = (l&127)|128;
+        }
+        return 5;
+    }
+}
+
+/* Decode the backlen and returns it. If the encoding looks invalid (more than
+ * 5 bytes are used), UINT64_MAX is returned to report the problem. 'p'
+ * points to the last byte of the backlen. */
+static uint64_t lpDecodeBacklen(unsigned char *p) {
+    uint64_t val = 0;
+    uint64_t shift = 0;
+    do {
+        val |= (uint64_t)(p[0] & 127) << shift;
+        if (!(p[0] & 128)) break;
+        shift += 7;
+        p--;
+        if (shift > 28) return UINT64_MAX;
+    } while(1);
+    return val;
+}
+
+/* Encode the string element pointed by 's' of size 'len' in the target
+ * buffer 'buf'. The function should be called with 'buf' having always
+ * enough space for encoding the string. This is done by calling
+ * lpEncodeGetType() before calling this function. */
+static void lpEncodeString(unsigned char *buf, unsigned char *s, uint32_t len) {
+    if (len < 64) {
+        buf[0] = len | LP_ENCODING_6BIT_STR;
+        memcpy(buf+1,s,len);
+    } else if (len < 4096) {
+        buf[0] = (len >> 8) | LP_ENCODING_12BIT_STR;
+        buf[1] = len & 0xff;
+        memcpy(buf+2,s,len);
+    } else {
+        buf[0] = LP_ENCODING_32BIT_STR;
+        buf[1] = len & 0xff;
+        buf[2] = (len >> 8) & 0xff;
+        buf[3] = (len >> 16) & 0xff;
+        buf[4] = (len >> 24) & 0xff;
+        memcpy(buf+5,s,len);
+    }
+}
+
+/* Return the encoded length of the listpack element pointed by 'p'. This
+ * includes the encoding byte, length bytes, and the element data itself,
+ * but not the backlen. If the element encoding is wrong then 0 is
+ * returned. */
+static uint32_t lpCurrentEncodedSize(unsigned char *p) {
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) return 1;
+    if (LP_ENCODING_IS_6BIT_STR(p[0])) return 1+LP_ENCODING_6BIT_STR_LEN(p);
+    if (LP_ENCODING_IS_13BIT_INT(p[0])) return 2;
+    if (p[0] == LP_ENCODING_16BIT_INT) return 3;
+    if (p[0] == LP_ENCODING_24BIT_INT) return 4;
+    if (p[0] == LP_ENCODING_32BIT_INT) return 5;
+    if (p[0] == LP_ENCODING_64BIT_INT) return 9;
+    if (LP_ENCODING_IS_12BIT_STR(p[0])) return 2+LP_ENCODING_12BIT_STR_LEN(p);
+    if (p[0] == LP_ENCODING_32BIT_STR) return 5+LP_ENCODING_32BIT_STR_LEN(p);
+    if (p[0] == LP_EOF) return 1;
+    return 0;
+}
+
+/* Skip the current entry returning the next. It is invalid to call this
+ * function if the current element is the EOF element at the end of the
+ * listpack, however, while this function is used to implement lpNext(),
+ * it does not return NULL when the EOF element is encountered. */
+static unsigned char *lpSkip(unsigned char *p) {
+    unsigned long entrylen = lpCurrentEncodedSize(p);
+    entrylen += lpEncodeBacklen(NULL,entrylen);
+    p += entrylen;
+    return p;
+}
+
+/* If 'p' points to an element of the listpack, calling lpNext() will return
+ * the pointer to the next element (the one on the right), or NULL if 'p'
+ * already pointed to the last element of the listpack. */
+unsigned char *lpNext(unsigned char *lp, unsigned char *p) {
+    ((void) lp); /* lp is not used for now. However lpPrev() uses it. */
+    p = lpSkip(p);
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* If 'p' points to an element of the listpack, calling lpPrev() will return
+ * the pointer to the previous element (the one on the left), or NULL if 'p'
+ * already pointed to the first element of the listpack. */
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p) {
+    if (p-lp == LP_HDR_SIZE) return NULL;
+    p--; /* Seek the first backlen byte of the last element. */
+    uint64_t prevlen = lpDecodeBacklen(p);
+    prevlen += lpEncodeBacklen(NULL,prevlen);
+    return p-prevlen+1; /* Seek the first byte of the previous entry. */
+}
+
+/* Return a pointer to the first element of the listpack, or NULL if the
+ * listpack has no elements. */
+unsigned char *lpFirst(unsigned char *lp) {
+    unsigned char *p = lp + LP_HDR_SIZE; /* Skip the header. */
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* Return a pointer to the last element of the listpack, or NULL if the
+ * listpack has no elements. */
+unsigned char *lpLast(unsigned char *lp) {
+    unsigned char *p = lp+lpGetTotalBytes(lp)-1; /* Seek EOF element. */
+    return lpPrev(lp,p); /* Will return NULL if EOF is the only element. */
+}
+
+/* Return the number of elements inside the listpack. This function attempts
+ * to use the cached value when within range, otherwise a full scan is
+ * needed. As a side effect of calling this function, the listpack header
+ * could be modified, because if the count is found to be already within
+ * the 'numele' header field range, the new value is set. */
+unsigned long lpLength(unsigned char *lp) {
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) return numele;
+
+    /* Too many elements inside the listpack. We need to scan in order
+     * to get the total number. */
+    uint32_t count = 0;
+    unsigned char *p = lpFirst(lp);
+    while(p) {
+        count++;
+        p = lpNext(lp,p);
+    }
+
+    /* If the count is again within range of the header numele field,
+     * set it. */
+    if (count < LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp,count);
+    return count;
+}
+
+/* Return the listpack element pointed by 'p'. Like ziplistGet() the
+ * function returns the string pointer, setting its length in '*slen', when
+ * the element is a string, or NULL if it is an integer, setting its value
+ * in '*lval'. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    int64_t val;
+    uint64_t uval, negstart, negmax;
+
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) {
+        negstart = UINT64_MAX; /* 7 bit ints are always positive. */
+        negmax = 0;
+        uval = p[0] & 0x7f;
+    } else if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+        *slen = LP_ENCODING_6BIT_STR_LEN(p);
+        return p+1;
+    } else if (LP_ENCODING_IS_13BIT_INT(p[0])) {
+        uval = ((p[0]&0x1f)<<8) | p[1];
+        negstart = (uint64_t)1<<12;
+        negmax = 8191;
+    } else if (p[0] == LP_ENCODING_16BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8;
+        negstart = (uint64_t)1<<15;
+        negmax = UINT16_MAX;
+    } else if (p[0] == LP_ENCODING_24BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16;
+        negstart = (uint64_t)1<<23;
+        negmax = UINT32_MAX>>8;
+    } else if (p[0] == LP_ENCODING_32BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24;
+        negstart = (uint64_t)1<<31;
+        negmax = UINT32_MAX;
+    } else if (p[0] == LP_ENCODING_64BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24 |
+               (uint64_t)p[5]<<32 |
+               (uint64_t)p[6]<<40 |
+               (uint64_t)p[7]<<48 |
+               (uint64_t)p[8]<<56;
+        negstart = (uint64_t)1<<63;
+        negmax = UINT64_MAX;
+    } else if (LP_ENCODING_IS_12BIT_STR(p[0])) {
+        *slen = LP_ENCODING_12BIT_STR_LEN(p);
+        return p+2;
+    } else if (p[0] == LP_ENCODING_32BIT_STR) {
+        *slen = LP_ENCODING_32BIT_STR_LEN(p);
+        return p+5;
+    } else {
+        uval = 12345678900000000ULL + p[0];
+        negstart = UINT64_MAX;
+        negmax = 0;
+    }
+
+    /* We reach this code path only for integer encodings.
+     * Convert the unsigned value to the signed one using two's complement
+     * rule. */
+    if (uval >= negstart) {
+        /* This three steps conversion should avoid undefined behaviors
+         * in the unsigned -> signed conversion. */
+        uval = negmax-uval;
+        val = uval;
+        val = -val-1;
+    } else {
+        val = uval;
+    }
+    *lval = val;
+    return NULL;
+}
+
+/* Insert, delete or replace the specified element 'ele' of length 'size' at
+ * the specified position 'p', with 'p' being a listpack element pointer
+ * obtained with lpFirst(), lpLast(), lpNext(), lpPrev() or lpSeek().
+ *
+ * The element is inserted before, after, or replaces the element pointed
+ * by 'p' depending on the 'where' argument, that can be LP_BEFORE, LP_AFTER
+ * or LP_REPLACE.
+ *
+ * If 'ele' is set to NULL, the function removes the element pointed by 'p'
+ * instead of inserting one.
+ *
+ * Returns NULL on out of memory or when the listpack total length would
+ * exceed the max allowed size of 2^32-1, otherwise the new pointer to the
+ * listpack holding the new element is returned (and the old pointer passed
+ * is no longer considered valid)
+ *
+ * If 'newp' is not NULL, at the end of a successful call '*newp' will be set
+ * to the address of the element just added, so that it will be possible to
+ * continue an interation with lpNext() and lpPrev().
+ *
+ * For deletion operations ('ele' set to NULL) 'newp' is set to the next
+ * element, on the right of the deleted one, or to NULL if the deleted
+ * element was the last one. */
+unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, unsigned char *p, int where, unsigned char **newp) {
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    unsigned char backlen[LP_MAX_BACKLEN_SIZE];
+
+    uint64_t enclen; /* The length of the encoded element. */
+
+    /* An element pointer set to NULL means deletion, which is conceptually
+     * replacing the element with a zero-length element. So whatever we
+     * get passed as 'where', set it to LP_REPLACE. */
+    if (ele == NULL) where = LP_REPLACE;
+
+    /* If we need to insert after the current element, we just jump to the
+     * next element (that could be the EOF one) and handle the case of
+     * inserting before. So the function will actually deal with just two
+     * cases: LP_BEFORE and LP_REPLACE. */
+    if (where == LP_AFTER) {
+        p = lpSkip(p);
+        where = LP_BEFORE;
+    }
+
+    /* Store the offset of the element 'p', so that we can obtain its
+     * address again after a reallocation. */
+    unsigned long poff = p-lp;
+
+    /* Calling lpEncodeGetType() results into the encoded version of the
+     * element to be stored into 'intenc' in case it is representable as
+     * an integer: in that case, the function returns LP_ENCODING_INT.
+     * Otherwise if LP_ENCODING_STRING is returned, we'll have to call
+     * lpEncodeString() to actually write the encoded string on place later.
+     *
+     * Whatever the returned encoding is, 'enclen' is populated with the
+     * length of the encoded element. */
+    int enctype;
+    if (ele) {
+        enctype = lpEncodeGetType(ele,size,intenc,&enclen);
+    } else {
+        enctype = -1;
+        enclen = 0;
+    }
+
+    /* We need to also encode the backward-parsable length of the element
+     * and append it to the end: this allows to traverse the listpack from
+     * the end to the start. */
+    unsigned long backlen_size = ele ? lpEncodeBacklen(backlen,enclen) : 0;
+    uint64_t old_listpack_bytes = lpGetTotalBytes(lp);
+    uint32_t replaced_len  = 0;
+    if (where == LP_REPLACE) {
+        replaced_len = lpCurrentEncodedSize(p);
+        replaced_len += lpEncodeBacklen(NULL,replaced_len);
+    }
+
+    uint64_t new_listpack_bytes = old_listpack_bytes + enclen + backlen_size
+                                  - replaced_len;
+    if (new_listpack_bytes > UINT32_MAX) return NULL;
+
+    /* We now need to reallocate in order to make space or shrink the
+     * allocation (in case 'when' value is LP_REPLACE and the new element is
+     * smaller). However we do that before memmoving the memory to
+     * make room for the new element if the final allocation will get
+     * larger, or we do it after if the final allocation will get smaller. */
+
+    unsigned char *dst = lp + poff; /* May be updated after reallocation. */
+
+    /* Realloc before: we need more room. */
+    if (new_listpack_bytes > old_listpack_bytes) {
+        if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        dst = lp + poff;
+    }
+
+    /* Setup the listpack relocating the elements to make the exact room
+     * we need to store the new one. */
+    if (where == LP_BEFORE) {
+        memmove(dst+enclen+backlen_size,dst,old_listpack_bytes-poff);
+    } else { /* LP_REPLACE. */
+        long lendiff = (enclen+backlen_size)-replaced_len;
+        memmove(dst+replaced_len+lendiff,
+                dst+replaced_len,
+                old_listpack_bytes-poff-replaced_len);
+    }
+
+    /* Realloc after: we need to free space. */
+    if (new_listpack_bytes < old_listpack_bytes) {
+        if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        dst = lp + poff;
+    }
+
+    /* Store the entry. */
+    if (newp) {
+        *newp = dst;
+        /* In case of deletion, set 'newp' to NULL if the next element is
+         * the EOF element. */
+        if (!ele && dst[0] == LP_EOF) *newp = NULL;
+    }
+    if (ele) {
+        if (enctype == LP_ENCODING_INT) {
+            memcpy(dst,intenc,enclen);
+        } else {
+            lpEncodeString(dst,ele,size);
+        }
+        dst += enclen;
+        memcpy(dst,backlen,backlen_size);
+        dst += backlen_size;
+    }
+
+    /* Update header. */
+    if (where != LP_REPLACE || ele == NULL) {
+        uint32_t num_elements = lpGetNumElements(lp);
+        if (num_elements != LP_HDR_NUMELE_UNKNOWN) {
+            if (ele)
+                lpSetNumElements(lp,num_elements+1);
+            else
+                lpSetNumElements(lp,num_elements-1);
+        }
+    }
+    lpSetTotalBytes(lp,new_listpack_bytes);
+    return lp;
+}
+
+/* Append the specified element 'ele' of length 'size' at the end of the
+ * listpack. It is implemented in terms of lpInsert(), so the return value is
+ * the same as lpInsert(). */
+unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    uint64_t listpack_bytes = lpGetTotalBytes(lp);
+    unsigned char *eofptr = lp + listpack_bytes - 1;
+    return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
+}
+
+/* Replace the element pointed by '*p' with 'ele', setting '*p' to the
+ * replaced element so that iteration can continue. The neighbours are left
+ * untouched: this is a single memmove() whatever the sizes are. */
+unsigned char *lpReplace(unsigned char *lp, unsigned char **p, unsigned char *ele, uint32_t size) {
+    return lpInsert(lp,ele,size,*p,LP_REPLACE,p);
+}
+
+/* Remove the element pointed by 'p', and return the resulting listpack.
+ * If 'newp' is not NULL, the next element pointer (to the right of the
+ * deleted one) is returned by reference. If the deleted element was the
+ * last one, '*newp' is set to NULL. */
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp) {
+    return lpInsert(lp,NULL,0,p,LP_REPLACE,newp);
+}
+
+/* Delete 'num' consecutive elements starting at '*p' with a single
+ * memmove(). On return '*p' points to the element that followed the
+ * deleted range, or is NULL if the range reached the end of the listpack. */
+unsigned char *lpDeleteRange(unsigned char *lp, unsigned char **p, unsigned long num) {
+    unsigned char *first = *p, *tail = *p;
+    unsigned long deleted = 0;
+    size_t poff = first-lp, bytes = lpGetTotalBytes(lp);
+    uint32_t numele = lpGetNumElements(lp);
+
+    while (deleted < num && tail[0] != LP_EOF) {
+        tail = lpSkip(tail);
+        deleted++;
+    }
+    if (deleted == 0) return lp;
+
+    memmove(first,tail,bytes-(tail-lp));
+    bytes -= tail-first;
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    lp = lp_realloc(lp,bytes);
+    *p = (lp[poff] == LP_EOF) ? NULL : lp+poff;
+    return lp;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', otherwise 0. Integer encoded elements are compared with
+ * the integer value of 's', if it has one. */
+unsigned int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll, sll;
+
+    if (p[0] == LP_EOF) return 0;
+    vstr = lpGetValue(p,&vlen,&vll);
+    if (vstr) {
+        return vlen == slen && memcmp(vstr,s,slen) == 0;
+    } else {
+        if (slen > 20 || !string2ll((char*)s,slen,&sll)) return 0;
+        return vll == sll;
+    }
+}
+
+/* Needles whose encoded form (encoding byte, length and data) fits this
+ * many bytes are matched with a single vector compare. */
+#define LP_FIND_VECTOR_SIZE 16
+
+/* Return 1 if the 'enclen' bytes at 'p' are equal to the ones of 'enc',
+ * that must be LP_FIND_VECTOR_SIZE bytes long. 'end' is the end of the
+ * listpack: the 16 byte load is only done when it can't cross it. */
+static inline int lpEncodedEquals(unsigned char *p, unsigned char *end, unsigned char *enc, uint32_t enclen) {
+#ifdef HAVE_LP_SSE2
+    if (end-p >= LP_FIND_VECTOR_SIZE) {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)enc);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a,b));
+        unsigned int want = (1U<<enclen)-1;
+        return (mask & want) == want;
+    }
+#else
+    ((void) end);
+#endif
+    return memcmp(p,enc,enclen) == 0;
+}
+
+/* Find the element equal to the string 's' of length 'slen' starting the
+ * search at 'p'. After every comparison 'skip' elements are skipped, so
+ * that for instance the fields of a field/value listpack can be searched
+ * with skip set to 1. Returns NULL when the element is not found.
+ *
+ * The encoding of an element only depends on its value, so a string needle
+ * is encoded once and then compared against the raw bytes of every entry:
+ * entries whose first byte (that holds the encoding and, for strings up to
+ * 63 bytes, the length) differs are rejected without decoding them, and
+ * short needles are matched with one SSE2 compare. Integer needles compare
+ * the decoded value. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned char *end = lp+lpGetTotalBytes(lp);
+    unsigned char enc[LP_FIND_VECTOR_SIZE];
+    uint64_t enclen;
+    int skipcnt = 0, sisint;
+    long long sll = 0;
+
+    sisint = lpEncodeGetType(s,slen,enc,&enclen) == LP_ENCODING_INT;
+    if (sisint) {
+        string2ll((char*)s,slen,&sll);
+    } else if (enclen <= LP_FIND_VECTOR_SIZE) {
+        memset(enc,0,sizeof(enc));
+        lpEncodeString(enc,s,slen);
+    } else {
+        /* Only the first byte is needed to reject mismatching entries. */
+        if (slen < 64) enc[0] = slen | LP_ENCODING_6BIT_STR;
+        else if (slen < 4096) enc[0] = (slen >> 8) | LP_ENCODING_12BIT_STR;
+        else enc[0] = LP_ENCODING_32BIT_STR;
+    }
+
+    while (p && p[0] != LP_EOF) {
+        if (skipcnt == 0) {
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vll;
+
+            if (sisint) {
+                vstr = lpGetValue(p,&vlen,&vll);
+                if (vstr ? (vlen == slen && memcmp(vstr,s,slen) == 0) :
+                           vll == sll) return p;
+            } else if (p[0] == enc[0]) {
+                if (enclen <= LP_FIND_VECTOR_SIZE) {
+                    if (lpEncodedEquals(p,end,enc,enclen)) return p;
+                } else {
+                    vstr = lpGetValue(p,&vlen,&vll);
+                    if (vstr && vlen == slen && memcmp(vstr,s,slen) == 0)
+                        return p;
+                }
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpSkip(p);
+    }
+    return NULL;
+}
+
+/* Return the total number of bytes the listpack is composed of. */
+size_t lpBytes(unsigned char *lp) {
+    return lpGetTotalBytes(lp);
+}
+
+/* Seek the specified element and returns the pointer to the seeked element.
+ * Positive indexes specify the zero-based element to seek from the head to
+ * the tail, negative indexes specify elements starting from the tail, where
+ * -1 means the last element, -2 the penultimate and so forth. If the index
+ * is out of range, NULL is returned. */
+unsigned char *lpSeek(unsigned char *lp, long index) {
+    int forward = 1; /* Seek forward by default. */
+
+    /* We want to seek from left to right or the other way around
+     * depending on the listpack length and the element position.
+     * However if the listpack length cannot be obtained in constant time,
+     * we always seek from left to right. */
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) {
+        if (index < 0) index = (long)numele+index;
+        if (index < 0) return NULL; /* Index still < 0 means out of range. */
+        if (index >= (long)numele) return NULL; /* Out of range the other side. */
+        /* We want to scan right-to-left if the element we are looking for
+         * is past the half of the listpack. */
+        if (index > (long)numele/2) {
+            forward = 0;
+            /* Right to left scanning always expects a negative index. Convert
+             * our index to negative form. */
+            index -= numele;
+        }
+    } else {
+        /* If the listpack length is unspecified, for negative indexes we
+         * want to always scan right-to-left. */
+        if (index < 0) forward = 0;
+    }
+
+    /* Forward and backward scanning is trivially based on lpNext()/lpPrev(). */
+    if (forward) {
+        unsigned char *ele = lpFirst(lp);
+        while (index > 0 && ele) {
+            ele = lpNext(lp,ele);
+            index--;
+        }
+        return ele;
+    } else {
+        unsigned char *ele = lpLast(lp);
+        while (index < -1 && ele) {
+            ele = lpPrev(lp,ele);
+            index++;
+        }
+        return ele;
+    }
+}
+
+/* Cheap validation of a listpack blob of 'size' bytes, used when loading
+ * it from an untrusted source: the header must match the size, the last
+ * byte must be the EOF marker, and walking the elements must land exactly
+ * on it. Returns 1 if the listpack looks valid, otherwise 0. */
+int lpValidateIntegrity(unsigned char *lp, size_t size) {
+    unsigned char *p, *eof;
+    uint32_t count = 0;
+
+    if (size < LP_HDR_SIZE+1) return 0;
+    if (lpGetTotalBytes(lp) != size) return 0;
+    eof = lp+size-1;
+    if (eof[0] != LP_EOF) return 0;
+
+    p = lp+LP_HDR_SIZE;
+    while (p < eof) {
+        uint32_t enclen = lpCurrentEncodedSize(p);
+        unsigned long backlen;
+
+        if (enclen == 0 || p[0] == LP_EOF) return 0;
+        backlen = lpEncodeBacklen(NULL,enclen);
+        if ((size_t)(eof-p) < enclen+backlen) return 0;
+        if (lpDecodeBacklen(p+enclen+backlen-1) != enclen) return 0;
+        p += enclen+backlen;
+        count++;
+    }
+    if (p != eof) return 0;
+    if (lpGetNumElements(lp) != LP_HDR_NUMELE_UNKNOWN &&
+        lpGetNumElements(lp) != count) return 0;
+    return 1;
+}
+
+/* Print a human readable representation of the listpack, used by
+ * DEBUG LISTPACK. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    unsigned int vlen;
+    long long vll;
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %lu}\n",
+        (unsigned int)lpBytes(lp), lpLength(lp));
+    p = lpFirst(lp);
+    while (p) {
+        uint32_t enclen = lpCurrentEncodedSize(p);
+        printf("{\n\taddr 0x%08lx,\n\tindex %2d,\n\toffset %5lu,\n"
+               "\tencoded len %u,\n\tbacklen %lu,\n",
+            (unsigned long)p, index, (unsigned long)(p-lp), enclen,
+            lpEncodeBacklen(NULL,enclen));
+        vstr = lpGetValue(p,&vlen,&vll);
+        if (vstr) {
+            printf("\t[str]");
+            if (vlen > 40) {
+                if (fwrite(vstr,40,1,stdout) == 0) perror("fwrite");
+                printf("...");
+            } else {
+                if (vlen && fwrite(vstr,vlen,1,stdout) == 0) perror("fwrite");
+            }
+        } else {
+            printf("\t[int]%lld", vll);
+        }
+        printf("\n}\n");
+        p = lpNext(lp,p);
+        index++;
+    }
+    printf("{end}\n\n");
+}
+
+#ifdef REDIS_TEST
+#include <assert.h>
+#include <sys/time.h>
+#include <time.h>
+#include "sds.h"
+
+#define UNUSED(x) (void)(x)
+#define ok() printf("OK\n")
+
+/* Check that the element 'p' holds the string representation 'expected'. */
+static void lpAssertValue(unsigned char *p, char *expected) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LP_INTBUF_SIZE];
+
+    assert(p != NULL);
+    vstr = lpGetValue(p,&vlen,&vll);
+    if (vstr == NULL) {
+        vlen = ll2string(buf,sizeof(buf),vll);
+        vstr = (unsigned char*)buf;
+    }
+    assert(vlen == strlen(expected) && memcmp(vstr,expected,vlen) == 0);
+}
+
+static unsigned char *lpAppendStr(unsigned char *lp, char *s) {
+    return lpAppend(lp,(unsigned char*)s,strlen(s));
+}
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* The straightforward search lpFind() is benchmarked against: decode every
+ * compared entry and check it against the needle. */
+static unsigned char *lpFindReference(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned int skipcnt = 0;
+
+    while (p) {
+        if (skipcnt == 0) {
+            if (lpCompare(p,s,slen)) return p;
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpNext(lp,p);
+    }
+    return NULL;
+}
+
+int listpackTest(int argc, char *argv[]) {
+    unsigned char *lp, *p;
+    char buf[LP_INTBUF_SIZE+64];
+    int j;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+
+    printf("Integer and string encodings round trip: "); {
+        char *values[] = {"0","127","128","-1","4095","-4096","4096",
+            "32767","-32768","8388607","-8388608","2147483647",
+            "-2147483648","9223372036854775807","-9223372036854775808",
+            "01","+1"," 1","-0","foo",""};
+        int count = sizeof(values)/sizeof(values[0]);
+
+        lp = lpNew();
+        for (j = 0; j < count; j++) lp = lpAppendStr(lp,values[j]);
+        assert(lpLength(lp) == (unsigned long)count);
+        assert(lpValidateIntegrity(lp,lpBytes(lp)));
+        for (j = 0, p = lpFirst(lp); j < count; j++, p = lpNext(lp,p))
+            lpAssertValue(p,values[j]);
+        assert(p == NULL);
+        for (j = count-1, p = lpLast(lp); j >= 0; j--, p = lpPrev(lp,p))
+            lpAssertValue(p,values[j]);
+        assert(p == NULL);
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Long strings and backlen sizes: "); {
+        size_t lens[] = {63,64,4095,4096,16383,16384,70000};
+        sds s;
+
+        lp = lpNew();
+        for (j = 0; j < 7; j++) {
+            s = sdsnewlen(NULL,lens[j]);
+            memset(s,'a'+j,lens[j]);
+            lp = lpAppend(lp,(unsigned char*)s,lens[j]);
+            sdsfree(s);
+        }
+        assert(lpValidateIntegrity(lp,lpBytes(lp)));
+        for (j = 6, p = lpLast(lp); j >= 0; j--, p = lpPrev(lp,p)) {
+            unsigned int vlen;
+            long long vll;
+            unsigned char *vstr = lpGetValue(p,&vlen,&vll);
+            assert(vstr && vlen == lens[j] && vstr[0] == 'a'+j);
+        }
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Seek, find, replace and delete: "); {
+        lp = lpNew();
+        lp = lpAppendStr(lp,"f1"); lp = lpAppendStr(lp,"1");
+        lp = lpAppendStr(lp,"f2"); lp = lpAppendStr(lp,"2");
+        lp = lpAppendStr(lp,"100"); lp = lpAppendStr(lp,"v3");
+        lpAssertValue(lpSeek(lp,0),"f1");
+        lpAssertValue(lpSeek(lp,-1),"v3");
+        lpAssertValue(lpSeek(lp,4),"100");
+        assert(lpSeek(lp,6) == NULL && lpSeek(lp,-7) == NULL);
+
+        /* Searching fields only must skip the values. */
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"2",1,1) == NULL);
+        p = lpFind(lp,lpFirst(lp),(unsigned char*)"100",3,1);
+        lpAssertValue(p,"100");
+        assert(lpCompare(p,(unsigned char*)"100",3));
+        assert(!lpCompare(p,(unsigned char*)"0100",4));
+
+        p = lpNext(lp,p);
+        lp = lpReplace(lp,&p,(unsigned char*)"a much longer value",19);
+        lpAssertValue(p,"a much longer value");
+        p = lpSeek(lp,1);
+        lp = lpReplace(lp,&p,(unsigned char*)"x",1);
+        lpAssertValue(lpSeek(lp,-1),"a much longer value");
+
+        p = lpSeek(lp,2);
+        lp = lpDelete(lp,p,&p);
+        lpAssertValue(p,"2");
+        lp = lpDeleteRange(lp,&p,2);
+        lpAssertValue(p,"a much longer value");
+        assert(lpLength(lp) == 3);
+        p = lpLast(lp);
+        lp = lpDelete(lp,p,&p);
+        assert(p == NULL && lpLength(lp) == 2);
+        assert(lpValidateIntegrity(lp,lpBytes(lp)));
+        lpFree(lp);
+        ok();
+    }
+
+    printf("More than 65535 elements: "); {
+        lp = lpNew();
+        for (j = 0; j < 70000; j++) {
+            int len = ll2string(buf,sizeof(buf),j);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+        assert(lpLength(lp) == 70000);
+        lpAssertValue(lpSeek(lp,69999),"69999");
+        lpAssertValue(lpSeek(lp,-70000),"0");
+        p = lpFirst(lp);
+        lp = lpDeleteRange(lp,&p,10000);
+        assert(lpLength(lp) == 60000);
+        lpAssertValue(p,"10000");
+        assert(lpValidateIntegrity(lp,lpBytes(lp)));
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Random inserts and deletes against a reference array: "); {
+        char *ref[512];
+        int len = 0, iter;
+
+        lp = lpNew();
+        for (iter = 0; iter < 20000; iter++) {
+            int idx, op = rand() % 3;
+
+            if (len == 0 || (op == 0 && len < 512)) {
+                idx = len ? rand() % len : 0;
+                if (rand() % 2)
+                    snprintf(buf,sizeof(buf),"%lld",
+                        (long long)(rand()-RAND_MAX/2)*(rand()%1000));
+                else
+                    snprintf(buf,sizeof(buf),"str-%d-%0*d",rand(),
+                        rand()%40,0);
+                memmove(ref+idx+1,ref+idx,sizeof(char*)*(len-idx));
+                ref[idx] = zstrdup(buf);
+                if (len)
+                    lp = lpInsert(lp,(unsigned char*)buf,strlen(buf),
+                                  lpSeek(lp,idx),LP_BEFORE,NULL);
+                else
+                    lp = lpAppendStr(lp,buf);
+                len++;
+            } else if (op == 1) {
+                idx = rand() % len;
+                zfree(ref[idx]);
+                memmove(ref+idx,ref+idx+1,sizeof(char*)*(len-idx-1));
+                lp = lpDelete(lp,lpSeek(lp,idx),NULL);
+                len--;
+            } else {
+                idx = rand() % len;
+                p = lpSeek(lp,idx);
+                lpAssertValue(p,ref[idx]);
+            }
+        }
+        assert(lpLength(lp) == (unsigned long)len);
+        assert(lpValidateIntegrity(lp,lpBytes(lp)));
+        for (j = 0, p = lpFirst(lp); j < len; j++, p = lpNext(lp,p)) {
+            lpAssertValue(p,ref[j]);
+            zfree(ref[j]);
+        }
+        lpFree(lp);
+        ok();
+    }
+
+    printf("lpFind agrees with a decoding scan: "); {
+        lp = lpNew();
+        for (j = 0; j < 512; j++) {
+            int len = (j % 3 == 0) ? ll2string(buf,sizeof(buf),j*j-100) :
+                      (j % 3 == 1) ? snprintf(buf,sizeof(buf),"field:%d",j) :
+                      snprintf(buf,sizeof(buf),"%070d",j);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+            lp = lpAppendStr(lp,"value");
+        }
+        for (j = -600; j < 1200; j++) {
+            int len = (j % 3 == 0) ? ll2string(buf,sizeof(buf),j*j-100) :
+                      (j % 3 == 1) ? snprintf(buf,sizeof(buf),"field:%d",j) :
+                      snprintf(buf,sizeof(buf),"%070d",j);
+            assert(lpFind(lp,lpFirst(lp),(unsigned char*)buf,len,1) ==
+                   lpFindReference(lp,lpFirst(lp),(unsigned char*)buf,len,1));
+        }
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Benchmark lpFind on 512 fields/values:\n"); {
+        long long start, t1, t2;
+        int found = 0, k;
+        int keylen[512];
+        char keys[512][16];
+
+        lp = lpNew();
+        for (j = 0; j < 512; j++) {
+            keylen[j] = snprintf(keys[j],sizeof(keys[j]),"field:%d",j);
+            lp = lpAppend(lp,(unsigned char*)keys[j],keylen[j]);
+            lp = lpAppendStr(lp,"value");
+        }
+        for (k = 0; k < 2; k++) {
+            start = usec();
+            for (j = 0; j < 100000; j++) {
+                int i = (j*7) % 512;
+                if (lpFind(lp,lpFirst(lp),(unsigned char*)keys[i],keylen[i],1))
+                    found++;
+            }
+            t1 = usec()-start;
+            start = usec();
+            for (j = 0; j < 100000; j++) {
+                int i = (j*7) % 512;
+                if (lpFindReference(lp,lpFirst(lp),(unsigned char*)keys[i],keylen[i],1))
+                    found++;
+            }
+            t2 = usec()-start;
+        }
+        assert(found == 400000);
+        printf("  100000 lookups: lpFind %lld usec, decoding scan %lld usec\n",
+            t1,t2);
+        lpFree(lp);
+    }
+
+    return 0;
+}
+#endif
@@ -0,0 +1,514 @@
+/* Compressor and decompressor for the LZ4 block format.
+ *
+ * The compressed data is a sequence of:
+ *
+ *   [token][literal length+][literals][offset:16 LE][match length+]
+ *
+ * The four high bits of the token are the number of literals, the four
+ * low bits the match length minus 4 (MINMATCH). A nibble of 15 means the
+ * length continues in the following bytes, each one added to the length,
+ * until a byte different than 255 is found. The match is copied from
+ * 'offset' bytes before the current output position, possibly overlapping
+ * the output itself. The last sequence has only literals: its last five
+ * bytes are always literals, and the last match starts at least twelve
+ * bytes before the end of the input, like the reference implementation.
+ *
+ * Two compressors are provided, producing the same format:
+ *
+ * LZ4_LEVEL_FAST uses a single small hash table of recent positions and
+ * greedy parsing, skipping ahead faster on data that doesn't compress.
+ * It is several times faster than LZF both compressing and decompressing.
+ *
+ * LZ4_LEVEL_HIGH keeps a chain of all the positions with the same hash in
+ * the 64k window, takes the longest match among the first candidates and
+ * checks if starting the match one byte later is better. It is slower to
+ * compress, but the result is smaller and decompresses just as fast.
+ *
+ * Like lzf_compress(), the compressors return 0 if the result would not
+ * fit in 'out_len' bytes, so the caller can store the data verbatim.
+ * The decompressor validates every length and offset against the input and
+ * output buffers, and returns 0 on malformed input. */
+
+#include "lz4.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_MAX_INPUT 0x7E000000
+
+#define LZ4_MIN_HASH_LOG 8           /* Tables shrink for short inputs. */
+#define LZ4_FAST_HASH_LOG 12
+#define LZ4_HIGH_HASH_LOG 15
+#define LZ4_HIGH_DEPTH 64           /* Chain candidates per position. */
+#define LZ4_SKIP_TRIGGER 6          /* Misses before the step grows. */
+
+static inline uint32_t lz4Read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4Hash(const unsigned char *p, int log) {
+    return (lz4Read32(p)*2654435761U) >> (32-log);
+}
+
+/* Hash table size for 'len' bytes of input: clearing a table much bigger
+ * than the input would cost more than compressing it. */
+static int lz4HashLog(size_t len, int maxlog) {
+    int log = LZ4_MIN_HASH_LOG;
+
+    while (log < maxlog && ((size_t)1 << log) < len) log++;
+    return log;
+}
+
+/* Number of bytes equal at 'a' and 'b', without reading at or past
+ * 'limit' from 'a'. */
+static inline size_t lz4Count(const unsigned char *a, const unsigned char *b,
+                              const unsigned char *limit)
+{
+    const unsigned char *start = a;
+
+    while (a+sizeof(uint64_t) <= limit) {
+        uint64_t x, y;
+        memcpy(&x,a,sizeof(x));
+        memcpy(&y,b,sizeof(y));
+        if (x != y) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return (a-start)+(__builtin_ctzll(x^y)>>3);
+#else
+            break;
+#endif
+        }
+        a += sizeof(uint64_t);
+        b += sizeof(uint64_t);
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a-start;
+}
+
+/* Append a length continuation (the part over 15) to 'op'. */
+static inline unsigned char *lz4PutLength(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Emit 'litlen' literals from 'lit' followed by a match of 'mlen' bytes at
+ * distance 'offset'. A zero 'mlen' emits the final literals only. Returns
+ * the new output position or NULL if the output buffer is too small. */
+static unsigned char *lz4Emit(unsigned char *op, unsigned char *oend,
+                              const unsigned char *lit, size_t litlen,
+                              size_t offset, size_t mlen)
+{
+    unsigned char *token;
+    size_t need = 1+litlen+(litlen/255)+1;
+
+    if (mlen) need += 2+((mlen-LZ4_MINMATCH)/255)+1;
+    if ((size_t)(oend-op) < need) return NULL;
+
+    token = op++;
+    if (litlen >= 15) {
+        *token = 15<<4;
+        op = lz4PutLength(op,litlen-15);
+    } else {
+        *token = (unsigned char)(litlen<<4);
+    }
+    memcpy(op,lit,litlen);
+    op += litlen;
+    if (mlen == 0) return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= LZ4_MINMATCH;
+    if (mlen >= 15) {
+        *token |= 15;
+        op = lz4PutLength(op,mlen-15);
+    } else {
+        *token |= (unsigned char)mlen;
+    }
+    return op;
+}
+
+static size_t lz4CompressFast(const unsigned char *in, size_t in_len,
+                              unsigned char *op, unsigned char *oend)
+{
+    uint32_t table[1<<LZ4_FAST_HASH_LOG];
+    int hashlog = lz4HashLog(in_len,LZ4_FAST_HASH_LOG);
+    const unsigned char *ip = in, *anchor = in, *ref;
+    const unsigned char *iend = in+in_len;
+    const unsigned char *mflimit = iend-LZ4_MFLIMIT;
+    const unsigned char *matchlimit = iend-LZ4_LASTLITERALS;
+    unsigned char *ostart = op;
+
+    memset(table,0,sizeof(uint32_t)<<hashlog);
+    if (in_len < LZ4_MFLIMIT+1) goto last;
+
+    ip++;
+    while (ip < mflimit) {
+        unsigned misses = 1 << LZ4_SKIP_TRIGGER;
+        size_t mlen;
+        uint32_t h;
+
+        /* Find a 4 bytes match, moving forward faster and faster when
+         * nothing is found. */
+        while(1) {
+            h = lz4Hash(ip,hashlog);
+            ref = in+table[h];
+            table[h] = (uint32_t)(ip-in);
+            if (ip-ref <= LZ4_MAX_DISTANCE && ref < ip &&
+                lz4Read32(ref) == lz4Read32(ip)) break;
+            ip += misses++ >> LZ4_SKIP_TRIGGER;
+            if (ip >= mflimit) goto last;
+        }
+
+        /* Extend backward and forward. */
+        while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        mlen = LZ4_MINMATCH+lz4Count(ip+LZ4_MINMATCH,ref+LZ4_MINMATCH,
+                                     matchlimit);
+        if ((op = lz4Emit(op,oend,anchor,ip-anchor,ip-ref,mlen)) == NULL)
+            return 0;
+        ip += mlen;
+        anchor = ip;
+        if (ip < mflimit) table[lz4Hash(ip-2,hashlog)] = (uint32_t)(ip-2-in);
+    }
+
+last:
+    if ((op = lz4Emit(op,oend,anchor,iend-anchor,0,0)) == NULL) return 0;
+    return op-ostart;
+}
+
+/* State of the high compression match finder: 'head' has the last
+ * position for every hash, 'chain' the distance from every position of
+ * the window to the previous one with the same hash. Both are sized
+ * after the input. */
+typedef struct lz4HighState {
+    int hashlog;
+    size_t next;                /* First position not yet inserted. */
+    int32_t *head;
+    uint16_t *chain;
+} lz4HighState;
+
+/* Insert the positions up to 'pos' (excluded) and return the longest
+ * match for 'pos', setting '*refptr'. */
+static size_t lz4HighFind(lz4HighState *s, const unsigned char *in,
+                          size_t pos, const unsigned char *matchlimit,
+                          const unsigned char **refptr)
+{
+    const unsigned char *ip = in+pos;
+    size_t best = 0, cand;
+    int depth = LZ4_HIGH_DEPTH;
+    uint32_t h;
+
+    while (s->next < pos) {
+        size_t delta;
+
+        h = lz4Hash(in+s->next,s->hashlog);
+        delta = s->next-s->head[h];
+        if (s->head[h] < 0 || delta > LZ4_MAX_DISTANCE) delta = 0;
+        s->chain[s->next & LZ4_MAX_DISTANCE] = (uint16_t)delta;
+        s->head[h] = (int32_t)s->next;
+        s->next++;
+    }
+
+    h = lz4Hash(ip,s->hashlog);
+    if (s->head[h] < 0) return 0;
+    cand = s->head[h];
+    while (depth-- && pos-cand <= LZ4_MAX_DISTANCE) {
+        const unsigned char *ref = in+cand;
+        size_t delta;
+
+        if (ref[best] == ip[best] && lz4Read32(ref) == lz4Read32(ip)) {
+            size_t len = LZ4_MINMATCH+lz4Count(ip+LZ4_MINMATCH,
+                                               ref+LZ4_MINMATCH,matchlimit);
+            if (len > best) {
+                best = len;
+                *refptr = ref;
+                if (ip+len >= matchlimit) break;
+            }
+        }
+        if ((delta = s->chain[cand & LZ4_MAX_DISTANCE]) == 0 ||
+            delta > cand) break;
+        cand -= delta;
+    }
+    return best;
+}
+
+static size_t lz4CompressHigh(const unsigned char *in, size_t in_len,
+                              unsigned char *op, unsigned char *oend)
+{
+    lz4HighState state, *s = &state;
+    size_t chainlen = in_len <= LZ4_MAX_DISTANCE ? in_len :
+                                                   LZ4_MAX_DISTANCE+1;
+    const unsigned char *ip = in, *anchor = in, *ref = NULL, *ref2 = NULL;
+    const unsigned char *iend = in+in_len;
+    const unsigned char *mflimit = iend-LZ4_MFLIMIT;
+    const unsigned char *matchlimit = iend-LZ4_LASTLITERALS;
+    unsigned char *ostart = op;
+
+    s->hashlog = lz4HashLog(in_len,LZ4_HIGH_HASH_LOG);
+    s->next = 0;
+    s->head = malloc((sizeof(int32_t)<<s->hashlog)+sizeof(uint16_t)*chainlen);
+    if (s->head == NULL) return 0;
+    s->chain = (uint16_t*)(s->head+((size_t)1<<s->hashlog));
+    memset(s->head,0xff,sizeof(int32_t)<<s->hashlog);
+    if (in_len < LZ4_MFLIMIT+1) goto last;
+
+    while (ip < mflimit) {
+        size_t mlen, mlen2;
+
+        mlen = lz4HighFind(s,in,ip-in,matchlimit,&ref);
+        if (mlen < LZ4_MINMATCH) {
+            ip++;
+            continue;
+        }
+
+        /* Lazy matching: if the match starting at the next byte is
+         * longer, emit this byte as a literal and take that one. */
+        while (ip+1 < mflimit &&
+               (mlen2 = lz4HighFind(s,in,ip+1-in,matchlimit,&ref2)) > mlen)
+        {
+            ip++;
+            mlen = mlen2;
+            ref = ref2;
+        }
+
+        if ((op = lz4Emit(op,oend,anchor,ip-anchor,ip-ref,mlen)) == NULL) {
+            free(s->head);
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+last:
+    free(s->head);
+    if ((op = lz4Emit(op,oend,anchor,iend-anchor,0,0)) == NULL) return 0;
+    return op-ostart;
+}
+
+/* Compress 'in_len' bytes at 'in_data' into 'out_data'. Returns the
+ * compressed length, or 0 if it would be greater than 'out_len'. */
+size_t lz4_compress(const void *in_data, size_t in_len,
+                    void *out_data, size_t out_len, int level)
+{
+    unsigned char *op = out_data;
+
+    if (in_len == 0 || in_len > LZ4_MAX_INPUT) return 0;
+    if (level == LZ4_LEVEL_FAST)
+        return lz4CompressFast(in_data,in_len,op,op+out_len);
+    else
+        return lz4CompressHigh(in_data,in_len,op,op+out_len);
+}
+
+/* Read a length continuation, adding it to '*len'. Returns 0 on error. */
+static inline int lz4GetLength(const unsigned char **ipptr,
+                               const unsigned char *iend, size_t *len)
+{
+    const unsigned char *ip = *ipptr;
+    unsigned s;
+
+    do {
+        if (ip >= iend) return 0;
+        s = *ip++;
+        *len += s;
+    } while (s == 255);
+    *ipptr = ip;
+    return 1;
+}
+
+/* Decompress 'in_len' bytes at 'in_data' into 'out_data'. Returns the
+ * decompressed length, or 0 if the input is malformed or the output
+ * does not fit in 'out_len' bytes. */
+size_t lz4_decompress(const void *in_data, size_t in_len,
+                      void *out_data, size_t out_len)
+{
+    const unsigned char *ip = in_data, *iend = ip+in_len;
+    unsigned char *out = out_data, *op = out, *oend = out+out_len;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token >> 4, offset;
+        const unsigned char *ref;
+        unsigned char *mend;
+
+        /* Literals. Short runs far from the buffer ends are copied with a
+         * fixed size copy, writing garbage past them that is overwritten
+         * later. */
+        if (len != 15 && iend-ip >= 16 && oend-op >= 16) {
+            memcpy(op,ip,16);
+        } else {
+            if (len == 15 && !lz4GetLength(&ip,iend,&len)) return 0;
+            if ((size_t)(iend-ip) < len || (size_t)(oend-op) < len) return 0;
+            memcpy(op,ip,len);
+        }
+        ip += len;
+        op += len;
+        if (ip == iend) break; /* The last sequence has no match. */
+
+        /* Match. */
+        if (iend-ip < 2) return 0;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op-out)) return 0;
+        len = token & 15;
+        if (len == 15 && !lz4GetLength(&ip,iend,&len)) return 0;
+        len += LZ4_MINMATCH;
+        if ((size_t)(oend-op) < len) return 0;
+
+        ref = op-offset;
+        mend = op+len;
+        if (offset >= 16 && (size_t)(oend-mend) >= 16) {
+            /* Source and destination of every 16 bytes copy don't
+             * overlap, and the garbage written past the end is in the
+             * buffer. */
+            do {
+                memcpy(op,ref,16);
+                op += 16;
+                ref += 16;
+            } while (op < mend);
+        } else if (offset >= 8 && (size_t)(oend-mend) >= 8) {
+            do {
+                memcpy(op,ref,8);
+                op += 8;
+                ref += 8;
+            } while (op < mend);
+        } else {
+            while (op < mend) *op++ = *ref++;
+        }
+        op = mend;
+    }
+    return op-out;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <sys/time.h>
+#include "lzf.h"
+
+static long long lz4TestUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Fill 'buf' with data that compresses about like real values: JSON
+ * records with the same fields and random contents. */
+static void lz4TestFill(unsigned char *buf, size_t len) {
+    size_t j = 0;
+    int id = 0;
+
+    while (j < len) {
+        char tmp[256];
+        int n;
+
+        n = snprintf(tmp,sizeof(tmp),
+            "{\"id\":%d,\"name\":\"user%d\",\"email\":\"user%d@example.com\","
+            "\"score\":%d,\"active\":%s}",
+            id++, rand()%100000, rand()%100000, rand()%1000,
+            rand()%2 ? "true" : "false");
+        if ((size_t)n > len-j) n = len-j;
+        memcpy(buf+j,tmp,n);
+        j += n;
+    }
+}
+
+int lz4Test(int argc, char *argv[]) {
+    size_t len, clen, dlen, total = 64*1024*1024;
+    unsigned char *in, *comp, *dec;
+    int j, level, errors = 0;
+    long long start;
+
+    (void)argc;
+    (void)argv;
+    in = malloc(1024*1024);
+    comp = malloc(1024*1024+1024);
+    dec = malloc(1024*1024);
+
+    /* Round trips of every size up to 1k and some bigger ones, of
+     * compressible, random and constant data. */
+    for (level = LZ4_LEVEL_FAST; level <= LZ4_LEVEL_HIGH; level++) {
+        for (j = 0; j < 3000; j++) {
+            len = j < 1024 ? (size_t)j+1 : (size_t)(rand() % (1024*1024))+1;
+            if (j % 3 == 0) lz4TestFill(in,len);
+            else if (j % 3 == 1) { size_t k; for (k = 0; k < len; k++) in[k] = rand(); }
+            else memset(in,'A'+(j%26),len);
+            clen = lz4_compress(in,len,comp,len+len/255+16,level);
+            if (clen == 0) {
+                printf("level %d len %zu: not compressed\n", level, len);
+                errors++;
+                continue;
+            }
+            dlen = lz4_decompress(comp,clen,dec,len);
+            if (dlen != len || memcmp(in,dec,len)) {
+                printf("level %d len %zu: round trip failed\n", level, len);
+                errors++;
+            }
+            /* Truncated output buffers must be refused. */
+            if (len > 1 && lz4_decompress(comp,clen,dec,len-1) != 0) {
+                printf("level %d len %zu: overflow not detected\n",
+                       level, len);
+                errors++;
+            }
+        }
+    }
+
+    /* Garbage must not crash or overflow the output. */
+    for (j = 0; j < 100000; j++) {
+        size_t k;
+        len = rand() % 256;
+        for (k = 0; k < len; k++) comp[k] = rand();
+        dlen = lz4_decompress(comp,len,dec,1024);
+        if (dlen > 1024) errors++;
+    }
+
+    /* Ratio and speed compared to LZF on 4k values. */
+    lz4TestFill(in,1024*1024);
+    for (level = -1; level <= LZ4_LEVEL_HIGH; level++) {
+        size_t done, csize = 0;
+        long long ctime, dtime;
+
+        start = lz4TestUstime();
+        for (done = 0; done < total; done += 4096) {
+            size_t off = (done/4096 % 255)*4096;
+            if (level < 0)
+                clen = lzf_compress(in+off,4096,comp,4096);
+            else
+                clen = lz4_compress(in+off,4096,comp,4096,level);
+            csize += clen;
+        }
+        ctime = lz4TestUstime()-start;
+        start = lz4TestUstime();
+        for (done = 0; done < total; done += 4096) {
+            if (level < 0)
+                lzf_decompress(comp,clen,dec,4096);
+            else
+                lz4_decompress(comp,clen,dec,4096);
+        }
+        dtime = lz4TestUstime()-start;
+        printf("%-8s ratio %.3f compress %.0f MB/s decompress %.0f MB/s\n",
+            level < 0 ? "lzf" : (level == LZ4_LEVEL_FAST ? "lz4" : "lz4hc"),
+            (double)csize/total, (double)total/ctime,
+            (double)total/dtime);
+    }
+
+    free(in);
+    free(comp);
+    free(dec);
+    printf("%s\n", errors ? "ERRORS" : "ALL TESTS PASSED");
+    return errors ? 1 : 0;
+}
+#endif
@@ -0,0 +1,19 @@
+#ifndef __LZ4_H
+#define __LZ4_H
+
+#include <stddef.h>
+
+/* Compression levels for lz4_compress(). */
+#define LZ4_LEVEL_FAST 0    /* Single hash probe, greedy parsing. */
+#define LZ4_LEVEL_HIGH 1    /* Hash chains and lazy matching. */
+
+size_t lz4_compress(const void *in_data, size_t in_len,
+                    void *out_data, size_t out_len, int level);
+size_t lz4_decompress(const void *in_data, size_t in_len,
+                      void *out_data, size_t out_len);
+
+#ifdef REDIS_TEST
+int lz4Test(int argc, char *argv[]);
+#endif
+
+#endif
@@ -250,9 +250,9 @@ robj *createIntsetObject(void) {
 
 /* 创建一个哈希对象 */
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -268,11 +268,11 @@ robj *createZsetObject(void) {
     return o;
 }
 
-/* 创建一个压缩表对象 */
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
+/* 创建一个紧凑列表(listpack)编码的有序集合对象 */
+robj *createZsetListpackObject(void) {
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -323,8 +323,8 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -336,8 +336,8 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown hash encoding type");
@@ -370,6 +370,11 @@ void incrRefCount(robj *o) {
  */
 void decrRefCount(robj *o) {
     if (o->refcount == 1) {
+        if (o->encoding == OBJ_ENCODING_MAPPED) {
+            freeMappedObject(o);
+            zfree(o);
+            return;
+        }
         switch(o->type) {
         case OBJ_STRING: freeStringObject(o); break;
         case OBJ_LIST: freeListObject(o); break;
@@ -828,9 +833,11 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_HT: return "hashtable";
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+    case OBJ_ENCODING_MAPPED: return "mapped";
     default: return "unknown";
     }
 }
@@ -849,7 +856,10 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
     struct dictEntry *de;
     size_t asize = 0, elesize = 0, samples = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->encoding == OBJ_ENCODING_MAPPED) {
+        /* Only the placeholder is in memory, see rdbmap.c. */
+        asize = sizeof(*o)+sizeof(rdbMappedValue);
+    } else if (o->type == OBJ_STRING) {
         if(o->encoding == OBJ_ENCODING_INT) {
             asize = sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_RAW) {
@@ -893,8 +903,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
@@ -911,8 +921,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -966,13 +976,16 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         zmalloc_get_fragmentation_ratio(server.resident_set_size);
     mem_total += server.initial_memory_usage;
 
-    mem = 0;
-    if (server.repl_backlog)
-        mem += zmalloc_size(server.repl_backlog);
+    /* The replication buffer is accounted to the backlog up to its size,
+     * what exceeds it is kept for the slaves. */
+    mem = server.repl_buffer_mem;
+    if (listLength(server.slaves) &&
+        (long long)mem > server.repl_backlog_size)
+        mem = server.repl_backlog_size;
     mh->repl_backlog = mem;
     mem_total += mem;
 
-    mem = 0;
+    mem = server.repl_buffer_mem - mh->repl_backlog;
     if (listLength(server.slaves)) {
         listIter li;
         listNode *ln;
@@ -980,7 +993,8 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         listRewind(server.slaves,&li);
         while((ln = listNext(&li))) {
             client *c = listNodeValue(ln);
-            mem += getClientOutputBufferMemoryUsage(c);
+            mem += getClientOutputBufferMemoryUsage(c) -
+                   replicaPendingStreamBytes(c);
             mem += sdsAllocSize(c->querybuf);
             mem += sizeof(client);
         }
@@ -1009,11 +1023,14 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem = 0;
     if (server.aof_state != AOF_OFF) {
         mem += sdslen(server.aof_buf);
-        mem += aofRewriteBufferSize();
     }
     mh->aof_buffer = mem;
     mem_total+=mem;
 
+    mem = hllUnionCacheMemory();
+    mh->hll_union_cache = mem;
+    mem_total+=mem;
+
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         long long keyscount = dictSize(db->dict);
@@ -1029,8 +1046,11 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+        /* The expire slots in the entries (time and index position), and
+         * the arrays of the index. */
+        mem = dbExpiresCount(db) * (sizeof(long long)+sizeof(uint32_t)) +
+              (db->expires_index->size+db->expires_index->due_size) *
+              sizeof(dictEntry*);
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
@@ -1245,7 +1265,7 @@ void memoryCommand(client *c) {
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
-        addReplyMultiBulkLen(c,(14+mh->num_dbs)*2);
+        addReplyMultiBulkLen(c,(15+mh->num_dbs)*2);
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1268,6 +1288,9 @@ void memoryCommand(client *c) {
         addReplyBulkCString(c,"aof.buffer");
         addReplyLongLong(c,mh->aof_buffer);
 
+        addReplyBulkCString(c,"hll.union.cache");
+        addReplyLongLong(c,mh->hll_union_cache);
+
         for (size_t j = 0; j < mh->num_dbs; j++) {
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
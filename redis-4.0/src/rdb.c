@@ -29,6 +29,7 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#include "lz4.h"    /* LZ4 block format */
 #include "zipmap.h"
 #include "endianconv.h"
 
@@ -326,16 +327,95 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
- * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+/* Like rdbSaveLzfBlob() for the codecs saved as RDB_ENC_CODEC: the
+ * encoding byte is followed by the codec ID, then the lengths. */
+ssize_t rdbSaveCodecBlob(rio *rdb, int codec, void *data, size_t compress_len,
+                         size_t original_len) {
+    unsigned char hdr[2];
+    ssize_t n, nwritten = 0;
+
+    hdr[0] = (RDB_ENCVAL<<6)|RDB_ENC_CODEC;
+    hdr[1] = codec;
+    if ((n = rdbWriteRaw(rdb,hdr,2)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbSaveLen(rdb,compress_len)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbSaveLen(rdb,original_len)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbWriteRaw(rdb,data,compress_len)) == -1) return -1;
+    nwritten += n;
+    return nwritten;
+}
+
+/* Return the RDB version to write in the header of files and in the footer
+ * of DUMP payloads saved to 'rdb', according to its codec. Values still
+ * mapped from a file that may contain RDB_ENC_CODEC strings are copied
+ * as they are (see rdbmap.c), so in that case RDB_VERSION is used even
+ * with lzf. */
+int rdbSaveVersion(rio *rdb) {
+    return rdb->codec == RDB_COMPRESSION_LZF && !rdbMappedCodecInUse() ?
+           RDB_VERSION_NOCODEC : RDB_VERSION;
+}
+
+/* Save a string compressed with the codec of 'rdb' (see rioInitWith*()),
+ * that is the rdb-compression-codec option. Like rdbSaveLzfStringObject() returns 0
+ * if the string can't be compressed. */
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
+    size_t comprlen, outlen;
+    ssize_t nwritten;
+    void *out;
+    int level;
+
+    if (rdb->codec == RDB_COMPRESSION_LZF)
+        return rdbSaveLzfStringObject(rdb,s,len);
+
+    if (len <= 4) return 0;
+    level = rdb->codec == RDB_COMPRESSION_LZ4HC ?
+            LZ4_LEVEL_HIGH : LZ4_LEVEL_FAST;
+    outlen = len-4;
+    if ((out = zmalloc(outlen+1)) == NULL) return 0;
+    comprlen = lz4_compress(s,len,out,outlen,level);
+    if (comprlen == 0) {
+        zfree(out);
+        return 0;
+    }
+    nwritten = rdbSaveCodecBlob(rdb,RDB_CODEC_LZ4,out,comprlen,len);
+    zfree(out);
+    return nwritten;
+}
+
+/* Decompress 'clen' bytes of a string compressed with 'codec' into 'len'
+ * bytes at 'dst'. Returns 0 on success, -1 if the codec is unknown or the
+ * data is corrupted. */
+static int rdbDecompress(int codec, unsigned char *src, size_t clen,
+                         char *dst, size_t len) {
+    switch(codec) {
+    case RDB_CODEC_LZF:
+        return lzf_decompress(src,clen,dst,len) == 0 ? -1 : 0;
+    case RDB_CODEC_LZ4:
+        return lz4_decompress(src,clen,dst,len) == len ? 0 : -1;
+    default:
+        return -1;
+    }
+}
+
+/* Load a compressed string in RDB format: RDB_ENC_LZF or RDB_ENC_CODEC,
+ * as specified by 'enc'. The returned value changes according to 'flags'.
+ * For more info check the rdbGenericLoadStringObject() function. */
+void *rdbLoadCompressedStringObject(rio *rdb, int enc, int flags,
+                                    size_t *lenptr) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
     unsigned char *c = NULL;
     char *val = NULL;
+    int codec = RDB_CODEC_LZF;
 
+    if (enc == RDB_ENC_CODEC) {
+        unsigned char byte;
+        if (rioRead(rdb,&byte,1) == 0) return NULL;
+        codec = byte;
+    }
     if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((c = zmalloc(clen)) == NULL) goto err;
@@ -350,8 +430,9 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) {
-        if (rdbCheckMode) rdbCheckSetError("Invalid LZF compressed string");
+    if (rdbDecompress(codec,c,clen,val,len) == -1) {
+        if (rdbCheckMode) rdbCheckSetError("Invalid compressed string "
+                                           "(codec %d)", codec);
         goto err;
     }
     zfree(c);
@@ -385,10 +466,10 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -463,7 +544,8 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+        case RDB_ENC_CODEC:
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
         default:
             rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",len);
         }
@@ -593,6 +675,9 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val) {
 
 /* Save the object type of object "o". */
 int rdbSaveObjectType(rio *rdb, robj *o) {
+    if (o->encoding == OBJ_ENCODING_MAPPED)
+        return rdbSaveType(rdb,((rdbMappedValue*)o->ptr)->rdbtype);
+
     switch (o->type) {
     case OBJ_STRING:
         return rdbSaveType(rdb,RDB_TYPE_STRING);
@@ -609,15 +694,15 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_SKIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -643,7 +728,14 @@ int rdbLoadObjectType(rio *rdb) {
 ssize_t rdbSaveObject(rio *rdb, robj *o) {
     ssize_t n = 0, nwritten = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->encoding == OBJ_ENCODING_MAPPED) {
+        /* Not yet loaded from a mapped RDB: the value is already in RDB
+         * format, see rdbmap.c. */
+        rdbMappedValue *mv = o->ptr;
+
+        if (rdb && rioWrite(rdb,mv->data,mv->len) == 0) return -1;
+        return mv->len;
+    } else if (o->type == OBJ_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
         nwritten += n;
@@ -697,8 +789,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -733,8 +825,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -880,26 +972,33 @@ int rdbSaveInfoAuxFields(rio *rdb, int flags, rdbSaveInfo *rsi) {
  * integer pointed by 'error' is set to the value of errno just after the I/O
  * error. */
 int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
+    return rdbSaveRioWithIndex(rdb,error,flags,rsi,NULL);
+}
+
+/* Like rdbSaveRio() but if 'idx' is not NULL the offset of every key
+ * written is also added to the index, that rdbSave() appends to the file
+ * so that it can be loaded lazily, see rdbmap.c. */
+int rdbSaveRioWithIndex(rio *rdb, int *error, int flags, rdbSaveInfo *rsi,
+                        rdbIndex *idx)
+{
     dictIterator *di = NULL;
     dictEntry *de;
     char magic[10];
     int j;
     long long now = mstime();
     uint64_t cksum;
-    size_t processed = 0;
 
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
-    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    snprintf(magic,sizeof(magic),"REDIS%04d",rdbSaveVersion(rdb));
     if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
     if (rdbSaveInfoAuxFields(rdb,flags,rsi) == -1) goto werr;
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         dict *d = db->dict;
+        int numthreads;
         if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
-        if (!di) return C_ERR;
 
         /* Write the SELECT DB opcode */
         if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
@@ -913,32 +1012,35 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
         db_size = (dictSize(db->dict) <= UINT32_MAX) ?
                                 dictSize(db->dict) :
                                 UINT32_MAX;
-        expires_size = (dictSize(db->expires) <= UINT32_MAX) ?
-                                dictSize(db->expires) :
+        expires_size = (dbExpiresCount(db) <= UINT32_MAX) ?
+                                dbExpiresCount(db) :
                                 UINT32_MAX;
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
+        if (idx) rdbIndexBeginDb(idx,j,rdb->processed_bytes);
+
+        /* 大的数据库交给多个线程序列化，见rdbsave.c */
+        if ((numthreads = rdbSaveDbThreads(db)) != 0) {
+            if (rdbSaveDbParallel(rdb,db,numthreads,now,idx) == C_ERR)
+                goto werr;
+            continue;
+        }
 
         /* Iterate this DB writing every entry */
+        di = dictGetSafeIterator(d);
+        if (!di) return C_ERR;
         while((de = dictNext(di)) != NULL) {
             sds keystr = dictGetKey(de);
             robj key, *o = dictGetVal(de);
             long long expire;
+            int saved;
 
             initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire,now) == -1) goto werr;
-
-            /* When this RDB is produced as part of an AOF rewrite, move
-             * accumulated diff from parent to child while rewriting in
-             * order to have a smaller final write. */
-            if (flags & RDB_SAVE_AOF_PREAMBLE &&
-                rdb->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
-            {
-                processed = rdb->processed_bytes;
-                aofReadDiffFromParent();
-            }
+            expire = getEntryExpire(de);
+            if ((saved = rdbSaveKeyValuePair(rdb,&key,o,expire,now)) == -1)
+                goto werr;
+            if (idx && saved) rdbIndexAddKey(idx,rdb->processed_bytes);
         }
         dictReleaseIterator(di);
     }
@@ -967,15 +1069,25 @@ werr:
  *
  * While the suffix is the 40 bytes hex string we announced in the prefix.
  * This way processes receiving the payload can understand when it ends
- * without doing any processing of the content. */
-int rdbSaveRioWithEOFMark(rio *rdb, int *error, rdbSaveInfo *rsi) {
+ * without doing any processing of the content.
+ *
+ * If 'compress' is true the prefix is $EOFZ: and what follows is sent as
+ * frames, see replcompress.c: the rio must be a set of sockets. */
+int rdbSaveRioWithEOFMark(rio *rdb, int *error, rdbSaveInfo *rsi,
+                          int compress)
+{
     char eofmark[RDB_EOF_MARK_SIZE];
 
     getRandomHexChars(eofmark,RDB_EOF_MARK_SIZE);
     if (error) *error = 0;
-    if (rioWrite(rdb,"$EOF:",5) == 0) goto werr;
+    if (rioWrite(rdb,compress ? "$EOFZ:" : "$EOF:",compress ? 6 : 5) == 0)
+        goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     if (rioWrite(rdb,"\r\n",2) == 0) goto werr;
+    if (compress) {
+        if (rioFlush(rdb) == 0) goto werr;
+        rdb->io.fdset.compress = 1;
+    }
     if (rdbSaveRio(rdb,error,RDB_SAVE_NONE,rsi) == C_ERR) goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     return C_OK;
@@ -994,8 +1106,12 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
     FILE *fp;
     rio rdb;
+    rdbIndex idx, *idxp = NULL;
     int error = 0;
 
+    // 文件会被覆盖，不能再用来做复制的全量同步
+    replicationInvalidateSnapshot();
+
     // 备份文件名
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
     fp = fopen(tmpfile,"w");
@@ -1011,11 +1127,20 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     }
 
     rioInitWithFile(&rdb,fp);// 为写入进行初始化
-    // 写入文件
-    if (rdbSaveRio(&rdb,&error,RDB_SAVE_NONE,rsi) == C_ERR) {
+    // 写入文件，需要的话在文件末尾加上key的索引
+    if (server.rdb_save_index) {
+        rdbIndexInit(&idx);
+        idxp = &idx;
+    }
+    if (rdbSaveRioWithIndex(&rdb,&error,RDB_SAVE_NONE,rsi,idxp) == C_ERR) {
         errno = error;
         goto werr;
     }
+    if (idxp) {
+        if (rdbIndexWrite(&rdb,idxp) == C_ERR) goto werr;
+        rdbIndexFree(idxp);
+        idxp = NULL;
+    }
 
     /* 把缓冲区的内容都输出，确保数据不会留在操作系统的缓冲区 */
     if (fflush(fp) == EOF) goto werr;
@@ -1046,6 +1171,7 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     // 错误处理
 werr:
     serverLog(LL_WARNING,"Write error saving DB on disk: %s", strerror(errno));
+    if (idxp) rdbIndexFree(idxp);
     fclose(fp);
     unlink(tmpfile);
     return C_ERR;
@@ -1059,7 +1185,12 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     long long start;
 
     // 如果aof或者另一个备份任务正在执行，返回错误
-    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_snapshot) return C_ERR;
+    replicationInvalidateSnapshot();
+
+    // 不fork，由服务器进程自己增量地生成快照
+    if (server.rdb_save_forkless) return rdbSnapshotStart(filename,rsi);
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
@@ -1157,6 +1288,29 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Re-encode a ziplist loaded from an older RDB file as a listpack holding
+ * the same entries in the same order. The ziplist is not freed. */
+static unsigned char *rdbZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (p != NULL) {
+        if (!ziplistGet(p,&vstr,&vlen,&vll))
+            rdbExitReportCorruptRDB("Ziplist integrity check failed.");
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb) {
@@ -1261,7 +1415,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1276,8 +1430,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1285,11 +1439,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value ||
@@ -1338,10 +1490,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
+        size_t encoded_len;
         unsigned char *encoded =
-            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
         if (encoded == NULL) return NULL;
         o = createObject(OBJ_STRING,encoded); /* Obj type fixed below. */
 
@@ -1353,10 +1508,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *zl = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1365,14 +1520,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        zl = lpAppend(zl, fstr, flen);
+                        zl = lpAppend(zl, vstr, vlen);
                     }
 
                     zfree(o->ptr);
                     o->ptr = zl;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
@@ -1393,14 +1548,38 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST) {
+                    /* Dumps of RDB version 8 or older store small sorted
+                     * sets as ziplists: re-encode them as listpacks. */
+                    unsigned char *lp = rdbZiplistToListpack(o->ptr);
+                    zfree(o->ptr);
+                    o->ptr = lp;
+                } else if (!lpValidateIntegrity(o->ptr,encoded_len)) {
+                    rdbExitReportCorruptRDB("Listpack integrity check failed.");
+                }
+                if (lpLength(o->ptr) % 2)
+                    rdbExitReportCorruptRDB("Sorted set listpack with an odd "
+                                            "number of elements.");
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST) {
+                    unsigned char *lp = rdbZiplistToListpack(o->ptr);
+                    zfree(o->ptr);
+                    o->ptr = lp;
+                } else if (!lpValidateIntegrity(o->ptr,encoded_len)) {
+                    rdbExitReportCorruptRDB("Listpack integrity check failed.");
+                }
+                if (lpLength(o->ptr) % 2)
+                    rdbExitReportCorruptRDB("Hash listpack with an odd "
+                                            "number of elements.");
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
@@ -1461,16 +1640,25 @@ void startLoading(FILE *fp) {
     struct stat sb;
 
     /* Load the DB */
-    server.loading = 1;
-    server.loading_start_time = time(NULL);
-    server.loading_loaded_bytes = 0;
     if (fstat(fileno(fp), &sb) == -1) {
-        server.loading_total_bytes = 0;
+        startLoadingStream(0,0);
     } else {
-        server.loading_total_bytes = sb.st_size;
+        startLoadingStream(sb.st_size,0);
     }
 }
 
+/* Like startLoading() for streams that can't be stat()ed, like the socket
+ * of the master: 'size' is the payload length, or 0 if unknown. With 'async'
+ * the server keeps serving the old dataset while the new one is loaded, so
+ * only server.async_loading is set. */
+void startLoadingStream(off_t size, int async) {
+    server.loading = !async;
+    server.async_loading = async;
+    server.loading_start_time = time(NULL);
+    server.loading_loaded_bytes = 0;
+    server.loading_total_bytes = size;
+}
+
 /* Refresh the loading progress info */
 void loadingProgress(off_t pos) {
     server.loading_loaded_bytes = pos;
@@ -1481,6 +1669,7 @@ void loadingProgress(off_t pos) {
 /* Loading finished */
 void stopLoading(void) {
     server.loading = 0;
+    server.async_loading = 0;
 }
 
 /* Track loading progress in order to serve client's from time to time
@@ -1502,14 +1691,51 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     }
 }
 
+/* Handle an AUX field loaded from an RDB file. */
+void rdbLoadAuxField(robj *auxkey, robj *auxval, rdbSaveInfo *rsi) {
+    if (((char*)auxkey->ptr)[0] == '%') {
+        /* All the fields with a name staring with '%' are considered
+         * information fields and are logged at startup with a log
+         * level of NOTICE. */
+        serverLog(LL_NOTICE,"RDB '%s': %s",
+            (char*)auxkey->ptr,
+            (char*)auxval->ptr);
+    } else if (!strcasecmp(auxkey->ptr,"repl-stream-db")) {
+        if (rsi) rsi->repl_stream_db = atoi(auxval->ptr);
+    } else if (!strcasecmp(auxkey->ptr,"repl-id")) {
+        if (rsi && sdslen(auxval->ptr) == CONFIG_RUN_ID_SIZE) {
+            memcpy(rsi->repl_id,auxval->ptr,CONFIG_RUN_ID_SIZE+1);
+            rsi->repl_id_is_set = 1;
+        }
+    } else if (!strcasecmp(auxkey->ptr,"repl-offset")) {
+        if (rsi) rsi->repl_offset = strtoll(auxval->ptr,NULL,10);
+    } else {
+        /* We ignore fields we don't understand, as by AUX field
+         * contract. */
+        serverLog(LL_DEBUG,"Unrecognized RDB AUX field: '%s'",
+            (char*)auxkey->ptr);
+    }
+}
+
 /* Load an RDB file from the rio stream 'rdb'. On success C_OK is returned,
  * otherwise C_ERR is returned and 'errno' is set accordingly. */
 int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
+    return rdbLoadRioIntoDbs(rdb,rsi,server.db);
+}
+
+/* Like rdbLoadRio() but the keys are added to the array of server.dbnum DBs
+ * 'dbs', that may not be the DBs served to clients (see initTempDb()).
+ *
+ * A short read is a fatal error, unless the rio flagged it as a read error
+ * of its target (a socket connection dropped): in that case C_ERR is
+ * returned, and the keys loaded so far are left in 'dbs'. */
+int rdbLoadRioIntoDbs(rio *rdb, rdbSaveInfo *rsi, redisDb *dbs) {
     uint64_t dbid;
     int type, rdbver;
-    redisDb *db = server.db+0;
+    redisDb *db = dbs+0;
     char buf[1024];
     long long expiretime, now = mstime();
+    rdbLoadPipe *pl = NULL;
 
     rdb->update_cksum = rdbLoadProgressCallback;
     rdb->max_processing_chunk = server.loading_process_events_interval_bytes;
@@ -1521,11 +1747,13 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
         return C_ERR;
     }
     rdbver = atoi(buf+5);// 第5位之后是版本号
-    if (rdbver < 1 || rdbver > RDB_VERSION) {
+    if (!rdbIsVersionSupported(rdbver)) {
         serverLog(LL_WARNING,"Can't handle RDB format version %d",rdbver);
         errno = EINVAL;
         return C_ERR;
     }
+    /* 如果配置了rdb-load-threads，值交给工作线程解码，见rdbload.c */
+    pl = rdbLoadPipeCreate(rdb);
 
     while(1) {
         robj *key, *val;
@@ -1567,7 +1795,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
                     "databases. Exiting\n", server.dbnum);
                 exit(1);
             }
-            db = server.db+dbid;
+            db = dbs+dbid;
             continue; /* 继续读下一个数据类型 */
         } else if (type == RDB_OPCODE_RESIZEDB) {
             /* RESIZEDB: 提示需要进行重新调整大小，避免不必要的重新哈希 */
@@ -1577,7 +1805,6 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             dictExpand(db->dict,db_size);
-            dictExpand(db->expires,expires_size);
             continue; /* Read type again. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
@@ -1588,30 +1815,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
             robj *auxkey, *auxval;
             if ((auxkey = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
             if ((auxval = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
-
-            if (((char*)auxkey->ptr)[0] == '%') {
-                /* All the fields with a name staring with '%' are considered
-                 * information fields and are logged at startup with a log
-                 * level of NOTICE. */
-                serverLog(LL_NOTICE,"RDB '%s': %s",
-                    (char*)auxkey->ptr,
-                    (char*)auxval->ptr);
-            } else if (!strcasecmp(auxkey->ptr,"repl-stream-db")) {
-                if (rsi) rsi->repl_stream_db = atoi(auxval->ptr);
-            } else if (!strcasecmp(auxkey->ptr,"repl-id")) {
-                if (rsi && sdslen(auxval->ptr) == CONFIG_RUN_ID_SIZE) {
-                    memcpy(rsi->repl_id,auxval->ptr,CONFIG_RUN_ID_SIZE+1);
-                    rsi->repl_id_is_set = 1;
-                }
-            } else if (!strcasecmp(auxkey->ptr,"repl-offset")) {
-                if (rsi) rsi->repl_offset = strtoll(auxval->ptr,NULL,10);
-            } else {
-                /* We ignore fields we don't understand, as by AUX field
-                 * contract. */
-                serverLog(LL_DEBUG,"Unrecognized RDB AUX field: '%s'",
-                    (char*)auxkey->ptr);
-            }
-
+            rdbLoadAuxField(auxkey,auxval,rsi);
             decrRefCount(auxkey);
             decrRefCount(auxval);
             continue; /* Read type again. */
@@ -1619,6 +1823,18 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
 
         /* 读取key */
         if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+        if (pl) {
+            if (rdbLoadPipeCanDecode(type)) {
+                int expired = server.masterhost == NULL &&
+                              expiretime != -1 && expiretime < now;
+                if (rdbLoadPipeAdd(pl,rdb,db,key,type,expiretime,expired)
+                    == C_ERR) goto eoferr;
+                continue;
+            }
+            /* Module values are loaded by the main thread: add all the
+             * keys queued so far first. */
+            if (rdbLoadPipeDrain(pl) == C_ERR) goto eoferr;
+        }
         /* 读取值 */
         if ((val = rdbLoadObject(type,rdb)) == NULL) goto eoferr;
         /*
@@ -1640,6 +1856,11 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
 
         decrRefCount(key);
     }
+    if (pl) {
+        if (rdbLoadPipeDrain(pl) == C_ERR) goto eoferr;
+        rdbLoadPipeRelease(pl,rdb);
+        pl = NULL;
+    }
     /* 如果RDB的版本大于5，校验checksum */
     if (rdbver >= 5 && server.rdb_checksum) {
         uint64_t cksum, expected = rdb->cksum;
@@ -1656,6 +1877,16 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
     return C_OK;
 
 eoferr: /* unexpected end of file is handled here with a fatal exit */
+    if (rdb->flags & RIO_FLAG_READ_ERROR) {
+        int saved_errno = errno;
+
+        /* 连接断开不是数据损坏，由调用者决定如何处理 */
+        if (pl) rdbLoadPipeRelease(pl,rdb);
+        serverLog(LL_WARNING,"Short read loading DB from the network: %s",
+            strerror(saved_errno));
+        errno = saved_errno;
+        return C_ERR;
+    }
     serverLog(LL_WARNING,"Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbExitReportCorruptRDB("Unexpected EOF reading RDB file");
     return C_ERR; /* Just to avoid warning */
@@ -1678,8 +1909,13 @@ int rdbLoad(char *filename, rdbSaveInfo *rsi) {
 
     if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
     startLoading(fp);
-    rioInitWithFile(&rdb,fp);// 初始化
-    retval = rdbLoadRio(&rdb,rsi); // 真正载入文件
+    /* 带索引的RDB文件可以映射到内存，值在第一次访问时才解码，见rdbmap.c */
+    if (server.rdb_lazy_load && rdbLoadMapped(fileno(fp),rsi) == C_OK) {
+        retval = C_OK;
+    } else {
+        rioInitWithFile(&rdb,fp);// 初始化
+        retval = rdbLoadRio(&rdb,rsi); // 真正载入文件
+    }
     fclose(fp);
     stopLoading();
     return retval;
@@ -1841,8 +2077,10 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     pid_t childpid;
     long long start;
     int pipefds[2];
+    int compress = server.repl_compression;
 
-    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_snapshot) return C_ERR;
 
     /* Before to fork, create a pipe that will be used in order to
      * send back to the parent the IDs of the slaves that successfully
@@ -1867,6 +2105,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
         if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) {
             clientids[numfds] = slave->id;
             fds[numfds++] = slave->fd;
+            if (!(slave->slave_capa & SLAVE_CAPA_LZ4)) compress = 0;
             replicationSetupSlaveForFullResync(slave,getPsyncInitialOffset());
             /* Put the socket in blocking mode to simplify RDB transfer.
              * We'll restore it when the children returns (since duped socket
@@ -1890,7 +2129,11 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
         closeListeningSockets(0);
         redisSetProcTitle("redis-rdb-to-slaves");
 
-        retval = rdbSaveRioWithEOFMark(&slave_sockets,NULL,rsi);
+        /* Only the compression done in the child is reported. */
+        server.stat_repl_compress_raw = 0;
+        server.stat_repl_compress_wire = 0;
+        server.stat_repl_compress_usec = 0;
+        retval = rdbSaveRioWithEOFMark(&slave_sockets,NULL,rsi,compress);
         if (retval == C_OK && rioFlush(&slave_sockets) == 0)
             retval = C_ERR;
 
@@ -1904,6 +2147,12 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             }
 
             server.child_info_data.cow_size = private_dirty;
+            server.child_info_data.repl_compress_raw =
+                server.stat_repl_compress_raw;
+            server.child_info_data.repl_compress_wire =
+                server.stat_repl_compress_wire;
+            server.child_info_data.repl_compress_usec =
+                server.stat_repl_compress_usec;
             sendChildInfo(CHILD_INFO_TYPE_RDB);
 
             /* If we are returning OK, at least one slave was served
@@ -1996,7 +2245,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
  */
 void saveCommand(client *c) {
     // BGSAVE执行时不能执行SAVE
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -2031,7 +2280,7 @@ void bgsaveCommand(client *c) {
     }
 
     // BGSAVE正在执行，不操作
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         addReplyError(c,"Background save already in progress");
     } else if (server.aof_child_pid != -1) {
         // aof正在执行，如果schedule==1，BGSAVE被提上日程
@@ -37,8 +37,25 @@
 #include "server.h"
 
 /* The current RDB version. When the format changes in a way that is no longer
- * backward compatible this number gets incremented. */
-#define RDB_VERSION 8
+ * backward compatible this number gets incremented.
+ *
+ * Up to version 8 the format is the one of Redis 4.0. Later Redis releases
+ * use the versions from 9 on for their own types and encodings, so the
+ * versions written by this server are far from theirs: RDB_VERSION_NOCODEC
+ * adds the listpack types, RDB_VERSION also RDB_ENC_CODEC, and is only
+ * used when needed (see rdbSaveVersion()). A server that doesn't know
+ * these versions refuses the file instead of misreading a type, and this
+ * server refuses the files of versions 9 to RDB_VERSION_NOCODEC-1.
+ *
+ * This is a one way upgrade: files, DUMP payloads and so MIGRATE written
+ * by this server can only be loaded by servers of this version or newer,
+ * since small hashes and sorted sets are always saved as listpacks. */
+#define RDB_VERSION 1001
+#define RDB_VERSION_NOCODEC 1000
+#define RDB_VERSION_UPSTREAM_MAX 8
+#define rdbIsVersionSupported(v) \
+    (((v) >= 1 && (v) <= RDB_VERSION_UPSTREAM_MAX) || \
+     ((v) >= RDB_VERSION_NOCODEC && (v) <= RDB_VERSION))
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -68,6 +85,19 @@
 #define RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define RDB_ENC_CODEC 4       /* string compressed with the codec that follows */
+
+/* RDB_ENC_CODEC is followed by one byte with the ID of the codec, then by
+ * the compressed and the original length, and the compressed data, like
+ * RDB_ENC_LZF. RDB_CODEC_LZF is never saved, LZF uses RDB_ENC_LZF so that
+ * older versions can load it. */
+#define RDB_CODEC_LZF 0
+#define RDB_CODEC_LZ4 1       /* LZ4 block format, see lz4.c */
+
+/* Values of the rdb-compression-codec option. */
+#define RDB_COMPRESSION_LZF 0
+#define RDB_COMPRESSION_LZ4 1     /* Fast */
+#define RDB_COMPRESSION_LZ4HC 2   /* Smaller, slower to save */
 
 /* Dup object types to RDB object types. Only reason is readability (are we
  * dealing with RDB types or with in-memory object types?). */
@@ -89,10 +119,15 @@
 #define RDB_TYPE_ZSET_ZIPLIST  12
 #define RDB_TYPE_HASH_ZIPLIST  13
 #define RDB_TYPE_LIST_QUICKLIST 14
+/* Types of this server only: far from the ones of later Redis releases,
+ * that go up from 15, and from the opcodes, that go down from 255. */
+#define RDB_TYPE_HASH_LISTPACK 128
+#define RDB_TYPE_ZSET_LISTPACK 129
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 14))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 14) || \
+                            (t >= 128 && t <= 129))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
 #define RDB_OPCODE_AUX        250
@@ -123,6 +158,7 @@ int rdbSaveType(rio *rdb, unsigned char type);
 int rdbLoadType(rio *rdb);
 int rdbSaveTime(rio *rdb, time_t t);
 time_t rdbLoadTime(rio *rdb);
+long long rdbLoadMillisecondTime(rio *rdb);
 int rdbSaveLen(rio *rdb, uint64_t len);
 uint64_t rdbLoadLen(rio *rdb, int *isencoded);
 int rdbLoadLenByRef(rio *rdb, int *isencoded, uint64_t *lenptr);
@@ -138,6 +174,8 @@ size_t rdbSavedObjectLen(robj *o);
 robj *rdbLoadObject(int type, rio *rdb);
 void backgroundSaveDoneHandler(int exitcode, int bysignal);
 int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime, long long now);
+int rdbSaveVersion(rio *rdb);
+int rdbSaveInfoAuxFields(rio *rdb, int flags, rdbSaveInfo *rsi);
 robj *rdbLoadStringObject(rio *rdb);
 int rdbSaveStringObject(rio *rdb, robj *obj);
 ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len);
@@ -147,6 +185,52 @@ int rdbLoadBinaryDoubleValue(rio *rdb, double *val);
 int rdbSaveBinaryFloatValue(rio *rdb, float val);
 int rdbLoadBinaryFloatValue(rio *rdb, float *val);
 int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi);
+int rdbLoadRioIntoDbs(rio *rdb, rdbSaveInfo *rsi, redisDb *dbs);
+void rdbLoadAuxField(robj *auxkey, robj *auxval, rdbSaveInfo *rsi);
+void rdbLoadProgressCallback(rio *r, const void *buf, size_t len);
 rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi);
 
+/* Key index appended to RDB files, see rdbmap.c */
+typedef struct rdbIndex {
+    sds buf;            /* Serialized DB sections. */
+    size_t section;     /* Offset in 'buf' of the current DB section. */
+} rdbIndex;
+
+void rdbIndexInit(rdbIndex *idx);
+void rdbIndexFree(rdbIndex *idx);
+void rdbIndexBeginDb(rdbIndex *idx, int dbid, uint64_t offset);
+void rdbIndexAddKey(rdbIndex *idx, uint64_t end);
+int rdbIndexWrite(rio *rdb, rdbIndex *idx);
+
+/* Parallel saving, see rdbsave.c */
+int rdbSaveDbThreads(redisDb *db);
+int rdbSaveDbParallel(rio *rdb, redisDb *db, int numthreads, long long now,
+                      rdbIndex *idx);
+
+/* Parallel loading, see rdbload.c */
+typedef struct rdbLoadPipe rdbLoadPipe;
+rdbLoadPipe *rdbLoadPipeCreate(rio *rdb);
+int rdbLoadPipeCanDecode(int type);
+int rdbLoadPipeAdd(rdbLoadPipe *p, rio *rdb, redisDb *db, robj *key,
+                   int type, long long expire, int skip);
+int rdbLoadPipeDrain(rdbLoadPipe *p);
+void rdbLoadPipeRelease(rdbLoadPipe *p, rio *rdb);
+
+/* Lazy loading of mapped RDB files, see rdbmap.c */
+typedef struct rdbMapping rdbMapping;
+
+/* The ptr of OBJ_ENCODING_MAPPED objects. */
+typedef struct rdbMappedValue {
+    rdbMapping *map;            /* Keeps the file mapped. */
+    const unsigned char *data;  /* The value as written by rdbSaveObject(). */
+    size_t len;
+    int rdbtype;
+} rdbMappedValue;
+
+int rdbLoadMapped(int fd, rdbSaveInfo *rsi);
+int rdbMappedCodecInUse(void);
+robj *rdbMappedDecode(robj *o);
+robj *rdbMappedMaterialize(dictEntry *de);
+void freeMappedObject(robj *o);
+
 #endif
@@ -0,0 +1,436 @@
+/* Parallel RDB loading.
+ *
+ * rdbLoadRio() normally reads a key, decodes its value with rdbLoadObject()
+ * and adds it to the DB, one key at a time. Decoding is most of the work
+ * for aggregate values: every element of a set, hash, sorted set or list
+ * is a string that may be LZF compressed, and the final object is built
+ * element after element (or converted from a ziplist, validated, and so
+ * forth).
+ *
+ * When "rdb-load-threads" is greater than zero the loading is split in
+ * three stages:
+ *
+ * 1) The main thread keeps parsing the opcodes of the RDB stream exactly
+ *    like before (SELECTDB, RESIZEDB, AUX, expires, the key), but the value
+ *    is not decoded: its payload is just skipped following the length
+ *    headers, and the raw bytes are captured, from the checksum callback,
+ *    into a batch buffer together with the key, DB and expire.
+ *
+ * 2) Full batches are queued to a pool of worker threads, that decode
+ *    the payloads calling rdbLoadObject() against an in memory rio.
+ *
+ * 3) The main thread adds the decoded keys to the DBs, batch after batch,
+ *    in the same order they appear in the file, so duplicated keys and
+ *    expires are handled like in the sequential code.
+ *
+ * Module values can only be loaded by the module, in the main thread, so
+ * when one is found the pipeline is drained and the value is loaded in
+ * the usual way. Everything else (checksum, serving clients while loading,
+ * corrupted file reports) is unchanged. */
+
+#include "server.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#define RDB_LOAD_BATCH_KEYS 256            /* Max keys per batch. */
+#define RDB_LOAD_BATCH_BYTES (1024*256)    /* Max payload bytes per batch. */
+#define RDB_LOAD_INFLIGHT_PER_THREAD 4     /* Queued batches per worker. */
+#define RDB_LOAD_THREAD_STACK_SIZE (1024*1024*4)
+
+typedef struct rdbLoadRecord {
+    redisDb *db;
+    robj *key;
+    robj *val;              /* Decoded value, set by the worker. */
+    long long expire;       /* Expire time or -1. */
+    int type;               /* RDB type of the value. */
+    size_t offset;          /* Offset of the payload inside the batch. */
+} rdbLoadRecord;
+
+typedef struct rdbLoadBatch {
+    sds payload;                        /* Raw values, back to back. */
+    int count;                          /* Number of records. */
+    int decoded;                        /* Set by the worker when done. */
+    rdbLoadRecord rec[RDB_LOAD_BATCH_KEYS];
+} rdbLoadBatch;
+
+struct rdbLoadPipe {
+    pthread_t *threads;
+    int numthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t newjob_cond;     /* Signaled when a batch is queued. */
+    pthread_cond_t done_cond;       /* Signaled when a batch is decoded. */
+    list *todo;                     /* Batches waiting for a worker. */
+    list *inflight;                 /* Queued batches in file order. */
+    rdbLoadBatch *cur;              /* Batch being filled. */
+    int capture;                    /* Append the bytes read to cur? */
+    int exiting;                    /* Workers must exit. */
+};
+
+/* The pipe attached to the rio being loaded, used by the rio callback. */
+static rdbLoadPipe *rdb_load_pipe = NULL;
+
+static rdbLoadBatch *rdbLoadBatchCreate(void) {
+    rdbLoadBatch *b = zmalloc(sizeof(*b));
+
+    b->payload = sdsMakeRoomFor(sdsempty(),RDB_LOAD_BATCH_BYTES);
+    b->count = 0;
+    b->decoded = 0;
+    return b;
+}
+
+/* Release a batch, including the objects not yet added to the DB. */
+static void rdbLoadBatchFree(rdbLoadBatch *b) {
+    int j;
+
+    for (j = 0; j < b->count; j++) {
+        if (b->rec[j].key) decrRefCount(b->rec[j].key);
+        if (b->rec[j].val) decrRefCount(b->rec[j].val);
+    }
+    sdsfree(b->payload);
+    zfree(b);
+}
+
+/* Decode all the values of a batch. Called by the worker threads. */
+static void rdbLoadBatchDecode(rdbLoadBatch *b) {
+    rio r;
+    int j;
+
+    rioInitWithBuffer(&r,b->payload);
+    for (j = 0; j < b->count; j++) {
+        r.io.buffer.pos = b->rec[j].offset;
+        b->rec[j].val = rdbLoadObject(b->rec[j].type,&r);
+    }
+}
+
+static void *rdbLoadWorker(void *arg) {
+    rdbLoadPipe *p = arg;
+    sigset_t sigset;
+
+    /* Like the bio threads, leave the watchdog signal to the main thread. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in RDB loading thread: %s",
+            strerror(errno));
+
+    pthread_mutex_lock(&p->lock);
+    while(1) {
+        listNode *ln;
+        rdbLoadBatch *b;
+
+        if (listLength(p->todo) == 0) {
+            if (p->exiting) break;
+            pthread_cond_wait(&p->newjob_cond,&p->lock);
+            continue;
+        }
+        ln = listFirst(p->todo);
+        b = ln->value;
+        listDelNode(p->todo,ln);
+        pthread_mutex_unlock(&p->lock);
+
+        rdbLoadBatchDecode(b);
+
+        pthread_mutex_lock(&p->lock);
+        b->decoded = 1;
+        pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* rio checksum callback used while the pipe is active: capture the value
+ * payloads into the current batch, then do the usual loading work. */
+static void rdbLoadPipeCallback(rio *r, const void *buf, size_t len) {
+    rdbLoadPipe *p = rdb_load_pipe;
+
+    if (p->capture) p->cur->payload = sdscatlen(p->cur->payload,buf,len);
+    rdbLoadProgressCallback(r,buf,len);
+}
+
+/* Skip 'len' bytes of payload. They are read straight into the batch
+ * buffer instead of going through the callback, to avoid an extra copy
+ * of big strings. */
+static int rdbLoadSkipBytes(rdbLoadPipe *p, rio *rdb, uint64_t len) {
+    size_t oldlen = sdslen(p->cur->payload);
+    int retval;
+
+    p->cur->payload = sdsMakeRoomFor(p->cur->payload,len);
+    p->capture = 0;
+    retval = rioRead(rdb,p->cur->payload+oldlen,len);
+    p->capture = 1;
+    if (retval == 0) return -1;
+    sdsIncrLen(p->cur->payload,len);
+    return 0;
+}
+
+/* Skip a string in any of the encodings rdbGenericLoadStringObject()
+ * understands. */
+static int rdbLoadSkipString(rdbLoadPipe *p, rio *rdb) {
+    int isencoded;
+    uint64_t len, clen;
+    unsigned char codec;
+
+    if (rdbLoadLenByRef(rdb,&isencoded,&len) == -1) return -1;
+    if (isencoded) {
+        switch(len) {
+        case RDB_ENC_INT8: len = 1; break;
+        case RDB_ENC_INT16: len = 2; break;
+        case RDB_ENC_INT32: len = 4; break;
+        case RDB_ENC_LZF:
+        case RDB_ENC_CODEC:
+            /* RDB_ENC_CODEC has the codec ID, then it is like LZF. */
+            if (len == RDB_ENC_CODEC && rioRead(rdb,&codec,1) == 0)
+                return -1;
+            if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+            if (rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+            len = clen;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return rdbLoadSkipBytes(p,rdb,len);
+}
+
+/* Skip a double in the format of rdbSaveDoubleValue(). */
+static int rdbLoadSkipDouble(rdbLoadPipe *p, rio *rdb) {
+    unsigned char len;
+
+    if (rioRead(rdb,&len,1) == 0) return -1;
+    /* 253, 254 and 255 are NaN, +inf and -inf, with no payload. */
+    return len < 253 ? rdbLoadSkipBytes(p,rdb,len) : 0;
+}
+
+/* Skip the payload of a value of type 'type', that must be one for which
+ * rdbLoadPipeCanDecode() returns true. */
+static int rdbLoadSkipObject(rdbLoadPipe *p, rio *rdb, int type) {
+    uint64_t len, j;
+
+    switch(type) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+    case RDB_TYPE_HASH_LISTPACK:
+        return rdbLoadSkipString(p,rdb);
+    }
+
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    for (j = 0; j < len; j++) {
+        if (rdbLoadSkipString(p,rdb) == -1) return -1;
+        switch(type) {
+        case RDB_TYPE_HASH:
+            if (rdbLoadSkipString(p,rdb) == -1) return -1;
+            break;
+        case RDB_TYPE_ZSET:
+            if (rdbLoadSkipDouble(p,rdb) == -1) return -1;
+            break;
+        case RDB_TYPE_ZSET_2:
+            if (rdbLoadSkipBytes(p,rdb,sizeof(double)) == -1) return -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Return true if values of type 'type' can be decoded by the workers. */
+int rdbLoadPipeCanDecode(int type) {
+    switch(type) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET:
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+    case RDB_TYPE_HASH:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_LIST_QUICKLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+    case RDB_TYPE_HASH_LISTPACK:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Add the keys of the oldest queued batch to the DBs, waiting for the
+ * workers to decode it if 'wait' is true. Returns 1 if a batch was added,
+ * 0 if there was nothing to add, -1 if a value could not be decoded. */
+static int rdbLoadPipeInsertHead(rdbLoadPipe *p, int wait) {
+    listNode *ln = listFirst(p->inflight);
+    rdbLoadBatch *b;
+    int j, decoded;
+
+    if (ln == NULL) return 0;
+    b = ln->value;
+    pthread_mutex_lock(&p->lock);
+    while (!(decoded = b->decoded) && wait)
+        pthread_cond_wait(&p->done_cond,&p->lock);
+    pthread_mutex_unlock(&p->lock);
+    if (!decoded) return 0;
+    listDelNode(p->inflight,ln);
+
+    for (j = 0; j < b->count; j++) {
+        rdbLoadRecord *r = b->rec+j;
+
+        if (r->val == NULL) {
+            rdbLoadBatchFree(b);
+            return -1;
+        }
+        dbAdd(r->db,r->key,r->val);
+        if (r->expire != -1) setExpire(NULL,r->db,r->key,r->expire);
+        decrRefCount(r->key);
+        r->key = r->val = NULL;
+    }
+    rdbLoadBatchFree(b);
+    return 1;
+}
+
+/* Queue the current batch to the workers, and add to the DBs the batches
+ * already decoded. */
+static int rdbLoadPipeSubmit(rdbLoadPipe *p) {
+    int retval, maxinflight = p->numthreads*RDB_LOAD_INFLIGHT_PER_THREAD;
+
+    if (p->cur->count == 0) return C_OK;
+    pthread_mutex_lock(&p->lock);
+    listAddNodeTail(p->todo,p->cur);
+    pthread_cond_signal(&p->newjob_cond);
+    pthread_mutex_unlock(&p->lock);
+    listAddNodeTail(p->inflight,p->cur);
+    p->cur = rdbLoadBatchCreate();
+
+    while ((retval = rdbLoadPipeInsertHead(p,
+            (int)listLength(p->inflight) >= maxinflight)) == 1);
+    return retval == -1 ? C_ERR : C_OK;
+}
+
+/* Start the worker threads and take over the checksum callback of 'rdb'.
+ * Returns NULL if parallel loading is disabled or can't be started. */
+rdbLoadPipe *rdbLoadPipeCreate(rio *rdb) {
+    rdbLoadPipe *p;
+    pthread_attr_t attr;
+    size_t stacksize;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int j, numthreads = server.rdb_load_threads;
+
+    /* With a single CPU the workers would just compete with the main
+     * thread. */
+    if (ncpu > 0 && numthreads > ncpu) numthreads = ncpu;
+    if (numthreads <= 0 || ncpu == 1 || rdb_load_pipe != NULL) return NULL;
+
+    p = zcalloc(sizeof(*p));
+    pthread_mutex_init(&p->lock,NULL);
+    pthread_cond_init(&p->newjob_cond,NULL);
+    pthread_cond_init(&p->done_cond,NULL);
+    p->todo = listCreate();
+    p->inflight = listCreate();
+    p->cur = rdbLoadBatchCreate();
+    p->threads = zmalloc(sizeof(pthread_t)*numthreads);
+
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1;
+    while (stacksize < RDB_LOAD_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&p->threads[j],&attr,rdbLoadWorker,p) != 0) {
+            serverLog(LL_WARNING,"Can't create RDB loading thread: %s",
+                strerror(errno));
+            break;
+        }
+        p->numthreads++;
+    }
+    pthread_attr_destroy(&attr);
+
+    rdb_load_pipe = p;
+    if (p->numthreads == 0) {
+        rdbLoadPipeRelease(p,rdb);
+        return NULL;
+    }
+    rdb->update_cksum = rdbLoadPipeCallback;
+    return p;
+}
+
+/* Capture the value of type 'type' that follows in 'rdb' and queue it to
+ * be decoded and added to 'db' as 'key'. The reference to 'key' is taken
+ * over by the pipe. If 'skip' is true the payload is just consumed, this
+ * is used for the keys already expired. */
+int rdbLoadPipeAdd(rdbLoadPipe *p, rio *rdb, redisDb *db, robj *key,
+                   int type, long long expire, int skip)
+{
+    rdbLoadBatch *b = p->cur;
+    size_t offset = sdslen(b->payload);
+    int retval;
+
+    p->capture = 1;
+    retval = rdbLoadSkipObject(p,rdb,type);
+    p->capture = 0;
+    if (retval == -1) {
+        decrRefCount(key);
+        return C_ERR;
+    }
+    if (skip) {
+        sdssetlen(b->payload,offset);
+        decrRefCount(key);
+        return C_OK;
+    }
+
+    b->rec[b->count].db = db;
+    b->rec[b->count].key = key;
+    b->rec[b->count].val = NULL;
+    b->rec[b->count].expire = expire;
+    b->rec[b->count].type = type;
+    b->rec[b->count].offset = offset;
+    b->count++;
+    if (b->count == RDB_LOAD_BATCH_KEYS ||
+        sdslen(b->payload) >= RDB_LOAD_BATCH_BYTES)
+        return rdbLoadPipeSubmit(p);
+    return C_OK;
+}
+
+/* Wait for all the values queued so far to be decoded and added to the
+ * DBs. Must be called before loading anything with the main thread that
+ * depends on the order of the keys, and at EOF. */
+int rdbLoadPipeDrain(rdbLoadPipe *p) {
+    int retval;
+
+    if (rdbLoadPipeSubmit(p) == C_ERR) return C_ERR;
+    while ((retval = rdbLoadPipeInsertHead(p,1)) == 1);
+    return retval == -1 ? C_ERR : C_OK;
+}
+
+/* Stop the workers, release the pipe and restore the callback of 'rdb'. */
+void rdbLoadPipeRelease(rdbLoadPipe *p, rio *rdb) {
+    listNode *ln;
+    int j;
+
+    pthread_mutex_lock(&p->lock);
+    p->exiting = 1;
+    pthread_cond_broadcast(&p->newjob_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (j = 0; j < p->numthreads; j++) pthread_join(p->threads[j],NULL);
+
+    /* The batches in 'todo' are also in 'inflight'. */
+    while ((ln = listFirst(p->inflight)) != NULL) {
+        rdbLoadBatchFree(ln->value);
+        listDelNode(p->inflight,ln);
+    }
+    rdbLoadBatchFree(p->cur);
+    listRelease(p->todo);
+    listRelease(p->inflight);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->newjob_cond);
+    pthread_cond_destroy(&p->done_cond);
+    zfree(p->threads);
+    zfree(p);
+    rdb_load_pipe = NULL;
+    rdb->update_cksum = rdbLoadProgressCallback;
+}
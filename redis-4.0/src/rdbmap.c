@@ -0,0 +1,468 @@
+/* Memory mapped RDB files with a key index, for instant restarts.
+ *
+ * Loading an RDB file means decoding every value and building the objects
+ * in memory, so a node with a big dataset can only accept traffic after
+ * the whole file is loaded. When "rdb-save-index" is enabled rdbSave()
+ * appends to the file an index of the offsets where every key starts and
+ * ends:
+ *
+ *   <RDB file> <DB section> ... <DB section> <footer>
+ *
+ * Every DB section is a sequence of little endian 64 bit integers:
+ *
+ *   <dbid> <count> <offset of the first key> <end of key 1> ... <end of key N>
+ *
+ * The keys of a DB are written one after the other, so every key starts
+ * where the previous one ends. The footer is the index length, the CRC64
+ * of the index and the RDB_INDEX_MAGIC string. Everything before the index
+ * is a standard RDB file (the loaders stop at the EOF opcode and checksum),
+ * so replicas, redis-check-rdb and servers not using the index load it
+ * like any other RDB file.
+ *
+ * When "rdb-lazy-load" is enabled and the file has a valid index, rdbLoad()
+ * maps the file in memory and, for every key, only parses the expire, the
+ * type and the key name. The value is an object with encoding
+ * OBJ_ENCODING_MAPPED pointing to the serialized value in the mapping, and
+ * it is decoded with rdbLoadObject() by lookupKey() the first time the key
+ * is accessed, see rdbMappedMaterialize(). Values never accessed are saved
+ * again copying the serialized value as it is: if the file was saved with
+ * a codec other than lzf they may contain RDB_ENC_CODEC strings, so until
+ * it is unmapped rdbSaveVersion() always returns RDB_VERSION.
+ *
+ * The file is unmapped when the last mapped value is freed or decoded.
+ * Mapped pages are not accounted in used_memory. The RDB checksum is
+ * verified before any key is added, reading the whole file once: this is
+ * still much faster than decoding it, and values are never served from a
+ * corrupted mapping. Files saved with "rdbchecksum no" are loaded
+ * sequentially. */
+
+#include "server.h"
+#include "crc64.h"
+#include "atomicvar.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RDB_INDEX_MAGIC "RDBIDX01"
+#define RDB_INDEX_FOOTER_LEN 24
+#define RDB_INDEX_SECTION_LEN 24
+
+struct rdbMapping {
+    unsigned char *addr;
+    size_t len;
+    long refs;                  /* The loader plus one per mapped value. */
+    pthread_mutex_t lock;       /* Values may be freed by the bio threads. */
+    int codec;                  /* May hold RDB_ENC_CODEC strings. */
+};
+
+/* Number of mappings of files saved with a version that allows
+ * RDB_ENC_CODEC strings: their values are saved again as they are, so
+ * while one exists rdbSaveVersion() can't use RDB_VERSION_NOCODEC. */
+static long rdb_codec_mappings = 0;
+pthread_mutex_t rdb_codec_mappings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int rdbMappedCodecInUse(void) {
+    long aux;
+    atomicGet(rdb_codec_mappings,aux);
+    return aux != 0;
+}
+
+/* ------------------------------ Saving the index -------------------------- */
+
+void rdbIndexInit(rdbIndex *idx) {
+    idx->buf = sdsempty();
+    idx->section = 0;
+}
+
+void rdbIndexFree(rdbIndex *idx) {
+    sdsfree(idx->buf);
+    idx->buf = NULL;
+}
+
+static sds rdbIndexAppend(sds buf, uint64_t v) {
+    memrev64ifbe(&v);
+    return sdscatlen(buf,&v,sizeof(v));
+}
+
+/* Start the section of DB 'dbid', whose first key starts at 'offset'. */
+void rdbIndexBeginDb(rdbIndex *idx, int dbid, uint64_t offset) {
+    idx->section = sdslen(idx->buf);
+    idx->buf = rdbIndexAppend(idx->buf,dbid);
+    idx->buf = rdbIndexAppend(idx->buf,0);
+    idx->buf = rdbIndexAppend(idx->buf,offset);
+}
+
+/* Add a key, ending at 'end', to the current DB section. */
+void rdbIndexAddKey(rdbIndex *idx, uint64_t end) {
+    uint64_t count;
+    char *p = idx->buf+idx->section+8;
+
+    memcpy(&count,p,sizeof(count));
+    memrev64ifbe(&count);
+    count++;
+    memrev64ifbe(&count);
+    memcpy(p,&count,sizeof(count));
+    idx->buf = rdbIndexAppend(idx->buf,end);
+}
+
+/* Append the index and the footer after the RDB checksum. */
+int rdbIndexWrite(rio *rdb, rdbIndex *idx) {
+    uint64_t footer[2];
+
+    footer[0] = sdslen(idx->buf);
+    footer[1] = crc64(0,(unsigned char*)idx->buf,sdslen(idx->buf));
+    memrev64ifbe(&footer[0]);
+    memrev64ifbe(&footer[1]);
+    if (rioWrite(rdb,idx->buf,sdslen(idx->buf)) == 0 ||
+        rioWrite(rdb,footer,sizeof(footer)) == 0 ||
+        rioWrite(rdb,RDB_INDEX_MAGIC,8) == 0) return C_ERR;
+    return C_OK;
+}
+
+/* ------------------------------ Mapped values ----------------------------- */
+
+static void rdbMappingRelease(rdbMapping *m) {
+    long refs;
+
+    pthread_mutex_lock(&m->lock);
+    refs = --m->refs;
+    pthread_mutex_unlock(&m->lock);
+    if (refs) return;
+    if (m->codec) atomicDecr(rdb_codec_mappings,1);
+    munmap(m->addr,m->len);
+    pthread_mutex_destroy(&m->lock);
+    zfree(m);
+}
+
+/* Return the object type of the RDB type 'rdbtype', or -1 if values of
+ * this type can't be decoded lazily (module values). */
+static int rdbMappedObjectType(int rdbtype) {
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+        return OBJ_STRING;
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_LIST_QUICKLIST:
+        return OBJ_LIST;
+    case RDB_TYPE_SET:
+    case RDB_TYPE_SET_INTSET:
+        return OBJ_SET;
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+        return OBJ_ZSET;
+    case RDB_TYPE_HASH:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_HASH_LISTPACK:
+        return OBJ_HASH;
+    default:
+        return -1;
+    }
+}
+
+static robj *createMappedObject(rdbMapping *m, int type, int rdbtype,
+                                const unsigned char *data, size_t len)
+{
+    rdbMappedValue *mv = zmalloc(sizeof(*mv));
+    robj *o;
+
+    pthread_mutex_lock(&m->lock);
+    m->refs++;
+    pthread_mutex_unlock(&m->lock);
+    mv->map = m;
+    mv->data = data;
+    mv->len = len;
+    mv->rdbtype = rdbtype;
+    o = createObject(type,mv);
+    o->encoding = OBJ_ENCODING_MAPPED;
+    return o;
+}
+
+void freeMappedObject(robj *o) {
+    rdbMappedValue *mv = o->ptr;
+
+    rdbMappingRelease(mv->map);
+    zfree(mv);
+}
+
+/* Return a new object with the value of the mapped object 'o'. The file
+ * checksum was verified when mapped, so failing here means the value was
+ * already corrupted when saved: we exit like rdbLoad() does. */
+robj *rdbMappedDecode(robj *o) {
+    rdbMappedValue *mv = o->ptr;
+    robj *val;
+    rio r;
+
+    rioInitWithMemory(&r,mv->data,mv->len);
+    if ((val = rdbLoadObject(mv->rdbtype,&r)) == NULL) {
+        serverLog(LL_WARNING,"Corrupted value of type %d found in the "
+                             "mapped RDB file. Exiting.", mv->rdbtype);
+        exit(1);
+    }
+    return val;
+}
+
+/* Replace the mapped value of the DB entry 'de' with the decoded one, that
+ * is returned. Called by lookupKey() the first time the key is accessed. */
+robj *rdbMappedMaterialize(dictEntry *de) {
+    robj *o = dictGetVal(de), *val = rdbMappedDecode(o);
+
+    val->lru = o->lru;
+    de->v.val = val;
+    decrRefCount(o);
+    return val;
+}
+
+/* ------------------------------ Lazy loading ------------------------------ */
+
+/* Add to 'db' the key serialized at [start,end) of the mapping. Returns
+ * C_ERR if the key can't be parsed. */
+static int rdbMappedLoadKey(rdbMapping *m, redisDb *db, uint64_t start,
+                            uint64_t end, long long now)
+{
+    long long expiretime = -1;
+    robj *key, *val;
+    size_t valpos;
+    int type, objtype;
+    rio r;
+
+    rioInitWithMemory(&r,m->addr+start,end-start);
+    if ((type = rdbLoadType(&r)) == -1) return C_ERR;
+    if (type == RDB_OPCODE_EXPIRETIME) {
+        if ((expiretime = rdbLoadTime(&r)) == -1) return C_ERR;
+        if ((type = rdbLoadType(&r)) == -1) return C_ERR;
+        expiretime *= 1000;
+    } else if (type == RDB_OPCODE_EXPIRETIME_MS) {
+        if ((expiretime = rdbLoadMillisecondTime(&r)) == -1) return C_ERR;
+        if ((type = rdbLoadType(&r)) == -1) return C_ERR;
+    }
+    if (!rdbIsObjectType(type)) return C_ERR;
+    if ((key = rdbLoadStringObject(&r)) == NULL) return C_ERR;
+
+    /* Like rdbLoadRio(), masters don't load expired keys. */
+    if (server.masterhost == NULL && expiretime != -1 && expiretime < now) {
+        decrRefCount(key);
+        return C_OK;
+    }
+
+    valpos = r.io.mem.pos;
+    if ((objtype = rdbMappedObjectType(type)) != -1) {
+        val = createMappedObject(m,objtype,type,m->addr+start+valpos,
+                                 end-start-valpos);
+    } else if ((val = rdbLoadObject(type,&r)) == NULL) {
+        decrRefCount(key);
+        return C_ERR;
+    }
+    dbAdd(db,key,val);
+    if (expiretime != -1) setExpire(NULL,db,key,expiretime);
+    decrRefCount(key);
+    return C_OK;
+}
+
+/* Check the DB sections of the index at 'p', so that the keys can be
+ * added without further checks but parsing them. 'rdblen' is the length
+ * of the RDB part of the file. */
+static int rdbMappedCheckIndex(const unsigned char *p, uint64_t len,
+                               uint64_t rdblen)
+{
+    uint64_t v[3], last, end, j;
+
+    while (len) {
+        if (len < RDB_INDEX_SECTION_LEN) return C_ERR;
+        memcpy(v,p,sizeof(v));
+        memrev64ifbe(&v[0]);
+        memrev64ifbe(&v[1]);
+        memrev64ifbe(&v[2]);
+        p += RDB_INDEX_SECTION_LEN;
+        len -= RDB_INDEX_SECTION_LEN;
+        if (v[0] >= (unsigned)server.dbnum) return C_ERR;
+        if (v[1] > len/8) return C_ERR;
+        last = v[2];
+        if (last < 9) return C_ERR;
+        for (j = 0; j < v[1]; j++) {
+            memcpy(&end,p+j*8,8);
+            memrev64ifbe(&end);
+            if (end <= last || end > rdblen) return C_ERR;
+            last = end;
+        }
+        p += v[1]*8;
+        len -= v[1]*8;
+    }
+    return C_OK;
+}
+
+/* Verify the checksum at the end of the 'rdblen' bytes of the RDB part of
+ * the mapping, serving the clients like the loading loop while reading. */
+static int rdbMappedVerifyChecksum(rdbMapping *m, uint64_t rdblen) {
+    size_t interval = server.loading_process_events_interval_bytes;
+    uint64_t expected, cksum = 0, pos = 0;
+
+    if (rdblen < 9+8) return C_ERR;
+    memcpy(&expected,m->addr+rdblen-8,8);
+    memrev64ifbe(&expected);
+    if (expected == 0) return C_ERR; /* Saved without checksum. */
+
+    if (interval == 0) interval = rdblen;
+    while (pos < rdblen-8) {
+        uint64_t chunk = rdblen-8-pos;
+
+        if (chunk > interval) chunk = interval;
+        cksum = crc64(cksum,m->addr+pos,chunk);
+        pos += chunk;
+        if (pos < rdblen-8) {
+            updateCachedTime();
+            if (server.masterhost && server.repl_state == REPL_STATE_TRANSFER)
+                replicationSendNewlineToMaster();
+            processEventsWhileBlocked();
+        }
+    }
+    return cksum == expected ? C_OK : C_ERR;
+}
+
+/* Parse the RDB header and the AUX fields at the start of the mapping. */
+static int rdbMappedLoadHeader(rdbMapping *m, uint64_t rdblen,
+                               rdbSaveInfo *rsi)
+{
+    char buf[10];
+    int type, rdbver;
+    rio r;
+
+    rioInitWithMemory(&r,m->addr,rdblen);
+    if (rioRead(&r,buf,9) == 0) return C_ERR;
+    buf[9] = '\0';
+    if (memcmp(buf,"REDIS",5) != 0) return C_ERR;
+    rdbver = atoi(buf+5);
+    if (!rdbIsVersionSupported(rdbver)) return C_ERR;
+    if (rdbver > RDB_VERSION_NOCODEC) {
+        m->codec = 1;
+        atomicIncr(rdb_codec_mappings,1);
+    }
+
+    while ((type = rdbLoadType(&r)) == RDB_OPCODE_AUX) {
+        robj *auxkey, *auxval;
+
+        if ((auxkey = rdbLoadStringObject(&r)) == NULL) return C_ERR;
+        if ((auxval = rdbLoadStringObject(&r)) == NULL) {
+            decrRefCount(auxkey);
+            return C_ERR;
+        }
+        rdbLoadAuxField(auxkey,auxval,rsi);
+        decrRefCount(auxkey);
+        decrRefCount(auxval);
+    }
+    return type == -1 ? C_ERR : C_OK;
+}
+
+/* Load the RDB file open at 'fd' mapping it in memory, if it has a valid
+ * index. Returns C_ERR without loading anything if the file can't be
+ * loaded this way, so that the caller can load it with rdbLoadRio(). */
+int rdbLoadMapped(int fd, rdbSaveInfo *rsi) {
+    struct stat sb;
+    unsigned char footer[RDB_INDEX_FOOTER_LEN];
+    uint64_t idxlen, cksum, rdblen, pos, j;
+    const unsigned char *p, *end;
+    long long now = mstime(), start = ustime(), keys = 0;
+    size_t interval = server.loading_process_events_interval_bytes;
+    size_t progress = 0;
+    rdbMapping *m;
+    void *addr;
+
+    if (fstat(fd,&sb) == -1 ||
+        sb.st_size < 9+RDB_INDEX_FOOTER_LEN ||
+        pread(fd,footer,sizeof(footer),sb.st_size-sizeof(footer)) !=
+            (ssize_t)sizeof(footer) ||
+        memcmp(footer+16,RDB_INDEX_MAGIC,8) != 0) return C_ERR;
+
+    memcpy(&idxlen,footer,8);
+    memcpy(&cksum,footer+8,8);
+    memrev64ifbe(&idxlen);
+    memrev64ifbe(&cksum);
+    if (idxlen > (uint64_t)sb.st_size-9-RDB_INDEX_FOOTER_LEN) {
+        serverLog(LL_WARNING,"Invalid RDB index length, loading the file "
+                             "without it.");
+        return C_ERR;
+    }
+    rdblen = sb.st_size-RDB_INDEX_FOOTER_LEN-idxlen;
+
+    addr = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (addr == MAP_FAILED) {
+        serverLog(LL_WARNING,"Can't map the RDB file in memory, loading it "
+                             "sequentially: %s", strerror(errno));
+        return C_ERR;
+    }
+    m = zmalloc(sizeof(*m));
+    m->addr = addr;
+    m->len = sb.st_size;
+    m->refs = 1;
+    m->codec = 0;
+    pthread_mutex_init(&m->lock,NULL);
+
+    p = m->addr+rdblen;
+    if (crc64(0,p,idxlen) != cksum ||
+        rdbMappedCheckIndex(p,idxlen,rdblen) == C_ERR)
+    {
+        serverLog(LL_WARNING,"Invalid RDB index, loading the file "
+                             "without it.");
+        rdbMappingRelease(m);
+        return C_ERR;
+    }
+    if (rdbMappedVerifyChecksum(m,rdblen) == C_ERR) {
+        serverLog(LL_WARNING,"Missing or wrong RDB checksum, loading the "
+                             "file sequentially.");
+        rdbMappingRelease(m);
+        return C_ERR;
+    }
+    if (rdbMappedLoadHeader(m,rdblen,rsi) == C_ERR) {
+        serverLog(LL_WARNING,"Invalid RDB header, loading the file "
+                             "sequentially.");
+        rdbMappingRelease(m);
+        return C_ERR;
+    }
+
+    end = p+idxlen;
+    while (p < end) {
+        uint64_t v[3];
+        redisDb *db;
+
+        memcpy(v,p,sizeof(v));
+        memrev64ifbe(&v[0]);
+        memrev64ifbe(&v[1]);
+        memrev64ifbe(&v[2]);
+        p += RDB_INDEX_SECTION_LEN;
+        db = server.db+v[0];
+        dictExpand(db->dict,dictSize(db->dict)+v[1]);
+        pos = v[2];
+        for (j = 0; j < v[1]; j++) {
+            uint64_t keyend;
+
+            memcpy(&keyend,p,8);
+            memrev64ifbe(&keyend);
+            p += 8;
+            if (rdbMappedLoadKey(m,db,pos,keyend,now) == C_ERR) {
+                serverLog(LL_WARNING,"Corrupted key at offset %llu of the "
+                    "mapped RDB file. Exiting.", (unsigned long long)pos);
+                exit(1);
+            }
+            pos = keyend;
+            keys++;
+
+            /* Serve the clients while loading, see rdbLoadProgressCallback(). */
+            if (interval && pos-progress >= interval) {
+                progress = pos;
+                updateCachedTime();
+                if (server.masterhost && server.repl_state == REPL_STATE_TRANSFER)
+                    replicationSendNewlineToMaster();
+                loadingProgress(pos);
+                processEventsWhileBlocked();
+            }
+        }
+    }
+    serverLog(LL_NOTICE,"%lld keys mapped from the RDB file in %.3f seconds, "
+                        "values will be loaded on access",
+        keys, (float)(ustime()-start)/1000000);
+    rdbMappingRelease(m);
+    return C_OK;
+}
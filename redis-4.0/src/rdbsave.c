@@ -0,0 +1,257 @@
+/* Multi threaded RDB saving.
+ *
+ * rdbSaveRio() serializes the keys one after the other, and for datasets
+ * with big values most of the time is spent LZF compressing them in
+ * rdbSaveRawString(). When "rdb-save-threads" is greater than zero, the
+ * keys of big DBs are instead serialized by a pool of threads:
+ *
+ * 1) The buckets of the DB hash tables (both of them if the DB is in the
+ *    middle of a rehashing) are split in chunks of RDB_SAVE_CHUNK_BUCKETS
+ *    consecutive buckets. Threads grab the next chunk in order and
+ *    serialize (and compress) its keys into an in memory buffer with
+ *    rdbSaveKeyValuePair(), like the serial code does.
+ *
+ * 2) The calling thread writes the chunk buffers to the target rio in
+ *    chunk order, so the checksum and the output are exactly the ones of
+ *    a single threaded save that visited the keys in bucket order. The
+ *    output is a standard RDB, and works for files and for the diskless
+ *    replication sockets alike.
+ *
+ * At most RDB_SAVE_WINDOW_PER_THREAD chunks per thread can be serialized
+ * ahead of the writer, so the memory used is bounded.
+ *
+ * When the key index is requested (see rdbmap.c) the threads also record
+ * where every key ends in the chunk buffer, and the writer adds the offset
+ * of the buffer in the file.
+ *
+ * This is only safe because nothing modifies the dataset while saving:
+ * usually the process is the BGSAVE child, otherwise the server is blocked
+ * in SAVE. Module values are serialized by the module callbacks, that are
+ * not required to be thread safe, so when modules are loaded the serial
+ * code is used. */
+
+#include "server.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#define RDB_SAVE_CHUNK_BUCKETS 4096         /* Buckets per chunk. */
+#define RDB_SAVE_WINDOW_PER_THREAD 4        /* Chunks buffered per thread. */
+#define RDB_SAVE_MIN_KEYS 16384             /* Smaller DBs are saved serially. */
+#define RDB_SAVE_THREAD_STACK_SIZE (1024*1024*4)
+
+typedef struct rdbSaveChunk {
+    sds buf;                /* Serialized keys of the chunk. */
+    sds ends;               /* uint64_t end of every key in 'buf'. */
+    int ready;              /* Set by the worker, cleared by the writer. */
+} rdbSaveChunk;
+
+typedef struct rdbSavePool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;      /* A chunk was serialized. */
+    pthread_cond_t space_cond;      /* A chunk was written. */
+    redisDb *db;
+    long long now;
+    int index;                      /* Fill the 'ends' of the chunks. */
+    int codec;                      /* Codec of the target rio. */
+    unsigned long nchunks;          /* Total chunks of the DB. */
+    unsigned long chunks0;          /* Chunks of the first hash table. */
+    unsigned long next;             /* Next chunk to serialize. */
+    unsigned long written;          /* Chunks written by the writer. */
+    unsigned long window;           /* Number of slots. */
+    rdbSaveChunk *slots;            /* Chunk N uses slot N % window. */
+    int exiting;                    /* Writer failed, stop. */
+} rdbSavePool;
+
+/* Return the number of threads to use to save 'db', or zero if it is
+ * better to use the serial code. */
+int rdbSaveDbThreads(redisDb *db) {
+    long ncpu;
+    int numthreads = server.rdb_save_threads;
+
+    if (numthreads <= 0 || dictSize(db->dict) < RDB_SAVE_MIN_KEYS) return 0;
+    if (moduleCount() != 0) return 0;
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu == 1) return 0;
+    if (ncpu > 0 && numthreads > ncpu) numthreads = ncpu;
+    return numthreads;
+}
+
+/* Serialize the keys of chunk 'chunk' in the empty buffer of 'slot'. */
+static void rdbSaveChunkKeys(rdbSavePool *p, unsigned long chunk,
+                             rdbSaveChunk *slot)
+{
+    dict *d = p->db->dict;
+    unsigned long idx, end;
+    int table = 0;
+    rio r;
+
+    /* The chunks of table 0 come first, then the ones of table 1. */
+    if (chunk >= p->chunks0) {
+        chunk -= p->chunks0;
+        table = 1;
+    }
+    idx = chunk*RDB_SAVE_CHUNK_BUCKETS;
+    end = idx+RDB_SAVE_CHUNK_BUCKETS;
+    if (end > d->ht[table].size) end = d->ht[table].size;
+
+    rioInitWithBuffer(&r,slot->buf);
+    r.codec = p->codec;
+    for (; idx < end; idx++) {
+        dictEntry *de;
+
+        for (de = d->ht[table].table[idx]; de; de = de->next) {
+            robj key;
+            uint64_t keyend;
+
+            initStaticStringObject(key,dictGetKey(de));
+            if (rdbSaveKeyValuePair(&r,&key,dictGetVal(de),
+                                    getEntryExpire(de),p->now) == 1 &&
+                p->index)
+            {
+                keyend = r.processed_bytes;
+                slot->ends = sdscatlen(slot->ends,&keyend,sizeof(keyend));
+            }
+        }
+    }
+    slot->buf = r.io.buffer.ptr;
+}
+
+static void *rdbSaveWorker(void *arg) {
+    rdbSavePool *p = arg;
+    sigset_t sigset;
+
+    /* Like the bio threads, leave the watchdog signal to the main thread. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    pthread_mutex_lock(&p->lock);
+    while(!p->exiting && p->next < p->nchunks) {
+        unsigned long chunk;
+        rdbSaveChunk *slot;
+
+        if (p->next >= p->written+p->window) {
+            pthread_cond_wait(&p->space_cond,&p->lock);
+            continue;
+        }
+        chunk = p->next++;
+        slot = p->slots+(chunk % p->window);
+        pthread_mutex_unlock(&p->lock);
+
+        rdbSaveChunkKeys(p,chunk,slot);
+
+        pthread_mutex_lock(&p->lock);
+        slot->ready = 1;
+        pthread_cond_broadcast(&p->ready_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Save the keys of 'db' to 'rdb' using 'numthreads' threads, as returned
+ * by rdbSaveDbThreads(). Returns C_OK, or C_ERR on write errors with errno
+ * set. The DB header (SELECTDB / RESIZEDB) must already be written. If
+ * 'idx' is not NULL the keys are added to the index. */
+int rdbSaveDbParallel(rio *rdb, redisDb *db, int numthreads, long long now,
+                      rdbIndex *idx)
+{
+    rdbSavePool p;
+    pthread_t *threads;
+    pthread_attr_t attr;
+    size_t stacksize;
+    unsigned long c;
+    int j, started = 0, err = 0;
+    dict *d = db->dict;
+
+    p.db = db;
+    p.now = now;
+    p.index = idx != NULL;
+    p.codec = rdb->codec;
+    p.chunks0 = (d->ht[0].size+RDB_SAVE_CHUNK_BUCKETS-1)/RDB_SAVE_CHUNK_BUCKETS;
+    p.nchunks = p.chunks0 +
+        (d->ht[1].size+RDB_SAVE_CHUNK_BUCKETS-1)/RDB_SAVE_CHUNK_BUCKETS;
+    p.next = 0;
+    p.written = 0;
+    p.window = numthreads*RDB_SAVE_WINDOW_PER_THREAD;
+    p.exiting = 0;
+    p.slots = zmalloc(sizeof(rdbSaveChunk)*p.window);
+    for (c = 0; c < p.window; c++) {
+        p.slots[c].buf = sdsempty();
+        p.slots[c].ends = sdsempty();
+        p.slots[c].ready = 0;
+    }
+    pthread_mutex_init(&p.lock,NULL);
+    pthread_cond_init(&p.ready_cond,NULL);
+    pthread_cond_init(&p.space_cond,NULL);
+
+    threads = zmalloc(sizeof(pthread_t)*numthreads);
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1;
+    while (stacksize < RDB_SAVE_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&threads[j],&attr,rdbSaveWorker,&p) != 0) break;
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    /* Write the chunks in order. If no thread could be started, serialize
+     * them here. */
+    for (c = 0; c < p.nchunks; c++) {
+        rdbSaveChunk *slot = p.slots+(c % p.window);
+        uint64_t base = rdb->processed_bytes;
+        size_t k;
+
+        if (started) {
+            pthread_mutex_lock(&p.lock);
+            while (!slot->ready) pthread_cond_wait(&p.ready_cond,&p.lock);
+            pthread_mutex_unlock(&p.lock);
+        } else {
+            rdbSaveChunkKeys(&p,c,slot);
+        }
+
+        if (sdslen(slot->buf) &&
+            rioWrite(rdb,slot->buf,sdslen(slot->buf)) == 0)
+        {
+            err = errno ? errno : EIO;
+            break;
+        }
+        sdsclear(slot->buf);
+        for (k = 0; k < sdslen(slot->ends); k += sizeof(uint64_t)) {
+            uint64_t keyend;
+
+            memcpy(&keyend,slot->ends+k,sizeof(keyend));
+            rdbIndexAddKey(idx,base+keyend);
+        }
+        sdsclear(slot->ends);
+
+        pthread_mutex_lock(&p.lock);
+        slot->ready = 0;
+        p.written++;
+        pthread_cond_broadcast(&p.space_cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.exiting = 1;
+    pthread_cond_broadcast(&p.space_cond);
+    pthread_mutex_unlock(&p.lock);
+    for (j = 0; j < started; j++) pthread_join(threads[j],NULL);
+
+    for (c = 0; c < p.window; c++) {
+        sdsfree(p.slots[c].buf);
+        sdsfree(p.slots[c].ends);
+    }
+    zfree(p.slots);
+    zfree(threads);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.ready_cond);
+    pthread_cond_destroy(&p.space_cond);
+    if (err) {
+        errno = err;
+        return C_ERR;
+    }
+    return C_OK;
+}
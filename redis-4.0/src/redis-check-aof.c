@@ -199,7 +199,21 @@ int redis_check_aof_main(int argc, char **argv) {
         }
     }
 
-    off_t pos = process(fp);
+    /* Binary incr files are made of checksummed blocks, see aofbin.c. */
+    char magic[AOF_BIN_MAGIC_LEN];
+    off_t start = ftello(fp);
+    int binary = start == 0 && fread(magic,sizeof(magic),1,fp) == 1 &&
+                 memcmp(magic,AOF_BIN_MAGIC,sizeof(magic)) == 0;
+    off_t pos;
+    if (binary) {
+        char *err;
+        printf("The AOF uses the binary format.\n");
+        pos = aofBinCheck(fp,&err);
+        if (err) printf("%s\n", err);
+    } else {
+        fseeko(fp,start,SEEK_SET);
+        pos = process(fp);
+    }
     off_t diff = size-pos;
     printf("AOF analyzed: size=%lld, ok_up_to=%lld, diff=%lld\n",
         (long long) size, (long long) pos, (long long) diff);
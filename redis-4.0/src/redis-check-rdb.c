@@ -88,6 +88,13 @@ char *rdb_type_string[] = {
     "quicklist"
 };
 
+static char *rdbCheckTypeString(int type) {
+    if (type == RDB_TYPE_HASH_LISTPACK) return "hash-listpack";
+    if (type == RDB_TYPE_ZSET_LISTPACK) return "zset-listpack";
+    return ((unsigned)type < sizeof(rdb_type_string)/sizeof(char*)) ?
+           rdb_type_string[type] : "unknown";
+}
+
 /* Show a few stats collected into 'rdbstate' */
 void rdbShowGenericInfo(void) {
     printf("[info] %lu keys read\n", rdbstate.keys);
@@ -117,9 +124,7 @@ void rdbCheckError(const char *fmt, ...) {
     if (rdbstate.key_type != -1)
         printf("[additional info] Reading type %d (%s)\n",
             rdbstate.key_type,
-            ((unsigned)rdbstate.key_type <
-             sizeof(rdb_type_string)/sizeof(char*)) ?
-                rdb_type_string[rdbstate.key_type] : "unknown");
+            rdbCheckTypeString(rdbstate.key_type));
     rdbShowGenericInfo();
 }
 
@@ -196,7 +201,7 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         return 1;
     }
     rdbver = atoi(buf+5);
-    if (rdbver < 1 || rdbver > RDB_VERSION) {
+    if (!rdbIsVersionSupported(rdbver)) {
         rdbCheckError("Can't handle RDB format version %d",rdbver);
         return 1;
     }
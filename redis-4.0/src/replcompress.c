@@ -0,0 +1,242 @@
+/* Compressed framing of the master <-> slave link.
+ *
+ * The replication stream is made of the same commands written again and
+ * again with similar keys and values, and compresses well. When the
+ * "repl-compression" option is enabled on both sides the slave asks for
+ * it during the handshake, after the REPLCONF capa exchange:
+ *
+ *   REPLCONF compress lz4
+ *
+ * The master replies +OK only if compression is enabled on its side too,
+ * and flags the slave with SLAVE_CAPA_LZ4. Any other reply, like the error
+ * of a master that does not know the option, means that the link is not
+ * compressed. A capability alone is not enough here, since the slave must
+ * know the format of what it will receive.
+ *
+ * Once agreed, the following is sent as a sequence of frames:
+ *
+ * 1) The live stream, starting just after the +CONTINUE reply of a partial
+ *    resync, or after the RDB payload of a full resync. The slave decodes
+ *    it as it is read, so the offsets, the backlog and the stream proxied
+ *    to the sub-slaves are the ones of the plain stream.
+ *
+ * 2) The RDB payload of a diskless sync, if all the slaves served by the
+ *    child agreed on it. The preamble is "$EOFZ:<mark>\r\n" instead of
+ *    "$EOF:<mark>\r\n", then both the RDB and the final mark are framed.
+ *
+ * A frame is:
+ *
+ *   <type> <raw len> <payload len> <payload>
+ *
+ * Where the type is REPL_FRAME_LZ4 or REPL_FRAME_STORED (for the chunks
+ * LZ4 is not able to make smaller) and the lengths are 32 bit little
+ * endian integers. A frame holds at most REPL_FRAME_MAX_RAW bytes of the
+ * stream, so both sides only need a bounded buffer. The bytes and the CPU
+ * time spent are reported by INFO replication. */
+
+#include "server.h"
+#include "endianconv.h"
+#include "lz4.h"
+
+#define REPL_FRAME_STORED 'R'
+#define REPL_FRAME_LZ4 'Z'
+#define REPL_FRAME_MIN_COMPRESS 64  /* Smaller chunks are just stored. */
+
+/* ------------------------------- Framing ---------------------------------- */
+
+/* Append to 'dst' the 'len' bytes at 'p' as a sequence of frames. */
+sds replCompressFrames(sds dst, const char *p, size_t len) {
+    long long start = ustime();
+    size_t wire = sdslen(dst), raw = len;
+
+    while(len) {
+        size_t rawlen = len < REPL_FRAME_MAX_RAW ? len : REPL_FRAME_MAX_RAW;
+        size_t outlen = 0;
+        uint32_t hdrlen[2];
+        char *hdr;
+
+        dst = sdsMakeRoomFor(dst,REPL_FRAME_HDR_LEN+rawlen);
+        hdr = dst+sdslen(dst);
+        if (rawlen >= REPL_FRAME_MIN_COMPRESS)
+            outlen = lz4_compress(p,rawlen,hdr+REPL_FRAME_HDR_LEN,rawlen-1,
+                                  LZ4_LEVEL_FAST);
+        if (outlen == 0) {
+            memcpy(hdr+REPL_FRAME_HDR_LEN,p,rawlen);
+            outlen = rawlen;
+            hdr[0] = REPL_FRAME_STORED;
+        } else {
+            hdr[0] = REPL_FRAME_LZ4;
+        }
+        hdrlen[0] = rawlen;
+        hdrlen[1] = outlen;
+        memrev32ifbe(&hdrlen[0]);
+        memrev32ifbe(&hdrlen[1]);
+        memcpy(hdr+1,hdrlen,sizeof(hdrlen));
+        sdsIncrLen(dst,REPL_FRAME_HDR_LEN+outlen);
+        p += rawlen;
+        len -= rawlen;
+    }
+    server.stat_repl_compress_raw += raw;
+    server.stat_repl_compress_wire += sdslen(dst)-wire;
+    server.stat_repl_compress_usec += ustime()-start;
+    return dst;
+}
+
+/* Check the frame header at 'hdr', that is REPL_FRAME_HDR_LEN bytes, and
+ * return the lengths it announces. Returns C_ERR if it is not valid. */
+int replParseFrameHeader(const char *hdr, size_t *rawlen, size_t *datalen) {
+    uint32_t hdrlen[2];
+
+    memcpy(hdrlen,hdr+1,sizeof(hdrlen));
+    memrev32ifbe(&hdrlen[0]);
+    memrev32ifbe(&hdrlen[1]);
+    *rawlen = hdrlen[0];
+    *datalen = hdrlen[1];
+    if (*rawlen == 0 || *rawlen > REPL_FRAME_MAX_RAW) return C_ERR;
+    if (hdr[0] == REPL_FRAME_STORED) return *datalen == *rawlen ? C_OK : C_ERR;
+    if (hdr[0] == REPL_FRAME_LZ4) return *datalen < *rawlen ? C_OK : C_ERR;
+    return C_ERR;
+}
+
+/* Decode the complete frames at the start of the 'len' bytes at 'p',
+ * appending the stream they hold to '*dst'. Returns the number of bytes
+ * consumed, a partial frame at the end is left for the next call, or -1
+ * if the frames are corrupted. */
+ssize_t replDecompressFrames(sds *dst, const char *p, size_t len) {
+    long long start = ustime();
+    size_t consumed = 0, need = 0, rawlen, datalen;
+    const char *frame;
+
+    /* Find out the space needed first, so that the destination is grown
+     * only once. */
+    while(len-consumed >= REPL_FRAME_HDR_LEN) {
+        if (replParseFrameHeader(p+consumed,&rawlen,&datalen) == C_ERR)
+            return -1;
+        if (len-consumed-REPL_FRAME_HDR_LEN < datalen) break;
+        consumed += REPL_FRAME_HDR_LEN+datalen;
+        need += rawlen;
+    }
+    if (consumed == 0) return 0;
+
+    *dst = sdsMakeRoomFor(*dst,need);
+    for (frame = p; frame < p+consumed; frame += REPL_FRAME_HDR_LEN+datalen) {
+        char *out = *dst+sdslen(*dst);
+
+        replParseFrameHeader(frame,&rawlen,&datalen);
+        if (frame[0] == REPL_FRAME_STORED) {
+            memcpy(out,frame+REPL_FRAME_HDR_LEN,rawlen);
+        } else if (lz4_decompress(frame+REPL_FRAME_HDR_LEN,datalen,
+                                  out,rawlen) != rawlen)
+        {
+            return -1;
+        }
+        sdsIncrLen(*dst,rawlen);
+    }
+    server.stat_repl_decompress_raw += need;
+    server.stat_repl_decompress_wire += consumed;
+    server.stat_repl_decompress_usec += ustime()-start;
+    return consumed;
+}
+
+/* ------------------------------ Live stream ------------------------------- */
+
+/* Called when the slave 'c' starts receiving the live stream: from now on
+ * what is sent to it is framed, if this was agreed in the handshake. */
+void replicationStartCompression(client *c) {
+    if (!(c->slave_capa & SLAVE_CAPA_LZ4) || c->repl_compress) return;
+    c->repl_compress = 1;
+    sdsclear(c->repl_zbuf);
+    c->repl_zbuf_pos = 0;
+}
+
+/* Fill the frames buffer of the slave 'c' with up to REPL_FRAME_MAX_RAW
+ * bytes of what it has to receive, taken from its reply buffers first and
+ * then from the backlog on disk and the replication buffer, in the same
+ * order writeToClient() would send them. Returns the number of bytes now
+ * in the buffer. */
+size_t replicaCompressPendingStream(client *c) {
+    sds raw = sdsempty();
+
+    sdsclear(c->repl_zbuf);
+    c->repl_zbuf_pos = 0;
+
+    if (c->bufpos) {
+        raw = sdscatlen(raw,c->buf+c->sentlen,c->bufpos-c->sentlen);
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+    while(listLength(c->reply) && sdslen(raw) < REPL_FRAME_MAX_RAW) {
+        listNode *ln = listFirst(c->reply);
+        sds o = listNodeValue(ln);
+        size_t objlen = sdslen(o);
+
+        raw = sdscatlen(raw,o+c->sentlen,objlen-c->sentlen);
+        c->reply_bytes -= objlen;
+        c->sentlen = 0;
+        listDelNode(c->reply,ln);
+    }
+    while(c->repl_disk_off != -1 && sdslen(raw) < REPL_FRAME_MAX_RAW) {
+        size_t room = replicaSendableLen(c->repl_disk_off,
+                                         REPL_FRAME_MAX_RAW-sdslen(raw));
+        ssize_t nread;
+
+        if (room == 0) break;
+        raw = sdsMakeRoomFor(raw,room);
+        nread = replDiskRead(c->repl_disk_off,raw+sdslen(raw),room);
+        if (nread == -1) {
+            serverLog(LL_WARNING,"Error reading the backlog from disk "
+                "for slave %s: %s", replicationGetSlaveName(c),
+                strerror(errno));
+            freeClientAsync(c);
+            break;
+        }
+        sdsIncrLen(raw,nread);
+        replicaConsumeDiskStream(c,nread);
+    }
+    while(c->ref_repl_buf_node && sdslen(raw) < REPL_FRAME_MAX_RAW) {
+        listNode *next = listNextNode(c->ref_repl_buf_node);
+        replBufBlock *b = listNodeValue(c->ref_repl_buf_node);
+        size_t avail;
+
+        if (b->used == c->ref_block_pos) {
+            if (next == NULL) break;
+            b->refcount--;
+            ((replBufBlock*)listNodeValue(next))->refcount++;
+            c->ref_repl_buf_node = next;
+            c->ref_block_pos = 0;
+            incrementalTrimReplicationBacklog(1);
+            continue;
+        }
+        avail = replicaSendableLen(b->repl_offset+c->ref_block_pos,
+                                   b->used-c->ref_block_pos);
+        if (avail == 0) break; /* Held until the AOF is fsynced. */
+        if (avail > REPL_FRAME_MAX_RAW-sdslen(raw))
+            avail = REPL_FRAME_MAX_RAW-sdslen(raw);
+        raw = sdscatlen(raw,b->buf+c->ref_block_pos,avail);
+        c->ref_block_pos += avail;
+    }
+
+    if (sdslen(raw))
+        c->repl_zbuf = replCompressFrames(c->repl_zbuf,raw,sdslen(raw));
+    sdsfree(raw);
+    return sdslen(c->repl_zbuf);
+}
+
+/* Called by readQueryFromClient() for a master with a compressed link,
+ * after 'nread' bytes were read at the end of the query buffer, that is
+ * 'qblen' bytes long. The frames are decoded in their place: the function
+ * returns the number of stream bytes now following the first 'qblen' of
+ * the query buffer (its length is left untouched), or -1 on error. */
+ssize_t replDecompressMasterInput(client *c, size_t qblen, size_t nread) {
+    ssize_t consumed;
+    size_t decoded;
+
+    c->repl_zbuf = sdscatlen(c->repl_zbuf,c->querybuf+qblen,nread);
+    consumed = replDecompressFrames(&c->querybuf,c->repl_zbuf,
+                                    sdslen(c->repl_zbuf));
+    if (consumed == -1) return -1;
+    sdsrange(c->repl_zbuf,consumed,-1);
+    decoded = sdslen(c->querybuf)-qblen;
+    sdssetlen(c->querybuf,qblen);
+    return decoded;
+}
@@ -0,0 +1,158 @@
+/* Disk tier of the replication backlog.
+ *
+ * The in memory backlog (see the comment on top of replication.c) allows
+ * a partial resync to slaves disconnected for as long as repl-backlog-size
+ * bytes of writes. Under a sustained write load this is a few minutes at
+ * best, and growing it costs memory.
+ *
+ * When "repl-backlog-disk-size" is not zero, the blocks released trimming
+ * the backlog are appended instead to segment files, so that a PSYNC can
+ * also be served from the older part of the stream:
+ *
+ *   | segment | segment | segment |    blocks in memory    |
+ *   ^ first byte on disk          ^ server.repl_backlog->offset
+ *
+ * The segments always end where the memory starts. Every segment holds up
+ * to REPL_BACKLOG_SEGMENT_SIZE bytes, the oldest one is deleted once the
+ * others are enough to hold repl-backlog-disk-size bytes. The files are
+ * created in the working directory and unlinked right away: they are never
+ * read after a restart, and there is nothing to clean up after a crash.
+ *
+ * A slave asking for an offset on disk gets c->repl_disk_off set instead
+ * of a reference to a block, writeToClient() sends it reading the files in
+ * small chunks, then switches to the blocks where the disk ends. Slaves
+ * still reading a segment being deleted are disconnected. */
+
+#include "server.h"
+#include "latency.h"
+
+#include <fcntl.h>
+
+#define REPL_BACKLOG_SEGMENT_SIZE (64*1024*1024)
+
+/* Open a new segment starting at 'offset'. Returns NULL on error. */
+static replBacklogSegment *replDiskCreateSegment(long long offset) {
+    char tmpfile[256];
+    replBacklogSegment *seg;
+    int fd;
+
+    snprintf(tmpfile,sizeof(tmpfile),"temp-backlog-%d-%lld.seg",
+        (int) getpid(), offset);
+    fd = open(tmpfile,O_RDWR|O_CREAT|O_TRUNC|O_APPEND,0600);
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Can't create the backlog segment %s: %s",
+            tmpfile, strerror(errno));
+        return NULL;
+    }
+    unlink(tmpfile);
+
+    seg = zmalloc(sizeof(*seg));
+    seg->fd = fd;
+    seg->repl_offset = offset;
+    seg->len = 0;
+    listAddNodeTail(server.repl_backlog_segments,seg);
+    return seg;
+}
+
+/* Delete the oldest segment, disconnecting the slaves still reading it. */
+static void replDiskDeleteFirstSegment(void) {
+    listNode *first = listFirst(server.repl_backlog_segments), *ln;
+    replBacklogSegment *seg = listNodeValue(first);
+    listIter li;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (slave->repl_disk_off != -1 &&
+            slave->repl_disk_off < seg->repl_offset+seg->len)
+        {
+            serverLog(LL_WARNING,"Disconnecting slave %s: the backlog "
+                "segment it is reading was deleted",
+                replicationGetSlaveName(slave));
+            freeClientAsync(slave);
+        }
+    }
+    close(seg->fd);
+    server.repl_backlog_disk_histlen -= seg->len;
+    listDelNode(server.repl_backlog_segments,first);
+}
+
+/* Delete the oldest segments while the others hold repl-backlog-disk-size
+ * bytes, or all of them if the disk tier was disabled. */
+void replDiskTrim(void) {
+    while(listLength(server.repl_backlog_segments)) {
+        replBacklogSegment *first =
+            listNodeValue(listFirst(server.repl_backlog_segments));
+
+        if (server.repl_backlog_disk_size &&
+            server.repl_backlog_disk_histlen - first->len <
+            server.repl_backlog_disk_size) break;
+        replDiskDeleteFirstSegment();
+    }
+}
+
+/* Release the whole disk tier. */
+void replDiskFreeSegments(void) {
+    while(listLength(server.repl_backlog_segments))
+        replDiskDeleteFirstSegment();
+}
+
+/* Append the block 'b', that is leaving the in memory backlog, to the
+ * disk tier. On error the disk tier is dropped: it is started again with
+ * the next block, so that the segments still end where the memory does. */
+void replDiskSpillBlock(replBufBlock *b) {
+    listNode *ln = listLast(server.repl_backlog_segments);
+    replBacklogSegment *seg = ln ? listNodeValue(ln) : NULL;
+    long long latency;
+    ssize_t nwritten;
+
+    if (seg == NULL || seg->len >= REPL_BACKLOG_SEGMENT_SIZE)
+        seg = replDiskCreateSegment(b->repl_offset);
+    if (seg == NULL) {
+        replDiskFreeSegments();
+        return;
+    }
+    serverAssert(seg->repl_offset+seg->len == b->repl_offset);
+
+    latencyStartMonitor(latency);
+    nwritten = write(seg->fd,b->buf,b->used);
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("backlog-disk-write",latency);
+    if (nwritten != (ssize_t)b->used) {
+        serverLog(LL_WARNING,"Error writing the backlog to disk, dropping "
+            "the disk part of the backlog: %s",
+            nwritten == -1 ? strerror(errno) : "short write");
+        replDiskFreeSegments();
+        return;
+    }
+    seg->len += nwritten;
+    server.repl_backlog_disk_histlen += nwritten;
+    replDiskTrim();
+}
+
+/* Read up to 'len' bytes of the stream starting at 'offset', that must
+ * be on disk. Returns the number of bytes read, less than 'len' at the end
+ * of a segment, or -1 on error. */
+ssize_t replDiskRead(long long offset, char *buf, size_t len) {
+    listNode *ln;
+    listIter li;
+
+    listRewind(server.repl_backlog_segments,&li);
+    while((ln = listNext(&li))) {
+        replBacklogSegment *seg = listNodeValue(ln);
+        long long avail = seg->repl_offset+seg->len-offset;
+        ssize_t nread;
+
+        if (offset < seg->repl_offset) break;
+        if (avail <= 0) continue;
+        if ((long long)len > avail) len = avail;
+        do {
+            nread = pread(seg->fd,buf,len,offset-seg->repl_offset);
+        } while(nread == -1 && errno == EINTR);
+        if (nread == 0) errno = EIO;
+        return nread > 0 ? nread : -1;
+    }
+    errno = ERANGE;
+    return -1;
+}
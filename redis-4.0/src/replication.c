@@ -42,6 +42,8 @@ void replicationResurrectCachedMaster(int newfd);
 void replicationSendAck(void);
 void putSlaveOnline(client *slave);
 int cancelReplicationHandshake(void);
+int replicationTryReuseSnapshot(client *c);
+static void replicaSetReplBufferOffset(client *c, long long offset);
 
 /* --------------------------- Utility functions ---------------------------- */
 
@@ -74,83 +76,147 @@ char *replicationGetSlaveName(client *c) {
 
 /* ---------------------------------- MASTER -------------------------------- */
 
+/* The replication stream is appended once to server.repl_buffer_blocks,
+ * a list of replBufBlock. The backlog and every slave reference the block
+ * where their data starts, so adding a write to the stream costs a single
+ * copy no matter how many slaves are attached, and the slaves are written
+ * directly from the blocks (see writeToClient()).
+ *
+ * The backlog always references the first block, so blocks are only freed
+ * trimming the backlog: the first block is released when the backlog is
+ * bigger than repl-backlog-size without it, and no slave is still sending
+ * it. A slave that is lagging behind keeps the backlog longer than its
+ * configured size (which makes PSYNC more likely to succeed), but not
+ * longer than its output buffer limits.
+ *
+ * The released blocks may be kept on disk instead, see repldisk.c. */
+
+#define REPL_BACKLOG_TRIM_BLOCKS_PER_CALL 1
+
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
-    server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
+    server.repl_backlog = zmalloc(sizeof(replBacklog));
+    server.repl_backlog->ref_repl_buf_node = NULL;
+    server.repl_backlog->histlen = 0;
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
      * replication stream. */
-    server.repl_backlog_off = server.master_repl_offset+1;
+    server.repl_backlog->offset = server.master_repl_offset+1;
 }
 
 /* This function is called when the user modifies the replication backlog
- * size at runtime. It is up to the function to both update the
- * server.repl_backlog_size and to resize the buffer and setup it so that
- * it contains the same data as the previous one (possibly less data, but
- * the most recent bytes, or the same data and more free space in case the
- * buffer is enlarged). */
+ * size at runtime. The data already in the backlog is retained: when the
+ * backlog is shrunk the oldest blocks are released incrementally. */
 void resizeReplicationBacklog(long long newsize) {
     if (newsize < CONFIG_REPL_BACKLOG_MIN_SIZE)
         newsize = CONFIG_REPL_BACKLOG_MIN_SIZE;
-    if (server.repl_backlog_size == newsize) return;
-
     server.repl_backlog_size = newsize;
-    if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
-    }
+    if (server.repl_backlog)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
 }
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
+    if (server.repl_backlog == NULL) return;
+
+    /* Without slaves the backlog holds the only reference to the blocks. */
+    listEmpty(server.repl_buffer_blocks);
+    server.repl_buffer_mem = 0;
+    replDiskFreeSegments();
     zfree(server.repl_backlog);
     server.repl_backlog = NULL;
 }
 
-/* Add data to the replication backlog.
+/* Release the first blocks of the backlog, at most 'max_blocks' of them,
+ * while the backlog is bigger than repl-backlog-size. */
+void incrementalTrimReplicationBacklog(size_t max_blocks) {
+    size_t trimmed = 0;
+
+    serverAssert(server.repl_backlog != NULL);
+    while (server.repl_backlog->histlen > server.repl_backlog_size &&
+           trimmed < max_blocks &&
+           listLength(server.repl_buffer_blocks) > 1)
+    {
+        listNode *first = listFirst(server.repl_buffer_blocks);
+        listNode *next = listNextNode(first);
+        replBufBlock *fo = listNodeValue(first);
+
+        serverAssert(first == server.repl_backlog->ref_repl_buf_node);
+        /* Some slave is still sending the block. */
+        if (fo->refcount != 1) break;
+        /* Don't trim below the configured size. */
+        if (server.repl_backlog->histlen - (long long)fo->used <
+            server.repl_backlog_size) break;
+
+        if (server.repl_backlog_disk_size) replDiskSpillBlock(fo);
+        server.repl_backlog->histlen -= fo->used;
+        server.repl_backlog->ref_repl_buf_node = next;
+        ((replBufBlock*)listNodeValue(next))->refcount++;
+        server.repl_buffer_mem -= fo->size+sizeof(replBufBlock)+
+                                  sizeof(listNode);
+        listDelNode(server.repl_buffer_blocks,first);
+        trimmed++;
+    }
+
+    /* Set the offset of the first byte we have in the backlog. */
+    server.repl_backlog->offset = server.master_repl_offset -
+                                  server.repl_backlog->histlen + 1;
+}
+
+/* Add data to the replication buffer, read by the backlog and the slaves.
  * This function also increments the global replication offset stored at
  * server.master_repl_offset, because there is no case where we want to feed
  * the backlog without incrementing the offset. */
-void feedReplicationBacklog(void *ptr, size_t len) {
-    unsigned char *p = ptr;
+void feedReplicationBuffer(void *ptr, size_t len) {
+    listNode *ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *tail = ln ? listNodeValue(ln) : NULL;
+    char *p = ptr;
 
+    if (server.repl_backlog == NULL) return;
     server.master_repl_offset += len;
-
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
-        if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
-        len -= thislen;
-        p += thislen;
-        server.repl_backlog_histlen += thislen;
-    }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    server.repl_backlog_off = server.master_repl_offset -
-                              server.repl_backlog_histlen + 1;
+    server.repl_backlog->histlen += len;
+
+    /* Fill the free space of the last block first... */
+    if (tail && tail->size > tail->used) {
+        size_t avail = tail->size - tail->used;
+        size_t copy = (avail >= len) ? len : avail;
+
+        memcpy(tail->buf+tail->used,p,copy);
+        tail->used += copy;
+        p += copy;
+        len -= copy;
+    }
+
+    /* ...then add a new one for the rest. */
+    if (len) {
+        size_t size = (len < PROTO_REPLY_CHUNK_BYTES) ?
+                      PROTO_REPLY_CHUNK_BYTES : len;
+
+        tail = zmalloc(sizeof(replBufBlock)+size);
+        tail->refcount = 0;
+        tail->repl_offset = server.master_repl_offset - len + 1;
+        tail->size = size;
+        tail->used = len;
+        memcpy(tail->buf,p,len);
+        listAddNodeTail(server.repl_buffer_blocks,tail);
+        server.repl_buffer_mem += size+sizeof(replBufBlock)+sizeof(listNode);
+
+        if (server.repl_backlog->ref_repl_buf_node == NULL) {
+            /* The buffer is empty only before the first write. */
+            serverAssert(listLength(server.repl_buffer_blocks) == 1);
+            server.repl_backlog->ref_repl_buf_node =
+                listFirst(server.repl_buffer_blocks);
+            tail->refcount++;
+        }
+    }
+    server.repl_backlog->offset = server.master_repl_offset -
+                                  server.repl_backlog->histlen + 1;
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Wrapper for feedReplicationBuffer() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationBufferWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -162,7 +228,64 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen(o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
+    feedReplicationBuffer(p,len);
+}
+
+/* Slaves waiting for BGSAVE to start don't get the replication stream:
+ * they'll start accumulating it when the RDB they'll load is created. */
+static int canFeedReplicaReplBuffer(client *slave) {
+    return slave->replstate != SLAVE_STATE_WAIT_BGSAVE_START &&
+           slave->repl_disk_off == -1;
+}
+
+/* Called before appending a chunk of the replication stream, returns in
+ * 'node' and 'pos' where the chunk is going to start, to be passed to
+ * replicationFeedEnd(). As a side effect the write handler of the slaves
+ * that had nothing to send is installed, like addReply() does. */
+static void replicationFeedBegin(list *slaves, listNode **node, size_t *pos) {
+    listNode *ln;
+    listIter li;
+
+    *node = listLast(server.repl_buffer_blocks);
+    *pos = *node ? ((replBufBlock*)listNodeValue(*node))->used : 0;
+
+    listRewind(slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (canFeedReplicaReplBuffer(slave)) prepareClientToWrite(slave);
+    }
+}
+
+/* Called after appending a chunk of the replication stream: slaves that
+ * are not referencing the buffer yet start from the chunk, and the ones
+ * that are now too far behind are disconnected. */
+static void replicationFeedEnd(list *slaves, listNode *node, size_t pos) {
+    listNode *ln;
+    listIter li;
+
+    if (node == NULL) {
+        node = listFirst(server.repl_buffer_blocks);
+        pos = 0;
+    } else if (pos == ((replBufBlock*)listNodeValue(node))->size) {
+        node = listNextNode(node);
+        pos = 0;
+    }
+    if (node == NULL) return; /* Nothing was added. */
+
+    listRewind(slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+        if (slave->ref_repl_buf_node == NULL) {
+            slave->ref_repl_buf_node = node;
+            slave->ref_block_pos = pos;
+            ((replBufBlock*)listNodeValue(node))->refcount++;
+        }
+        asyncCloseClientOnOutputBufferLimitReached(slave);
+    }
+    incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
 }
 
 /* Propagate write commands to slaves, and populate the replication backlog
@@ -171,10 +294,11 @@ void feedReplicationBacklogWithObject(robj *o) {
  * stream. Instead if the instance is a slave and has sub-slaves attached,
  * we use replicationFeedSlavesFromMaster() */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
+    listNode *start_node;
+    size_t start_pos;
     int j, len;
     char llstr[LONG_STR_SIZE];
+    char aux[LONG_STR_SIZE+3];
 
     /* If the instance is not a top level master, return ASAP: we'll just proxy
      * the stream of data we receive from our master instead, in order to
@@ -190,6 +314,8 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
+    replicationFeedBegin(slaves,&start_node,&start_pos);
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -207,77 +333,166 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = ln->value;
-            if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-            addReply(slave,selectcmd);
-        }
+        feedReplicationBufferWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
-        char aux[LONG_STR_SIZE+3];
+    /* Write the command to the replication buffer. */
+
+    /* Add the multi bulk reply length. */
+    aux[0] = '*';
+    len = ll2string(aux+1,sizeof(aux)-1,argc);
+    aux[len+1] = '\r';
+    aux[len+2] = '\n';
+    feedReplicationBuffer(aux,len+3);
 
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
+    for (j = 0; j < argc; j++) {
+        long objlen = stringObjectLen(argv[j]);
+
+        /* We need to feed the buffer with the object as a bulk reply
+         * not just as a plain string, so create the $..CRLF payload len
+         * and add the final CRLF */
+        aux[0] = '$';
+        len = ll2string(aux+1,sizeof(aux)-1,objlen);
         aux[len+1] = '\r';
         aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
+        feedReplicationBuffer(aux,len+3);
+        feedReplicationBufferWithObject(argv[j]);
+        feedReplicationBuffer(aux+len+1,2);
+    }
 
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
+    replicationFeedEnd(slaves,start_node,start_pos);
+}
 
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
-        }
+/* Called when a slave is freed, or stops being a slave, to release the
+ * block of the replication buffer it references. */
+void freeReplicaReferencedReplBuffer(client *replica) {
+    replica->repl_disk_off = -1;
+    if (replica->ref_repl_buf_node == NULL) return;
+    ((replBufBlock*)listNodeValue(replica->ref_repl_buf_node))->refcount--;
+    replica->ref_repl_buf_node = NULL;
+    replica->ref_block_pos = 0;
+    if (server.repl_backlog)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+}
+
+/* Let the slave 'dst' send the same replication stream of 'src', used
+ * when a slave attaches to the BGSAVE another slave is waiting for. */
+void copyReplicaOutputBuffer(client *dst, client *src) {
+    freeReplicaReferencedReplBuffer(dst);
+    dst->repl_disk_off = src->repl_disk_off;
+    if (src->ref_repl_buf_node == NULL) return;
+    dst->ref_repl_buf_node = src->ref_repl_buf_node;
+    dst->ref_block_pos = src->ref_block_pos;
+    ((replBufBlock*)listNodeValue(dst->ref_repl_buf_node))->refcount++;
+}
+
+/* Return true if the slave 'c' has part of the replication buffer still
+ * to send. */
+int replicaHasPendingStream(client *c) {
+    listNode *ln = c->ref_repl_buf_node;
+
+    if (c->repl_compress && c->repl_zbuf_pos < sdslen(c->repl_zbuf))
+        return 1;
+    if (c->repl_disk_off != -1) return 1;
+    if (ln == NULL) return 0;
+    return ln != listLast(server.repl_buffer_blocks) ||
+           c->ref_block_pos < ((replBufBlock*)listNodeValue(ln))->used;
+}
+
+/* Like replicaHasPendingStream(), but ignoring the part of the stream held
+ * until the AOF is fsynced, see aofReplSafeOffset(). */
+int replicaHasSendableStream(client *c) {
+    replBufBlock *b;
+
+    if (c->repl_compress && c->repl_zbuf_pos < sdslen(c->repl_zbuf))
+        return 1;
+    if (c->repl_disk_off != -1)
+        return replicaSendableLen(c->repl_disk_off,1) != 0;
+    if (!replicaHasPendingStream(c)) return 0;
+    b = listNodeValue(c->ref_repl_buf_node);
+    return replicaSendableLen(b->repl_offset+c->ref_block_pos,1) != 0;
+}
+
+/* Return how many of the 'len' bytes of the stream starting at 'offset'
+ * can be sent to the slaves now, see aofReplSafeOffset(). */
+size_t replicaSendableLen(long long offset, size_t len) {
+    long long left = aofReplSafeOffset() - offset + 1;
+
+    if (left <= 0) return 0;
+    return ((long long)len > left) ? (size_t)left : len;
+}
+
+/* Bytes of the replication buffer the slave 'c' still has to send. */
+size_t replicaPendingStreamBytes(client *c) {
+    replBufBlock *cur, *last;
+
+    if (c->ref_repl_buf_node == NULL) return 0;
+    cur = listNodeValue(c->ref_repl_buf_node);
+    last = listNodeValue(listLast(server.repl_buffer_blocks));
+    return (last->repl_offset + last->used) -
+           (cur->repl_offset + c->ref_block_pos);
+}
+
+/* Make the slave 'c' send the replication stream starting at 'offset',
+ * that must be inside the backlog. When 'offset' is the next byte we'll
+ * generate, the slave will start from the next chunk fed to the buffer.
+ * If 'offset' is on disk the slave will read the disk first. */
+static void replicaSetReplBufferOffset(client *c, long long offset) {
+    listNode *ln;
+    listIter li;
+    replBufBlock *o = NULL;
+
+    freeReplicaReferencedReplBuffer(c);
+    if (offset < server.repl_backlog->offset) {
+        serverAssert(offset >= replicationBacklogFirstByte());
+        c->repl_disk_off = offset;
+        return;
     }
+    if (server.repl_backlog->histlen == 0) return;
 
-    /* Write the command to every slave. */
-    listRewind(slaves,&li);
+    /* Find the block containing 'offset', or the last one if the slave
+     * already has everything. */
+    listRewind(server.repl_buffer_blocks,&li);
     while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        /* Don't feed slaves that are still waiting for BGSAVE to start */
-        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
+        o = listNodeValue(ln);
+        if (offset < o->repl_offset + (long long)o->used ||
+            ln == listLast(server.repl_buffer_blocks)) break;
+    }
+    serverAssert(ln != NULL && offset >= o->repl_offset);
 
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
+    c->ref_repl_buf_node = ln;
+    c->ref_block_pos = offset - o->repl_offset;
+    o->refcount++;
+}
 
-        /* Add the multi bulk length. */
-        addReplyMultiBulkLen(slave,argc);
+/* Called after 'len' bytes read from the disk tier were sent to the slave
+ * 'c'. Where the disk ends, the slave goes on with the blocks in memory. */
+void replicaConsumeDiskStream(client *c, size_t len) {
+    c->repl_disk_off += len;
+    if (c->repl_disk_off == server.repl_backlog->offset)
+        replicaSetReplBufferOffset(c,c->repl_disk_off);
+}
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
+/* Offset of the first byte of the backlog, on disk or in memory. */
+long long replicationBacklogFirstByte(void) {
+    if (listLength(server.repl_backlog_segments)) {
+        replBacklogSegment *seg =
+            listNodeValue(listFirst(server.repl_backlog_segments));
+        return seg->repl_offset;
     }
+    return server.repl_backlog->offset;
 }
 
 /* This function is used in order to proxy what we receive from our master
  * to our sub-slaves. */
 #include <ctype.h>
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen) {
-    listNode *ln;
-    listIter li;
+    listNode *start_node;
+    size_t start_pos;
 
     /* Debugging: this is handy to see the stream sent from master
      * to slaves. Disabled with if(0). */
@@ -289,15 +504,10 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        /* Don't feed slaves that are still waiting for BGSAVE to start */
-        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-        addReplyString(slave,buf,buflen);
-    }
+    if (server.repl_backlog == NULL) return;
+    replicationFeedBegin(slaves,&start_node,&start_pos);
+    feedReplicationBuffer(buf,buflen);
+    replicationFeedEnd(slaves,start_node,start_pos);
 }
 
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc) {
@@ -340,13 +550,16 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
+ * specified 'offset' up to the end of the backlog: the slave just starts
+ * sending the replication buffer from the block containing 'offset'. */
 long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
+    long long len = server.master_repl_offset - offset + 1;
 
     serverLog(LL_DEBUG, "[PSYNC] Slave request offset: %lld", offset);
 
-    if (server.repl_backlog_histlen == 0) {
+    if (server.repl_backlog->histlen == 0 &&
+        listLength(server.repl_backlog_segments) == 0)
+    {
         serverLog(LL_DEBUG, "[PSYNC] Backlog history len is zero");
         return 0;
     }
@@ -354,41 +567,14 @@ long long addReplyReplicationBacklog(client *c, long long offset) {
     serverLog(LL_DEBUG, "[PSYNC] Backlog size: %lld",
              server.repl_backlog_size);
     serverLog(LL_DEBUG, "[PSYNC] First byte: %lld",
-             server.repl_backlog_off);
+             server.repl_backlog->offset);
     serverLog(LL_DEBUG, "[PSYNC] History len: %lld",
-             server.repl_backlog_histlen);
-    serverLog(LL_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
-
-    /* Compute the amount of bytes we need to discard. */
-    skip = offset - server.repl_backlog_off;
-    serverLog(LL_DEBUG, "[PSYNC] Skipping: %lld", skip);
-
-    /* Point j to the oldest byte, that is actually our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    serverLog(LL_DEBUG, "[PSYNC] Index of first byte: %lld", j);
-
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
-
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
+             server.repl_backlog->histlen);
 
-        serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
-    }
-    return server.repl_backlog_histlen - skip;
+    prepareClientToWrite(c);
+    replicaSetReplBufferOffset(c,offset);
+    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
+    return len;
 }
 
 /* Return the offset to provide as reply to the PSYNC command received
@@ -489,8 +675,9 @@ int masterTryPartialResynchronization(client *c) {
 
     /* We still have the data our slave is asking for? */
     if (!server.repl_backlog ||
-        psync_offset < server.repl_backlog_off ||
-        psync_offset > (server.repl_backlog_off + server.repl_backlog_histlen))
+        psync_offset < replicationBacklogFirstByte() ||
+        psync_offset > (server.repl_backlog->offset +
+                        server.repl_backlog->histlen))
     {
         serverLog(LL_NOTICE,
             "Unable to partial resync with slave %s for lack of backlog (Slave request was: %lld).", replicationGetSlaveName(c), psync_offset);
@@ -522,6 +709,7 @@ int masterTryPartialResynchronization(client *c) {
         freeClientAsync(c);
         return C_OK;
     }
+    replicationStartCompression(c);
     psync_len = addReplyReplicationBacklog(c,psync_offset);
     serverLog(LL_NOTICE,
         "Partial resynchronization request from %s accepted. Sending %lld bytes of backlog starting from offset %lld.",
@@ -604,8 +792,13 @@ int startBgsaveForReplication(int mincapa) {
     }
 
     /* If the target is socket, rdbSaveToSlavesSockets() already setup
-     * the salves for a full resync. Otherwise for disk target do it now.*/
+     * the salves for a full resync. Otherwise for disk target do it now,
+     * and remember the offset of the RDB so that it can be reused by the
+     * slaves arriving after the BGSAVE started. */
     if (!socket_target) {
+        memcpy(server.repl_snapshot_replid,server.replid,
+               sizeof(server.replid));
+        server.repl_snapshot_pending_offset = getPsyncInitialOffset();
         listRewind(server.slaves,&li);
         while((ln = listNext(&li))) {
             client *slave = ln->value;
@@ -698,8 +891,15 @@ void syncCommand(client *c) {
         createReplicationBacklog();
     }
 
+    /* CASE 0: A recent RDB file created for replication can be sent
+     * as it is, streaming the backlog from its offset. */
+    if (replicationTryReuseSnapshot(c) == C_OK) {
+        server.stat_sync_full_reused++;
+        return;
+    }
+
     /* CASE 1: BGSAVE is in progress, with disk target. */
-    if (server.rdb_child_pid != -1 &&
+    if ((server.rdb_child_pid != -1 || server.rdb_snapshot) &&
         server.rdb_child_type == RDB_CHILD_TYPE_DISK)
     {
         /* Ok a background save is in progress. Let's check if it is a good
@@ -720,6 +920,7 @@ void syncCommand(client *c) {
             /* Perfect, the server is already registering differences for
              * another slave. Set the right state, and copy the buffer. */
             copyClientOutputBuffer(c,slave);
+            copyReplicaOutputBuffer(c,slave);
             replicationSetupSlaveForFullResync(c,slave->psync_initial_offset);
             serverLog(LL_NOTICE,"Waiting for end of BGSAVE for SYNC");
         } else {
@@ -807,6 +1008,16 @@ void replconfCommand(client *c) {
                 c->slave_capa |= SLAVE_CAPA_EOF;
             else if (!strcasecmp(c->argv[j+1]->ptr,"psync2"))
                 c->slave_capa |= SLAVE_CAPA_PSYNC2;
+        } else if (!strcasecmp(c->argv[j]->ptr,"compress")) {
+            /* Unlike capa, the slave needs to know if we accept, in order
+             * to parse what we'll send. See replcompress.c. */
+            if (!server.repl_compression ||
+                strcasecmp(c->argv[j+1]->ptr,"lz4"))
+            {
+                addReplyError(c,"Replication compression not available");
+                return;
+            }
+            c->slave_capa |= SLAVE_CAPA_LZ4;
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -856,6 +1067,7 @@ void putSlaveOnline(client *slave) {
     slave->replstate = SLAVE_STATE_ONLINE;
     slave->repl_put_online_on_ack = 0;
     slave->repl_ack_time = server.unixtime; /* Prevent false timeout. */
+    replicationStartCompression(slave);
     if (aeCreateFileEvent(server.el, slave->fd, AE_WRITABLE,
         sendReplyToClient, slave) == AE_ERR) {
         serverLog(LL_WARNING,"Unable to register writable event for slave bulk transfer: %s", strerror(errno));
@@ -923,6 +1135,21 @@ void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+/* Start sending the RDB file 'fd' of 'size' bytes to the slave, that will
+ * go online once the transfer is completed. */
+static int replicationStartBulkTransfer(client *slave, int fd, off_t size) {
+    slave->repldbfd = fd;
+    slave->repldboff = 0;
+    slave->repldbsize = size;
+    slave->replstate = SLAVE_STATE_SEND_BULK;
+    slave->replpreamble = sdscatprintf(sdsempty(),"$%lld\r\n",
+        (unsigned long long) slave->repldbsize);
+
+    aeDeleteFileEvent(server.el,slave->fd,AE_WRITABLE);
+    if (aeCreateFileEvent(server.el, slave->fd, AE_WRITABLE, sendBulkToSlave, slave) == AE_ERR) return C_ERR;
+    return C_OK;
+}
+
 /* This function is called at the end of every background saving,
  * or when the replication RDB transfer strategy is modified from
  * disk to socket or the other way around.
@@ -939,7 +1166,7 @@ void sendBulkToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
  * (if it had a disk or socket target). */
 void updateSlavesWaitingBgsave(int bgsaveerr, int type) {
     listNode *ln;
-    int startbgsave = 0;
+    int startbgsave = 0, fd;
     int mincapa = -1;
     listIter li;
 
@@ -977,29 +1204,91 @@ void updateSlavesWaitingBgsave(int bgsaveerr, int type) {
                     serverLog(LL_WARNING,"SYNC failed. BGSAVE child returned an error");
                     continue;
                 }
-                if ((slave->repldbfd = open(server.rdb_filename,O_RDONLY)) == -1 ||
-                    redis_fstat(slave->repldbfd,&buf) == -1) {
+                if ((fd = open(server.rdb_filename,O_RDONLY)) == -1 ||
+                    redis_fstat(fd,&buf) == -1) {
+                    if (fd != -1) close(fd);
                     freeClient(slave);
                     serverLog(LL_WARNING,"SYNC failed. Can't open/stat DB after BGSAVE: %s", strerror(errno));
                     continue;
                 }
-                slave->repldboff = 0;
-                slave->repldbsize = buf.st_size;
-                slave->replstate = SLAVE_STATE_SEND_BULK;
-                slave->replpreamble = sdscatprintf(sdsempty(),"$%lld\r\n",
-                    (unsigned long long) slave->repldbsize);
-
-                aeDeleteFileEvent(server.el,slave->fd,AE_WRITABLE);
-                if (aeCreateFileEvent(server.el, slave->fd, AE_WRITABLE, sendBulkToSlave, slave) == AE_ERR) {
+                if (replicationStartBulkTransfer(slave,fd,buf.st_size) ==
+                    C_ERR)
+                {
                     freeClient(slave);
                     continue;
                 }
             }
         }
     }
+
+    /* The RDB created for replication can now serve the slaves arriving
+     * in the next repl-snapshot-reuse-window seconds. */
+    if (type == RDB_CHILD_TYPE_DISK &&
+        server.repl_snapshot_pending_offset != -1)
+    {
+        struct redis_stat buf;
+
+        if (bgsaveerr == C_OK && redis_stat(server.rdb_filename,&buf) == 0) {
+            server.repl_snapshot_offset = server.repl_snapshot_pending_offset;
+            server.repl_snapshot_time = server.unixtime;
+            server.repl_snapshot_ino = buf.st_ino;
+            server.repl_snapshot_size = buf.st_size;
+        }
+        server.repl_snapshot_pending_offset = -1;
+    }
     if (startbgsave) startBgsaveForReplication(mincapa);
 }
 
+/* Forget the RDB file created for replication, called every time the RDB
+ * file is going to be rewritten. */
+void replicationInvalidateSnapshot(void) {
+    server.repl_snapshot_offset = -1;
+    server.repl_snapshot_pending_offset = -1;
+}
+
+/* Send the RDB file we created for a past full resync to the slave 'c',
+ * followed by the replication stream starting at the offset of the file.
+ * This is possible only if the file is recent enough, the replication
+ * history didn't change since then, and the backlog still has the whole
+ * stream generated after the RDB was created. Otherwise C_ERR is returned
+ * and the usual full resync is performed. */
+int replicationTryReuseSnapshot(client *c) {
+    struct redis_stat buf;
+    long long offset = server.repl_snapshot_offset;
+    int fd;
+
+    if (server.repl_snapshot_reuse_window == 0 || offset == -1) return C_ERR;
+    if (server.unixtime - server.repl_snapshot_time >
+        server.repl_snapshot_reuse_window) return C_ERR;
+    if (memcmp(server.repl_snapshot_replid,server.replid,
+               sizeof(server.replid)) != 0) return C_ERR;
+    if (server.repl_backlog == NULL ||
+        replicationBacklogFirstByte() > offset+1) return C_ERR;
+
+    /* Make sure the file on disk is still the one we created. */
+    if ((fd = open(server.rdb_filename,O_RDONLY)) == -1) return C_ERR;
+    if (redis_fstat(fd,&buf) == -1 ||
+        buf.st_ino != server.repl_snapshot_ino ||
+        buf.st_size != server.repl_snapshot_size)
+    {
+        close(fd);
+        return C_ERR;
+    }
+
+    if (replicationSetupSlaveForFullResync(c,offset) == C_ERR) {
+        close(fd);
+        return C_OK; /* The slave is going to be closed. */
+    }
+    replicaSetReplBufferOffset(c,offset+1);
+    if (replicationStartBulkTransfer(c,fd,buf.st_size) == C_ERR)
+        freeClientAsync(c);
+    serverLog(LL_NOTICE,"Sending the RDB created %d seconds ago for SYNC, "
+                        "streaming the backlog from offset %lld",
+                        (int)(server.unixtime - server.repl_snapshot_time),
+                        offset+1);
+    return C_OK;
+}
+
 /* Change the current instance replication ID with a new, random one.
  * This will prevent successful PSYNCs between this master and other
  * slaves, so the command should be called when something happens that
@@ -1101,10 +1390,168 @@ void restartAOF() {
     }
 }
 
+/* Final setup of the connected slave <- master link, once the RDB payload
+ * of a full resynchronization was loaded. */
+static void replicationFinishFullSync(rdbSaveInfo *rsi) {
+    replicationCreateMasterClient(server.repl_transfer_s,rsi->repl_stream_db);
+    server.repl_state = REPL_STATE_CONNECTED;
+    /* After a full resynchroniziation we use the replication ID and
+     * offset of the master. The secondary ID / offset are cleared since
+     * we are starting a new history. */
+    memcpy(server.replid,server.master->replid,sizeof(server.replid));
+    server.master_repl_offset = server.master->reploff;
+    clearReplicationId2();
+    /* Let's create the replication backlog if needed. Slaves need to
+     * accumulate the backlog regardless of the fact they have sub-slaves
+     * or not, in order to behave correctly if they are promoted to
+     * masters after a failover. */
+    if (server.repl_backlog == NULL) createReplicationBacklog();
+
+    serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Finished with success");
+}
+
+/* Return true if the RDB payload of the master should be parsed directly
+ * from the socket instead of being saved to a temp file first, according
+ * to the repl-diskless-load option. */
+static int useDisklessLoad(void) {
+    int j;
+
+    /* A short read while loading a module value is a fatal error, while
+     * the connection with the master can always drop. */
+    if (moduleCount()) return 0;
+    if (server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB) return 1;
+    if (server.repl_diskless_load != REPL_DISKLESS_LOAD_WHEN_DB_EMPTY)
+        return 0;
+    for (j = 0; j < server.dbnum; j++)
+        if (dictSize(server.db[j].dict)) return 0;
+    return 1;
+}
+
+/* Read the bytes following the RDB payload in the master stream: the EOF
+ * mark if 'eofmark' is not NULL (preceded by the checksum we did not read
+ * if rdbchecksum is disabled), otherwise what is left of the bulk payload,
+ * like the index appended by rdb-save-index. Returns C_OK or C_ERR. */
+static int readSyncBulkPayloadTrailer(rio *rdb, char *eofmark) {
+    char buf[4096];
+
+    rdb->update_cksum = NULL;
+    if (eofmark) {
+        if (!server.rdb_checksum && rioRead(rdb,buf,8) == 0) return C_ERR;
+        if (rioRead(rdb,buf,CONFIG_RUN_ID_SIZE) == 0) return C_ERR;
+        if (memcmp(buf,eofmark,CONFIG_RUN_ID_SIZE) != 0) {
+            serverLog(LL_WARNING,"The EOF mark received from the MASTER "
+                                 "doesn't match the announced one");
+            return C_ERR;
+        }
+        return C_OK;
+    }
+    while (rioTell(rdb) < server.repl_transfer_size) {
+        size_t len = server.repl_transfer_size - rioTell(rdb);
+
+        if (len > sizeof(buf)) len = sizeof(buf);
+        if (rioRead(rdb,buf,len) == 0) return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Load the RDB payload of the master directly from the socket 'fd', after
+ * the bulk header was read. The socket is read in blocking mode, with a
+ * timeout, by the loading code, that serves the clients from time to time.
+ *
+ * With repl-diskless-load swapdb the payload is loaded in a set of temp DBs
+ * while the clients are still served the old dataset, that is replaced
+ * only once the load succeeded. Otherwise (and always in cluster mode,
+ * where the slots -> keys map tracks the main DBs only) the old data is
+ * flushed first, as when loading from disk. */
+static void readSyncBulkPayloadDiskless(int fd, char *eofmark, int framed) {
+    int aof_is_enabled = server.aof_state != AOF_OFF;
+    int async = server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB &&
+                !server.cluster_enabled;
+    int flush_flags = server.repl_slave_lazy_flush ? EMPTYDB_ASYNC :
+                                                     EMPTYDB_NO_FLAGS;
+    size_t size = eofmark ? 0 : (size_t)server.repl_transfer_size;
+    rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
+    redisDb *dbs = server.db;
+    rio rdb;
+    int retval;
+
+    /* The readable handler would be called recursively by the loading
+     * code processing events. */
+    aeDeleteFileEvent(server.el,fd,AE_READABLE);
+    if (anetBlock(NULL,fd) == ANET_ERR ||
+        anetRecvTimeout(NULL,fd,server.repl_timeout*1000) == ANET_ERR)
+    {
+        serverLog(LL_WARNING,"Can't set the MASTER socket in blocking mode "
+                             "for the diskless load: %s", strerror(errno));
+        cancelReplicationHandshake();
+        return;
+    }
+
+    /* We need to stop any AOFRW fork before flusing and parsing RDB,
+     * otherwise we'll create a copy-on-write disaster. */
+    if (aof_is_enabled) stopAppendOnly();
+    if (async) {
+        /* A forkless snapshot in progress tracks the keys by DB id: finish
+         * it now, so that the keys loaded in the temp DBs are not mistaken
+         * for keys of the DBs it is saving. */
+        rdbSnapshotFinishSerialization();
+        dbs = initTempDb();
+        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory "
+                             "from socket, serving the old data meanwhile");
+    } else {
+        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
+        signalFlushedDb(-1);
+        emptyDb(-1,flush_flags,replicationEmptyDbCallback);
+        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory "
+                             "from socket");
+    }
+
+    rioInitWithSocket(&rdb,fd,size);
+    rdb.io.sock.framed = framed;
+    startLoadingStream(size,async);
+    retval = rdbLoadRioIntoDbs(&rdb,&rsi,dbs);
+    if (retval == C_OK) retval = readSyncBulkPayloadTrailer(&rdb,eofmark);
+    stopLoading();
+    rioFreeSocket(&rdb);
+    server.repl_transfer_lastio = server.unixtime;
+
+    if (retval == C_OK &&
+        (anetNonBlock(NULL,fd) == ANET_ERR ||
+         anetRecvTimeout(NULL,fd,0) == ANET_ERR)) retval = C_ERR;
+
+    if (retval != C_OK) {
+        serverLog(LL_WARNING,"Failed trying to load the MASTER "
+                             "synchronization DB from socket");
+        /* Never serve a partially loaded dataset. */
+        if (async)
+            discardTempDb(dbs,server.repl_slave_lazy_flush);
+        else
+            emptyDb(-1,flush_flags,replicationEmptyDbCallback);
+        cancelReplicationHandshake();
+        /* Re-enable the AOF if we disabled it earlier, in order to restore
+         * the original configuration. */
+        if (aof_is_enabled) restartAOF();
+        return;
+    }
+
+    if (async) {
+        /* 载入成功：换上新数据集，旧数据集随临时DB一起释放 */
+        signalFlushedDb(-1);
+        swapMainDbWithTempDb(dbs);
+        flushSlaveKeysWithExpireList();
+        discardTempDb(dbs,server.repl_slave_lazy_flush);
+    }
+    replicationFinishFullSync(&rsi);
+    /* Restart the AOF subsystem now that we finished the sync. This
+     * will trigger an AOF rewrite, and when done will start appending
+     * to the new file. */
+    if (aof_is_enabled) restartAOF();
+}
+
 /* Asynchronously read the SYNC payload we receive from a master */
 #define REPL_MAX_WRITTEN_BEFORE_FSYNC (1024*1024*8) /* 8 MB */
 void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
-    char buf[4096];
+    char buf[4096], *p = buf;
     ssize_t nread, readlen;
     off_t left;
     UNUSED(el);
@@ -1116,6 +1563,10 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     static char eofmark[CONFIG_RUN_ID_SIZE];
     static char lastbytes[CONFIG_RUN_ID_SIZE];
     static int usemark = 0;
+    /* With a compressed link, the frames not decoded yet, and the RDB
+     * they hold. */
+    static int framed = 0;
+    static sds zin = NULL, zout = NULL;
 
     /* If repl_transfer_size == -1 we still have to read the bulk length
      * from the master reply. */
@@ -1152,7 +1603,17 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
          *
          * At the end of the file the announced delimiter is transmitted. The
          * delimiter is long and random enough that the probability of a
-         * collision with the actual file content can be ignored. */
+         * collision with the actual file content can be ignored.
+         *
+         * If the link is compressed the master may use $EOFZ: instead, and
+         * send the payload and the delimiter as frames. */
+        framed = strncmp(buf+1,"EOFZ:",5) == 0;
+        if (framed) {
+            memmove(buf+4,buf+5,strlen(buf+5)+1); /* Now it's $EOF: */
+            if (zin == NULL) zin = sdsempty();
+            if (zout == NULL) zout = sdsempty();
+            sdsclear(zin);
+        }
         if (strncmp(buf+1,"EOF:",4) == 0 && strlen(buf+5) >= CONFIG_RUN_ID_SIZE) {
             usemark = 1;
             memcpy(eofmark,buf+5,CONFIG_RUN_ID_SIZE);
@@ -1169,6 +1630,9 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
                 "MASTER <-> SLAVE sync: receiving %lld bytes from master",
                 (long long) server.repl_transfer_size);
         }
+        /* 没有临时文件：直接从socket载入，见readSyncBulkPayloadDiskless() */
+        if (server.repl_transfer_fd == -1)
+            readSyncBulkPayloadDiskless(fd,usemark ? eofmark : NULL,framed);
         return;
     }
 
@@ -1188,6 +1652,24 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
         return;
     }
     server.stat_net_input_bytes += nread;
+    server.repl_transfer_lastio = server.unixtime;
+
+    /* Go on with the part of the RDB held by the complete frames. */
+    if (framed) {
+        ssize_t consumed;
+
+        zin = sdscatlen(zin,buf,nread);
+        sdsclear(zout);
+        if ((consumed = replDecompressFrames(&zout,zin,sdslen(zin))) == -1) {
+            serverLog(LL_WARNING,"Corrupted frame in the compressed RDB "
+                                 "received from the MASTER");
+            goto error;
+        }
+        sdsrange(zin,consumed,-1);
+        p = zout;
+        nread = sdslen(zout);
+        if (nread == 0) return;
+    }
 
     /* When a mark is used, we want to detect EOF asap in order to avoid
      * writing the EOF mark into the file... */
@@ -1196,17 +1678,16 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     if (usemark) {
         /* Update the last bytes array, and check if it matches our delimiter.*/
         if (nread >= CONFIG_RUN_ID_SIZE) {
-            memcpy(lastbytes,buf+nread-CONFIG_RUN_ID_SIZE,CONFIG_RUN_ID_SIZE);
+            memcpy(lastbytes,p+nread-CONFIG_RUN_ID_SIZE,CONFIG_RUN_ID_SIZE);
         } else {
             int rem = CONFIG_RUN_ID_SIZE-nread;
             memmove(lastbytes,lastbytes+nread,rem);
-            memcpy(lastbytes+rem,buf,nread);
+            memcpy(lastbytes+rem,p,nread);
         }
         if (memcmp(lastbytes,eofmark,CONFIG_RUN_ID_SIZE) == 0) eof_reached = 1;
     }
 
-    server.repl_transfer_lastio = server.unixtime;
-    if (write(server.repl_transfer_fd,buf,nread) != nread) {
+    if (write(server.repl_transfer_fd,p,nread) != nread) {
         serverLog(LL_WARNING,"Write error or short write writing to the DB dump file needed for MASTER <-> SLAVE synchronization: %s", strerror(errno));
         goto error;
     }
@@ -1275,22 +1756,10 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
         /* Final setup of the connected slave <- master link */
         zfree(server.repl_transfer_tmpfile);
+        server.repl_transfer_tmpfile = NULL;
         close(server.repl_transfer_fd);
-        replicationCreateMasterClient(server.repl_transfer_s,rsi.repl_stream_db);
-        server.repl_state = REPL_STATE_CONNECTED;
-        /* After a full resynchroniziation we use the replication ID and
-         * offset of the master. The secondary ID / offset are cleared since
-         * we are starting a new history. */
-        memcpy(server.replid,server.master->replid,sizeof(server.replid));
-        server.master_repl_offset = server.master->reploff;
-        clearReplicationId2();
-        /* Let's create the replication backlog if needed. Slaves need to
-         * accumulate the backlog regardless of the fact they have sub-slaves
-         * or not, in order to behave correctly if they are promoted to
-         * masters after a failover. */
-        if (server.repl_backlog == NULL) createReplicationBacklog();
-
-        serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Finished with success");
+        server.repl_transfer_fd = -1;
+        replicationFinishFullSync(&rsi);
         /* Restart the AOF subsystem now that we finished the sync. This
          * will trigger an AOF rewrite, and when done will start appending
          * to the new file. */
@@ -1744,6 +2213,34 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
                                   "REPLCONF capa: %s", err);
         }
         sdsfree(err);
+        server.repl_state = REPL_STATE_SEND_COMPRESS;
+    }
+
+    /* Ask the master to compress the link, if we want to. The stream
+     * is compressed only if the master replies +OK. */
+    if (server.repl_state == REPL_STATE_SEND_COMPRESS) {
+        server.repl_master_compress = 0;
+        if (server.repl_compression) {
+            err = sendSynchronousCommand(SYNC_CMD_WRITE,fd,"REPLCONF",
+                    "compress","lz4",NULL);
+            if (err) goto write_error;
+            sdsfree(err);
+            server.repl_state = REPL_STATE_RECEIVE_COMPRESS;
+            return;
+        }
+        server.repl_state = REPL_STATE_SEND_PSYNC;
+    }
+
+    /* Receive REPLCONF compress reply. */
+    if (server.repl_state == REPL_STATE_RECEIVE_COMPRESS) {
+        err = sendSynchronousCommand(SYNC_CMD_READ,fd,NULL);
+        if (err[0] == '-') {
+            serverLog(LL_NOTICE,"(Non critical) Master does not compress "
+                                "the replication link: %s", err);
+        } else {
+            server.repl_master_compress = 1;
+        }
+        sdsfree(err);
         server.repl_state = REPL_STATE_SEND_PSYNC;
     }
 
@@ -1805,17 +2302,20 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
     }
 
-    /* Prepare a suitable temp file for bulk transfer */
-    while(maxtries--) {
-        snprintf(tmpfile,256,
-            "temp-%d.%ld.rdb",(int)server.unixtime,(long int)getpid());
-        dfd = open(tmpfile,O_CREAT|O_WRONLY|O_EXCL,0644);
-        if (dfd != -1) break;
-        sleep(1);
-    }
-    if (dfd == -1) {
-        serverLog(LL_WARNING,"Opening the temp file needed for MASTER <-> SLAVE synchronization: %s",strerror(errno));
-        goto error;
+    /* Prepare a suitable temp file for bulk transfer, unless the payload
+     * is going to be loaded directly from the socket. */
+    if (!useDisklessLoad()) {
+        while(maxtries--) {
+            snprintf(tmpfile,256,
+                "temp-%d.%ld.rdb",(int)server.unixtime,(long int)getpid());
+            dfd = open(tmpfile,O_CREAT|O_WRONLY|O_EXCL,0644);
+            if (dfd != -1) break;
+            sleep(1);
+        }
+        if (dfd == -1) {
+            serverLog(LL_WARNING,"Opening the temp file needed for MASTER <-> SLAVE synchronization: %s",strerror(errno));
+            goto error;
+        }
     }
 
     /* Setup the non blocking download of the bulk file. */
@@ -1834,7 +2334,7 @@ void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
     server.repl_transfer_last_fsync_off = 0;
     server.repl_transfer_fd = dfd;
     server.repl_transfer_lastio = server.unixtime;
-    server.repl_transfer_tmpfile = zstrdup(tmpfile);
+    server.repl_transfer_tmpfile = dfd != -1 ? zstrdup(tmpfile) : NULL;
     return;
 
 error:
@@ -1894,9 +2394,14 @@ void undoConnectWithMaster(void) {
 void replicationAbortSyncTransfer(void) {
     serverAssert(server.repl_state == REPL_STATE_TRANSFER);
     undoConnectWithMaster();
-    close(server.repl_transfer_fd);
-    unlink(server.repl_transfer_tmpfile);
-    zfree(server.repl_transfer_tmpfile);
+    /* No temp file when loading from the socket (repl-diskless-load). */
+    if (server.repl_transfer_fd != -1) {
+        close(server.repl_transfer_fd);
+        unlink(server.repl_transfer_tmpfile);
+        zfree(server.repl_transfer_tmpfile);
+        server.repl_transfer_tmpfile = NULL;
+        server.repl_transfer_fd = -1;
+    }
 }
 
 /* This function aborts a non blocking replication attempt if there is one
@@ -2131,6 +2636,7 @@ void replicationCacheMaster(client *c) {
      * pending outputs to the master. */
     sdsclear(server.master->querybuf);
     sdsclear(server.master->pending_querybuf);
+    sdsclear(server.master->repl_zbuf);
     server.master->read_reploff = server.master->reploff;
     if (c->flags & CLIENT_MULTI) discardTransaction(c);
     listEmpty(c->reply);
@@ -2621,6 +3127,12 @@ void replicationCron(void) {
         }
     }
 
+    /* Blocks released by the slaves are trimmed from the backlog a few at
+     * a time when written, here we make sure the backlog converges to its
+     * configured size even when no slave is writing. */
+    if (server.repl_backlog)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL*10);
+
     /* If AOF is disabled and we no longer have attached slaves, we can
      * free our Replication Script Cache as there is no need to propagate
      * EVALSHA at all. */
@@ -2637,7 +3149,9 @@ void replicationCron(void) {
      * In case of diskless replication, we make sure to wait the specified
      * number of seconds (according to configuration) so that other slaves
      * have the time to arrive before we start streaming. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        server.rdb_snapshot == NULL)
+    {
         time_t idle, max_idle = 0;
         int slaves_waiting = 0;
         int mincapa = -1;
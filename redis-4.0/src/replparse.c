@@ -0,0 +1,441 @@
+/* Threaded parsing of the replication stream on slaves.
+ *
+ * A slave applies the stream of its master with the same code used for
+ * normal clients: processInputBuffer() parses a command, creating the
+ * argument objects, then executes it, one command after the other in the
+ * main thread. After a burst of writes in the master the parsing is a good
+ * part of the time the slave needs to catch up.
+ *
+ * When "slave-threaded-parse" is enabled the stream read from the master
+ * is handed to a dedicated thread, that turns it into argument vectors,
+ * while the main thread executes the commands parsed so far:
+ *
+ * 1) The main thread reads from the master socket as usual. If the parser
+ *    is idle the query buffer is moved to a new job, and the main thread
+ *    keeps reading into an empty buffer.
+ *
+ * 2) The thread parses all the complete commands of the job, then wakes
+ *    up the main thread writing to a pipe.
+ *
+ * 3) The main thread takes the parsed commands and executes them in the
+ *    stream order. What is left of the job (an incomplete command) is put
+ *    back in front of the query buffer.
+ *
+ * Commands are still executed by the main thread, one after the other, so
+ * the keyspace is untouched by the parser. The bytes owned by the parser
+ * (job in progress and commands not yet executed) are accounted in
+ * replParsePendingBytes(), so that the offset of the master client keeps
+ * counting only the applied part of the stream, like in the sequential
+ * code. If the parser finds something it is not able to handle (that is
+ * not a multi bulk command), the rest of the stream is processed by
+ * processInputBuffer(), that will report the protocol error. */
+
+#include "server.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#define REPL_PARSE_THREAD_STACK_SIZE (1024*1024*4)
+
+typedef struct replParseCmd {
+    int argc;
+    robj **argv;
+    size_t len;             /* Bytes of the stream used by the command. */
+} replParseCmd;
+
+typedef struct replParseJob {
+    sds buf;                /* Stream to parse, owned by the job. */
+    size_t consumed;        /* Bytes turned into complete commands. */
+    replParseCmd *cmds;
+    int numcmds;
+    int error;              /* Stopped at something not parsable. */
+} replParseJob;
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t newjob_cond;
+    pthread_cond_t done_cond;
+    int started;
+    int pipe[2];            /* Written by the thread when a job is done. */
+    client *owner;          /* Master client the state refers to. */
+    replParseJob *job;      /* Job queued or in progress, or NULL. */
+    int job_done;           /* Set by the thread. */
+    replParseCmd *queue;    /* Parsed commands to execute. */
+    int qlen, qpos;
+    size_t pending;         /* Bytes of job + queued commands. */
+    size_t stalled;         /* Query buffer len when the last job stopped
+                               at an incomplete command. */
+    int broken;             /* Don't use the parser for this client. */
+} rp;
+
+/* ------------------------------- Parser ---------------------------------- */
+
+/* Parse a decimal number in 's' up to '\r', returning the position after
+ * the CRLF, or NULL if the line is incomplete or not valid. */
+static char *replParseLine(char *s, char *end, long long *ll, int *err) {
+    char *nl = memchr(s,'\r',end-s);
+
+    if (nl == NULL || nl+1 >= end) {
+        /* Too long to be a count: the stream is corrupted. */
+        if (end-s > 32) *err = 1;
+        return NULL;
+    }
+    if (nl[1] != '\n' || !string2ll(s,nl-s,ll)) {
+        *err = 1;
+        return NULL;
+    }
+    return nl+2;
+}
+
+static void replParseJobFreeCmds(replParseCmd *cmds, int count) {
+    int j, i;
+
+    for (j = 0; j < count; j++) {
+        for (i = 0; i < cmds[j].argc; i++) decrRefCount(cmds[j].argv[i]);
+        zfree(cmds[j].argv);
+    }
+}
+
+/* Parse all the complete commands in the job buffer. Called by the thread.
+ * The limits are the same of processMultibulkBuffer(). */
+static void replParseJobRun(replParseJob *job) {
+    char *start = job->buf, *p = start, *end = start+sdslen(job->buf);
+    int slots = 0;
+
+    job->cmds = NULL;
+    job->numcmds = 0;
+    job->consumed = 0;
+    job->error = 0;
+
+    while (p < end) {
+        char *cmdstart = p;
+        long long mbulk, bulk;
+        robj **argv;
+        int argc = 0, j;
+
+        /* Empty lines are ignored like processInlineBuffer() does, they are
+         * accounted to the command that follows. */
+        while (p < end && (*p == '\n' || *p == '\r')) p++;
+        if (p == end) break;
+        if (*p != '*') {
+            job->error = 1;
+            break;
+        }
+        p = replParseLine(p+1,end,&mbulk,&job->error);
+        if (p == NULL) break;
+        if (mbulk > 1024*1024) {
+            job->error = 1;
+            break;
+        }
+        if (mbulk <= 0) {
+            /* Nothing to execute, just skip it like resetClient() would. */
+            job->consumed = p-start;
+            continue;
+        }
+
+        argv = zmalloc(sizeof(robj*)*mbulk);
+        while (argc < mbulk) {
+            if (p >= end) break;
+            if (*p != '$') {
+                job->error = 1;
+                break;
+            }
+            p = replParseLine(p+1,end,&bulk,&job->error);
+            if (p == NULL) break;
+            if (bulk < 0 || bulk > 512*1024*1024) {
+                job->error = 1;
+                break;
+            }
+            if (end-p < bulk+2) {
+                p = NULL;
+                break;
+            }
+            argv[argc++] = createStringObject(p,bulk);
+            p += bulk+2;
+        }
+
+        /* Incomplete or invalid: discard it, the main thread will get the
+         * rest of the buffer back. */
+        if (argc < mbulk) {
+            for (j = 0; j < argc; j++) decrRefCount(argv[j]);
+            zfree(argv);
+            break;
+        }
+
+        if (job->numcmds == slots) {
+            slots = slots ? slots*2 : 64;
+            job->cmds = zrealloc(job->cmds,sizeof(replParseCmd)*slots);
+        }
+        job->cmds[job->numcmds].argc = argc;
+        job->cmds[job->numcmds].argv = argv;
+        job->cmds[job->numcmds].len = (p-cmdstart);
+        job->numcmds++;
+        job->consumed = p-start;
+    }
+}
+
+static void *replParseThreadMain(void *arg) {
+    sigset_t sigset;
+    UNUSED(arg);
+
+    /* Like the bio threads, leave the watchdog signal to the main thread. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in replication parsing thread: %s",
+            strerror(errno));
+
+    pthread_mutex_lock(&rp.lock);
+    while(1) {
+        replParseJob *job;
+
+        while (rp.job == NULL || rp.job_done)
+            pthread_cond_wait(&rp.newjob_cond,&rp.lock);
+        job = rp.job;
+        pthread_mutex_unlock(&rp.lock);
+
+        replParseJobRun(job);
+
+        pthread_mutex_lock(&rp.lock);
+        rp.job_done = 1;
+        pthread_cond_signal(&rp.done_cond);
+        if (write(rp.pipe[1],"A",1) != 1) {
+            /* Not a problem: the pipe is already full of wake ups. */
+        }
+    }
+    return NULL;
+}
+
+/* ----------------------------- Main thread ------------------------------- */
+
+static void replParseNotifyHandler(aeEventLoop *el, int fd, void *privdata,
+                                   int mask)
+{
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    if (server.master && rp.owner == server.master)
+        processInputBufferAndReplicate(server.master);
+}
+
+/* Start the parsing thread the first time it is needed. */
+static int replParseStart(void) {
+    pthread_attr_t attr;
+    size_t stacksize;
+
+    if (rp.started) return C_OK;
+    if (pipe(rp.pipe) == -1) {
+        serverLog(LL_WARNING,"Can't create the replication parsing pipe: %s",
+            strerror(errno));
+        return C_ERR;
+    }
+    anetNonBlock(NULL,rp.pipe[0]);
+    anetNonBlock(NULL,rp.pipe[1]);
+    if (aeCreateFileEvent(server.el,rp.pipe[0],AE_READABLE,
+        replParseNotifyHandler,NULL) == AE_ERR)
+    {
+        close(rp.pipe[0]);
+        close(rp.pipe[1]);
+        return C_ERR;
+    }
+    pthread_mutex_init(&rp.lock,NULL);
+    pthread_cond_init(&rp.newjob_cond,NULL);
+    pthread_cond_init(&rp.done_cond,NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < REPL_PARSE_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+    if (pthread_create(&rp.thread,&attr,replParseThreadMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Can't create the replication parsing thread");
+        aeDeleteFileEvent(server.el,rp.pipe[0],AE_READABLE);
+        close(rp.pipe[0]);
+        close(rp.pipe[1]);
+        return C_ERR;
+    }
+    rp.started = 1;
+    return C_OK;
+}
+
+/* Wait for the job in progress, if any, and return it. */
+static replParseJob *replParseWaitJob(void) {
+    replParseJob *job;
+
+    if (rp.job == NULL) return NULL;
+    pthread_mutex_lock(&rp.lock);
+    while (!rp.job_done) pthread_cond_wait(&rp.done_cond,&rp.lock);
+    job = rp.job;
+    rp.job = NULL;
+    rp.job_done = 0;
+    pthread_mutex_unlock(&rp.lock);
+    return job;
+}
+
+/* Move the commands of a completed job to the queue of commands to execute,
+ * and what was not parsed back in front of the query buffer. */
+static void replParseCollect(client *c, replParseJob *job) {
+    size_t left = sdslen(job->buf) - job->consumed;
+    int j;
+
+    rp.pending -= sdslen(job->buf);
+    if (job->numcmds) {
+        if (rp.qpos == rp.qlen) {
+            zfree(rp.queue);
+            rp.queue = job->cmds;
+            rp.qlen = job->numcmds;
+            rp.qpos = 0;
+        } else {
+            rp.queue = zrealloc(rp.queue,
+                sizeof(replParseCmd)*(rp.qlen+job->numcmds));
+            memcpy(rp.queue+rp.qlen,job->cmds,
+                sizeof(replParseCmd)*job->numcmds);
+            rp.qlen += job->numcmds;
+            zfree(job->cmds);
+        }
+        for (j = 0; j < job->numcmds; j++) rp.pending += rp.queue[rp.qlen-1-j].len;
+    } else {
+        zfree(job->cmds);
+    }
+
+    if (left) {
+        sdsrange(job->buf,job->consumed,-1);
+        job->buf = sdscatsds(job->buf,c->querybuf);
+        sdsfree(c->querybuf);
+        c->querybuf = job->buf;
+    } else {
+        sdsfree(job->buf);
+    }
+    rp.stalled = job->error ? 0 : left;
+    if (job->error) rp.broken = 1;
+    zfree(job);
+}
+
+/* Hand the query buffer to the thread, if there is something new in it. */
+static void replParseSubmit(client *c) {
+    replParseJob *job;
+
+    if (rp.broken || rp.job || sdslen(c->querybuf) <= rp.stalled) return;
+    job = zmalloc(sizeof(*job));
+    job->buf = c->querybuf;
+    c->querybuf = sdsempty();
+    rp.pending += sdslen(job->buf);
+    rp.stalled = 0;
+
+    pthread_mutex_lock(&rp.lock);
+    rp.job = job;
+    rp.job_done = 0;
+    pthread_cond_signal(&rp.newjob_cond);
+    pthread_mutex_unlock(&rp.lock);
+}
+
+/* Execute the parsed commands, stopping in the same conditions of
+ * processInputBuffer(). Returns C_ERR if the client was freed. */
+static int replParseExecute(client *c) {
+    while (rp.qpos < rp.qlen) {
+        replParseCmd *cmd = rp.queue+rp.qpos;
+
+        if (!(c->flags & CLIENT_SLAVE) && clientsArePaused()) break;
+        if (c->flags & CLIENT_BLOCKED) break;
+        if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) break;
+
+        zfree(c->argv);
+        c->argv = cmd->argv;
+        c->argc = cmd->argc;
+        rp.pending -= cmd->len;
+        rp.qpos++;
+        if (processCommandAndResetClient(c) == C_ERR) return C_ERR;
+    }
+    if (rp.qpos == rp.qlen) {
+        zfree(rp.queue);
+        rp.queue = NULL;
+        rp.qlen = rp.qpos = 0;
+    }
+    return C_OK;
+}
+
+/* Return the bytes of the stream of 'c' that the parser took from the
+ * query buffer and are not yet applied. */
+size_t replParsePendingBytes(client *c) {
+    return (rp.owner == c) ? rp.pending : 0;
+}
+
+/* Drop the state of the parser, waiting for the job in progress. Called
+ * when the master client is freed or cached: what was not yet executed
+ * is part of the stream not applied, and will be received again. */
+void replParseReset(client *c) {
+    replParseJob *job;
+
+    if (rp.owner != c) return;
+    if ((job = replParseWaitJob()) != NULL) {
+        replParseJobFreeCmds(job->cmds,job->numcmds);
+        zfree(job->cmds);
+        sdsfree(job->buf);
+        zfree(job);
+    }
+    replParseJobFreeCmds(rp.queue+rp.qpos,rp.qlen-rp.qpos);
+    zfree(rp.queue);
+    rp.queue = NULL;
+    rp.qlen = rp.qpos = 0;
+    rp.pending = 0;
+    rp.stalled = 0;
+    rp.broken = 0;
+    rp.owner = NULL;
+}
+
+/* Process the stream read from the master 'c': like processInputBuffer()
+ * but with the parsing performed by the thread when slave-threaded-parse
+ * is enabled. */
+void replParseProcessMaster(client *c) {
+    replParseJob *job = NULL;
+    int idle;
+
+    /* Start using the parser only at a command boundary. */
+    if (rp.owner != c) {
+        if (!server.slave_threaded_parse || rp.owner != NULL ||
+            c->reqtype != 0 || replParseStart() == C_ERR)
+        {
+            processInputBuffer(c);
+            return;
+        }
+        rp.owner = c;
+    }
+
+    /* Take the result of the job if completed. */
+    idle = (rp.qpos == rp.qlen);
+    if (rp.job) {
+        pthread_mutex_lock(&rp.lock);
+        if (rp.job_done) {
+            job = rp.job;
+            rp.job = NULL;
+            rp.job_done = 0;
+        }
+        pthread_mutex_unlock(&rp.lock);
+        if (job) replParseCollect(c,job);
+    }
+
+    /* Parse the next part of the stream while we execute this one, unless
+     * the client stopped executing commands. */
+    if (idle && server.slave_threaded_parse) replParseSubmit(c);
+    if (replParseExecute(c) == C_ERR) return;
+
+    /* If the queue was only drained now, for instance when a CLIENT PAUSE
+     * ended, parse what was read meanwhile without waiting for the master
+     * to send more. */
+    if (!idle && rp.qpos == rp.qlen && server.slave_threaded_parse)
+        replParseSubmit(c);
+
+    /* Back to the sequential code when the parser can't be used anymore
+     * and everything it owned was executed. */
+    if ((rp.broken || !server.slave_threaded_parse) &&
+        rp.job == NULL && rp.qpos == rp.qlen)
+    {
+        replParseReset(c);
+        processInputBuffer(c);
+    }
+}
@@ -94,11 +94,14 @@ static const rio rioBufferIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
+    0,              /* codec */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
 void rioInitWithBuffer(rio *r, sds s) {
     *r = rioBufferIO;
+    r->codec = server.rdb_compression_codec;
     r->io.buffer.ptr = s;
     r->io.buffer.pos = 0;
 }
@@ -147,11 +150,14 @@ static const rio rioFileIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
+    0,              /* codec */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
 void rioInitWithFile(rio *r, FILE *fp) {
     *r = rioFileIO;
+    r->codec = server.rdb_compression_codec;
     r->io.file.fp = fp;
     r->io.file.buffered = 0;
     r->io.file.autosync = 0;
@@ -171,18 +177,28 @@ static size_t rioFdsetWrite(rio *r, const void *buf, size_t len) {
     int j;
     unsigned char *p = (unsigned char*) buf;
     int doflush = (buf == NULL && len == 0);
+    sds framed = NULL;
 
     /* To start we always append to our buffer. If it gets larger than
      * a given size, we actually write to the sockets. */
     if (len) {
+        size_t limit = r->io.fdset.compress ? REPL_FRAME_MAX_RAW :
+                                              PROTO_IOBUF_LEN;
+
         r->io.fdset.buf = sdscatlen(r->io.fdset.buf,buf,len);
         len = 0; /* Prevent entering the while below if we don't flush. */
-        if (sdslen(r->io.fdset.buf) > PROTO_IOBUF_LEN) doflush = 1;
+        if (sdslen(r->io.fdset.buf) > limit) doflush = 1;
     }
 
     if (doflush) {
-        p = (unsigned char*) r->io.fdset.buf;
-        len = sdslen(r->io.fdset.buf);
+        /* When compressing, what is written is the framed buffer. */
+        if (r->io.fdset.compress && sdslen(r->io.fdset.buf)) {
+            framed = replCompressFrames(sdsempty(),r->io.fdset.buf,
+                                        sdslen(r->io.fdset.buf));
+            sdsclear(r->io.fdset.buf);
+        }
+        p = (unsigned char*) (framed ? framed : r->io.fdset.buf);
+        len = framed ? sdslen(framed) : sdslen(r->io.fdset.buf);
     }
 
     /* Write in little chunchs so that when there are big writes we
@@ -220,13 +236,17 @@ static size_t rioFdsetWrite(rio *r, const void *buf, size_t len) {
                 if (r->io.fdset.state[j] == 0) r->io.fdset.state[j] = EIO;
             }
         }
-        if (broken == r->io.fdset.numfds) return 0; /* All the FDs in error. */
+        if (broken == r->io.fdset.numfds) {
+            sdsfree(framed);
+            return 0; /* All the FDs in error. */
+        }
         p += count;
         len -= count;
         r->io.fdset.pos += count;
     }
 
     if (doflush) sdsclear(r->io.fdset.buf);
+    sdsfree(framed);
     return 1;
 }
 
@@ -260,6 +280,8 @@ static const rio rioFdsetIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
+    0,              /* codec */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -267,6 +289,7 @@ void rioInitWithFdset(rio *r, int *fds, int numfds) {
     int j;
 
     *r = rioFdsetIO;
+    r->codec = server.rdb_compression_codec;
     r->io.fdset.fds = zmalloc(sizeof(int)*numfds);
     r->io.fdset.state = zmalloc(sizeof(int)*numfds);
     memcpy(r->io.fdset.fds,fds,sizeof(int)*numfds);
@@ -274,6 +297,7 @@ void rioInitWithFdset(rio *r, int *fds, int numfds) {
     r->io.fdset.numfds = numfds;
     r->io.fdset.pos = 0;
     r->io.fdset.buf = sdsempty();
+    r->io.fdset.compress = 0;
 }
 
 /* release the rio stream. */
@@ -283,6 +307,222 @@ void rioFreeFdset(rio *r) {
     sdsfree(r->io.fdset.buf);
 }
 
+/* ------------------------ Socket read implementation ----------------------- */
+
+/* Read exactly 'len' bytes from the socket. Returns 1 or 0 for
+ * success/failure. */
+static int rioSocketReadFully(rio *r, char *p, size_t len) {
+    while(len) {
+        ssize_t nread = read(r->io.sock.fd,p,len);
+
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) {
+            if (nread == 0) errno = ECONNRESET;
+            return 0;
+        }
+        server.stat_net_input_bytes += nread;
+        p += nread;
+        len -= nread;
+    }
+    return 1;
+}
+
+/* Read the next frame of a compressed link, appending what it holds to the
+ * buffer. Returns 1 or 0 for success/failure. */
+static int rioSocketReadFrame(rio *r) {
+    char hdr[REPL_FRAME_HDR_LEN];
+    size_t rawlen, datalen;
+    sds frame;
+    int ok;
+
+    if (!rioSocketReadFully(r,hdr,sizeof(hdr))) return 0;
+    if (replParseFrameHeader(hdr,&rawlen,&datalen) == C_ERR) {
+        errno = EPROTO;
+        return 0;
+    }
+    frame = sdsnewlen(NULL,sizeof(hdr)+datalen);
+    memcpy(frame,hdr,sizeof(hdr));
+    ok = rioSocketReadFully(r,frame+sizeof(hdr),datalen);
+    if (ok && replDecompressFrames(&r->io.sock.buf,frame,sdslen(frame)) !=
+              (ssize_t)sdslen(frame))
+    {
+        errno = EPROTO;
+        ok = 0;
+    }
+    sdsfree(frame);
+    return ok;
+}
+
+/* Returns 1 or 0 for success/failure. The socket must be in blocking mode,
+ * possibly with a receive timeout. Data is read ahead in big chunks, but
+ * never past 'read_limit' when it is set: after the RDB payload the master
+ * may send the replication stream. */
+static size_t rioSocketRead(rio *r, void *buf, size_t len) {
+    size_t avail = sdslen(r->io.sock.buf)-r->io.sock.pos;
+
+    if (r->io.sock.read_limit &&
+        r->io.sock.read_so_far+len > r->io.sock.read_limit)
+    {
+        errno = EOVERFLOW;
+        r->flags |= RIO_FLAG_READ_ERROR;
+        return 0;
+    }
+
+    /* Make room for the missing data, and for the read ahead, at the end
+     * of the buffer. */
+    if (len > avail) {
+        size_t room = len-avail;
+
+        if (room < PROTO_IOBUF_LEN) room = PROTO_IOBUF_LEN;
+        if (r->io.sock.pos) {
+            sdsrange(r->io.sock.buf,r->io.sock.pos,-1);
+            r->io.sock.pos = 0;
+        }
+        if (sdsavail(r->io.sock.buf) < room)
+            r->io.sock.buf = sdsMakeRoomFor(r->io.sock.buf,room);
+    }
+
+    while (len > sdslen(r->io.sock.buf)-r->io.sock.pos) {
+        size_t buffered = sdslen(r->io.sock.buf)-r->io.sock.pos;
+        size_t toread = len-buffered;
+        ssize_t nread;
+
+        /* A compressed link is read one frame at a time. */
+        if (r->io.sock.framed) {
+            if (rioSocketReadFrame(r) == 0) {
+                r->flags |= RIO_FLAG_READ_ERROR;
+                return 0;
+            }
+            continue;
+        }
+
+        /* Read ahead at least PROTO_IOBUF_LEN bytes if possible. */
+        if (toread < PROTO_IOBUF_LEN) toread = PROTO_IOBUF_LEN;
+        if (toread > sdsavail(r->io.sock.buf))
+            toread = sdsavail(r->io.sock.buf);
+        if (r->io.sock.read_limit &&
+            r->io.sock.read_so_far+buffered+toread > r->io.sock.read_limit)
+        {
+            toread = r->io.sock.read_limit-r->io.sock.read_so_far-buffered;
+        }
+        nread = read(r->io.sock.fd,
+                     r->io.sock.buf+sdslen(r->io.sock.buf),toread);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) {
+            if (nread == 0) errno = ECONNRESET;
+            r->flags |= RIO_FLAG_READ_ERROR;
+            return 0;
+        }
+        sdsIncrLen(r->io.sock.buf,nread);
+        server.stat_net_input_bytes += nread;
+    }
+    memcpy(buf,r->io.sock.buf+r->io.sock.pos,len);
+    r->io.sock.pos += len;
+    r->io.sock.read_so_far += len;
+    return 1;
+}
+
+/* The socket target is read only. */
+static size_t rioSocketWrite(rio *r, const void *buf, size_t len) {
+    UNUSED(r);
+    UNUSED(buf);
+    UNUSED(len);
+    return 0;
+}
+
+/* Returns the number of bytes consumed by the reader. */
+static off_t rioSocketTell(rio *r) {
+    return r->io.sock.read_so_far;
+}
+
+static int rioSocketFlush(rio *r) {
+    UNUSED(r);
+    return 1;
+}
+
+static const rio rioSocketIO = {
+    rioSocketRead,
+    rioSocketWrite,
+    rioSocketTell,
+    rioSocketFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    0,              /* flags */
+    0,              /* codec */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+void rioInitWithSocket(rio *r, int fd, size_t read_limit) {
+    *r = rioSocketIO;
+    r->codec = server.rdb_compression_codec;
+    r->io.sock.fd = fd;
+    r->io.sock.buf = sdsempty();
+    r->io.sock.pos = 0;
+    r->io.sock.read_limit = read_limit;
+    r->io.sock.read_so_far = 0;
+    r->io.sock.framed = 0;
+}
+
+/* Release the rio stream. */
+void rioFreeSocket(rio *r) {
+    sdsfree(r->io.sock.buf);
+}
+
+/* ------------------- Read only memory implementation ----------------------- */
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioMemoryRead(rio *r, void *buf, size_t len) {
+    if (r->io.mem.len-r->io.mem.pos < len)
+        return 0; /* not enough memory to return len bytes. */
+    memcpy(buf,r->io.mem.ptr+r->io.mem.pos,len);
+    r->io.mem.pos += len;
+    return 1;
+}
+
+/* The memory is read only, writes always fail. */
+static size_t rioMemoryWrite(rio *r, const void *buf, size_t len) {
+    UNUSED(r);
+    UNUSED(buf);
+    UNUSED(len);
+    return 0;
+}
+
+/* Returns read position in memory. */
+static off_t rioMemoryTell(rio *r) {
+    return r->io.mem.pos;
+}
+
+static int rioMemoryFlush(rio *r) {
+    UNUSED(r);
+    return 1;
+}
+
+static const rio rioMemoryIO = {
+    rioMemoryRead,
+    rioMemoryWrite,
+    rioMemoryTell,
+    rioMemoryFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    0,              /* flags */
+    0,              /* codec */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+/* Read 'len' bytes at 'buf' without copying them, as used to decode the
+ * values of a memory mapped RDB file. */
+void rioInitWithMemory(rio *r, const void *buf, size_t len) {
+    *r = rioMemoryIO;
+    r->codec = server.rdb_compression_codec;
+    r->io.mem.ptr = buf;
+    r->io.mem.len = len;
+    r->io.mem.pos = 0;
+}
+
 /* ---------------------------- Generic functions ---------------------------- */
 
 /* This function can be installed both in memory and file streams when checksum
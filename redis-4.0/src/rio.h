@@ -60,6 +60,14 @@ struct _rio {
     /* maximum single read or write chunk size */
     size_t max_processing_chunk;
 
+    /* RIO_FLAG_* */
+    int flags;
+
+    /* Codec (RDB_COMPRESSION_*) of the strings saved to this rio: the
+     * rdb-compression-codec option when the rio was created, so that a
+     * CONFIG SET can't change it in the middle of a payload. */
+    int codec;
+
     /* Backend-specific vars. */
     union {
         /* In-memory buffer target. */
@@ -80,12 +88,32 @@ struct _rio {
             int numfds;
             off_t pos;
             sds buf;
+            int compress;   /* Write the buffer as frames, see replcompress.c */
         } fdset;
+        /* Socket read target, buffered (diskless replica load). */
+        struct {
+            int fd;
+            sds buf;
+            off_t pos;              /* Position of the next byte in 'buf'. */
+            size_t read_limit;      /* Don't read past this, 0 = no limit. */
+            size_t read_so_far;     /* Bytes consumed by the reader. */
+            int framed;             /* Decode the frames of replcompress.c */
+        } sock;
+        /* Read only memory target (a mapped RDB file). */
+        struct {
+            const unsigned char *ptr;
+            size_t len;
+            off_t pos;
+        } mem;
     } io;
 };
 
 typedef struct _rio rio;
 
+/* The socket target had a read error or timeout: the stream is not
+ * necessarily corrupted, see rdbLoadRio(). */
+#define RIO_FLAG_READ_ERROR (1<<0)
+
 /* The following functions are our interface with the stream. They'll call the
  * actual implementation of read / write / tell, and will update the checksum
  * if needed. */
@@ -127,8 +155,11 @@ static inline int rioFlush(rio *r) {
 void rioInitWithFile(rio *r, FILE *fp);
 void rioInitWithBuffer(rio *r, sds s);
 void rioInitWithFdset(rio *r, int *fds, int numfds);
+void rioInitWithMemory(rio *r, const void *buf, size_t len);
+void rioInitWithSocket(rio *r, int fd, size_t read_limit);
 
 void rioFreeFdset(rio *r);
+void rioFreeSocket(rio *r);
 
 size_t rioWriteBulkCount(rio *r, char prefix, int count);
 size_t rioWriteBulkString(rio *r, const char *buf, size_t len);
@@ -154,6 +154,64 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return s;
 }
 
+/* Return the number of bytes sdsembed() needs in order to store a string
+ * of 'initlen' bytes: header, payload and the implicit null term. */
+size_t sdsEmbedSize(size_t initlen) {
+    char type = sdsReqType(initlen);
+    if (type == SDS_TYPE_5) type = SDS_TYPE_8;
+    return sdsHdrSize(type)+initlen+1;
+}
+
+/* Like sdsnewlen() but the string is built inside the caller provided
+ * buffer 'buf', that must be at least sdsEmbedSize(initlen) bytes, instead
+ * of being allocated on its own. This is used to store a string in the
+ * same allocation of the structure referencing it (for instance the keys
+ * of the main dictionary are stored at the tail of their dictEntry).
+ *
+ * The returned string is read only: it must never be passed to sdsfree()
+ * or to any function that may reallocate it, its lifetime is the one of
+ * the buffer holding it. Embedded strings never use the type 5 header, so
+ * the owner of the buffer is free to use SDS_EMBED_FLAG in the flags byte.
+ * 在调用者提供的buf中构造sds，不单独分配内存，返回的字符串只读 */
+sds sdsembed(void *buf, const void *init, size_t initlen) {
+    char type = sdsReqType(initlen);
+    if (type == SDS_TYPE_5) type = SDS_TYPE_8;
+    int hdrlen = sdsHdrSize(type);
+    sds s = (char*)buf+hdrlen;
+    unsigned char *fp = ((unsigned char*)s)-1;
+
+    switch(type) {
+        case SDS_TYPE_8: {
+            SDS_HDR_VAR(8,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_16: {
+            SDS_HDR_VAR(16,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+    }
+    if (initlen && init)
+        memcpy(s, init, initlen);
+    s[initlen] = '\0';
+    return s;
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 /* 创建空字符串 */
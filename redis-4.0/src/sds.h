@@ -80,6 +80,9 @@ struct __attribute__ ((__packed__)) sdshdr64 {
 #define SDS_TYPE_64 4
 #define SDS_TYPE_MASK 7
 #define SDS_TYPE_BITS 3
+/* Spare bit of the flags byte, only meaningful for strings created with
+ * sdsembed() (that never use type 5): its meaning is up to the caller. */
+#define SDS_EMBED_FLAG (1<<SDS_TYPE_BITS)
 // 获得一份sds结构体的拷贝，赋值给sh，如SDS_HDR_VAR(8, s) 展开后为 struct sdshdr8 *sh = (void *)((s)-sizeof(struct sdshdr8));
 // 此时sh的地址为sdshdr8起始地址，因为s一开始是指向了buf，sizeof(struct sdshdr8)值为3，s-3就指向了结构体的起始位置
 #define SDS_HDR_VAR(T,s) struct sdshdr##T *sh = (void*)((s)-(sizeof(struct sdshdr##T)));
@@ -245,6 +248,8 @@ static inline void sdssetalloc(sds s, size_t newlen) {
 }
 
 sds sdsnewlen(const void *init, size_t initlen);
+size_t sdsEmbedSize(size_t initlen);
+sds sdsembed(void *buf, const void *init, size_t initlen);
 sds sdsnew(const char *init);
 sds sdsempty(void);
 sds sdsdup(const sds s);
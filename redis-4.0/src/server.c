@@ -27,11 +27,11 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "server.h"
 #include "atomicvar.h"
 #include "bio.h"
 #include "cluster.h"
 #include "latency.h"
-#include "server.h"
 #include "slowlog.h"
 
 #include <arpa/inet.h>
@@ -510,6 +510,17 @@ void dictSdsDestructor(void *privdata, void *val)
 	sdsfree(val);
 }
 
+/* Embedded sds keys: the key is stored at the tail of the dictEntry. */
+size_t dictSdsKeyEmbedLen(const void *key)
+{
+	return sdsEmbedSize(sdslen((sds)key));
+}
+
+void *dictSdsKeyEmbed(void *buf, const void *key)
+{
+	return sdsembed(buf, key, sdslen((sds)key));
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1, const void *key2)
 {
 	const robj *o1 = key1, *o2 = key2;
@@ -605,14 +616,17 @@ dictType zsetDictType = {
     NULL	       /* val destructor */
 };
 
-/* Db->dict, keys are sds strings, vals are Redis objects. */
+/* Db->dict, keys are sds strings embedded in the dictEntry, vals are Redis
+ * objects. The key is freed together with its entry. */
 dictType dbDictType = {
-    dictSdsHash,	 /* hash function */
-    NULL,		 /* key dup */
-    NULL,		 /* val dup */
-    dictSdsKeyCompare,   /* key compare */
-    dictSdsDestructor,   /* key destructor */
-    dictObjectDestructor /* val destructor */
+    dictSdsHash,	  /* hash function */
+    NULL,		  /* key dup */
+    NULL,		  /* val dup */
+    dictSdsKeyCompare,	  /* key compare */
+    NULL,		  /* key destructor */
+    dictObjectDestructor, /* val destructor */
+    dictSdsKeyEmbedLen,   /* key embed len */
+    dictSdsKeyEmbed	  /* key embed */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -625,16 +639,6 @@ dictType shaScriptObjectDictType = {
     dictObjectDestructor   /* val destructor */
 };
 
-/* Db->expires */
-dictType keyptrDictType = {
-    dictSdsHash,       /* hash function */
-    NULL,	      /* key dup */
-    NULL,	      /* val dup */
-    dictSdsKeyCompare, /* key compare */
-    NULL,	      /* key destructor */
-    NULL	       /* val destructor */
-};
-
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
     dictSdsCaseHash,       /* hash function */
@@ -741,30 +745,45 @@ void tryResizeHashTables(int dbid)
 {
 	if (htNeedsResize(server.db[dbid].dict))
 		dictResize(server.db[dbid].dict);
-	if (htNeedsResize(server.db[dbid].expires))
-		dictResize(server.db[dbid].expires);
 }
 
 /* Our hash table implementation performs rehashing incrementally while
  * we write/read from the hash table. Still if the server is idle, the hash
- * table will use two tables for a long time. So we try to use 1 millisecond
- * of CPU time at every call of this function to perform some rehahsing.
+ * table will use two tables for a long time. So we try to use up to
+ * active-rehashing-budget-us microseconds of CPU time (1 millisecond by
+ * default) at every call of this function to perform some rehahsing, so
+ * a single event loop iteration never blocks longer than that because of it.
  *
  * The function returns 1 if some rehashing was performed, otherwise 0
  * is returned. */
 int incrementallyRehash(int dbid)
 {
-	/* Keys dictionary */
-	if (dictIsRehashing(server.db[dbid].dict)) {
-		dictRehashMilliseconds(server.db[dbid].dict, 1);
-		return 1; /* already used our millisecond for this loop... */
-	}
-	/* Expires */
-	if (dictIsRehashing(server.db[dbid].expires)) {
-		dictRehashMilliseconds(server.db[dbid].expires, 1);
-		return 1; /* already used our millisecond for this loop... */
+	dict *d = server.db[dbid].dict;
+	long long start = ustime(), elapsed;
+
+	if (!dictIsRehashing(d))
+		return 0;
+	dictRehashMicroseconds(d, server.active_rehashing_budget_us);
+	elapsed = ustime() - start;
+
+	server.stat_active_rehash_time += elapsed;
+	server.stat_active_rehash_cycles++;
+	if (elapsed > server.stat_active_rehash_max_time)
+		server.stat_active_rehash_max_time = elapsed;
+	return 1;
+}
+
+/* Return the number of keyspace dictionaries that are currently in the
+ * middle of an incremental rehashing. */
+int countRehashingDicts(void)
+{
+	int j, count = 0;
+
+	for (j = 0; j < server.dbnum; j++) {
+		if (dictIsRehashing(server.db[j].dict))
+			count++;
 	}
-	return 0;
+	return count;
 }
 
 /* This function is called once a background process of some kind terminates,
@@ -1068,7 +1087,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData)
 
 			size = dictSlots(server.db[j].dict);
 			used = dictSize(server.db[j].dict);
-			vkeys = dictSize(server.db[j].expires);
+			vkeys = dbExpiresCount(server.db+j);
 			if (used || vkeys) {
 				serverLog(LL_VERBOSE, "DB %d: %lld keys (%lld "
 						      "volatile) in %lld slots "
@@ -1158,7 +1177,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData)
 			 * was
 			 * successful or if, in case of an error, at least
 			 * CONFIG_BGSAVE_RETRY_DELAY seconds already elapsed. */
-			if (server.dirty >= sp->changes &&
+			if (server.rdb_snapshot == NULL &&
+			    server.dirty >= sp->changes &&
 			    server.unixtime - server.lastsave > sp->seconds &&
 			    (server.unixtime - server.lastbgsave_try >
 				 CONFIG_BGSAVE_RETRY_DELAY ||
@@ -1245,7 +1265,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData)
 	 * useful
 	 * because we want to give priority to RDB savings for replication. */
 	if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
-	    server.rdb_bgsave_scheduled &&
+	    server.rdb_snapshot == NULL && server.rdb_bgsave_scheduled &&
 	    (server.unixtime - server.lastbgsave_try >
 		 CONFIG_BGSAVE_RETRY_DELAY ||
 	     server.lastbgsave_status == C_OK)) {
@@ -1266,6 +1286,10 @@ void beforeSleep(struct aeEventLoop *eventLoop)
 {
 	UNUSED(eventLoop);
 
+	/* Handle reads queued by the I/O threads: the buffers are read and the
+	 * first command parsed in parallel, then executed here. */
+	handleClientsWithPendingReadsUsingThreads();
+
 	/* Call the Redis Cluster before sleep function. Note that this function
 	 * may change the state of Redis Cluster (from ok to fail or vice
 	 * versa),
@@ -1312,8 +1336,15 @@ void beforeSleep(struct aeEventLoop *eventLoop)
 	/* Write the AOF buffer on disk */
 	flushAppendOnlyFile(0);
 
+	/* Hold the replies of the writes the AOF writer thread is still
+	 * writing. */
+	aofHoldReplies();
+
 	/* Handle writes with pending output buffers. */
-	handleClientsWithPendingWrites();
+	handleClientsWithPendingWritesUsingThreads();
+
+	/* Close clients that need to be closed asynchronous */
+	freeClientsInAsyncFreeQueue();
 
 	/* Before we are going to sleep, let the threads access the dataset by
 	 * releasing the GIL. Redis main thread will not touch anything at this
@@ -1495,6 +1526,7 @@ void initServerConfig(void)
 	server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
 	server.saveparams = NULL;
 	server.loading = 0;
+	server.async_loading = 0;
 	server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
 	server.syslog_enabled = CONFIG_DEFAULT_SYSLOG_ENABLED;
 	server.syslog_ident = zstrdup(CONFIG_DEFAULT_SYSLOG_IDENT);
@@ -1515,6 +1547,8 @@ void initServerConfig(void)
 	server.aof_lastbgrewrite_status = C_OK;
 	server.aof_delayed_fsync = 0;
 	server.aof_fd = -1;
+	server.aof_last_incr_size = 0;
+	server.aof_manifest = NULL;
 	server.aof_selected_db =
 	    -1; /* Make sure the first time will not match */
 	server.aof_flush_postponed_start = 0;
@@ -1522,15 +1556,35 @@ void initServerConfig(void)
 	    CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
 	server.aof_load_truncated = CONFIG_DEFAULT_AOF_LOAD_TRUNCATED;
 	server.aof_use_rdb_preamble = CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE;
+	server.aof_writer_thread = CONFIG_DEFAULT_AOF_WRITER_THREAD;
+	server.aof_format = CONFIG_DEFAULT_AOF_FORMAT;
+	server.aof_binary_compression = CONFIG_DEFAULT_AOF_BINARY_COMPRESSION;
+	server.aof_fd_binary = 0;
+	server.aof_buf_framed = 0;
+	server.aof_fed_offset = 0;
+	server.aof_flushed_offset = 0;
+	server.aof_flushed_repl_offset = 0;
 	server.pidfile = NULL;
 	server.rdb_filename = zstrdup(CONFIG_DEFAULT_RDB_FILENAME);
 	server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
 	server.requirepass = NULL;
 	server.rdb_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
+	server.rdb_compression_codec = CONFIG_DEFAULT_RDB_COMPRESSION_CODEC;
 	server.rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
+	server.rdb_save_forkless = CONFIG_DEFAULT_RDB_SAVE_FORKLESS;
+	server.rdb_load_threads = CONFIG_DEFAULT_RDB_LOAD_THREADS;
+	server.rdb_save_threads = CONFIG_DEFAULT_RDB_SAVE_THREADS;
+	server.rdb_save_index = CONFIG_DEFAULT_RDB_SAVE_INDEX;
+	server.rdb_lazy_load = CONFIG_DEFAULT_RDB_LAZY_LOAD;
 	server.stop_writes_on_bgsave_err =
 	    CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
 	server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
+	server.active_rehashing_budget_us =
+	    CONFIG_DEFAULT_ACTIVE_REHASHING_BUDGET_US;
+	server.active_expire_cycle_max = CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MAX;
+	server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
+	server.io_threads_do_reads = CONFIG_DEFAULT_IO_THREADS_DO_READS;
+	server.io_threads_active = 0;
 	server.active_defrag_running = 0;
 	server.notify_keyspace_events = 0;
 	server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
@@ -1555,6 +1609,7 @@ void initServerConfig(void)
 	server.cluster_slave_validity_factor = CLUSTER_DEFAULT_SLAVE_VALIDITY;
 	server.cluster_require_full_coverage =
 	    CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE;
+	server.cluster_compact_bus = CLUSTER_DEFAULT_COMPACT_BUS;
 	server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
 	server.cluster_announce_ip = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP;
 	server.cluster_announce_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT;
@@ -1593,6 +1648,10 @@ void initServerConfig(void)
 	server.repl_serve_stale_data = CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA;
 	server.repl_slave_ro = CONFIG_DEFAULT_SLAVE_READ_ONLY;
 	server.repl_slave_lazy_flush = CONFIG_DEFAULT_SLAVE_LAZY_FLUSH;
+	server.slave_threaded_parse = CONFIG_DEFAULT_SLAVE_THREADED_PARSE;
+	server.repl_compression = CONFIG_DEFAULT_REPL_COMPRESSION;
+	server.repl_backlog_disk_size = CONFIG_DEFAULT_REPL_BACKLOG_DISK_SIZE;
+	server.repl_master_compress = 0;
 	server.repl_down_since =
 	    0; /* Never connected, repl is down since EVER. */
 	server.repl_disable_tcp_nodelay =
@@ -1600,6 +1659,11 @@ void initServerConfig(void)
 	server.repl_diskless_sync = CONFIG_DEFAULT_REPL_DISKLESS_SYNC;
 	server.repl_diskless_sync_delay =
 	    CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY;
+	server.repl_diskless_load = CONFIG_DEFAULT_REPL_DISKLESS_LOAD;
+	server.repl_snapshot_reuse_window =
+	    CONFIG_DEFAULT_REPL_SNAPSHOT_REUSE_WINDOW;
+	server.repl_snapshot_offset = -1;
+	server.repl_snapshot_pending_offset = -1;
 	server.repl_ping_slave_period = CONFIG_DEFAULT_REPL_PING_SLAVE_PERIOD;
 	server.repl_timeout = CONFIG_DEFAULT_REPL_TIMEOUT;
 	server.repl_min_slaves_to_write = CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE;
@@ -1612,9 +1676,6 @@ void initServerConfig(void)
 	/* Replication partial resync backlog */
 	server.repl_backlog = NULL;
 	server.repl_backlog_size = CONFIG_DEFAULT_REPL_BACKLOG_SIZE;
-	server.repl_backlog_histlen = 0;
-	server.repl_backlog_idx = 0;
-	server.repl_backlog_off = 0;
 	server.repl_backlog_time_limit = CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT;
 	server.repl_no_slaves_since = time(NULL);
 
@@ -1635,6 +1696,7 @@ void initServerConfig(void)
 	server.commands = dictCreate(&commandTableDictType, NULL);
 	server.orig_commands = dictCreate(&commandTableDictType, NULL);
 	populateCommandTable(); // 加载命令表
+	aofBinInitCommands();
 	server.delCommand = lookupCommandByCString("del");
 	server.multiCommand = lookupCommandByCString("multi");
 	server.lpushCommand = lookupCommandByCString("lpush");
@@ -1953,6 +2015,8 @@ void resetServerStats(void)
 	server.stat_numcommands = 0;
 	server.stat_numconnections = 0;
 	server.stat_expiredkeys = 0;
+	server.stat_expire_cycle_time_used = 0;
+	server.stat_expired_time_cap_reached_count = 0;
 	server.stat_evictedkeys = 0;
 	server.stat_keyspace_misses = 0;
 	server.stat_keyspace_hits = 0;
@@ -1965,7 +2029,14 @@ void resetServerStats(void)
 	server.stat_rejected_conn = 0;
 	server.stat_sync_full = 0;
 	server.stat_sync_partial_ok = 0;
+	server.stat_sync_full_reused = 0;
 	server.stat_sync_partial_err = 0;
+	server.stat_repl_compress_raw = 0;
+	server.stat_repl_compress_wire = 0;
+	server.stat_repl_compress_usec = 0;
+	server.stat_repl_decompress_raw = 0;
+	server.stat_repl_decompress_wire = 0;
+	server.stat_repl_decompress_usec = 0;
 	for (j = 0; j < STATS_METRIC_COUNT; j++) {
 		server.inst_metric[j].idx = 0;
 		server.inst_metric[j].last_sample_time = mstime();
@@ -1975,6 +2046,11 @@ void resetServerStats(void)
 	}
 	server.stat_net_input_bytes = 0;
 	server.stat_net_output_bytes = 0;
+	server.stat_io_reads_processed = 0;
+	server.stat_io_writes_processed = 0;
+	server.stat_active_rehash_time = 0;
+	server.stat_active_rehash_max_time = 0;
+	server.stat_active_rehash_cycles = 0;
 	server.aof_delayed_fsync = 0;
 }
 
@@ -2000,12 +2076,20 @@ void initServer(void)
 	server.clients = listCreate(); // 客户端链表
 	server.clients_to_close = listCreate();
 	server.slaves = listCreate();
+	server.repl_buffer_blocks = listCreate();
+	listSetFreeMethod(server.repl_buffer_blocks, zfree);
+	server.repl_buffer_mem = 0;
+	server.repl_backlog_segments = listCreate();
+	listSetFreeMethod(server.repl_backlog_segments, zfree);
+	server.repl_backlog_disk_histlen = 0;
 	server.monitors = listCreate();
 	server.clients_pending_write = listCreate();
+	server.clients_pending_read = listCreate();
 	server.slaveseldb = -1; /* Force to emit the first SELECT command. */
 	server.unblocked_clients = listCreate();
 	server.ready_keys = listCreate();
 	server.clients_waiting_acks = listCreate();
+	server.clients_waiting_aof = listCreate();
 	server.get_ack_from_slaves = 0;
 	server.clients_paused = 0;
 	server.system_memory_size = zmalloc_get_memory_size();
@@ -2051,7 +2135,7 @@ void initServer(void)
 	/* 创建redis数据库，并初始化其他内部状态值 */
 	for (j = 0; j < server.dbnum; j++) {
 		server.db[j].dict = dictCreate(&dbDictType, NULL);
-		server.db[j].expires = dictCreate(&keyptrDictType, NULL);
+		server.db[j].expires_index = expireIndexCreate();
 		server.db[j].blocking_keys = dictCreate(&keylistDictType, NULL);
 		server.db[j].ready_keys =
 		    dictCreate(&objectKeyPointerValueDictType, NULL);
@@ -2066,13 +2150,13 @@ void initServer(void)
 	listSetMatchMethod(server.pubsub_patterns, listMatchPubsubPattern);
 	server.cronloops = 0;
 	server.rdb_child_pid = -1;
+	server.rdb_snapshot = NULL;
 	server.aof_child_pid = -1;
 	server.rdb_child_type = RDB_CHILD_TYPE_NONE;
 	server.rdb_bgsave_scheduled = 0;
 	server.child_info_pipe[0] = -1;
 	server.child_info_pipe[1] = -1;
 	server.child_info_data.magic = 0;
-	aofRewriteBufferReset();
 	server.aof_buf = sdsempty();
 	server.lastsave = time(NULL); /* At startup we consider the DB saved. */
 	server.lastbgsave_try = 0;    /* At startup we never tried to BGSAVE. */
@@ -2128,18 +2212,6 @@ void initServer(void)
 		    "blocked clients subsystem.");
 	}
 
-	/* 如果开启了AOF，打开AOF文件 */
-	if (server.aof_state == AOF_ON) {
-		server.aof_fd = open(server.aof_filename,
-				     O_WRONLY | O_APPEND | O_CREAT, 0644);
-		if (server.aof_fd == -1) {
-			serverLog(LL_WARNING,
-				  "Can't open the append-only file: %s",
-				  strerror(errno));
-			exit(1);
-		}
-	}
-
 	/*
 	 * 32位的服务器最大内存限制是4G
 	 * 如果没有在配置文件明确指定，设置3G的内存限制
@@ -2153,6 +2225,12 @@ void initServer(void)
 		server.maxmemory_policy = MAXMEMORY_NO_EVICTION;
 	}
 
+	/* 根据 cpuid 选择 BITCOUNT/BITPOS/BITOP 的 SIMD 实现 */
+	bitopsSelectKernels(BITOPS_KERNEL_BEST);
+	/* 在创建任何线程之前生成 CRC 查找表并选择实现 */
+	crc64Init();
+	crc16Init();
+
 	if (server.cluster_enabled)
 		clusterInit(); // 初始化集群信息
 	replicationScriptCacheInit();
@@ -2160,6 +2238,7 @@ void initServer(void)
 	slowlogInit(); // 初始化慢查询日志模块
 	latencyMonitorInit();
 	bioInit(); // 初始化后台IO模块
+	initThreadedIO(); // 初始化I/O线程
 	server.initial_memory_usage = zmalloc_used_memory();
 }
 
@@ -2557,6 +2636,11 @@ void call(client *c, int flags)
 		redisOpArrayFree(&server.also_propagate);
 	}
 	server.also_propagate = prev_also_propagate;
+
+	/* The reply may depend on any write already in the AOF buffer, not
+	 * only the ones of the client: it may have to wait for all of them to
+	 * be on disk, see aofClientMustWait(). */
+	c->aof_woff = server.aof_fed_offset;
 	server.stat_numcommands++;
 }
 
@@ -2724,6 +2808,15 @@ int processCommand(client *c)
 		return C_OK;
 	}
 
+	/* Loading the master dataset in the background? The old dataset is
+	 * still served, but admin commands could replace it or start a new
+	 * sync under our feet. */
+	if (server.async_loading && (c->cmd->flags & CMD_ADMIN) &&
+	    !(c->cmd->flags & CMD_LOADING)) {
+		addReply(c, shared.loadingerr);
+		return C_OK;
+	}
+
 	/* Lua script too slow? Only allow a limited number of commands. */
 	if (server.lua_timedout && c->cmd->proc != authCommand &&
 	    c->cmd->proc != replconfCommand &&
@@ -2795,6 +2888,7 @@ int prepareForShutdown(int flags)
 		kill(server.rdb_child_pid, SIGUSR1);
 		rdbRemoveTempFile(server.rdb_child_pid);
 	}
+	rdbSnapshotAbort();
 
 	if (server.aof_state != AOF_OFF) {
 		/* Kill the AOF saving child as the AOF we already have may be
@@ -3158,6 +3252,8 @@ sds genRedisInfoString(char *section)
 			  "arch_bits:%d\r\n"
 			  "multiplexing_api:%s\r\n"
 			  "atomicvar_api:%s\r\n"
+			  "bitops_kernel:%s\r\n"
+			  "crc64_kernel:%s\r\n"
 			  "gcc_version:%d.%d.%d\r\n"
 			  "process_id:%ld\r\n"
 			  "run_id:%s\r\n"
@@ -3172,7 +3268,8 @@ sds genRedisInfoString(char *section)
 		    strtol(redisGitDirty(), NULL, 10) > 0,
 		    (unsigned long long)redisBuildId(), mode, name.sysname,
 		    name.release, name.machine, server.arch_bits,
-		    aeGetApiName(), REDIS_ATOMIC_API,
+		    aeGetApiName(), REDIS_ATOMIC_API, bitopsKernelName(),
+		    crc64KernelName(),
 #ifdef __GNUC__
 		    __GNUC__, __GNUC_MINOR__, __GNUC_PATCHLEVEL__,
 #else
@@ -3275,6 +3372,7 @@ sds genRedisInfoString(char *section)
 		info = sdscatprintf(
 		    info, "# Persistence\r\n"
 			  "loading:%d\r\n"
+			  "async_loading:%d\r\n"
 			  "rdb_changes_since_last_save:%lld\r\n"
 			  "rdb_bgsave_in_progress:%d\r\n"
 			  "rdb_last_save_time:%jd\r\n"
@@ -3290,11 +3388,13 @@ sds genRedisInfoString(char *section)
 			  "aof_last_bgrewrite_status:%s\r\n"
 			  "aof_last_write_status:%s\r\n"
 			  "aof_last_cow_size:%zu\r\n",
-		    server.loading, server.dirty, server.rdb_child_pid != -1,
+		    server.loading, server.async_loading, server.dirty,
+		    server.rdb_child_pid != -1 || server.rdb_snapshot != NULL,
 		    (intmax_t)server.lastsave,
 		    (server.lastbgsave_status == C_OK) ? "ok" : "err",
 		    (intmax_t)server.rdb_save_time_last,
-		    (intmax_t)((server.rdb_child_pid == -1)
+		    (intmax_t)((server.rdb_child_pid == -1 &&
+				    server.rdb_snapshot == NULL)
 				   ? -1
 				   : time(NULL) - server.rdb_save_time_start),
 		    server.stat_rdb_cow_bytes, server.aof_state != AOF_OFF,
@@ -3314,18 +3414,19 @@ sds genRedisInfoString(char *section)
 				  "aof_base_size:%lld\r\n"
 				  "aof_pending_rewrite:%d\r\n"
 				  "aof_buffer_length:%zu\r\n"
-				  "aof_rewrite_buffer_length:%lu\r\n"
 				  "aof_pending_bio_fsync:%llu\r\n"
-				  "aof_delayed_fsync:%lu\r\n",
+				  "aof_delayed_fsync:%lu\r\n"
+				  "aof_clients_waiting_fsync:%lu\r\n",
 			    (long long)server.aof_current_size,
 			    (long long)server.aof_rewrite_base_size,
 			    server.aof_rewrite_scheduled,
-			    sdslen(server.aof_buf), aofRewriteBufferSize(),
+			    sdslen(server.aof_buf),
 			    bioPendingJobsOfType(BIO_AOF_FSYNC),
-			    server.aof_delayed_fsync);
+			    server.aof_delayed_fsync,
+			    listLength(server.clients_waiting_aof));
 		}
 
-		if (server.loading) {
+		if (server.loading || server.async_loading) {
 			double perc;
 			time_t eta, elapsed;
 			off_t remaining_bytes = server.loading_total_bytes -
@@ -3375,7 +3476,11 @@ sds genRedisInfoString(char *section)
 			  "sync_full:%lld\r\n"
 			  "sync_partial_ok:%lld\r\n"
 			  "sync_partial_err:%lld\r\n"
+			  "sync_full_reused:%lld\r\n"
 			  "expired_keys:%lld\r\n"
+			  "expired_keys_pending:%llu\r\n"
+			  "expired_time_cap_reached_count:%lld\r\n"
+			  "expire_cycle_cpu_milliseconds:%lld\r\n"
 			  "evicted_keys:%lld\r\n"
 			  "keyspace_hits:%lld\r\n"
 			  "keyspace_misses:%lld\r\n"
@@ -3387,7 +3492,14 @@ sds genRedisInfoString(char *section)
 			  "active_defrag_hits:%lld\r\n"
 			  "active_defrag_misses:%lld\r\n"
 			  "active_defrag_key_hits:%lld\r\n"
-			  "active_defrag_key_misses:%lld\r\n",
+			  "active_defrag_key_misses:%lld\r\n"
+			  "io_threads_active:%d\r\n"
+			  "io_threaded_reads_processed:%lld\r\n"
+			  "io_threaded_writes_processed:%lld\r\n"
+			  "rehashing_dicts:%d\r\n"
+			  "active_rehash_cycles:%lld\r\n"
+			  "active_rehash_time_us:%lld\r\n"
+			  "active_rehash_max_cycle_us:%lld\r\n",
 		    server.stat_numconnections, server.stat_numcommands,
 		    getInstantaneousMetric(STATS_METRIC_COMMAND),
 		    server.stat_net_input_bytes, server.stat_net_output_bytes,
@@ -3397,7 +3509,11 @@ sds genRedisInfoString(char *section)
 			1024,
 		    server.stat_rejected_conn, server.stat_sync_full,
 		    server.stat_sync_partial_ok, server.stat_sync_partial_err,
-		    server.stat_expiredkeys, server.stat_evictedkeys,
+		    server.stat_sync_full_reused,
+		    server.stat_expiredkeys, countPendingExpires(),
+		    server.stat_expired_time_cap_reached_count,
+		    server.stat_expire_cycle_time_used / 1000,
+		    server.stat_evictedkeys,
 		    server.stat_keyspace_hits, server.stat_keyspace_misses,
 		    dictSize(server.pubsub_channels),
 		    listLength(server.pubsub_patterns), server.stat_fork_time,
@@ -3406,7 +3522,14 @@ sds genRedisInfoString(char *section)
 		    server.stat_active_defrag_hits,
 		    server.stat_active_defrag_misses,
 		    server.stat_active_defrag_key_hits,
-		    server.stat_active_defrag_key_misses);
+		    server.stat_active_defrag_key_misses,
+		    server.io_threads_active,
+		    server.stat_io_reads_processed,
+		    server.stat_io_writes_processed,
+		    countRehashingDicts(),
+		    server.stat_active_rehash_cycles,
+		    server.stat_active_rehash_time,
+		    server.stat_active_rehash_max_time);
 	}
 
 	/* Replication */
@@ -3535,11 +3658,45 @@ sds genRedisInfoString(char *section)
 			  "repl_backlog_active:%d\r\n"
 			  "repl_backlog_size:%lld\r\n"
 			  "repl_backlog_first_byte_offset:%lld\r\n"
-			  "repl_backlog_histlen:%lld\r\n",
+			  "repl_backlog_histlen:%lld\r\n"
+			  "repl_buffer_blocks:%lu\r\n"
+			  "repl_buffer_mem:%zu\r\n"
+			  "repl_backlog_disk_segments:%lu\r\n"
+			  "repl_backlog_disk_histlen:%lld\r\n"
+			  "repl_backlog_disk_first_byte_offset:%lld\r\n",
 		    server.replid, server.replid2, server.master_repl_offset,
 		    server.second_replid_offset, server.repl_backlog != NULL,
-		    server.repl_backlog_size, server.repl_backlog_off,
-		    server.repl_backlog_histlen);
+		    server.repl_backlog_size,
+		    server.repl_backlog ? server.repl_backlog->offset : 0,
+		    server.repl_backlog ? server.repl_backlog->histlen : 0,
+		    listLength(server.repl_buffer_blocks),
+		    server.repl_buffer_mem,
+		    listLength(server.repl_backlog_segments),
+		    server.repl_backlog_disk_histlen,
+		    server.repl_backlog ? replicationBacklogFirstByte() : 0);
+		info = sdscatprintf(
+		    info, "master_link_compressed:%d\r\n"
+			  "repl_compress_raw_bytes:%lld\r\n"
+			  "repl_compress_wire_bytes:%lld\r\n"
+			  "repl_compress_ratio:%.2f\r\n"
+			  "repl_compress_cpu_usec:%lld\r\n"
+			  "repl_decompress_raw_bytes:%lld\r\n"
+			  "repl_decompress_wire_bytes:%lld\r\n"
+			  "repl_decompress_ratio:%.2f\r\n"
+			  "repl_decompress_cpu_usec:%lld\r\n",
+		    server.masterhost != NULL && server.repl_master_compress,
+		    server.stat_repl_compress_raw,
+		    server.stat_repl_compress_wire,
+		    server.stat_repl_compress_wire ?
+			(double)server.stat_repl_compress_raw /
+			    server.stat_repl_compress_wire : 0,
+		    server.stat_repl_compress_usec,
+		    server.stat_repl_decompress_raw,
+		    server.stat_repl_decompress_wire,
+		    server.stat_repl_decompress_wire ?
+			(double)server.stat_repl_decompress_raw /
+			    server.stat_repl_decompress_wire : 0,
+		    server.stat_repl_decompress_usec);
 	}
 
 	/* CPU */
@@ -3604,7 +3761,7 @@ sds genRedisInfoString(char *section)
 			long long keys, vkeys;
 
 			keys = dictSize(server.db[j].dict);
-			vkeys = dictSize(server.db[j].expires);
+			vkeys = dbExpiresCount(server.db+j);
 			if (keys || vkeys) {
 				info = sdscatprintf(
 				    info, "db%d:keys=%lld,expires=%lld,avg_ttl="
@@ -3861,7 +4018,7 @@ void loadDataFromDisk(void)
 {
 	long long start = ustime();
 	if (server.aof_state == AOF_ON) {
-		if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+		if (loadAppendOnlyFiles(server.aof_manifest) == C_OK)
 			serverLog(
 			    LL_NOTICE,
 			    "DB loaded from append only file: %.3f seconds",
@@ -4040,6 +4197,8 @@ int main(int argc, char **argv)
 	if (argc == 3 && !strcasecmp(argv[1], "test")) {
 		if (!strcasecmp(argv[2], "ziplist")) {
 			return ziplistTest(argc, argv);
+		} else if (!strcasecmp(argv[2], "listpack")) {
+			return listpackTest(argc, argv);
 		} else if (!strcasecmp(argv[2], "quicklist")) {
 			quicklistTest(argc, argv);
 		} else if (!strcasecmp(argv[2], "intset")) {
@@ -4056,6 +4215,12 @@ int main(int argc, char **argv)
 			return endianconvTest(argc, argv);
 		} else if (!strcasecmp(argv[2], "crc64")) {
 			return crc64Test(argc, argv);
+		} else if (!strcasecmp(argv[2], "crc16")) {
+			return crc16Test(argc, argv);
+		} else if (!strcasecmp(argv[2], "bitops")) {
+			return bitopsTest(argc, argv);
+		} else if (!strcasecmp(argv[2], "lz4")) {
+			return lz4Test(argc, argv);
 		}
 
 		return -1; /* test not found */
@@ -4216,7 +4381,9 @@ int main(int argc, char **argv)
 		linuxMemoryWarnings();
 #endif
 		moduleLoadFromQueue();
+		aofLoadManifestFromDisk();
 		loadDataFromDisk(); // 使用RDB或者AOF文件还原数据库状态
+		aofOpenIfNeededOnServerStart();
 		if (server.cluster_enabled) {
 			if (verifyClusterConfigWithData() == C_ERR) {
 				serverLog(LL_WARNING, "You can't have keys in "
@@ -58,6 +58,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list without cascading updates */
 #include "intset.h"  /* Compact integer set structure */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
@@ -72,6 +73,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "sha1.h"
 #include "endianconv.h"
 #include "crc64.h"
+#include "lz4.h"
 
 /* Error codes */
 #define C_OK                    0
@@ -95,7 +97,6 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_REWRITE_PERC  100
 #define AOF_REWRITE_MIN_SIZE (64*1024*1024)
 #define AOF_REWRITE_ITEMS_PER_CMD 64
-#define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
 #define CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN 10000
 #define CONFIG_DEFAULT_SLOWLOG_MAX_LEN 128
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
@@ -123,10 +124,20 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_SYSLOG_ENABLED 0
 #define CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR 1
 #define CONFIG_DEFAULT_RDB_COMPRESSION 1
+#define CONFIG_DEFAULT_RDB_COMPRESSION_CODEC RDB_COMPRESSION_LZF
+#define CONFIG_DEFAULT_RDB_SAVE_FORKLESS 0
+#define CONFIG_DEFAULT_RDB_SAVE_INDEX 0
+#define CONFIG_DEFAULT_RDB_LAZY_LOAD 0
+#define CONFIG_DEFAULT_RDB_LOAD_THREADS 4
+#define CONFIG_MAX_RDB_LOAD_THREADS 64
+#define CONFIG_DEFAULT_RDB_SAVE_THREADS 4
+#define CONFIG_MAX_RDB_SAVE_THREADS 64
 #define CONFIG_DEFAULT_RDB_CHECKSUM 1
 #define CONFIG_DEFAULT_RDB_FILENAME "dump.rdb"
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC 0
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY 5
+#define CONFIG_DEFAULT_REPL_SNAPSHOT_REUSE_WINDOW 0
+#define CONFIG_DEFAULT_REPL_DISKLESS_LOAD REPL_DISKLESS_LOAD_DISABLED
 #define CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA 1
 #define CONFIG_DEFAULT_SLAVE_READ_ONLY 1
 #define CONFIG_DEFAULT_SLAVE_ANNOUNCE_IP NULL
@@ -140,7 +151,10 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
 #define CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE 0
+#define CONFIG_DEFAULT_AOF_WRITER_THREAD 0
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
+#define CONFIG_DEFAULT_ACTIVE_REHASHING_BUDGET_US 1000 /* 1 ms per cron call */
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_CYCLE_MAX ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
 #define CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG 10
@@ -150,6 +164,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_MIN_RESERVED_FDS 32
 #define CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
 #define CONFIG_DEFAULT_SLAVE_LAZY_FLUSH 0
+#define CONFIG_DEFAULT_SLAVE_THREADED_PARSE 0
+#define CONFIG_DEFAULT_REPL_COMPRESSION 0
+#define CONFIG_DEFAULT_REPL_BACKLOG_DISK_SIZE 0 /* Disk tier disabled. */
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
@@ -160,6 +177,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* don't defrag if frag overhead is below 100mb */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MIN 25 /* 25% CPU min (at lower threshold) */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
+#define CONFIG_DEFAULT_IO_THREADS_NUM 1 /* Single threaded by default */
+#define CONFIG_DEFAULT_IO_THREADS_DO_READS 0 /* Read + parse from threads? */
+#define IO_THREADS_MAX_NUM 128
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -216,6 +236,10 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* Types of the files listed in the AOF manifest. */
+#define AOF_FILE_TYPE_BASE 'b' /* Written by the AOF rewrite. */
+#define AOF_FILE_TYPE_INCR 'i' /* Writes received after the base. */
+
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a slave server */
 #define CLIENT_MASTER (1<<1)  /* This client is a master server */
@@ -248,6 +272,15 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
+#define CLIENT_PENDING_READ (1<<28) /* The client has pending reads and was put
+                                       in the list of clients we can read
+                                       from. */
+#define CLIENT_PENDING_COMMAND (1<<29) /* Used in threaded I/O to signal after
+                                          we return single threaded that the
+                                          client has already pending commands
+                                          to be executed. */
+#define CLIENT_AOF_WAIT (1<<30) /* Reply held until its writes are fsynced
+                                   by the AOF writer thread. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -285,11 +318,13 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REPL_STATE_RECEIVE_IP 9 /* Wait for REPLCONF reply */
 #define REPL_STATE_SEND_CAPA 10 /* Send REPLCONF capa */
 #define REPL_STATE_RECEIVE_CAPA 11 /* Wait for REPLCONF reply */
-#define REPL_STATE_SEND_PSYNC 12 /* Send PSYNC */
-#define REPL_STATE_RECEIVE_PSYNC 13 /* Wait for PSYNC reply */
+#define REPL_STATE_SEND_COMPRESS 12 /* Send REPLCONF compress */
+#define REPL_STATE_RECEIVE_COMPRESS 13 /* Wait for REPLCONF reply */
+#define REPL_STATE_SEND_PSYNC 14 /* Send PSYNC */
+#define REPL_STATE_RECEIVE_PSYNC 15 /* Wait for PSYNC reply */
 /* --- End of handshake states --- */
-#define REPL_STATE_TRANSFER 14 /* Receiving .rdb from master */
-#define REPL_STATE_CONNECTED 15 /* Connected to master */
+#define REPL_STATE_TRANSFER 16 /* Receiving .rdb from master */
+#define REPL_STATE_CONNECTED 17 /* Connected to master */
 
 /* State of slaves from the POV of the master. Used in client->replstate.
  * In SEND_BULK and ONLINE state the slave receives new updates
@@ -304,6 +339,16 @@ typedef long long mstime_t; /* millisecond time type. */
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)    /* Can parse the RDB EOF streaming format. */
 #define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
+#define SLAVE_CAPA_LZ4 (1<<2)    /* Agreed on LZ4 framing, see replcompress.c */
+
+/* Compressed replication framing, see replcompress.c. */
+#define REPL_FRAME_HDR_LEN 9           /* Type, raw len, payload len. */
+#define REPL_FRAME_MAX_RAW (64*1024)   /* Max bytes of stream per frame. */
+
+/* Slave diskless load modes: how the slave consumes the RDB payload. */
+#define REPL_DISKLESS_LOAD_DISABLED 0 /* Save to a temp file, then load it. */
+#define REPL_DISKLESS_LOAD_WHEN_DB_EMPTY 1 /* From socket if dataset empty. */
+#define REPL_DISKLESS_LOAD_SWAPDB 2 /* From socket into a fresh keyspace. */
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
@@ -341,6 +386,21 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_FSYNC_EVERYSEC 2
 #define CONFIG_DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
 
+/* Encodings of the AOF incr files, see aofbin.c. */
+#define AOF_FORMAT_RESP 0
+#define AOF_FORMAT_BINARY 1
+#define CONFIG_DEFAULT_AOF_FORMAT AOF_FORMAT_RESP
+#define CONFIG_DEFAULT_AOF_BINARY_COMPRESSION 1
+#define AOF_BIN_MAGIC "RAOF\x01"
+#define AOF_BIN_MAGIC_LEN 5
+
+/* aofBinLoad() return values. */
+#define AOF_BIN_OK 0
+#define AOF_BIN_EOF 1
+#define AOF_BIN_TRUNCATED 2
+#define AOF_BIN_READERR 3
+#define AOF_BIN_FMTERR 4
+
 /* Zip structure related defaults */
 #define OBJ_HASH_MAX_ZIPLIST_ENTRIES 512
 #define OBJ_HASH_MAX_ZIPLIST_VALUE 64
@@ -581,6 +641,8 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_SKIPLIST 7  /* 跳跃表 Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* 用于保存短字符串的编码类型 Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* 压缩链表和双向链表组成的快速列表 Encoded as linked list of ziplists */
+#define OBJ_ENCODING_LISTPACK 10 /* 紧凑列表 Encoded as listpack */
+#define OBJ_ENCODING_MAPPED 11 /* 还在映射的RDB文件中 Not yet loaded from a mapped RDB */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -611,13 +673,27 @@ typedef struct redisObject {
 
 struct evictionPoolEntry; /* Defined in evict.c */
 
+/* Expiry index of a DB: the main dict entries of the volatile keys, in a
+ * min-heap ordered by expire time for the keys not yet due, and in a plain
+ * array for the expired ones. The position of every entry is stored in the
+ * entry itself, next to its expire (see db.c). */
+typedef struct expireIndex {
+    dictEntry **heap;
+    unsigned long len;          /* Keys in 'heap'. */
+    unsigned long size;         /* Allocated slots of 'heap'. */
+    dictEntry **due;
+    unsigned long due_len;      /* Keys in 'due', expired before 'due_time'. */
+    unsigned long due_size;     /* Allocated slots of 'due'. */
+    long long due_time;         /* Last expireIndexAdvance() time. */
+} expireIndex;
+
 /*
  * 表示redis的数据库
  * 不同数据库用不同的id表示，id取值范围是0到最大配置值
  */
 typedef struct redisDb {
     dict *dict;                 /* 数据库的键空间，保存数据库中的所有键值对 */
-    dict *expires;              /* 保存所有过期的键值对 */
+    struct expireIndex *expires_index; /* Volatile keys by expire time */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
@@ -625,6 +701,10 @@ typedef struct redisDb {
     long long avg_ttl;          /* Average TTL, just for stats */
 } redisDb;
 
+/* Number of volatile keys of a DB: every one has an element in the index. */
+#define dbExpiresCount(db) \
+    ((db)->expires_index->len+(db)->expires_index->due_len)
+
 /* Client MULTI/EXEC state */
 typedef struct multiCmd {
     robj **argv;
@@ -678,6 +758,31 @@ typedef struct readyList {
     robj *key;
 } readyList;
 
+/* The replication stream is appended once to a list of blocks shared by
+ * the backlog and the replicas: every reader references the block it is
+ * reading, see replication.c. */
+typedef struct replBufBlock {
+    int refcount;           /* Backlog and replicas referencing the block. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    size_t size, used;
+    char buf[];
+} replBufBlock;
+
+typedef struct replBacklog {
+    listNode *ref_repl_buf_node; /* First block of the backlog, always the
+                                    first of server.repl_buffer_blocks. */
+    long long histlen;      /* Backlog actual data length */
+    long long offset;       /* Replication "master offset" of first byte in
+                               the replication backlog. */
+} replBacklog;
+
+/* A file of the disk tier of the backlog, see repldisk.c. */
+typedef struct replBacklogSegment {
+    int fd;                 /* The file is unlinked as soon as created. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    long long len;          /* Bytes in the file. */
+} replBacklogSegment;
+
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
 /*
@@ -721,14 +826,24 @@ typedef struct client {
     long long psync_initial_offset; /* FULLRESYNC reply offset other slaves
                                        copying this slave output buffer
                                        should use. */
+    listNode *ref_repl_buf_node; /* Replication buffer block the slave is
+                                    sending, NULL if none yet. */
+    size_t ref_block_pos;   /* Bytes of that block already sent. */
+    long long repl_disk_off; /* Next byte to send from the disk tier of the
+                                backlog, -1 if sending from memory. */
     char replid[CONFIG_RUN_ID_SIZE+1]; /* Master replication ID (if master). */
     int slave_listening_port; /* As configured with: SLAVECONF listening-port */
     char slave_ip[NET_IP_STR_LEN]; /* Optionally given by REPLCONF ip-address */
     int slave_capa;         /* Slave capabilities: SLAVE_CAPA_* bitwise OR. */
+    int repl_compress;      /* Stream to this slave is framed, compressed. */
+    sds repl_zbuf;          /* If this is a slave, frames not sent yet. If
+                               a master, frames not decoded yet. */
+    size_t repl_zbuf_pos;   /* Bytes of repl_zbuf already sent. */
     multiState mstate;      /* 事务状态 */
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    long long aof_woff;     /* AOF offset of the last write of the client. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* 客户端订阅的频道 */
     list *pubsub_patterns;  /* 客户端订阅的模式 */
@@ -833,6 +948,7 @@ struct redisMemOverhead {
     size_t clients_slaves;
     size_t clients_normal;
     size_t aof_buffer;
+    size_t hll_union_cache;
     size_t overhead_total;
     size_t dataset;
     size_t total_keys;
@@ -868,6 +984,22 @@ typedef struct rdbSaveInfo {
 
 #define RDB_SAVE_INFO_INIT {-1,0,"000000000000000000000000000000",-1}
 
+/* The AOF is made of a base file, produced by the last rewrite, followed by
+ * the incremental files that received the writes since then. The files are
+ * listed, in loading order, by the manifest file. See aof.c. */
+typedef struct aofInfo {
+    sds file_name;          /* File name, relative to the working dir. */
+    long long file_seq;     /* Sequence number, per file type. */
+    int file_type;          /* AOF_FILE_TYPE_* */
+} aofInfo;
+
+typedef struct aofManifest {
+    aofInfo *base_aof_info;     /* NULL if there is no base file yet. */
+    list *incr_aof_list;        /* aofInfo of the incr files, oldest first. */
+    long long curr_base_file_seq;
+    long long curr_incr_file_seq;
+} aofManifest;
+
 /*-----------------------------------------------------------------------------
  * Global server state
  *----------------------------------------------------------------------------*/
@@ -898,6 +1030,8 @@ struct redisServer {
     unsigned int lruclock;      /* Clock for LRU eviction */
     int shutdown_asap;          /* 是否需要关闭服务器标志 */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    long long active_rehashing_budget_us; /* Max usec per active rehash call */
+    int active_expire_cycle_max;    /* Max CPU % of the slow expire cycle */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *requirepass;          /* Pass for AUTH command, or NULL */
     char *pidfile;              /* PID file path */
@@ -928,6 +1062,7 @@ struct redisServer {
     list *clients;              /* 所有连接到服务器的客户端 */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_pending_read;  /* Client has pending read socket buffers. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client; /* Current client, only used on crash report */
     int clients_paused;         /* True if clients are currently paused */
@@ -938,6 +1073,8 @@ struct redisServer {
     int protected_mode;         /* Don't accept external connections. */
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
+    int async_loading;          /* Loading the master RDB into a temp
+                                   keyspace while serving the old one. */
     off_t loading_total_bytes;
     off_t loading_loaded_bytes;
     time_t loading_start_time;
@@ -951,6 +1088,8 @@ struct redisServer {
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expire_cycle_time_used; /* Usec spent in active expire */
+    long long stat_expired_time_cap_reached_count; /* Cycles out of time */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
@@ -965,6 +1104,13 @@ struct redisServer {
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
+    long long stat_sync_full_reused;/* Full resyncs served by a past RDB. */
+    long long stat_repl_compress_raw;   /* Stream bytes compressed... */
+    long long stat_repl_compress_wire;  /* ...and what was sent instead. */
+    long long stat_repl_compress_usec;  /* CPU time spent compressing. */
+    long long stat_repl_decompress_raw; /* Same for the frames received */
+    long long stat_repl_decompress_wire;/* from our master. */
+    long long stat_repl_decompress_usec;
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
@@ -974,6 +1120,11 @@ struct redisServer {
     long long stat_net_output_bytes; /* Bytes written to network. */
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
+    long long stat_io_reads_processed; /* Number of read events processed by IO threads */
+    long long stat_io_writes_processed; /* Number of write events processed by IO threads */
+    long long stat_active_rehash_time;     /* Usec spent in active rehashing */
+    long long stat_active_rehash_max_time; /* Longest active rehash call (usec) */
+    long long stat_active_rehash_cycles;   /* Active rehash calls doing work */
     /* The following two are used to track instantaneous metrics, like
      * number of operations per second, network traffic. */
     struct {
@@ -994,6 +1145,9 @@ struct redisServer {
     int active_defrag_cycle_min;       /* minimal effort for defrag in CPU percentage */
     int active_defrag_cycle_max;       /* maximal effort for defrag in CPU percentage */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
+    int io_threads_num;             /* Number of IO threads to use. */
+    int io_threads_do_reads;        /* Read and parse from IO threads? */
+    int io_threads_active;          /* Is IO threads currently active? */
     int dbnum;                      /* 服务器的数据库数量 */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
     int supervised_mode;            /* See SUPERVISED_* */
@@ -1008,9 +1162,10 @@ struct redisServer {
     off_t aof_rewrite_min_size;     /* the AOF file is at least N bytes. */
     off_t aof_rewrite_base_size;    /* AOF size on latest startup or rewrite. */
     off_t aof_current_size;         /* AOF current size. */
+    off_t aof_last_incr_size;       /* Size of the incr file written now. */
+    aofManifest *aof_manifest;      /* Files the AOF is made of. */
     int aof_rewrite_scheduled;      /* 标记BGREWRITEAOF是否被服务器延迟了 */
     pid_t aof_child_pid;            /* PID if rewriting process */
-    list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
     sds aof_buf;      /* aof缓冲区，在进入下一个事件循环前写入 */
     int aof_fd;       /* File descriptor of currently selected AOF file */
     int aof_selected_db; /* Currently selected DB in AOF */
@@ -1025,16 +1180,18 @@ struct redisServer {
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
     int aof_use_rdb_preamble;       /* 混合持久化开关 */
-    /* AOF pipes used to communicate between parent and child during rewrite. */
-    int aof_pipe_write_data_to_child;
-    int aof_pipe_read_data_from_parent;
-    int aof_pipe_write_ack_to_parent;
-    int aof_pipe_read_ack_from_child;
-    int aof_pipe_write_ack_to_child;
-    int aof_pipe_read_ack_from_parent;
-    int aof_stop_sending_diff;     /* If true stop sending accumulated diffs
-                                      to child process. */
-    sds aof_child_diff;             /* AOF diff accumulator child side. */
+    int aof_writer_thread;          /* Write and fsync in a dedicated thread. */
+    int aof_format;                 /* AOF_FORMAT_* of the new incr files. */
+    int aof_binary_compression;     /* LZ4 compress the binary AOF blocks. */
+    int aof_fd_binary;              /* The open incr file is binary. */
+    size_t aof_buf_framed;          /* Bytes of aof_buf already framed in
+                                       blocks, if aof_fd_binary. */
+    long long aof_fed_offset;       /* Bytes appended to aof_buf so far. */
+    long long aof_flushed_offset;   /* Bytes written (and fsynced if the
+                                       policy is always) so far. */
+    long long aof_flushed_repl_offset; /* master_repl_offset when the last
+                                          flushed batch was handed over. */
+    list *clients_waiting_aof;      /* Clients with CLIENT_AOF_WAIT set. */
     /* RDB persistence */
     long long dirty;                /* Changes to DB from the last save */
     long long dirty_before_bgsave;  /* Used to restore dirty on failed BGSAVE */
@@ -1043,6 +1200,7 @@ struct redisServer {
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_codec;      /* RDB_COMPRESSION_* */
     int rdb_checksum;               /* Use RDB checksum? */
     time_t lastsave;                /* Unix time of last successful save */
     time_t lastbgsave_try;          /* Unix time of last attempted bgsave */
@@ -1050,6 +1208,12 @@ struct redisServer {
     time_t rdb_save_time_start;     /* Current RDB save start time. */
     int rdb_bgsave_scheduled;       /* BGSAVE when possible if true. */
     int rdb_child_type;             /* Type of save by active child. */
+    int rdb_save_forkless;          /* BGSAVE with snapshot.c, no fork. */
+    int rdb_load_threads;           /* Threads decoding values on load. */
+    int rdb_save_threads;           /* Threads serializing big DBs. */
+    int rdb_save_index;             /* Append the key index to RDB files. */
+    int rdb_lazy_load;              /* Map indexed RDB files on load. */
+    struct rdbSnapshot *rdb_snapshot; /* Forkless BGSAVE in progress. */
     int lastbgsave_status;          /* C_OK or C_ERR */
     int stop_writes_on_bgsave_err;  /* Don't allow writes if can't BGSAVE */
     int rdb_pipe_write_result_to_parent; /* RDB pipes used to return the state */
@@ -1059,6 +1223,9 @@ struct redisServer {
     struct {
         int process_type;           /* AOF or RDB child? */
         size_t cow_size;            /* Copy on write size. */
+        long long repl_compress_raw;  /* Diskless RDB compression stats. */
+        long long repl_compress_wire;
+        long long repl_compress_usec;
         unsigned long long magic;   /* Magic value to make sure data is valid. */
     } child_info_data;
     /* Propagation of commands in AOF / replication */
@@ -1075,13 +1242,13 @@ struct redisServer {
     long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
-    long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset,
-                                       that is the next byte will'll write to.*/
-    long long repl_backlog_off;     /* Replication "master offset" of first
-                                       byte in the replication backlog buffer.*/
+    replBacklog *repl_backlog;      /* Replication backlog for partial syncs */
+    long long repl_backlog_size;    /* Backlog size */
+    list *repl_buffer_blocks;       /* Replication buffer, replBufBlock list */
+    size_t repl_buffer_mem;         /* Memory used by the replication buffer */
+    list *repl_backlog_segments;    /* Older part of the backlog, on disk. */
+    long long repl_backlog_disk_histlen; /* Bytes in repl_backlog_segments. */
+    long long repl_backlog_disk_size; /* Max bytes on disk, 0 = disabled. */
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
@@ -1091,6 +1258,19 @@ struct redisServer {
     int repl_good_slaves_count;     /* Number of slaves with lag <= max_lag. */
     int repl_diskless_sync;         /* Send RDB to slaves sockets directly. */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_diskless_load;         /* Slave: parse the RDB from the socket
+                                       directly. REPL_DISKLESS_LOAD_* */
+    time_t repl_snapshot_reuse_window; /* Seconds an RDB created for a full
+                                          resync can serve other slaves. */
+    /* RDB file created for replication that later slaves can reuse, valid
+     * if repl_snapshot_offset != -1. See replicationTryReuseSnapshot(). */
+    char repl_snapshot_replid[CONFIG_RUN_ID_SIZE+1];
+    long long repl_snapshot_offset; /* Replication offset of the snapshot. */
+    long long repl_snapshot_pending_offset; /* Offset of the replication
+                                               BGSAVE in progress, or -1. */
+    time_t repl_snapshot_time;      /* Time the RDB file was completed. */
+    ino_t repl_snapshot_ino;        /* Inode and size of the file, to spot */
+    off_t repl_snapshot_size;       /* any later change. */
     /* Replication (slave) */
     char *masterauth;               /* AUTH with this password with master */
     char *masterhost;               /* Hostname of master */
@@ -1120,6 +1300,9 @@ struct redisServer {
     char master_replid[CONFIG_RUN_ID_SIZE+1];  /* Master PSYNC runid. */
     long long master_initial_offset;           /* Master PSYNC offset. */
     int repl_slave_lazy_flush;          /* Lazy FLUSHALL before loading DB? */
+    int slave_threaded_parse;  /* Parse the master stream in a thread. */
+    int repl_compression;      /* Compress the replication link if possible. */
+    int repl_master_compress;  /* Our master agreed to compress the link. */
     /* Replication script cache. */
     dict *repl_scriptcache_dict;        /* SHA1 all slaves are aware of. */
     list *repl_scriptcache_fifo;        /* First in, first out LRU eviction. */
@@ -1171,6 +1354,7 @@ struct redisServer {
     int cluster_slave_validity_factor; /* Slave max data age for failover. */
     int cluster_require_full_coverage; /* If true, put the cluster down if
                                           there is at least an uncovered slot.*/
+    int cluster_compact_bus;    /* Send compact PING/PONG when possible. */
     char *cluster_announce_ip;  /* IP address to announce on cluster bus. */
     int cluster_announce_port;     /* base port to announce on cluster bus. */
     int cluster_announce_bus_port; /* bus port to announce on cluster bus. */
@@ -1237,6 +1421,7 @@ struct redisCommand {
     int lastkey;  /* The last argument that's a key */
     int keystep;  /* The step between first and last key */
     long long microseconds, calls;
+    int aof_id;   /* Id in the binary AOF format, 0 if none. */
 };
 
 struct redisFunctionSym {
@@ -1312,8 +1497,8 @@ extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
-extern dictType keyptrDictType;
 extern dictType modulesDictType;
+extern dictType keylistDictType;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
@@ -1342,6 +1527,18 @@ void getRandomHexChars(char *p, unsigned int len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+
+/* bitops.c -- SIMD kernel levels for BITCOUNT, BITPOS and BITOP. */
+#define BITOPS_KERNEL_SCALAR 0
+#define BITOPS_KERNEL_POPCNT 1
+#define BITOPS_KERNEL_AVX2 2
+#define BITOPS_KERNEL_AVX512 3
+#define BITOPS_KERNEL_BEST BITOPS_KERNEL_AVX512
+int bitopsSelectKernels(int maxlevel);
+const char *bitopsKernelName(void);
+#ifdef REDIS_TEST
+int bitopsTest(int argc, char *argv[]);
+#endif
 void redisSetProcTitle(char *title);
 
 /* networking.c -- Networking and Client related operations */
@@ -1354,6 +1551,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void *addDeferredMultiBulkLength(client *c);
 void setDeferredMultiBulkLength(client *c, void *node, long length);
 void processInputBuffer(client *c);
+void processInputBufferAndReplicate(client *c);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -1397,7 +1595,15 @@ void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
+int handleClientsWithPendingWritesUsingThreads(void);
+int handleClientsWithPendingReadsUsingThreads(void);
+int stopThreadedIOIfNeeded(void);
+int postponeClientRead(client *c);
+void clientInstallWriteHandler(client *c);
+int processCommandAndResetClient(client *c);
+void initThreadedIO(void);
 int clientHasPendingReplies(client *c);
+int prepareClientToWrite(client *c);
 void unlinkClient(client *c);
 int writeToClient(int fd, client *c, int handler_installed);
 
@@ -1469,7 +1675,7 @@ robj *createSetObject(void);
 robj *createIntsetObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
 int checkType(client *c, robj *o, int type);
@@ -1496,6 +1702,10 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc);
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen);
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc);
 void updateSlavesWaitingBgsave(int bgsaveerr, int type);
+void replicationInvalidateSnapshot(void);
+void replParseProcessMaster(client *c);
+size_t replParsePendingBytes(client *c);
+void replParseReset(client *c);
 void replicationCron(void);
 void replicationHandleMasterDisconnection(void);
 void replicationCacheMaster(client *c);
@@ -1519,29 +1729,65 @@ void changeReplicationId(void);
 void clearReplicationId2(void);
 void chopReplicationBacklog(void);
 void replicationCacheMasterUsingMyself(void);
-void feedReplicationBacklog(void *ptr, size_t len);
+void feedReplicationBuffer(void *ptr, size_t len);
+void incrementalTrimReplicationBacklog(size_t max_blocks);
+void copyReplicaOutputBuffer(client *dst, client *src);
+void freeReplicaReferencedReplBuffer(client *replica);
+int replicaHasPendingStream(client *c);
+int replicaHasSendableStream(client *c);
+size_t replicaSendableLen(long long offset, size_t len);
+size_t replicaPendingStreamBytes(client *c);
+size_t replicaCompressPendingStream(client *c);
+void replicaConsumeDiskStream(client *c, size_t len);
+long long replicationBacklogFirstByte(void);
+
+/* Disk tier of the replication backlog */
+void replDiskSpillBlock(replBufBlock *b);
+ssize_t replDiskRead(long long offset, char *buf, size_t len);
+void replDiskTrim(void);
+void replDiskFreeSegments(void);
+void replicationStartCompression(client *c);
+
+/* Compressed replication framing */
+sds replCompressFrames(sds dst, const char *p, size_t len);
+ssize_t replDecompressFrames(sds *dst, const char *p, size_t len);
+int replParseFrameHeader(const char *hdr, size_t *rawlen, size_t *datalen);
+ssize_t replDecompressMasterInput(client *c, size_t qblen, size_t nread);
 
 /* Generic persistence functions */
 void startLoading(FILE *fp);
+void startLoadingStream(off_t size, int async);
 void loadingProgress(off_t pos);
 void stopLoading(void);
 
 /* RDB persistence */
 #include "rdb.h"
 int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi);
+int rdbSaveRioWithIndex(rio *rdb, int *error, int flags, rdbSaveInfo *rsi, rdbIndex *idx);
 
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
-int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFiles(aofManifest *am);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
-void aofRewriteBufferReset(void);
-unsigned long aofRewriteBufferSize(void);
-ssize_t aofReadDiffFromParent(void);
+void aofLoadManifestFromDisk(void);
+void aofOpenIfNeededOnServerStart(void);
+void aofManifestFree(aofManifest *am);
+int aofClientMustWait(client *c);
+long long aofReplSafeOffset(void);
+void aofHoldReplies(void);
+void aofHoldClient(client *c);
+void freeFakeClientArgv(struct client *c);
+void aofBinInitCommands(void);
+sds catAppendOnlyBinaryCommand(sds dst, int argc, robj **argv);
+sds catAppendOnlyBinarySelect(sds dst, int dictid);
+sds aofBinCatBlock(sds dst, const char *p, size_t len, int compress);
+int aofBinLoad(FILE *fp, client *fakeClient, off_t offset, off_t *valid_up_to);
+off_t aofBinCheck(FILE *fp, char **err);
 
 /* Child info */
 void openChildInfoPipe(void);
@@ -1592,13 +1838,13 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned int zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1684,10 +1930,10 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
 sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
@@ -1715,13 +1961,33 @@ struct rewriteConfigState; /* Forward declaration to export API. */
 void rewriteConfigRewriteLine(struct rewriteConfigState *state, const char *option, sds line, int force);
 int rewriteConfig(char *path);
 
+/* snapshot.c -- Fork-less incremental RDB snapshots */
+int rdbSnapshotStart(char *filename, rdbSaveInfo *rsi);
+void rdbSnapshotBeforeWrite(redisDb *db, sds key);
+void rdbSnapshotFinishSerialization(void);
+void rdbSnapshotAbort(void);
+
+/* Must be called before the key 'key' of 'db' is created, modified or
+ * deleted, so that a forkless snapshot in progress can save it first. */
+#define rdbSnapshotTouchKey(db,key) do { \
+    if (server.rdb_snapshot) rdbSnapshotBeforeWrite(db,key); \
+} while(0)
+
 /* db.c -- Keyspace access API */
 int removeExpire(redisDb *db, robj *key);
+int dbDeleteExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
+int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry *de);
 long long getExpire(redisDb *db, robj *key);
+long long getEntryExpire(dictEntry *de);
+expireIndex *expireIndexCreate(void);
+void expireIndexRelease(expireIndex *ei);
+void expireIndexAdvance(expireIndex *ei, long long now);
+void dbEntryMoved(redisDb *db, dictEntry *de);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
+robj *lookupKeyFromEntry(dictEntry *de, int flags);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
@@ -1743,6 +2009,10 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 #define EMPTYDB_NO_FLAGS 0      /* No flags. */
 #define EMPTYDB_ASYNC (1<<0)    /* Reclaim memory in another thread. */
 long long emptyDb(int dbnum, int flags, void(callback)(void*));
+redisDb *initTempDb(void);
+void discardTempDb(redisDb *tempDb, int async);
+void swapMainDbWithTempDb(redisDb *tempDb);
+void scanDatabaseForReadyLists(redisDb *db);
 
 int selectDb(client *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
@@ -1773,6 +2043,10 @@ int *georadiusGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numk
 /* Cluster */
 void clusterInit(void);
 unsigned short crc16(const char *buf, int len);
+void crc16Init(void);
+#ifdef REDIS_TEST
+int crc16Test(int argc, char *argv[]);
+#endif
 unsigned int keyHashSlot(char *key, int keylen);
 void clusterCron(void);
 void clusterPropagatePublish(robj *channel, robj *message);
@@ -1807,11 +2081,21 @@ void disconnectAllBlockedClients(void);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
+void activeExpireKey(redisDb *db, robj *keyobj);
+void activeExpireUpdateAvgTTL(redisDb *db, long long now);
+unsigned long long countPendingExpires(void);
+unsigned int expireIndexGetSomeKeys(redisDb *db, dictEntry **des,
+                                    unsigned int count, int soonest);
 void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
 size_t getSlaveKeyWithExpireCount(void);
 
+/* hyperloglog.c -- Multi key PFCOUNT cache */
+void hllUnionCacheForget(robj *o);
+void hllUnionCacheFlush(void);
+size_t hllUnionCacheMemory(void);
+
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
 #define LFU_INIT_VAL 5
@@ -1822,6 +2106,8 @@ uint8_t LFULogIncr(uint8_t value);
 uint64_t dictSdsHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
+size_t dictSdsKeyEmbedLen(const void *key);
+void *dictSdsKeyEmbed(void *buf, const void *key);
 
 /* Git SHA1 */
 char *redisGitSHA1(void);
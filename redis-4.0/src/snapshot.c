@@ -0,0 +1,423 @@
+/* Fork-less incremental RDB snapshots.
+ *
+ * BGSAVE normally forks, and the child process serializes a copy on write
+ * view of the dataset. With large datasets fork() itself can block the
+ * server for hundreds of milliseconds, and a write heavy workload can end
+ * up duplicating most of the memory pages while the child is running.
+ *
+ * When "rdb-save-forkless" is enabled, rdbSaveBackground() starts instead
+ * an incremental snapshot performed by the server process itself:
+ *
+ * 1) The DB dictionaries are walked bucket after bucket by a time event,
+ *    a few milliseconds at a time, serializing every key with the same
+ *    rdbSaveKeyValuePair() used by rdbSave(). Incremental rehashing of the
+ *    dictionaries is paused for the whole snapshot (the same way a safe
+ *    iterator does), so the position (table, bucket) of every key that
+ *    existed when the snapshot started does not change, and comparing it
+ *    with the iteration cursor tells if the key was already saved.
+ *
+ * 2) Before a key is modified, deleted or created (see the calls to
+ *    rdbSnapshotTouchKey() in db.c and lazyfree.c) the key, if not yet
+ *    saved, is saved immediately with its old value, and remembered in a
+ *    per DB "done" set, so that the iteration will skip it later. A key
+ *    that did not exist is just added to the set. This is copy on write at
+ *    key granularity: the snapshot is a consistent point in time view of
+ *    the dataset as it was when it started, exactly like the forked one.
+ *
+ * 3) The RDB payload is accumulated in memory and handed to a bio thread
+ *    (BIO_RDB_WRITE) that writes it to the temp file, so the main thread
+ *    never blocks on disk I/O. Once the last buffer is written and the file
+ *    fsync()ed, the temp file is renamed and the usual BGSAVE completion
+ *    path (backgroundSaveDoneHandler()) is called, so the slaves waiting
+ *    for the BGSAVE are served as usual.
+ *
+ * Keys saved out of order are preceded by a SELECTDB opcode, so the result
+ * is a standard RDB file any Redis can load. Operations that replace whole
+ * databases (FLUSHDB, SWAPDB, loading a dataset) first complete the
+ * serialization synchronously, while FLUSHALL and SHUTDOWN abort the
+ * snapshot, like they do with a saving child.
+ *
+ * Serializing a single huge key that is about to be modified happens in the
+ * context of the command modifying it, so the latency of a write can be as
+ * high as the time needed to serialize the key it touches. */
+
+#include "server.h"
+#include "bio.h"
+#include "atomicvar.h"
+#include "latency.h"
+
+#include <fcntl.h>
+
+#define RDB_SNAPSHOT_SLICE_US 2000      /* Max time spent per time event. */
+#define RDB_SNAPSHOT_BUFFER (1024*1024*4) /* Buffer size handed to bio. */
+#define RDB_SNAPSHOT_MAX_PENDING 16     /* Max buffers queued for writing. */
+
+typedef struct rdbSnapshot {
+    char tmpfile[256];          /* Temp file name, renamed on success. */
+    sds filename;               /* Final file name. */
+    int fd;                     /* Temp file, written by the bio thread. */
+    rio rdb;                    /* Buffer target rio, checksum included. */
+    long long now;              /* Keys expired at this time are skipped. */
+    long long start;            /* Start time in microseconds. */
+    int iterating;              /* Still serializing? Hooks are active. */
+    int aborted;                /* Snapshot canceled, don't rename. */
+    int dbid;                   /* DB being iterated. */
+    int table;                  /* Hash table of the DB being iterated. */
+    unsigned long bucket;       /* Next bucket to save. */
+    int dbstarted;              /* SELECTDB / RESIZEDB written for dbid. */
+    int selected;               /* DB of the last SELECTDB written. */
+    dict **done;                /* Keys saved out of order or created. */
+    long long keys;             /* Number of keys saved. */
+    long long cowkeys;          /* Keys saved before being modified. */
+} rdbSnapshot;
+
+/* Set by the bio thread when writing the snapshot fails. */
+static int rdb_snapshot_write_errno = 0;
+
+/* Keys of the "done" sets are copies of the DB keys, values are unused. */
+static dictType snapshotDoneDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Called by the bio thread: write 'buf' to 'fd'. If 'last' is true the
+ * file is also synced to disk and closed. */
+void rdbSnapshotWriteFromBioThread(int fd, sds buf, int last) {
+    int err;
+
+    atomicGet(rdb_snapshot_write_errno,err);
+    if (buf) {
+        size_t nwritten = 0, len = sdslen(buf);
+
+        while (!err && nwritten < len) {
+            ssize_t n = write(fd,buf+nwritten,len-nwritten);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                err = errno;
+            } else {
+                nwritten += n;
+            }
+        }
+        sdsfree(buf);
+    }
+    if (last) {
+        if (!err && fsync(fd) == -1) err = errno;
+        close(fd);
+    }
+    if (err) atomicSet(rdb_snapshot_write_errno,err);
+}
+
+/* Hand the accumulated payload to the bio thread. */
+static void rdbSnapshotFlush(rdbSnapshot *s, int last) {
+    sds buf = s->rdb.io.buffer.ptr;
+
+    if (s->aborted || sdslen(buf) == 0) {
+        sdsfree(buf);
+        buf = NULL;
+    }
+    s->rdb.io.buffer.ptr = last ? NULL : sdsempty();
+    s->rdb.io.buffer.pos = 0;
+    if (buf || last)
+        bioCreateBackgroundJob(BIO_RDB_WRITE,(void*)(long)s->fd,buf,
+                               (void*)(long)last);
+}
+
+/* Make sure the keys that follow are loaded into DB 'dbid'. */
+static int rdbSnapshotSelect(rdbSnapshot *s, int dbid) {
+    if (s->selected == dbid) return 0;
+    if (rdbSaveType(&s->rdb,RDB_OPCODE_SELECTDB) == -1) return -1;
+    if (rdbSaveLen(&s->rdb,dbid) == -1) return -1;
+    s->selected = dbid;
+    return 0;
+}
+
+/* The values are compressed with the codec of s->rdb, set when the
+ * snapshot started: a CONFIG SET of rdb-compression-codec while the
+ * snapshot runs doesn't change the RDB version of the header. */
+static void rdbSnapshotSaveEntry(rdbSnapshot *s, dictEntry *de) {
+    robj key;
+
+    initStaticStringObject(key,dictGetKey(de));
+    if (rdbSaveKeyValuePair(&s->rdb,&key,dictGetVal(de),getEntryExpire(de),
+                            s->now) == 1) s->keys++;
+}
+
+/* Return true if the iteration already went past the key 'key' of
+ * 'db', that is, the key was saved or didn't exist when the snapshot
+ * started. */
+static int rdbSnapshotKeyVisited(rdbSnapshot *s, redisDb *db, sds key) {
+    dict *d = db->dict;
+    dictEntry *he;
+    uint64_t h;
+    unsigned long idx;
+    int table;
+
+    if (db->id != s->dbid) return db->id < s->dbid;
+    h = dictHashKey(d,key);
+    for (table = 0; table <= 1; table++) {
+        if (d->ht[table].size == 0) continue;
+        idx = h & d->ht[table].sizemask;
+        for (he = d->ht[table].table[idx]; he; he = he->next) {
+            if (key == he->key || dictCompareKeys(d,key,he->key)) {
+                if (table != s->table) return table < s->table;
+                return idx < s->bucket;
+            }
+        }
+    }
+    return 0; /* Not found: a new key. */
+}
+
+/* Called before 'key' of 'db' is created, modified or deleted while a
+ * snapshot is in progress: save the current value if the iteration did
+ * not reach it yet. */
+void rdbSnapshotBeforeWrite(redisDb *db, sds key) {
+    rdbSnapshot *s = server.rdb_snapshot;
+    dictEntry *de;
+
+    if (!s->iterating) return;
+    if (rdbSnapshotKeyVisited(s,db,key)) return;
+    if (dictFind(s->done[db->id],key) != NULL) return;
+
+    de = dictFind(db->dict,key);
+    if (de) {
+        if (rdbSnapshotSelect(s,db->id) == -1) return;
+        rdbSnapshotSaveEntry(s,de);
+        s->cowkeys++;
+    }
+    dictAdd(s->done[db->id],sdsdup(key),NULL);
+}
+
+/* Pause or resume the incremental rehashing of all the DBs. */
+static void rdbSnapshotPauseRehashing(int pause) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++)
+        server.db[j].dict->iterators += pause ? 1 : -1;
+}
+
+/* Stop iterating: resume rehashing and release the "done" sets. */
+static void rdbSnapshotStopIterating(rdbSnapshot *s) {
+    int j;
+
+    if (!s->iterating) return;
+    s->iterating = 0;
+    rdbSnapshotPauseRehashing(0);
+    for (j = 0; j < server.dbnum; j++) dictRelease(s->done[j]);
+    zfree(s->done);
+    s->done = NULL;
+}
+
+/* Serialize buckets for up to 'us' microseconds (forever if 'us' is zero).
+ * When all the DBs are serialized the RDB trailer is written and the
+ * iteration stops. */
+static void rdbSnapshotStep(rdbSnapshot *s, long long us) {
+    long long start = ustime();
+    int buckets = 0;
+
+    while (s->dbid < server.dbnum) {
+        redisDb *db = server.db+s->dbid;
+        dict *d = db->dict;
+        dictEntry *de;
+
+        if (!s->dbstarted) {
+            if (dictSize(d) == 0) goto nextdb;
+            uint32_t db_size = dictSize(d) <= UINT32_MAX ?
+                               dictSize(d) : UINT32_MAX;
+            uint32_t expires_size = dbExpiresCount(db) <= UINT32_MAX ?
+                                    dbExpiresCount(db) : UINT32_MAX;
+            s->selected = -1;
+            if (rdbSnapshotSelect(s,s->dbid) == -1) goto werr;
+            if (rdbSaveType(&s->rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
+            if (rdbSaveLen(&s->rdb,db_size) == -1) goto werr;
+            if (rdbSaveLen(&s->rdb,expires_size) == -1) goto werr;
+            s->dbstarted = 1;
+        }
+
+        if (s->bucket >= d->ht[s->table].size) {
+            if (s->table == 0 && dictIsRehashing(d)) {
+                s->table = 1;
+                s->bucket = 0;
+                continue;
+            }
+            goto nextdb;
+        }
+
+        if (rdbSnapshotSelect(s,s->dbid) == -1) goto werr;
+        dict *done = s->done[s->dbid];
+        for (de = d->ht[s->table].table[s->bucket]; de; de = de->next) {
+            if (dictSize(done) && dictFind(done,dictGetKey(de))) continue;
+            rdbSnapshotSaveEntry(s,de);
+        }
+        s->bucket++;
+
+        if ((++buckets & 63) == 0) {
+            if (sdslen(s->rdb.io.buffer.ptr) > RDB_SNAPSHOT_BUFFER)
+                rdbSnapshotFlush(s,0);
+            if (us && ustime()-start > us) return;
+        }
+        continue;
+
+nextdb:
+        s->dbid++;
+        s->table = 0;
+        s->bucket = 0;
+        s->dbstarted = 0;
+    }
+
+    /* EOF opcode and CRC64 checksum, zero if checksums are disabled. */
+    uint64_t cksum;
+    if (rdbSaveType(&s->rdb,RDB_OPCODE_EOF) == -1) goto werr;
+    cksum = s->rdb.cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(&s->rdb,&cksum,8) == 0) goto werr;
+    rdbSnapshotStopIterating(s);
+    rdbSnapshotFlush(s,1);
+    return;
+
+werr: /* Writing to a memory buffer can't fail, but just in case. */
+    serverLog(LL_WARNING,"Error serializing the forkless RDB snapshot");
+    atomicSet(rdb_snapshot_write_errno,EIO);
+    rdbSnapshotStopIterating(s);
+    rdbSnapshotFlush(s,1);
+}
+
+/* Time event driving the snapshot, and completing it once the bio thread
+ * wrote everything. */
+static int rdbSnapshotTimeProc(struct aeEventLoop *el, long long id,
+                               void *clientData)
+{
+    rdbSnapshot *s = server.rdb_snapshot;
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    if (s->iterating) {
+        mstime_t latency;
+
+        /* Don't let the payload waiting to be written grow without limits
+         * when the disk is slower than us. */
+        if (bioPendingJobsOfType(BIO_RDB_WRITE) >= RDB_SNAPSHOT_MAX_PENDING)
+            return 1;
+        latencyStartMonitor(latency);
+        rdbSnapshotStep(s,RDB_SNAPSHOT_SLICE_US);
+        if (s->iterating) rdbSnapshotFlush(s,0);
+        latencyEndMonitor(latency);
+        latencyAddSampleIfNeeded("rdb-snapshot-step",latency);
+        return 0;
+    }
+    if (bioPendingJobsOfType(BIO_RDB_WRITE) != 0) return 1;
+
+    /* All written: rename the file and run the BGSAVE completion code. */
+    int err, exitcode = 0, bysignal = 0;
+    atomicGet(rdb_snapshot_write_errno,err);
+    if (s->aborted) {
+        bysignal = SIGUSR1;
+    } else if (err) {
+        serverLog(LL_WARNING,"Write error saving the forkless RDB snapshot "
+                             "on disk: %s", strerror(err));
+        unlink(s->tmpfile);
+        exitcode = 1;
+    } else if (rename(s->tmpfile,s->filename) == -1) {
+        serverLog(LL_WARNING,"Error moving temp DB file %s on the final "
+                             "destination %s: %s",
+                             s->tmpfile, s->filename, strerror(errno));
+        unlink(s->tmpfile);
+        exitcode = 1;
+    } else {
+        serverLog(LL_NOTICE,"DB saved on disk by forkless snapshot: "
+            "%lld keys (%lld saved before being modified) in %.3f seconds",
+            s->keys, s->cowkeys, (double)(ustime()-s->start)/1000000);
+    }
+    server.rdb_snapshot = NULL;
+    sdsfree(s->filename);
+    zfree(s);
+    backgroundSaveDoneHandler(exitcode,bysignal);
+    return AE_NOMORE;
+}
+
+/* Start a forkless snapshot of the dataset into 'filename'. Called by
+ * rdbSaveBackground() when "rdb-save-forkless" is enabled. */
+int rdbSnapshotStart(char *filename, rdbSaveInfo *rsi) {
+    rdbSnapshot *s;
+    char magic[10];
+    int fd, j;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    s = zcalloc(sizeof(*s));
+    snprintf(s->tmpfile,sizeof(s->tmpfile),"temp-forkless-%d.rdb",
+        (int) getpid());
+    fd = open(s->tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Failed opening the RDB file %s for saving: %s",
+            s->tmpfile, strerror(errno));
+        server.lastbgsave_status = C_ERR;
+        zfree(s);
+        return C_ERR;
+    }
+    if (aeCreateTimeEvent(server.el,0,rdbSnapshotTimeProc,NULL,NULL) ==
+        AE_ERR)
+    {
+        serverLog(LL_WARNING,"Can't create the forkless RDB snapshot timer");
+        close(fd);
+        unlink(s->tmpfile);
+        zfree(s);
+        return C_ERR;
+    }
+
+    s->fd = fd;
+    s->filename = sdsnew(filename);
+    s->now = mstime();
+    s->start = ustime();
+    s->selected = -1;
+    s->done = zmalloc(sizeof(dict*)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++)
+        s->done[j] = dictCreate(&snapshotDoneDictType,NULL);
+    rioInitWithBuffer(&s->rdb,sdsempty());
+    if (server.rdb_checksum) s->rdb.update_cksum = rioGenericUpdateChecksum;
+    atomicSet(rdb_snapshot_write_errno,0);
+
+    /* The header is written right now, so that the aux fields describe
+     * the state of the server at the time of the snapshot. */
+    snprintf(magic,sizeof(magic),"REDIS%04d",rdbSaveVersion(&s->rdb));
+    rioWrite(&s->rdb,magic,9);
+    rdbSaveInfoAuxFields(&s->rdb,RDB_SAVE_NONE,rsi);
+
+    s->iterating = 1;
+    rdbSnapshotPauseRehashing(1);
+    server.rdb_snapshot = s;
+    server.rdb_save_time_start = time(NULL);
+    server.rdb_child_type = RDB_CHILD_TYPE_DISK;
+    serverLog(LL_NOTICE,"Background saving started by forkless snapshot");
+    return C_OK;
+}
+
+/* Serialize synchronously what is left of the snapshot. Called before
+ * operations that replace whole DBs, that would otherwise lose the data
+ * not yet saved. The disk writes still complete in the background. */
+void rdbSnapshotFinishSerialization(void) {
+    rdbSnapshot *s = server.rdb_snapshot;
+
+    if (!s || !s->iterating) return;
+    rdbSnapshotStep(s,0);
+}
+
+/* Cancel the snapshot in progress, if any, like a BGSAVE child killed by
+ * SIGUSR1: the temp file is removed and no error is reported. */
+void rdbSnapshotAbort(void) {
+    rdbSnapshot *s = server.rdb_snapshot;
+
+    if (!s || s->aborted) return;
+    serverLog(LL_WARNING,"Aborting the forkless RDB snapshot in progress");
+    s->aborted = 1;
+    unlink(s->tmpfile);
+    if (s->iterating) {
+        rdbSnapshotStopIterating(s);
+        rdbSnapshotFlush(s,1);
+    }
+}
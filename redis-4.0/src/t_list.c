@@ -904,6 +904,8 @@ int serveClientBlockedOnList(client *receiver, robj *key, robj *dstkey, redisDb
             return C_ERR;
         }
     }
+    /* The reply waits for the pop to be on disk, see aofClientMustWait(). */
+    receiver->aof_woff = server.aof_fed_offset;
     return C_OK;
 }
 